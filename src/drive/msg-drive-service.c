@@ -14,18 +14,24 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <glib/gstdio.h>
 #include <libsoup/soup.h>
 #include <json-glib/json-glib.h>
 
 #include "msg-authorizer.h"
+#include "msg-batch.h"
 #include "msg-error.h"
 #include "msg-input-stream.h"
+#include "msg-json-utils.h"
+#include "msg-parallel-download.h"
 #include "msg-private.h"
 #include "msg-service.h"
 #include "drive/msg-drive.h"
 #include "drive/msg-drive-item.h"
 #include "drive/msg-drive-item-file.h"
 #include "drive/msg-drive-service.h"
+#include "drive/msg-drive-upload-journal.h"
+#include "drive/msg-drive-upload-stream.h"
 
 struct _MsgDriveService {
   MsgService parent_instance;
@@ -168,52 +174,29 @@ msg_drive_service_get_drives (MsgDriveService  *self,
                               GCancellable     *cancellable,
                               GError          **error)
 {
+  g_autoptr (MsgPageIterator) iter = NULL;
   g_autofree char *url = NULL;
-  JsonObject *root_object = NULL;
-  JsonArray *array = NULL;
-  guint array_length = 0, index = 0;
   g_autolist (MsgDrive) list = NULL;
-  g_autoptr (GBytes) response = NULL;
-  g_autoptr (JsonParser) parser = NULL;
-
-  if (!msg_service_refresh_authorization (MSG_SERVICE (self), cancellable, error))
-    return NULL;
+  g_autoptr (GError) local_error = NULL;
+  MsgDrive *drive;
 
   url = g_strconcat (MSG_API_ENDPOINT, "/me/drives", NULL);
+  iter = msg_page_iterator_new (MSG_SERVICE (self), url, (MsgPageIteratorItemFunc) msg_drive_new_from_json);
 
-  do {
-    g_autoptr (SoupMessage) message = NULL;
-
-    message = msg_service_build_message (MSG_SERVICE (self), "GET", url, NULL, FALSE);
-    parser = msg_service_send_and_parse_response (MSG_SERVICE (self), message, &root_object, cancellable, error);
-    if (!parser)
-      return NULL;
-
-    array = json_object_get_array_member (root_object, "value");
-    g_assert (array != NULL);
-
-    array_length = json_array_get_length (array);
-    for (index = 0; index < array_length; index++) {
-      MsgDrive *drive = NULL;
-      JsonObject *drive_object = NULL;
-      g_autoptr (GError) local_error = NULL;
-
-      drive_object = json_array_get_object_element (array, index);
-      drive = msg_drive_new_from_json (drive_object, &local_error);
-      if (drive) {
-
-        if (!drive_already_added (list, drive)) {
-          self->type = msg_drive_get_drive_type (drive);
-          list = g_list_append (list, drive);
-        }
-      } else {
-        g_warning ("Could not parse drive object: %s", local_error->message);
-      }
+  while ((drive = msg_page_iterator_next (iter, cancellable, &local_error))) {
+    if (drive_already_added (list, drive)) {
+      g_object_unref (drive);
+      continue;
     }
 
-    g_clear_pointer (&url, g_free);
-    url = msg_service_get_next_link (root_object);
-  } while (url != NULL);
+    self->type = msg_drive_get_drive_type (drive);
+    list = g_list_append (list, drive);
+  }
+
+  if (local_error) {
+    g_propagate_error (error, g_steal_pointer (&local_error));
+    return NULL;
+  }
 
   return g_steal_pointer (&list);
 }
@@ -253,6 +236,30 @@ msg_drive_service_get_root (MsgDriveService  *self,
   return msg_drive_item_new_from_json (root_object, error);
 }
 
+/* Returns the url of the content of @item, following shared items */
+static char *
+get_content_url (MsgDriveItem *item)
+{
+  const char *drive_id = NULL;
+  const char *id = NULL;
+
+  if (!msg_drive_item_is_shared (item)) {
+    drive_id = msg_drive_item_get_drive_id (item);
+    id = msg_drive_item_get_id (item);
+  } else {
+    drive_id = msg_drive_item_get_remote_drive_id (item);
+    id = msg_drive_item_get_remote_id (item);
+  }
+
+  return g_strconcat (MSG_API_ENDPOINT,
+                      "/drives/",
+                      drive_id,
+                      "/items/",
+                      id,
+                      "/content",
+                      NULL);
+}
+
 /**
  * msg_drive_service_download_item:
  * @self: a #MsgDriveService
@@ -271,8 +278,6 @@ msg_drive_service_download_item (MsgDriveService  *self,
                                  GError          **error)
 {
   g_autofree char *url = NULL;
-  const char *drive_id = NULL;
-  const char *id = NULL;
 
   if (!MSG_IS_DRIVE_ITEM_FILE (item)) {
     g_warning ("Download only allowed for files");
@@ -282,57 +287,107 @@ msg_drive_service_download_item (MsgDriveService  *self,
   if (!msg_service_refresh_authorization (MSG_SERVICE (self), cancellable, error))
     return NULL;
 
-  if (!msg_drive_item_is_shared (item)) {
-    drive_id = msg_drive_item_get_drive_id (item);
-    id = msg_drive_item_get_id (item);
-  } else {
-    drive_id = msg_drive_item_get_remote_drive_id (item);
-    id = msg_drive_item_get_remote_id (item);
-  }
-
-  url = g_strconcat (MSG_API_ENDPOINT,
-                     "/drives/",
-                     drive_id,
-                     "/items/",
-                     id,
-                     "/content",
-                     NULL);
+  url = get_content_url (item);
 
   return msg_input_stream_new (MSG_SERVICE (self), url);
 }
 
 /**
- * msg_drive_service_list_children:
+ * msg_drive_service_download_item_to_file:
  * @self: a #MsgDriveService
  * @item: a #MsgDriveItem
+ * @destination: the local file to write
+ * @concurrency: number of byte ranges fetched at the same time
  * @cancellable: a #GCancellable
  * @error: a #GError
  *
- * Get a list of all files in folder item
+ * Downloads the content of @item to @destination. The content is split
+ * into byte ranges which are fetched over up to @concurrency connections
+ * at once and written to their position in @destination as they arrive.
+ * @destination is only replaced once the download is complete.
  *
- * Returns: (element-type MsgDriveItem) (transfer full): all items in folder
+ * Returns: %TRUE on success
  */
-GList *
-msg_drive_service_list_children (MsgDriveService  *self,
-                                 MsgDriveItem     *item,
-                                 GCancellable     *cancellable,
-                                 GError          **error)
+gboolean
+msg_drive_service_download_item_to_file (MsgDriveService  *self,
+                                         MsgDriveItem     *item,
+                                         GFile            *destination,
+                                         guint             concurrency,
+                                         GCancellable     *cancellable,
+                                         GError          **error)
 {
-  g_autoptr (MsgDriveItem) child_item = NULL;
+  g_autoptr (GFileOutputStream) output = NULL;
+  g_autoptr (MsgParallelDownload) download = NULL;
+  g_autoptr (GCancellable) abort = NULL;
   g_autofree char *url = NULL;
-  JsonObject *root_object = NULL;
-  JsonArray *array = NULL;
-  guint array_length = 0, index = 0;
-  JsonObject *item_object = NULL;
-  g_autolist (MsgDriveItem) children = NULL;
-  g_autoptr (GBytes) response = NULL;
-  g_autoptr (JsonParser) parser = NULL;
-  gboolean add_prefer_header = self->type == MSG_DRIVE_TYPE_BUSINESS;
-  const char *drive_id = NULL;
-  const char *id = NULL;
+
+  if (!MSG_IS_DRIVE_ITEM_FILE (item)) {
+    g_set_error (error,
+                 msg_error_quark (),
+                 MSG_ERROR_FAILED,
+                 "Download only allowed for files");
+    return FALSE;
+  }
 
   if (!msg_service_refresh_authorization (MSG_SERVICE (self), cancellable, error))
-    return NULL;
+    return FALSE;
+
+  output = g_file_replace (destination, NULL, FALSE, G_FILE_CREATE_NONE, cancellable, error);
+  if (!output)
+    return FALSE;
+
+  url = get_content_url (item);
+
+  /* Non seekable destinations get the segments in order */
+  if (!g_seekable_can_seek (G_SEEKABLE (output))) {
+    g_autoptr (GInputStream) input = msg_input_stream_new (MSG_SERVICE (self), url);
+
+    /* Closing the target on errors as well would commit partial content */
+    msg_input_stream_set_parallel (input, concurrency, 0);
+    if (g_output_stream_splice (G_OUTPUT_STREAM (output),
+                                input,
+                                G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE,
+                                cancellable,
+                                error) >= 0)
+      return g_output_stream_close (G_OUTPUT_STREAM (output), cancellable, error);
+  } else {
+    download = msg_parallel_download_new (MSG_SERVICE (self), url, 0, concurrency,
+                                          MSG_INPUT_STREAM_DEFAULT_SEGMENT_SIZE, G_OUTPUT_STREAM (output));
+
+    if (msg_parallel_download_start (download, cancellable, error) &&
+        msg_parallel_download_wait (download, cancellable, error)) {
+      g_clear_pointer (&download, msg_parallel_download_free);
+      return g_output_stream_close (G_OUTPUT_STREAM (output), cancellable, error);
+    }
+  }
+
+  /* Closing cancelled keeps the previous content of destination */
+  g_clear_pointer (&download, msg_parallel_download_free);
+  abort = g_cancellable_new ();
+  g_cancellable_cancel (abort);
+  g_output_stream_close (G_OUTPUT_STREAM (output), abort, NULL);
+
+  return FALSE;
+}
+
+/**
+ * msg_drive_service_iterate_children:
+ * @self: a #MsgDriveService
+ * @item: a #MsgDriveItem
+ *
+ * Creates an iterator over all files in folder item. Pages are requested
+ * on demand while iterating.
+ *
+ * Returns: (transfer full): a new `MsgPageIterator` returning `MsgDriveItem`s
+ */
+MsgPageIterator *
+msg_drive_service_iterate_children (MsgDriveService *self,
+                                    MsgDriveItem    *item)
+{
+  MsgPageIterator *iter;
+  g_autofree char *url = NULL;
+  const char *drive_id = NULL;
+  const char *id = NULL;
 
   if (!msg_drive_item_is_shared (item)) {
     drive_id = msg_drive_item_get_drive_id (item);
@@ -352,37 +407,43 @@ msg_drive_service_list_children (MsgDriveService  *self,
                      "&select=id,remoteItem,file,folder,parentReference,name,createdBy,lastModifiedBy,createdDateTime,lastModifiedDateTime,size",
                      NULL);
 
-  do {
-    g_autoptr (SoupMessage) message = NULL;
-
-    message = msg_service_build_message (MSG_SERVICE (self), "GET", url, NULL /*msg_drive_item_get_etag (item)*/, FALSE);
-    if (add_prefer_header)
-      soup_message_headers_append (soup_message_get_request_headers (message), "Prefer", "Include-Feature=AddToOneDrive");
-
-    parser = msg_service_send_and_parse_response (MSG_SERVICE (self), message, &root_object, cancellable, error);
-    if (!parser)
-      return NULL;
-
-    array = json_object_get_array_member (root_object, "value");
-    g_assert (array != NULL);
+  iter = msg_page_iterator_new (MSG_SERVICE (self), url, (MsgPageIteratorItemFunc) msg_drive_item_new_from_json);
+  if (self->type == MSG_DRIVE_TYPE_BUSINESS)
+    msg_page_iterator_add_header (iter, "Prefer", "Include-Feature=AddToOneDrive");
 
-    array_length = json_array_get_length (array);
-    for (index = 0; index < array_length; index++) {
-      g_autoptr (GError) local_error = NULL;
-      item_object = json_array_get_object_element (array, index);
+  return iter;
+}
 
-      child_item = msg_drive_item_new_from_json (item_object, &local_error);
-      if (local_error) {
-        g_warning ("Could not read child item: %s", local_error->message);
-        continue;
-      }
+/**
+ * msg_drive_service_list_children:
+ * @self: a #MsgDriveService
+ * @item: a #MsgDriveItem
+ * @cancellable: a #GCancellable
+ * @error: a #GError
+ *
+ * Get a list of all files in folder item
+ *
+ * Returns: (element-type MsgDriveItem) (transfer full): all items in folder
+ */
+GList *
+msg_drive_service_list_children (MsgDriveService  *self,
+                                 MsgDriveItem     *item,
+                                 GCancellable     *cancellable,
+                                 GError          **error)
+{
+  g_autoptr (MsgPageIterator) iter = NULL;
+  g_autolist (MsgDriveItem) children = NULL;
+  g_autoptr (GError) local_error = NULL;
+  MsgDriveItem *child_item;
 
-      children = g_list_prepend (children, g_steal_pointer (&child_item));
-    }
+  iter = msg_drive_service_iterate_children (self, item);
+  while ((child_item = msg_page_iterator_next (iter, cancellable, &local_error)))
+    children = g_list_prepend (children, child_item);
 
-    g_clear_pointer (&url, g_free);
-    url = msg_service_get_next_link (root_object);
-  } while (url != NULL);
+  if (local_error) {
+    g_propagate_error (error, g_steal_pointer (&local_error));
+    return NULL;
+  }
 
   return g_steal_pointer (&children);
 }
@@ -586,6 +647,94 @@ msg_drive_service_delete (MsgDriveService  *self,
   return bytes != NULL;
 }
 
+/**
+ * msg_drive_service_delete_items:
+ * @self: a drive service
+ * @items: (element-type MsgDriveItem): a list of #MsgDriveItem
+ * @cancellable: a cancellable
+ * @error: a error
+ *
+ * Deletes all @items. Requests are combined into batches to reduce
+ * the number of round trips. Processing stops at the first batch
+ * containing a failed request.
+ *
+ * Returns: %TRUE when all items have been deleted, otherwise %FALSE
+ */
+gboolean
+msg_drive_service_delete_items (MsgDriveService  *self,
+                                GList            *items,
+                                GCancellable     *cancellable,
+                                GError          **error)
+{
+  GList *iter = items;
+
+  if (!msg_service_refresh_authorization (MSG_SERVICE (self), cancellable, error))
+    return FALSE;
+
+  while (iter) {
+    g_autoptr (MsgBatch) batch = msg_batch_new (MSG_SERVICE (self));
+    g_autoptr (GPtrArray) ids = g_ptr_array_new ();
+
+    for (; iter && !msg_batch_is_full (batch); iter = iter->next) {
+      MsgDriveItem *item = iter->data;
+      g_autoptr (SoupMessage) message = NULL;
+      g_autofree char *url = NULL;
+      const char *id;
+
+      url = g_strconcat (MSG_API_ENDPOINT,
+                         "/drives/",
+                         msg_drive_item_get_drive_id (item),
+                         "/items/",
+                         msg_drive_item_get_id (item),
+                         NULL);
+
+      message = msg_service_build_message (MSG_SERVICE (self), "DELETE", url, NULL, FALSE);
+      id = msg_batch_add (batch, message, NULL, NULL);
+      if (!id) {
+        g_set_error (error,
+                     msg_error_quark (),
+                     MSG_ERROR_FAILED,
+                     "Could not add %s to batch request",
+                     url);
+        return FALSE;
+      }
+
+      g_ptr_array_add (ids, (gpointer)id);
+    }
+
+    if (!msg_batch_send (batch, cancellable, error))
+      return FALSE;
+
+    for (guint idx = 0; idx < ids->len; idx++) {
+      if (!msg_batch_check_response (batch, g_ptr_array_index (ids, idx), error))
+        return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
+/* Creates an upload session for @item and returns its upload url */
+static char *
+create_upload_session (MsgDriveService  *self,
+                       MsgDriveItem     *item,
+                       char            **expiration,
+                       GCancellable     *cancellable,
+                       GError          **error)
+{
+  g_autofree char *url = NULL;
+
+  url = g_strconcat (MSG_API_ENDPOINT,
+                     "/drives/",
+                     msg_drive_item_get_drive_id (item),
+                     "/items/",
+                     msg_drive_item_get_id (item),
+                     "/createUploadSession",
+                     NULL);
+
+  return msg_drive_upload_stream_create_session (MSG_SERVICE (self), url, expiration, cancellable, error);
+}
+
 /**
  * msg_drive_service_update:
  * @self: a drive service
@@ -594,6 +743,9 @@ msg_drive_service_delete (MsgDriveService  *self,
  * @error: a error
  *
  * Creates an update stream for drive item in order to update it's content.
+ * The size of the content is not known, so content larger than one
+ * fragment is spooled until the stream is closed, see
+ * msg_drive_service_update_with_size().
  *
  * Returns: (transfer full): an output stream
  */
@@ -602,17 +754,129 @@ msg_drive_service_update (MsgDriveService  *self,
                           MsgDriveItem     *item,
                           GCancellable     *cancellable,
                           GError          **error)
+{
+  return msg_drive_service_update_with_size (self, item, -1, cancellable, error);
+}
+
+/**
+ * msg_drive_service_update_with_size:
+ * @self: a drive service
+ * @item: a drive item
+ * @size: number of bytes which will be written, or -1 if unknown
+ * @cancellable: a cancellable
+ * @error: a error
+ *
+ * Creates an update stream for drive item in order to update it's content.
+ * Content of up to %MSG_DRIVE_UPLOAD_SIMPLE_MAX_SIZE bytes is uploaded with
+ * a single request, larger content in fragments through an upload session,
+ * see #MsgDriveUploadStream. With a known @size fragments are sent while
+ * writing, otherwise they are spooled until the stream is closed.
+ *
+ * No request is sent before data is written, so @cancellable and @error are
+ * not used: errors are reported by g_output_stream_write() and
+ * g_output_stream_close() on the returned stream.
+ *
+ * Returns: (transfer full): an output stream
+ */
+GOutputStream *
+msg_drive_service_update_with_size (MsgDriveService                       *self,
+                                    MsgDriveItem                          *item,
+                                    goffset                                size,
+                                    __attribute__ ((unused)) GCancellable *cancellable,
+                                    __attribute__ ((unused)) GError      **error)
 {
   GOutputStream *stream = NULL;
+  g_autofree char *item_url = NULL;
+  g_autofree char *content_url = NULL;
+  g_autofree char *session_url = NULL;
+
+  item_url = g_strconcat (MSG_API_ENDPOINT,
+                          "/drives/",
+                          msg_drive_item_get_drive_id (item),
+                          "/items/",
+                          msg_drive_item_get_id (item),
+                          NULL);
+  content_url = g_strconcat (item_url, "/content", NULL);
+  session_url = g_strconcat (item_url, "/createUploadSession", NULL);
+
+  /* The session is only created if the content turns out to be large */
+  stream = msg_drive_upload_stream_new_deferred (MSG_SERVICE (self), content_url, session_url, size);
+  g_object_set_data (G_OBJECT (stream), "ms-graph-item", item);
+
+  return stream;
+}
+
+/**
+ * msg_drive_service_add_file:
+ * @self: a #MsgDriveService
+ * @parent: parent folder
+ * @name: name of the new file
+ * @size: number of bytes which will be written, or -1 if unknown
+ * @cancellable: a #GCancellable
+ * @error: a #GError
+ *
+ * Creates a stream uploading a new file named @name into @parent. Unlike
+ * msg_drive_service_add_item_to_folder() followed by an update, small
+ * files are created together with their content in a single request.
+ * Large files are sent in fragments while writing if @size is known, see
+ * msg_drive_service_update_with_size(). Finish the upload with
+ * msg_drive_service_update_finish().
+ *
+ * Only @name is validated here, upload errors are reported by
+ * g_output_stream_write() and g_output_stream_close() on the returned stream.
+ *
+ * Returns: (transfer full): an output stream or %NULL on error
+ */
+GOutputStream *
+msg_drive_service_add_file (MsgDriveService                       *self,
+                            MsgDriveItem                          *parent,
+                            const char                            *name,
+                            goffset                                size,
+                            __attribute__ ((unused)) GCancellable *cancellable,
+                            GError                               **error)
+{
+  g_autofree char *escaped_name = NULL;
+  g_autofree char *item_url = NULL;
+  g_autofree char *content_url = NULL;
+  g_autofree char *session_url = NULL;
+
+  if (!is_valid_name (name)) {
+    g_set_error (error,
+                 msg_error_quark (),
+                 MSG_ERROR_FAILED,
+                 "Invalid characters in name");
+    return NULL;
+  }
+
+  escaped_name = g_uri_escape_string (name, NULL, TRUE);
+  item_url = g_strconcat (MSG_API_ENDPOINT,
+                          "/drives/",
+                          msg_drive_item_get_drive_id (parent),
+                          "/items/",
+                          msg_drive_item_get_id (parent),
+                          ":/",
+                          escaped_name,
+                          ":",
+                          NULL);
+
+  /* Resolve conflicts the same way as upload sessions do */
+  content_url = g_strconcat (item_url, "/content?%40microsoft.graph.conflictBehavior=rename", NULL);
+  session_url = g_strconcat (item_url, "/createUploadSession", NULL);
+
+  return msg_drive_upload_stream_new_deferred (MSG_SERVICE (self), content_url, session_url, size);
+}
+
+/* Replaces the content of @item in a single request */
+static MsgDriveItem *
+put_content (MsgDriveService  *self,
+             MsgDriveItem     *item,
+             GBytes           *bytes,
+             GCancellable     *cancellable,
+             GError          **error)
+{
   g_autofree char *url = NULL;
-  g_autoptr (JsonBuilder) builder = NULL;
-  g_autoptr (JsonNode) create_node = NULL;
   g_autoptr (SoupMessage) message = NULL;
   JsonObject *root_object = NULL;
-  g_autofree char *json = NULL;
-  g_autoptr (GBytes) response = NULL;
-  g_autoptr (GBytes) body = NULL;
-  const char *upload_url;
   g_autoptr (JsonParser) parser = NULL;
 
   if (!msg_service_refresh_authorization (MSG_SERVICE (self), cancellable, error))
@@ -623,46 +887,24 @@ msg_drive_service_update (MsgDriveService  *self,
                      msg_drive_item_get_drive_id (item),
                      "/items/",
                      msg_drive_item_get_id (item),
-                     "/createUploadSession",
+                     "/content",
                      NULL);
 
-  message = msg_service_build_message (MSG_SERVICE (self), "POST", url, NULL, FALSE);
-  builder = json_builder_new ();
-  json_builder_begin_object (builder);
-  json_builder_set_member_name (builder, "@microsoft.graph.conflictBehavior");
-  json_builder_add_string_value (builder, "rename");
-  json_builder_end_object (builder);
-  create_node = json_builder_get_root (builder);
-  json = json_to_string (create_node, TRUE);
-
-  body = g_bytes_new (json, strlen (json));
-  soup_message_set_request_body_from_bytes (message, "application/json", body);
+  message = msg_service_build_message (MSG_SERVICE (self), "PUT", url, NULL, FALSE);
+  soup_message_set_request_body_from_bytes (message, "application/octet-stream", bytes);
 
   parser = msg_service_send_and_parse_response (MSG_SERVICE (self), message, &root_object, cancellable, error);
   if (!parser)
     return NULL;
 
-  if (!json_object_has_member (root_object, "uploadUrl")) {
-    g_set_error (error,
-                 msg_error_quark (),
-                 MSG_ERROR_FAILED,
-                 "No uploadUrl found");
-    return NULL;
-  }
-
-  upload_url = json_object_get_string_member (root_object, "uploadUrl");
-
-  stream = g_memory_output_stream_new_resizable ();
-  g_object_set_data_full (G_OBJECT (stream), "ms-graph-upload-url", g_strdup (upload_url), g_free);
-  g_object_set_data (G_OBJECT (stream), "ms-graph-item", item);
-
-  return stream;
+  return msg_drive_item_new_from_json (root_object, error);
 }
 
 /**
  * msg_drive_service_update_finish:
  * @self: a #MsgDriveService
- * @item: a #MsgDriveItem
+ * @item: (nullable): a #MsgDriveItem, %NULL for streams of
+ *   msg_drive_service_add_file()
  * @stream: stream where data is store and needs to be transfered
  * @cancellable: a #GCancellable
  * @error: a #GError
@@ -679,35 +921,236 @@ msg_drive_service_update_finish (MsgDriveService  *self,
                                  GError          **error)
 {
   g_autoptr (GBytes) bytes = NULL;
-  g_autofree char *url = NULL;
+
+  if (MSG_IS_DRIVE_UPLOAD_STREAM (stream)) {
+    MsgDriveUploadStream *upload_stream = MSG_DRIVE_UPLOAD_STREAM (stream);
+    MsgDriveItem *ret;
+
+    if (!g_output_stream_is_closed (stream) && !g_output_stream_close (stream, cancellable, error)) {
+      g_clear_object (&stream);
+      return NULL;
+    }
+
+    /* Empty content cannot be sent through an upload session, streams
+     * without a session have uploaded it themselves */
+    if (msg_drive_upload_stream_get_offset (upload_stream) > 0 || !msg_drive_upload_stream_get_upload_url (upload_stream)) {
+      ret = msg_drive_upload_stream_get_item (upload_stream, error);
+      g_clear_object (&stream);
+      return ret;
+    }
+  }
+
+  g_output_stream_close (stream, NULL, NULL);
+  if (G_IS_MEMORY_OUTPUT_STREAM (stream))
+    bytes = g_memory_output_stream_steal_as_bytes (G_MEMORY_OUTPUT_STREAM (stream));
+  else
+    bytes = g_bytes_new (NULL, 0);
+  g_clear_object (&stream);
+
+  /* Streams of msg_drive_service_add_file() have no item to put content to */
+  if (!item) {
+    g_set_error (error,
+                 msg_error_quark (),
+                 MSG_ERROR_FAILED,
+                 "Upload finished without a drive item");
+    return NULL;
+  }
+
+  return put_content (self, item, bytes, cancellable, error);
+}
+
+/* Returns the offset the session of @journal expects next, or -1 if it
+ * cannot be resumed */
+static goffset
+query_upload_session (MsgDriveService       *self,
+                      MsgDriveUploadJournal *journal,
+                      goffset                size,
+                      GCancellable          *cancellable)
+{
   g_autoptr (SoupMessage) message = NULL;
-  JsonObject *root_object = NULL;
-  g_autoptr (GBytes) response = NULL;
   g_autoptr (JsonParser) parser = NULL;
+  g_autoptr (GError) error = NULL;
+  JsonObject *root_object = NULL;
+  JsonArray *ranges;
+  const char *range;
+  goffset offset;
 
-  if (!msg_service_refresh_authorization (MSG_SERVICE (self), cancellable, error))
+  message = msg_service_build_message (MSG_SERVICE (self), "GET", journal->upload_url, NULL, FALSE);
+  if (!message)
+    return -1;
+
+  g_object_set_data (G_OBJECT (message), "msg-preauthenticated", GINT_TO_POINTER (TRUE));
+
+  parser = msg_service_send_and_parse_response (MSG_SERVICE (self), message, &root_object, cancellable, &error);
+  if (!parser || !SOUP_STATUS_IS_SUCCESSFUL (soup_message_get_status (message))) {
+    g_debug ("Upload session cannot be resumed: %s", error ? error->message : soup_message_get_reason_phrase (message));
+    return -1;
+  }
+
+  if (!json_object_has_member (root_object, "nextExpectedRanges"))
+    return -1;
+
+  /* Ranges look like "26-" or "26-99", only the first one is of interest */
+  ranges = json_object_get_array_member (root_object, "nextExpectedRanges");
+  if (json_array_get_length (ranges) == 0)
+    return -1;
+
+  range = json_array_get_string_element (ranges, 0);
+  offset = range ? g_ascii_strtoll (range, NULL, 10) : -1;
+  if (offset < 0 || offset >= size)
+    return -1;
+
+  if (json_object_has_member (root_object, "expirationDateTime")) {
+    g_free (journal->expiration);
+    journal->expiration = g_strdup (msg_json_object_get_string (root_object, "expirationDateTime"));
+  }
+
+  return offset;
+}
+
+typedef struct {
+  MsgDriveUploadJournal *journal;
+  const char *path;
+} UploadJournalData;
+
+static void
+upload_offset_cb (GObject                             *object,
+                  __attribute__ ((unused)) GParamSpec *pspec,
+                  gpointer                             user_data)
+{
+  UploadJournalData *data = user_data;
+  g_autoptr (GError) error = NULL;
+
+  data->journal->offset = msg_drive_upload_stream_get_offset (MSG_DRIVE_UPLOAD_STREAM (object));
+  if (!msg_drive_upload_journal_save (data->journal, data->path, &error))
+    g_warning ("Could not update upload journal: %s", error->message);
+}
+
+/**
+ * msg_drive_service_upload_file:
+ * @self: a #MsgDriveService
+ * @item: the drive item whose content is replaced
+ * @file: the local source file
+ * @journal_dir: (nullable): directory for the upload journal, or %NULL
+ *   to disable resuming
+ * @cancellable: a #GCancellable
+ * @error: a #GError
+ *
+ * Uploads @file through an upload session. The session and the bytes
+ * acknowledged by the server are recorded in a journal in @journal_dir,
+ * so that an interrupted upload, even of a previous process, resumes
+ * from the last acknowledged byte. The journal is only used as long as
+ * @file has not been modified and the session did not expire, and is
+ * removed once the upload is complete. Files of up to
+ * %MSG_DRIVE_UPLOAD_SIMPLE_MAX_SIZE bytes are uploaded with a single
+ * request and without a journal.
+ *
+ * Returns: (transfer full): the uploaded #MsgDriveItem or %NULL on error
+ */
+MsgDriveItem *
+msg_drive_service_upload_file (MsgDriveService  *self,
+                               MsgDriveItem     *item,
+                               GFile            *file,
+                               const char       *journal_dir,
+                               GCancellable     *cancellable,
+                               GError          **error)
+{
+  g_autoptr (GFileInfo) info = NULL;
+  g_autoptr (MsgDriveUploadJournal) journal = NULL;
+  g_autoptr (GFileInputStream) input = NULL;
+  g_autoptr (GOutputStream) stream = NULL;
+  g_autofree char *path = NULL;
+  g_autofree char *fingerprint = NULL;
+  UploadJournalData data;
+  MsgDriveItem *ret;
+  goffset offset = 0;
+  goffset size;
+
+  info = g_file_query_info (file,
+                            G_FILE_ATTRIBUTE_STANDARD_SIZE "," G_FILE_ATTRIBUTE_TIME_MODIFIED "," G_FILE_ATTRIBUTE_ETAG_VALUE,
+                            G_FILE_QUERY_INFO_NONE,
+                            cancellable,
+                            error);
+  if (!info)
     return NULL;
 
-  url = g_strconcat (MSG_API_ENDPOINT,
-                     "/drives/",
-                     msg_drive_item_get_drive_id (item),
-                     "/items/",
-                     msg_drive_item_get_id (item),
-                     "/content",
-                     NULL);
+  size = g_file_info_get_size (info);
+  if (size <= MSG_DRIVE_UPLOAD_SIMPLE_MAX_SIZE) {
+    g_autoptr (GBytes) bytes = NULL;
 
-  g_output_stream_close (stream, NULL, NULL);
-  bytes = g_memory_output_stream_steal_as_bytes (G_MEMORY_OUTPUT_STREAM (stream));
+    /* Small files take a single request, there is nothing to resume */
+    bytes = g_file_load_bytes (file, cancellable, NULL, error);
+    if (!bytes)
+      return NULL;
 
-  message = msg_service_build_message (MSG_SERVICE (self), "PUT", url, NULL, FALSE);
-  soup_message_set_request_body_from_bytes (message, "application/octet-stream", bytes);
-  g_clear_object (&stream);
+    return put_content (self, item, bytes, cancellable, error);
+  }
 
-  parser = msg_service_send_and_parse_response (MSG_SERVICE (self), message, &root_object, cancellable, error);
-  if (!parser)
+  if (journal_dir) {
+    path = msg_drive_upload_journal_get_path (journal_dir, msg_drive_item_get_drive_id (item), msg_drive_item_get_id (item), file);
+    fingerprint = msg_drive_upload_journal_fingerprint (info);
+    journal = msg_drive_upload_journal_load (path);
+
+    if (journal && (g_strcmp0 (journal->fingerprint, fingerprint) != 0 || msg_drive_upload_journal_is_expired (journal)))
+      g_clear_pointer (&journal, msg_drive_upload_journal_free);
+
+    if (journal) {
+      offset = query_upload_session (self, journal, size, cancellable);
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        return NULL;
+
+      if (offset < 0) {
+        g_clear_pointer (&journal, msg_drive_upload_journal_free);
+        offset = 0;
+      }
+    }
+  }
+
+  if (!journal) {
+    journal = g_new0 (MsgDriveUploadJournal, 1);
+    journal->upload_url = create_upload_session (self, item, &journal->expiration, cancellable, error);
+    if (!journal->upload_url)
+      return NULL;
+
+    journal->fingerprint = g_steal_pointer (&fingerprint);
+  }
+
+  journal->offset = offset;
+  if (path && !msg_drive_upload_journal_save (journal, path, error))
     return NULL;
 
-  return msg_drive_item_new_from_json (root_object, error);
+  input = g_file_read (file, cancellable, error);
+  if (!input)
+    return NULL;
+
+  if (offset > 0 && !g_seekable_seek (G_SEEKABLE (input), offset, G_SEEK_SET, cancellable, error))
+    return NULL;
+
+  stream = msg_drive_upload_stream_new (MSG_SERVICE (self), journal->upload_url, size, 0);
+  msg_drive_upload_stream_set_offset (MSG_DRIVE_UPLOAD_STREAM (stream), offset);
+
+  if (path) {
+    data.journal = journal;
+    data.path = path;
+    g_signal_connect (stream, "notify::offset", G_CALLBACK (upload_offset_cb), &data);
+  }
+
+  /* On failure the journal is kept for the next attempt */
+  if (g_output_stream_splice (stream,
+                              G_INPUT_STREAM (input),
+                              G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE | G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET,
+                              cancellable,
+                              error) < 0)
+    return NULL;
+
+  if (path)
+    g_signal_handlers_disconnect_by_data (stream, &data);
+
+  ret = msg_drive_upload_stream_get_item (MSG_DRIVE_UPLOAD_STREAM (stream), error);
+  if (ret && path)
+    g_unlink (path);
+
+  return ret;
 }
 
 /**
@@ -770,6 +1213,28 @@ msg_drive_service_add_item_to_folder (MsgDriveService  *self,
   return msg_drive_item_new_from_json (root_object, error);
 }
 
+/**
+ * msg_drive_service_iterate_shared_with_me:
+ * @self: a #MsgDriveService
+ *
+ * Creates an iterator over all shared with me items. Pages are requested
+ * on demand while iterating.
+ *
+ * Returns: (transfer full): a new `MsgPageIterator` returning `MsgDriveItem`s
+ */
+MsgPageIterator *
+msg_drive_service_iterate_shared_with_me (MsgDriveService *self)
+{
+  g_autofree char *url = NULL;
+
+  url = g_strconcat (MSG_API_ENDPOINT,
+                     "/me/drive/sharedWithMe",
+                     "?select=id,remoteItem,file,folder,parentReference,name,createdBy,lastModifiedBy,createdDateTime,lastModifiedDateTime,size",
+                     NULL);
+
+  return msg_page_iterator_new (MSG_SERVICE (self), url, (MsgPageIteratorItemFunc) msg_drive_item_new_from_json);
+}
+
 /**
  * msg_drive_service_get_shared_with_me:
  * @self: a #MsgDriveService
@@ -785,51 +1250,19 @@ msg_drive_service_get_shared_with_me (MsgDriveService  *self,
                                       GCancellable     *cancellable,
                                       GError          **error)
 {
-  g_autoptr (MsgDriveItem) child_item = NULL;
-  g_autofree char *url = NULL;
-  JsonObject *root_object = NULL;
-  JsonArray *array = NULL;
-  guint array_length = 0, index = 0;
-  JsonObject *item_object = NULL;
+  g_autoptr (MsgPageIterator) iter = NULL;
   g_autolist (MsgDriveItem) children = NULL;
-  g_autoptr (GBytes) response = NULL;
-  g_autoptr (JsonParser) parser = NULL;
-
-  if (!msg_service_refresh_authorization (MSG_SERVICE (self), cancellable, error))
-    return NULL;
-
-  url = g_strconcat (MSG_API_ENDPOINT,
-                     "/me/drive/sharedWithMe",
-                     "?select=id,remoteItem,file,folder,parentReference,name,createdBy,lastModifiedBy,createdDateTime,lastModifiedDateTime,size",
-                     NULL);
-  do {
-    g_autoptr (SoupMessage) message = NULL;
+  g_autoptr (GError) local_error = NULL;
+  MsgDriveItem *child_item;
 
-    message = msg_service_build_message (MSG_SERVICE (self), "GET", url, NULL, FALSE);
-    parser = msg_service_send_and_parse_response (MSG_SERVICE (self), message, &root_object, cancellable, error);
-    if (!parser)
-      return NULL;
-
-    array = json_object_get_array_member (root_object, "value");
-    g_assert (array != NULL);
-
-    array_length = json_array_get_length (array);
-    for (index = 0; index < array_length; index++) {
-      g_autoptr (GError) local_error = NULL;
-      item_object = json_array_get_object_element (array, index);
+  iter = msg_drive_service_iterate_shared_with_me (self);
+  while ((child_item = msg_page_iterator_next (iter, cancellable, &local_error)))
+    children = g_list_prepend (children, child_item);
 
-      child_item = msg_drive_item_new_from_json (item_object, &local_error);
-      if (local_error) {
-        g_warning ("Could not load shared with me item: %s", local_error->message);
-        continue;
-      }
-
-      children = g_list_prepend (children, g_steal_pointer (&child_item));
-    }
-
-    g_clear_pointer (&url, g_free);
-    url = msg_service_get_next_link (root_object);
-  } while (url != NULL);
+  if (local_error) {
+    g_propagate_error (error, g_steal_pointer (&local_error));
+    return NULL;
+  }
 
   return g_steal_pointer (&children);
 }
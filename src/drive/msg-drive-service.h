@@ -46,6 +46,10 @@ msg_drive_service_get_root (MsgDriveService  *self,
                             GCancellable     *cancellable,
                             GError          **error);
 
+MsgPageIterator *
+msg_drive_service_iterate_children (MsgDriveService *self,
+                                    MsgDriveItem    *item);
+
 GList *
 msg_drive_service_list_children (MsgDriveService  *self,
                                  MsgDriveItem     *item,
@@ -64,6 +68,14 @@ msg_drive_service_download_item (MsgDriveService  *self,
                                  GCancellable     *cancellable,
                                  GError          **error);
 
+gboolean
+msg_drive_service_download_item_to_file (MsgDriveService  *self,
+                                         MsgDriveItem     *item,
+                                         GFile            *destination,
+                                         guint             concurrency,
+                                         GCancellable     *cancellable,
+                                         GError          **error);
+
 /* Write support */
 
 MsgDriveItem *
@@ -87,12 +99,33 @@ msg_drive_service_delete (MsgDriveService  *self,
                           GCancellable     *cancellable,
                           GError          **error);
 
+gboolean
+msg_drive_service_delete_items (MsgDriveService  *self,
+                                GList            *items,
+                                GCancellable     *cancellable,
+                                GError          **error);
+
 GOutputStream *
 msg_drive_service_update (MsgDriveService  *self,
                           MsgDriveItem     *item,
                           GCancellable     *cancellable,
                           GError          **error);
 
+GOutputStream *
+msg_drive_service_update_with_size (MsgDriveService  *self,
+                                    MsgDriveItem     *item,
+                                    goffset           size,
+                                    GCancellable     *cancellable,
+                                    GError          **error);
+
+GOutputStream *
+msg_drive_service_add_file (MsgDriveService  *self,
+                            MsgDriveItem     *parent,
+                            const char       *name,
+                            goffset           size,
+                            GCancellable     *cancellable,
+                            GError          **error);
+
 MsgDriveItem *
 msg_drive_service_update_finish (MsgDriveService  *self,
                                  MsgDriveItem     *item,
@@ -100,6 +133,14 @@ msg_drive_service_update_finish (MsgDriveService  *self,
                                  GCancellable     *cancellable,
                                  GError          **error);
 
+MsgDriveItem *
+msg_drive_service_upload_file (MsgDriveService  *self,
+                               MsgDriveItem     *item,
+                               GFile            *file,
+                               const char       *journal_dir,
+                               GCancellable     *cancellable,
+                               GError          **error);
+
 MsgDriveItem *
 msg_drive_service_add_item_to_folder (MsgDriveService  *self,
                                       MsgDriveItem     *parent,
@@ -107,6 +148,9 @@ msg_drive_service_add_item_to_folder (MsgDriveService  *self,
                                       GCancellable     *cancellable,
                                       GError          **error);
 
+MsgPageIterator *
+msg_drive_service_iterate_shared_with_me (MsgDriveService *self);
+
 GList *
 msg_drive_service_get_shared_with_me (MsgDriveService  *self,
                                       GCancellable     *cancellable,
@@ -0,0 +1,162 @@
+/* Copyright 2024 Jan-Michael Brummer <jan-michael.brummer1@volkswagen.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "drive/msg-drive-upload-journal.h"
+
+#define JOURNAL_GROUP "Upload"
+
+/* Sessions are not resumed shortly before they expire */
+#define JOURNAL_EXPIRY_MARGIN (5 * G_TIME_SPAN_MINUTE)
+
+/**
+ * msg_drive_upload_journal_get_path:
+ * @directory: journal directory
+ * @drive_id: drive of the uploaded item
+ * @item_id: uploaded item
+ * @file: source file
+ *
+ * Creates the journal path of the upload of @file to an item.
+ *
+ * Returns: (transfer full): journal path
+ */
+char *
+msg_drive_upload_journal_get_path (const char *directory,
+                                   const char *drive_id,
+                                   const char *item_id,
+                                   GFile      *file)
+{
+  g_autofree char *uri = g_file_get_uri (file);
+  g_autofree char *key = g_strjoin ("\n", drive_id, item_id, uri, NULL);
+  g_autofree char *checksum = g_compute_checksum_for_string (G_CHECKSUM_SHA256, key, -1);
+  g_autofree char *name = g_strconcat (checksum, ".upload", NULL);
+
+  return g_build_filename (directory, name, NULL);
+}
+
+/**
+ * msg_drive_upload_journal_fingerprint:
+ * @info: a #GFileInfo holding size, modification time and etag
+ *
+ * Creates a fingerprint of the source file, which changes whenever the
+ * file is modified.
+ *
+ * Returns: (transfer full): fingerprint
+ */
+char *
+msg_drive_upload_journal_fingerprint (GFileInfo *info)
+{
+  return g_strdup_printf ("%" G_GOFFSET_FORMAT ":%" G_GUINT64_FORMAT ":%s",
+                          g_file_info_get_size (info),
+                          g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED),
+                          g_file_info_get_etag (info) ? g_file_info_get_etag (info) : "");
+}
+
+/**
+ * msg_drive_upload_journal_load:
+ * @path: journal path
+ *
+ * Loads a journal written by msg_drive_upload_journal_save().
+ *
+ * Returns: (transfer full) (nullable): the journal or %NULL if there is
+ *   no valid one
+ */
+MsgDriveUploadJournal *
+msg_drive_upload_journal_load (const char *path)
+{
+  g_autoptr (GKeyFile) key_file = g_key_file_new ();
+  g_autoptr (MsgDriveUploadJournal) journal = NULL;
+  g_autoptr (GError) error = NULL;
+
+  if (!g_key_file_load_from_file (key_file, path, G_KEY_FILE_NONE, NULL))
+    return NULL;
+
+  journal = g_new0 (MsgDriveUploadJournal, 1);
+  journal->upload_url = g_key_file_get_string (key_file, JOURNAL_GROUP, "UploadUrl", NULL);
+  journal->expiration = g_key_file_get_string (key_file, JOURNAL_GROUP, "Expiration", NULL);
+  journal->fingerprint = g_key_file_get_string (key_file, JOURNAL_GROUP, "Fingerprint", NULL);
+  journal->offset = g_key_file_get_int64 (key_file, JOURNAL_GROUP, "Offset", &error);
+
+  if (!journal->upload_url || !journal->fingerprint || error || journal->offset < 0) {
+    g_debug ("Ignoring invalid upload journal %s", path);
+    return NULL;
+  }
+
+  return g_steal_pointer (&journal);
+}
+
+/**
+ * msg_drive_upload_journal_save:
+ * @journal: a #MsgDriveUploadJournal
+ * @path: journal path
+ * @error: a #GError
+ *
+ * Atomically replaces the journal at @path.
+ *
+ * Returns: %TRUE on success
+ */
+gboolean
+msg_drive_upload_journal_save (MsgDriveUploadJournal  *journal,
+                               const char             *path,
+                               GError                **error)
+{
+  g_autoptr (GKeyFile) key_file = g_key_file_new ();
+  g_autofree char *data = NULL;
+  gsize len;
+
+  g_key_file_set_string (key_file, JOURNAL_GROUP, "UploadUrl", journal->upload_url);
+  if (journal->expiration)
+    g_key_file_set_string (key_file, JOURNAL_GROUP, "Expiration", journal->expiration);
+  g_key_file_set_int64 (key_file, JOURNAL_GROUP, "Offset", journal->offset);
+  g_key_file_set_string (key_file, JOURNAL_GROUP, "Fingerprint", journal->fingerprint);
+
+  data = g_key_file_to_data (key_file, &len, NULL);
+
+  /* The upload url grants write access to the item */
+  return g_file_set_contents_full (path, data, len, G_FILE_SET_CONTENTS_CONSISTENT, 0600, error);
+}
+
+/**
+ * msg_drive_upload_journal_is_expired:
+ * @journal: a #MsgDriveUploadJournal
+ *
+ * Returns: %TRUE if the session of @journal expired or is about to expire
+ */
+gboolean
+msg_drive_upload_journal_is_expired (MsgDriveUploadJournal *journal)
+{
+  g_autoptr (GDateTime) expiration = NULL;
+  g_autoptr (GDateTime) now = NULL;
+
+  if (!journal->expiration)
+    return FALSE;
+
+  expiration = g_date_time_new_from_iso8601 (journal->expiration, NULL);
+  if (!expiration)
+    return TRUE;
+
+  now = g_date_time_new_now_utc ();
+  return g_date_time_difference (expiration, now) < JOURNAL_EXPIRY_MARGIN;
+}
+
+void
+msg_drive_upload_journal_free (MsgDriveUploadJournal *journal)
+{
+  g_free (journal->upload_url);
+  g_free (journal->expiration);
+  g_free (journal->fingerprint);
+  g_free (journal);
+}
@@ -0,0 +1,60 @@
+/* Copyright 2024 Jan-Michael Brummer <jan-michael.brummer1@volkswagen.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/* Internal on-disk state of a resumable upload session */
+
+typedef struct {
+  char *upload_url;
+  /* ISO 8601 expiration of the session */
+  char *expiration;
+  /* Bytes acknowledged by the server */
+  goffset offset;
+  char *fingerprint;
+} MsgDriveUploadJournal;
+
+char *
+msg_drive_upload_journal_get_path (const char *directory,
+                                   const char *drive_id,
+                                   const char *item_id,
+                                   GFile      *file);
+
+char *
+msg_drive_upload_journal_fingerprint (GFileInfo *info);
+
+MsgDriveUploadJournal *
+msg_drive_upload_journal_load (const char *path);
+
+gboolean
+msg_drive_upload_journal_save (MsgDriveUploadJournal  *journal,
+                               const char             *path,
+                               GError                **error);
+
+gboolean
+msg_drive_upload_journal_is_expired (MsgDriveUploadJournal *journal);
+
+void
+msg_drive_upload_journal_free (MsgDriveUploadJournal *journal);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (MsgDriveUploadJournal, msg_drive_upload_journal_free);
+
+G_END_DECLS
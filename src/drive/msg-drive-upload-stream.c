@@ -0,0 +1,876 @@
+/* Copyright 2024 Jan-Michael Brummer <jan-michael.brummer1@volkswagen.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <string.h>
+
+#include <libsoup/soup.h>
+#include <json-glib/json-glib.h>
+
+#include "msg-error.h"
+#include "msg-json-utils.h"
+#include "msg-service.h"
+#include "drive/msg-drive-item.h"
+#include "drive/msg-drive-upload-stream.h"
+
+/**
+ * MsgDriveUploadStream:
+ *
+ * Uploads the data written to it through an upload session. Data is
+ * collected in fragment buffers, which are sent with a matching
+ * `Content-Range` as soon as they are full, so memory stays bounded by
+ * twice the fragment size regardless of the file size.
+ *
+ * Full fragments are hashed and sent on a worker thread, while the
+ * caller keeps reading its source into the second buffer. Results of the
+ * worker are applied by the writing thread, which also emits
+ * notify::offset. The last fragment is sent on close, its response
+ * holds the uploaded item, see msg_drive_upload_stream_get_item().
+ *
+ * Streams created with msg_drive_upload_stream_new_deferred() only create
+ * the upload session once the content exceeds
+ * %MSG_DRIVE_UPLOAD_SIMPLE_MAX_SIZE. Smaller content is sent with a single
+ * request on close.
+ *
+ * Every fragment has to announce the total size. If it is not known in
+ * advance, content exceeding one fragment is spooled to a file in the
+ * user cache directory and uploaded on close. /tmp is avoided, as it is
+ * often backed by memory.
+ */
+struct _MsgDriveUploadStream {
+  GOutputStream parent_instance;
+
+  MsgService *service;
+  /* NULL until the session of a deferred stream is created */
+  char *upload_url;
+  /* Targets of deferred streams */
+  char *content_url;
+  char *session_url;
+  /* Total size if known in advance, -1 otherwise */
+  goffset size;
+  gsize fragment_size;
+
+  /* Fragment being filled by the writer, starting at queued */
+  guint8 *buffer;
+  gsize buffered;
+  goffset queued;
+  /* Fragment of the sender thread, if any */
+  guint8 *spare;
+  /* Worker sending SendJobs, started with the first full fragment */
+  GThread *sender;
+  GAsyncQueue *jobs;
+  GAsyncQueue *results;
+  gboolean sending;
+
+  /* Content of unknown size beyond the first fragment, see spool_write() */
+  GFile *spool_file;
+  GFileIOStream *spool;
+
+  /* Bytes already accepted by the server */
+  goffset offset;
+  /* SHA-256 of the content, unless the upload has been resumed */
+  GChecksum *checksum;
+
+  JsonParser *item_parser;
+  /* Set once a fragment failed or the stream is dropped unclosed */
+  gboolean abandoned;
+};
+
+G_DEFINE_TYPE (MsgDriveUploadStream, msg_drive_upload_stream, G_TYPE_OUTPUT_STREAM);
+
+enum {
+  PROP_0,
+  PROP_OFFSET,
+  PROP_COUNT
+};
+
+static GParamSpec *properties[PROP_COUNT] = { NULL, };
+
+#define SPOOL_CHUNK_SIZE (64 * 1024)
+
+/* Owns the checksum while it is queued, so that only one thread uses it */
+typedef struct {
+  const guint8 *data;
+  gsize len;
+  goffset start;
+  GChecksum *checksum;
+  GCancellable *cancellable;
+  GError *error;
+} SendJob;
+
+/* Stops the sender thread */
+static SendJob stop_job;
+
+/* Sends one fragment, called from the sender thread for all but the
+ * last one. Only the last fragment returns @item_parser. */
+static gboolean
+upload_fragment (MsgDriveUploadStream  *self,
+                 const guint8          *data,
+                 gsize                  len,
+                 goffset                start,
+                 gboolean               last,
+                 JsonParser           **item_parser,
+                 GCancellable          *cancellable,
+                 GError               **error)
+{
+  g_autoptr (SoupMessage) message = NULL;
+  g_autoptr (GBytes) body = NULL;
+  g_autoptr (GBytes) response = NULL;
+  g_autoptr (JsonParser) parser = NULL;
+  g_autofree char *range = NULL;
+  JsonObject *root_object = NULL;
+  goffset end = start + len;
+  goffset total = self->size;
+  guint status;
+
+  /* Content of unknown size larger than one fragment is spooled, so
+   * this can only be a single last fragment */
+  if (total < 0)
+    total = end;
+
+  range = g_strdup_printf ("bytes %" G_GOFFSET_FORMAT "-%" G_GOFFSET_FORMAT "/%" G_GOFFSET_FORMAT, start, end - 1, total);
+
+  message = msg_service_build_message (self->service, "PUT", self->upload_url, NULL, FALSE);
+  if (!message) {
+    g_set_error (error,
+                 MSG_ERROR,
+                 MSG_ERROR_FAILED,
+                 "Invalid upload url");
+    return FALSE;
+  }
+
+  /* The upload url is pre-authenticated, the access token must not be sent */
+  g_object_set_data (G_OBJECT (message), "msg-preauthenticated", GINT_TO_POINTER (TRUE));
+  soup_message_headers_replace (soup_message_get_request_headers (message), "Content-Range", range);
+
+  /* The buffer is not touched until the message has been sent */
+  body = g_bytes_new_static (data, len);
+  soup_message_set_request_body_from_bytes (message, "application/octet-stream", body);
+
+  response = msg_service_send_and_read (self->service, message, cancellable, error);
+  if (!response)
+    return FALSE;
+
+  status = soup_message_get_status (message);
+  if (status == SOUP_STATUS_ACCEPTED && !last)
+    return TRUE;
+
+  parser = msg_service_parse_response (response, &root_object, error);
+  if (!parser)
+    return FALSE;
+
+  if (!SOUP_STATUS_IS_SUCCESSFUL (status) || status == SOUP_STATUS_ACCEPTED) {
+    g_set_error (error,
+                 MSG_ERROR,
+                 MSG_ERROR_FAILED,
+                 "Upload of bytes %" G_GOFFSET_FORMAT "-%" G_GOFFSET_FORMAT " failed: %s",
+                 start,
+                 end - 1,
+                 soup_message_get_reason_phrase (message));
+    return FALSE;
+  }
+
+  if (item_parser)
+    *item_parser = g_steal_pointer (&parser);
+
+  return TRUE;
+}
+
+/* Creates the session of a deferred stream, if not done yet */
+static gboolean
+ensure_session (MsgDriveUploadStream  *self,
+                GCancellable          *cancellable,
+                GError               **error)
+{
+  if (self->upload_url)
+    return TRUE;
+
+  self->upload_url = msg_drive_upload_stream_create_session (self->service, self->session_url, NULL, cancellable, error);
+
+  return self->upload_url != NULL;
+}
+
+/* Sends the buffered rest, whose response holds the uploaded item */
+static gboolean
+upload_last_fragment (MsgDriveUploadStream  *self,
+                      GCancellable          *cancellable,
+                      GError               **error)
+{
+  g_autoptr (JsonParser) parser = NULL;
+
+  if (!ensure_session (self, cancellable, error) ||
+      !upload_fragment (self, self->buffer, self->buffered, self->queued, TRUE, &parser, cancellable, error))
+    return FALSE;
+
+  self->offset = self->queued + self->buffered;
+  g_set_object (&self->item_parser, parser);
+  g_object_notify_by_pspec (G_OBJECT (self), properties[PROP_OFFSET]);
+
+  return TRUE;
+}
+
+/* Sends the whole content of a deferred stream in a single request */
+static gboolean
+upload_content (MsgDriveUploadStream  *self,
+                GCancellable          *cancellable,
+                GError               **error)
+{
+  g_autoptr (SoupMessage) message = NULL;
+  g_autoptr (GBytes) body = NULL;
+  g_autoptr (JsonParser) parser = NULL;
+  JsonObject *root_object = NULL;
+
+  if (!msg_service_refresh_authorization (self->service, cancellable, error))
+    return FALSE;
+
+  message = msg_service_build_message (self->service, "PUT", self->content_url, NULL, FALSE);
+  body = g_bytes_new_static (self->buffer, self->buffered);
+  soup_message_set_request_body_from_bytes (message, "application/octet-stream", body);
+
+  parser = msg_service_send_and_parse_response (self->service, message, &root_object, cancellable, error);
+  if (!parser)
+    return FALSE;
+
+  self->offset = self->buffered;
+  g_set_object (&self->item_parser, parser);
+  g_object_notify_by_pspec (G_OBJECT (self), properties[PROP_OFFSET]);
+
+  return TRUE;
+}
+
+/* Only touches @self through upload_fragment (), whose fields are not
+ * changed while a fragment is in flight */
+static gpointer
+send_thread_func (gpointer user_data)
+{
+  MsgDriveUploadStream *self = user_data;
+  SendJob *job;
+
+  while ((job = g_async_queue_pop (self->jobs)) != &stop_job) {
+    /* Only one fragment is in flight, so hashing stays in order */
+    if (job->checksum)
+      g_checksum_update (job->checksum, job->data, job->len);
+
+    upload_fragment (self, job->data, job->len, job->start, FALSE, NULL, job->cancellable, &job->error);
+    g_async_queue_push (self->results, job);
+  }
+
+  return NULL;
+}
+
+/* Queues the fragment @data, see wait_for_sender () */
+static void
+send_fragment (MsgDriveUploadStream *self,
+               const guint8         *data,
+               gsize                 len,
+               GCancellable         *cancellable)
+{
+  SendJob *job;
+
+  if (!self->sender) {
+    self->jobs = g_async_queue_new ();
+    self->results = g_async_queue_new ();
+    self->sender = g_thread_new ("msg-upload", send_thread_func, self);
+  }
+
+  job = g_new0 (SendJob, 1);
+  job->data = data;
+  job->len = len;
+  job->start = self->queued;
+  job->checksum = g_steal_pointer (&self->checksum);
+  job->cancellable = cancellable ? g_object_ref (cancellable) : NULL;
+
+  self->sending = TRUE;
+  g_async_queue_push (self->jobs, job);
+}
+
+/* Waits for the fragment in flight and applies its result */
+static gboolean
+wait_for_sender (MsgDriveUploadStream  *self,
+                 GError               **error)
+{
+  SendJob *job;
+  gboolean ret;
+
+  if (!self->sending)
+    return TRUE;
+
+  job = g_async_queue_pop (self->results);
+  self->sending = FALSE;
+  self->checksum = g_steal_pointer (&job->checksum);
+
+  ret = job->error == NULL;
+  if (ret) {
+    self->offset = job->start + job->len;
+    g_object_notify_by_pspec (G_OBJECT (self), properties[PROP_OFFSET]);
+  } else {
+    g_propagate_error (error, job->error);
+  }
+
+  g_clear_object (&job->cancellable);
+  g_free (job);
+
+  return ret;
+}
+
+static void
+stop_sender (MsgDriveUploadStream *self)
+{
+  if (!self->sender)
+    return;
+
+  g_async_queue_push (self->jobs, &stop_job);
+  g_thread_join (g_steal_pointer (&self->sender));
+
+  g_clear_pointer (&self->jobs, g_async_queue_unref);
+  g_clear_pointer (&self->results, g_async_queue_unref);
+}
+
+/* Compares the content hash with the one reported for the uploaded item */
+static gboolean
+verify_checksum (MsgDriveUploadStream  *self,
+                 GError               **error)
+{
+  JsonObject *root_object = json_node_get_object (json_parser_get_root (self->item_parser));
+  JsonObject *file;
+  JsonObject *hashes;
+  const char *expected;
+
+  if (!json_object_has_member (root_object, "file"))
+    return TRUE;
+
+  file = json_object_get_object_member (root_object, "file");
+  if (!file || !json_object_has_member (file, "hashes"))
+    return TRUE;
+
+  /* Only some drives report SHA-256 hashes */
+  hashes = json_object_get_object_member (file, "hashes");
+  expected = hashes ? json_object_get_string_member_with_default (hashes, "sha256Hash", NULL) : NULL;
+  if (!expected || g_ascii_strcasecmp (expected, g_checksum_get_string (self->checksum)) == 0)
+    return TRUE;
+
+  g_set_error (error,
+               MSG_ERROR,
+               MSG_ERROR_FAILED,
+               "Uploaded content does not match, SHA-256 is %s instead of %s",
+               expected,
+               g_checksum_get_string (self->checksum));
+  return FALSE;
+}
+
+/* Buffers @buffer and sends full fragments of a stream of known size */
+static gssize
+queue_write (MsgDriveUploadStream  *self,
+             const void            *buffer,
+             gsize                  count,
+             GCancellable          *cancellable,
+             GError               **error)
+{
+  gsize len;
+
+  if (self->size >= 0 && self->queued + (goffset)(self->buffered + count) > self->size) {
+    g_set_error (error,
+                 G_IO_ERROR,
+                 G_IO_ERROR_INVALID_ARGUMENT,
+                 "Upload exceeds announced size of %" G_GOFFSET_FORMAT " bytes",
+                 self->size);
+    return -1;
+  }
+
+  /* A full buffer is only sent once more data follows, so that the last
+   * fragment is always sent on close with the final size */
+  if (self->buffered == self->fragment_size) {
+    guint8 *full;
+
+    if (!wait_for_sender (self, error) || !ensure_session (self, cancellable, error)) {
+      self->abandoned = TRUE;
+      return -1;
+    }
+
+    full = self->buffer;
+    self->buffer = self->spare;
+    self->spare = full;
+
+    send_fragment (self, full, self->buffered, cancellable);
+    self->queued += self->buffered;
+    self->buffered = 0;
+  }
+
+  if (!self->buffer)
+    self->buffer = g_malloc (self->fragment_size);
+
+  len = MIN (count, self->fragment_size - self->buffered);
+  memcpy (self->buffer + self->buffered, buffer, len);
+  self->buffered += len;
+
+  return len;
+}
+
+/* Appends to the spool of a stream of unknown size, moving the full
+ * first fragment there on the first call */
+static gssize
+spool_write (MsgDriveUploadStream  *self,
+             const void            *buffer,
+             gsize                  count,
+             GCancellable          *cancellable,
+             GError               **error)
+{
+  GOutputStream *output;
+
+  if (!self->spool) {
+    g_autoptr (GFile) directory = g_file_new_build_filename (g_get_user_cache_dir (), "msgraph", NULL);
+    g_autoptr (GError) local_error = NULL;
+    g_autofree char *uuid = g_uuid_string_random ();
+    g_autofree char *name = g_strconcat ("upload-", uuid, NULL);
+
+    if (!g_file_make_directory_with_parents (directory, cancellable, &local_error) &&
+        !g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_EXISTS)) {
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return -1;
+    }
+
+    self->spool_file = g_file_get_child (directory, name);
+    self->spool = g_file_create_readwrite (self->spool_file, G_FILE_CREATE_PRIVATE, cancellable, error);
+    if (!self->spool) {
+      g_clear_object (&self->spool_file);
+      return -1;
+    }
+
+    output = g_io_stream_get_output_stream (G_IO_STREAM (self->spool));
+    if (!g_output_stream_write_all (output, self->buffer, self->buffered, NULL, cancellable, error))
+      return -1;
+
+    self->queued = self->buffered;
+    self->buffered = 0;
+  }
+
+  output = g_io_stream_get_output_stream (G_IO_STREAM (self->spool));
+  if (!g_output_stream_write_all (output, buffer, count, NULL, cancellable, error))
+    return -1;
+
+  self->queued += count;
+
+  return count;
+}
+
+/* Uploads the spooled content now that its size is known */
+static gboolean
+upload_spool (MsgDriveUploadStream  *self,
+              GCancellable          *cancellable,
+              GError               **error)
+{
+  GInputStream *input = g_io_stream_get_input_stream (G_IO_STREAM (self->spool));
+  g_autofree guint8 *chunk = g_malloc (SPOOL_CHUNK_SIZE);
+
+  if (!g_seekable_seek (G_SEEKABLE (self->spool), 0, G_SEEK_SET, cancellable, error))
+    return FALSE;
+
+  self->size = self->queued;
+  self->queued = 0;
+
+  while (TRUE) {
+    gssize len = g_input_stream_read (input, chunk, SPOOL_CHUNK_SIZE, cancellable, error);
+
+    if (len < 0)
+      return FALSE;
+
+    if (len == 0)
+      return TRUE;
+
+    for (gssize written = 0; written < len;) {
+      gssize ret = queue_write (self, chunk + written, len - written, cancellable, error);
+
+      if (ret < 0)
+        return FALSE;
+
+      written += ret;
+    }
+  }
+}
+
+static void
+clear_spool (MsgDriveUploadStream *self)
+{
+  if (self->spool_file)
+    g_file_delete (self->spool_file, NULL, NULL);
+
+  g_clear_object (&self->spool);
+  g_clear_object (&self->spool_file);
+}
+
+static gssize
+msg_drive_upload_stream_write (GOutputStream  *stream,
+                               const void     *buffer,
+                               gsize           count,
+                               GCancellable   *cancellable,
+                               GError        **error)
+{
+  MsgDriveUploadStream *self = MSG_DRIVE_UPLOAD_STREAM (stream);
+
+  if (self->size < 0 && (self->spool || self->buffered == self->fragment_size))
+    return spool_write (self, buffer, count, cancellable, error);
+
+  return queue_write (self, buffer, count, cancellable, error);
+}
+
+static gboolean
+msg_drive_upload_stream_close (GOutputStream  *stream,
+                               GCancellable   *cancellable,
+                               GError        **error)
+{
+  MsgDriveUploadStream *self = MSG_DRIVE_UPLOAD_STREAM (stream);
+  gboolean ret = TRUE;
+
+  if (self->spool && !self->abandoned && !upload_spool (self, cancellable, error)) {
+    self->abandoned = TRUE;
+    ret = FALSE;
+  }
+
+  /* Abandoned uploads must not commit partial content */
+  if (self->abandoned) {
+    wait_for_sender (self, NULL);
+  } else if (!wait_for_sender (self, error)) {
+    self->abandoned = TRUE;
+    ret = FALSE;
+  } else if (self->size >= 0 && self->queued + (goffset)self->buffered != self->size) {
+    g_set_error (error,
+                 G_IO_ERROR,
+                 G_IO_ERROR_PARTIAL_INPUT,
+                 "Upload closed after %" G_GOFFSET_FORMAT " of %" G_GOFFSET_FORMAT " bytes",
+                 self->queued + (goffset)self->buffered,
+                 self->size);
+    ret = FALSE;
+  } else if (self->buffered > 0 || !self->upload_url) {
+    /* Empty uploads have to be done without a session */
+    if (self->checksum)
+      g_checksum_update (self->checksum, self->buffer, self->buffered);
+
+    if (!self->upload_url && self->buffered <= MSG_DRIVE_UPLOAD_SIMPLE_MAX_SIZE)
+      ret = upload_content (self, cancellable, error);
+    else
+      ret = upload_last_fragment (self, cancellable, error);
+
+    if (ret && self->checksum)
+      ret = verify_checksum (self, error);
+
+    self->queued += self->buffered;
+  }
+
+  g_clear_pointer (&self->buffer, g_free);
+  g_clear_pointer (&self->spare, g_free);
+  self->buffered = 0;
+  clear_spool (self);
+  stop_sender (self);
+
+  return ret;
+}
+
+static void
+msg_drive_upload_stream_dispose (GObject *object)
+{
+  MsgDriveUploadStream *self = MSG_DRIVE_UPLOAD_STREAM (object);
+
+  self->abandoned = TRUE;
+  wait_for_sender (self, NULL);
+  stop_sender (self);
+
+  G_OBJECT_CLASS (msg_drive_upload_stream_parent_class)->dispose (object);
+}
+
+static void
+msg_drive_upload_stream_finalize (GObject *object)
+{
+  MsgDriveUploadStream *self = MSG_DRIVE_UPLOAD_STREAM (object);
+
+  g_clear_object (&self->service);
+  g_clear_pointer (&self->upload_url, g_free);
+  g_clear_pointer (&self->content_url, g_free);
+  g_clear_pointer (&self->session_url, g_free);
+  g_clear_pointer (&self->buffer, g_free);
+  g_clear_pointer (&self->spare, g_free);
+  g_clear_pointer (&self->checksum, g_checksum_free);
+  g_clear_object (&self->item_parser);
+  clear_spool (self);
+
+  G_OBJECT_CLASS (msg_drive_upload_stream_parent_class)->finalize (object);
+}
+
+static void
+msg_drive_upload_stream_get_property (GObject    *object,
+                                      guint       property_id,
+                                      GValue     *value,
+                                      GParamSpec *pspec)
+{
+  MsgDriveUploadStream *self = MSG_DRIVE_UPLOAD_STREAM (object);
+
+  switch (property_id) {
+    case PROP_OFFSET:
+      g_value_set_int64 (value, msg_drive_upload_stream_get_offset (self));
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+      break;
+  }
+}
+
+static void
+msg_drive_upload_stream_class_init (MsgDriveUploadStreamClass *class)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (class);
+  GOutputStreamClass *stream_class = G_OUTPUT_STREAM_CLASS (class);
+
+  object_class->dispose = msg_drive_upload_stream_dispose;
+  object_class->finalize = msg_drive_upload_stream_finalize;
+  object_class->get_property = msg_drive_upload_stream_get_property;
+  stream_class->write_fn = msg_drive_upload_stream_write;
+  stream_class->close_fn = msg_drive_upload_stream_close;
+
+  properties [PROP_OFFSET] = g_param_spec_int64 ("offset",
+                                                 "Offset",
+                                                 "Bytes accepted by the server",
+                                                 0,
+                                                 G_MAXINT64,
+                                                 0,
+                                                 G_PARAM_STATIC_STRINGS | G_PARAM_READABLE | G_PARAM_EXPLICIT_NOTIFY);
+
+  g_object_class_install_properties (object_class, PROP_COUNT, properties);
+}
+
+static void
+msg_drive_upload_stream_init (__attribute__ ((unused)) MsgDriveUploadStream *self)
+{
+}
+
+/**
+ * msg_drive_upload_stream_new:
+ * @service: a #MsgService
+ * @upload_url: the `uploadUrl` of an upload session
+ * @size: total number of bytes which will be written
+ * @fragment_size: bytes sent per request, rounded up to a multiple of
+ *   %MSG_DRIVE_UPLOAD_FRAGMENT_ALIGNMENT, or 0 for the default
+ *
+ * Creates a stream uploading everything written to it to @upload_url.
+ *
+ * Returns: (transfer full): a new #GOutputStream
+ */
+GOutputStream *
+msg_drive_upload_stream_new (MsgService *service,
+                             const char *upload_url,
+                             goffset     size,
+                             gsize       fragment_size)
+{
+  MsgDriveUploadStream *self;
+
+  g_return_val_if_fail (MSG_IS_SERVICE (service), NULL);
+  g_return_val_if_fail (upload_url != NULL, NULL);
+  g_return_val_if_fail (size >= 0, NULL);
+
+  if (!fragment_size)
+    fragment_size = MSG_DRIVE_UPLOAD_DEFAULT_FRAGMENT_SIZE;
+
+  fragment_size = (fragment_size + MSG_DRIVE_UPLOAD_FRAGMENT_ALIGNMENT - 1) / MSG_DRIVE_UPLOAD_FRAGMENT_ALIGNMENT * MSG_DRIVE_UPLOAD_FRAGMENT_ALIGNMENT;
+
+  self = g_object_new (MSG_TYPE_DRIVE_UPLOAD_STREAM, NULL);
+  self->service = g_object_ref (service);
+  self->upload_url = g_strdup (upload_url);
+  self->size = size;
+  self->fragment_size = MIN (fragment_size, MSG_DRIVE_UPLOAD_MAX_FRAGMENT_SIZE);
+  self->checksum = g_checksum_new (G_CHECKSUM_SHA256);
+
+  return G_OUTPUT_STREAM (self);
+}
+
+/**
+ * msg_drive_upload_stream_new_deferred:
+ * @service: a #MsgService
+ * @content_url: url replacing the content with a single `PUT`
+ * @session_url: url creating an upload session with a `POST`
+ * @size: total number of bytes which will be written, or -1 if unknown
+ *
+ * Creates a stream which uploads content of up to
+ * %MSG_DRIVE_UPLOAD_SIMPLE_MAX_SIZE bytes with one request to
+ * @content_url. Larger content is uploaded through a session created at
+ * @session_url once the first fragment is full. Without @size, content
+ * exceeding the first fragment is spooled to the user cache directory
+ * until the stream is closed, so pass @size whenever it is known.
+ *
+ * Returns: (transfer full): a new #GOutputStream
+ */
+GOutputStream *
+msg_drive_upload_stream_new_deferred (MsgService *service,
+                                      const char *content_url,
+                                      const char *session_url,
+                                      goffset     size)
+{
+  MsgDriveUploadStream *self;
+
+  g_return_val_if_fail (MSG_IS_SERVICE (service), NULL);
+  g_return_val_if_fail (content_url != NULL, NULL);
+  g_return_val_if_fail (session_url != NULL, NULL);
+
+  self = g_object_new (MSG_TYPE_DRIVE_UPLOAD_STREAM, NULL);
+  self->service = g_object_ref (service);
+  self->content_url = g_strdup (content_url);
+  self->session_url = g_strdup (session_url);
+  self->size = size;
+  self->fragment_size = MSG_DRIVE_UPLOAD_DEFAULT_FRAGMENT_SIZE;
+  self->checksum = g_checksum_new (G_CHECKSUM_SHA256);
+
+  return G_OUTPUT_STREAM (self);
+}
+
+/**
+ * msg_drive_upload_stream_create_session:
+ * @service: a #MsgService
+ * @url: the `createUploadSession` url of an item
+ * @expiration: (out) (optional): return location for the expiration date
+ * @cancellable: a #GCancellable
+ * @error: a #GError
+ *
+ * Creates an upload session. Name conflicts are resolved by renaming
+ * the uploaded item.
+ *
+ * Returns: (transfer full): the upload url of the session or %NULL on error
+ */
+char *
+msg_drive_upload_stream_create_session (MsgService    *service,
+                                        const char    *url,
+                                        char         **expiration,
+                                        GCancellable  *cancellable,
+                                        GError       **error)
+{
+  g_autoptr (JsonBuilder) builder = NULL;
+  g_autoptr (JsonNode) create_node = NULL;
+  g_autoptr (SoupMessage) message = NULL;
+  JsonObject *root_object = NULL;
+  g_autofree char *json = NULL;
+  g_autoptr (GBytes) body = NULL;
+  g_autoptr (JsonParser) parser = NULL;
+
+  if (!msg_service_refresh_authorization (service, cancellable, error))
+    return NULL;
+
+  message = msg_service_build_message (service, "POST", url, NULL, FALSE);
+  builder = json_builder_new ();
+  json_builder_begin_object (builder);
+  json_builder_set_member_name (builder, "@microsoft.graph.conflictBehavior");
+  json_builder_add_string_value (builder, "rename");
+  json_builder_end_object (builder);
+  create_node = json_builder_get_root (builder);
+  json = json_to_string (create_node, TRUE);
+
+  body = g_bytes_new (json, strlen (json));
+  soup_message_set_request_body_from_bytes (message, "application/json", body);
+
+  parser = msg_service_send_and_parse_response (service, message, &root_object, cancellable, error);
+  if (!parser)
+    return NULL;
+
+  if (!json_object_has_member (root_object, "uploadUrl")) {
+    g_set_error (error,
+                 msg_error_quark (),
+                 MSG_ERROR_FAILED,
+                 "No uploadUrl found");
+    return NULL;
+  }
+
+  if (expiration)
+    *expiration = g_strdup (msg_json_object_get_string (root_object, "expirationDateTime"));
+
+  return g_strdup (json_object_get_string_member (root_object, "uploadUrl"));
+}
+
+/**
+ * msg_drive_upload_stream_get_upload_url:
+ * @self: a #MsgDriveUploadStream
+ *
+ * Get the url of the upload session.
+ *
+ * Returns: (transfer none) (nullable): upload url, %NULL if a deferred
+ *   stream did not need a session yet
+ */
+const char *
+msg_drive_upload_stream_get_upload_url (MsgDriveUploadStream *self)
+{
+  return self->upload_url;
+}
+
+/**
+ * msg_drive_upload_stream_get_offset:
+ * @self: a #MsgDriveUploadStream
+ *
+ * Get the number of bytes already accepted by the server.
+ *
+ * Returns: uploaded bytes
+ */
+goffset
+msg_drive_upload_stream_get_offset (MsgDriveUploadStream *self)
+{
+  return self->offset;
+}
+
+/**
+ * msg_drive_upload_stream_set_offset:
+ * @self: a #MsgDriveUploadStream
+ * @offset: bytes already accepted by the server
+ *
+ * Resumes an interrupted upload session. Must be called before writing,
+ * data written afterwards is uploaded starting at @offset. The content
+ * of resumed uploads is not verified against the hash of the item.
+ */
+void
+msg_drive_upload_stream_set_offset (MsgDriveUploadStream *self,
+                                    goffset               offset)
+{
+  g_return_if_fail (MSG_IS_DRIVE_UPLOAD_STREAM (self));
+  g_return_if_fail (self->queued == 0 && self->buffered == 0);
+  g_return_if_fail (self->size < 0 || offset <= self->size);
+
+  self->offset = offset;
+  self->queued = offset;
+
+  /* The hash would not cover the content sent before */
+  if (offset > 0)
+    g_clear_pointer (&self->checksum, g_checksum_free);
+}
+
+/**
+ * msg_drive_upload_stream_get_item:
+ * @self: a #MsgDriveUploadStream
+ * @error: a #GError
+ *
+ * Get the item created by the upload, once the stream has been closed.
+ *
+ * Returns: (transfer full): a new #MsgDriveItem or %NULL on error
+ */
+MsgDriveItem *
+msg_drive_upload_stream_get_item (MsgDriveUploadStream  *self,
+                                  GError               **error)
+{
+  JsonNode *root;
+
+  if (!self->item_parser) {
+    g_set_error (error,
+                 MSG_ERROR,
+                 MSG_ERROR_FAILED,
+                 "Upload has not been completed");
+    return NULL;
+  }
+
+  root = json_parser_get_root (self->item_parser);
+
+  return msg_drive_item_new_from_json (json_node_get_object (root), error);
+}
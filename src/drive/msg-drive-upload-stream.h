@@ -0,0 +1,76 @@
+/* Copyright 2024 Jan-Michael Brummer <jan-michael.brummer1@volkswagen.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#if !defined(_MSG_INSIDE) && !defined(MSG_COMPILATION)
+#error "Only <msg.h> can be included directly."
+#endif
+
+#include <gio/gio.h>
+
+#include <drive/msg-drive-item.h>
+#include <msg-service.h>
+
+G_BEGIN_DECLS
+
+/* Fragments of upload sessions have to be multiples of 320 KiB */
+#define MSG_DRIVE_UPLOAD_FRAGMENT_ALIGNMENT (320 * 1024)
+#define MSG_DRIVE_UPLOAD_DEFAULT_FRAGMENT_SIZE (32 * MSG_DRIVE_UPLOAD_FRAGMENT_ALIGNMENT)
+#define MSG_DRIVE_UPLOAD_MAX_FRAGMENT_SIZE (192 * MSG_DRIVE_UPLOAD_FRAGMENT_ALIGNMENT)
+
+/* Content up to this size is uploaded without a session */
+#define MSG_DRIVE_UPLOAD_SIMPLE_MAX_SIZE (4 * 1024 * 1024)
+
+#define MSG_TYPE_DRIVE_UPLOAD_STREAM (msg_drive_upload_stream_get_type ())
+
+G_DECLARE_FINAL_TYPE (MsgDriveUploadStream, msg_drive_upload_stream, MSG, DRIVE_UPLOAD_STREAM, GOutputStream);
+
+GOutputStream *
+msg_drive_upload_stream_new (MsgService *service,
+                             const char *upload_url,
+                             goffset     size,
+                             gsize       fragment_size);
+
+GOutputStream *
+msg_drive_upload_stream_new_deferred (MsgService *service,
+                                      const char *content_url,
+                                      const char *session_url,
+                                      goffset     size);
+
+char *
+msg_drive_upload_stream_create_session (MsgService    *service,
+                                        const char    *url,
+                                        char         **expiration,
+                                        GCancellable  *cancellable,
+                                        GError       **error);
+
+const char *
+msg_drive_upload_stream_get_upload_url (MsgDriveUploadStream *self);
+
+goffset
+msg_drive_upload_stream_get_offset (MsgDriveUploadStream *self);
+
+void
+msg_drive_upload_stream_set_offset (MsgDriveUploadStream *self,
+                                    goffset               offset);
+
+MsgDriveItem *
+msg_drive_upload_stream_get_item (MsgDriveUploadStream  *self,
+                                  GError               **error);
+
+G_END_DECLS
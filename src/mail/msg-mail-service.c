@@ -20,6 +20,7 @@
 #include <stdio.h>
 
 #include "msg-authorizer.h"
+#include "msg-batch.h"
 #include "msg-error.h"
 #include "msg-private.h"
 #include "msg-service.h"
@@ -49,6 +50,43 @@ msg_mail_service_new (MsgAuthorizer *authorizer)
   return g_object_new (MSG_TYPE_MAIL_SERVICE, "authorizer", authorizer, NULL);
 }
 
+/**
+ * msg_mail_service_iterate_messages:
+ * @self: a #MsgMailService
+ * @folder: a #MsgMailFolder
+ * @link: (nullable): next or delta link to continue with
+ * @max_page_size: maximal page size
+ *
+ * Creates an iterator over all mails of @folder. Pages are requested on
+ * demand while iterating. The new delta link is available through
+ * msg_page_iterator_get_delta_link() once the iteration has finished.
+ *
+ * Returns: (transfer full): a new `MsgPageIterator` returning `MsgMailMessage`s
+ */
+MsgPageIterator *
+msg_mail_service_iterate_messages (MsgMailService *self,
+                                   MsgMailFolder  *folder,
+                                   const char     *link,
+                                   int             max_page_size)
+{
+  MsgPageIterator *iter;
+  g_autofree char *url = NULL;
+
+  if (link)
+    url = g_strdup (link);
+  else
+    url = g_strconcat (MSG_API_ENDPOINT, "/me/mailFolders//", msg_mail_folder_get_id (folder), "/messages/delta?$select=from,subject,toRecipients,ccRecipients,hasAttachments,bodyPreview,receivedDateTime,isRead,id", NULL);
+
+  iter = msg_page_iterator_new (MSG_SERVICE (self), url, (MsgPageIteratorItemFunc) msg_mail_message_new_from_json);
+
+  if (max_page_size > 0) {
+    g_autofree char *prefer_value = g_strdup_printf ("odata.maxpagesize=%u", max_page_size);
+    msg_page_iterator_add_header (iter, "Prefer", prefer_value);
+  }
+
+  return iter;
+}
+
 /**
  * msg_mail_service_get_messages
  * @self: a #MsgMailService
@@ -75,73 +113,105 @@ msg_mail_service_get_messages (MsgMailService  *self,
                                GCancellable    *cancellable,
                                GError         **error)
 {
-  JsonObject *root_object = NULL;
-  g_autofree char *url = NULL;
+  g_autoptr (MsgPageIterator) iter = NULL;
   g_autolist (MsgMailMessage) list = NULL;
-  JsonArray *array = NULL;
-  guint array_length = 0, index = 0;
-  g_autoptr (GBytes) response = NULL;
-  g_autoptr (JsonParser) parser = NULL;
+  g_autoptr (GError) local_error = NULL;
+  MsgMailMessage *msg;
 
-  if (!msg_service_refresh_authorization (MSG_SERVICE (self), cancellable, error))
-    return NULL;
+  iter = msg_mail_service_iterate_messages (self, folder, next_link ? next_link : delta_link, max_page_size);
 
-  if (next_link)
-    url = g_strdup (next_link);
-  else if (delta_link)
-    url = g_strdup (delta_link);
-  else
-    url = g_strconcat (MSG_API_ENDPOINT, "/me/mailFolders//", msg_mail_folder_get_id (folder), "/messages/delta?$select=from,subject,toRecipients,ccRecipients,hasAttachments,bodyPreview,receivedDateTime,isRead,id", NULL);
+  /* With @out_next_link the caller requests page by page */
+  if (out_next_link)
+    msg_page_iterator_set_follow_next_link (iter, FALSE);
 
-  do {
-    g_autoptr (SoupMessage) message = NULL;
+  while ((msg = msg_page_iterator_next (iter, cancellable, &local_error)))
+    list = g_list_prepend (list, msg);
 
-    message = msg_service_build_message (MSG_SERVICE (self), "GET", url, NULL, FALSE);
+  if (local_error) {
+    g_propagate_error (error, g_steal_pointer (&local_error));
+    return NULL;
+  }
 
-    if (max_page_size > 0) {
-      g_autofree char *prefer_value = g_strdup_printf ("odata.maxpagesize=%u", max_page_size);
-      soup_message_headers_append (soup_message_get_request_headers (message), "Prefer", prefer_value);
-    }
+  if (msg_page_iterator_get_delta_link (iter) && out_delta_link)
+    *out_delta_link = g_strdup (msg_page_iterator_get_delta_link (iter));
 
-    parser = msg_service_send_and_parse_response (MSG_SERVICE (self), message, &root_object, cancellable, error);
-    if (!parser)
-      return NULL;
+  if (out_next_link)
+    *out_next_link = g_strdup (msg_page_iterator_get_next_link (iter));
 
-    array = json_object_get_array_member (root_object, "value");
-    g_assert (array != NULL);
+  return g_list_reverse (g_steal_pointer (&list));
+}
 
-    array_length = json_array_get_length (array);
-    for (index = 0; index < array_length; index++) {
-      g_autoptr (GError) local_error = NULL;
-      MsgMailMessage *msg = NULL;
-      JsonObject *mail_object = NULL;
+/**
+ * msg_mail_service_get_messages_array:
+ * @self: a #MsgMailService
+ * @folder: a #MsgMailFolder
+ * @next_link: next link if available
+ * @out_next_link: next next link
+ * @delta_link: delta link if used
+ * @out_delta_link: new delta link
+ * @max_page_size: maximal page size
+ * @cancellable: a #GCancellable
+ * @error: a #GError
+ *
+ * Same as msg_mail_service_get_messages(), but returns an array which is
+ * cheaper to build and to index for large mailboxes.
+ *
+ * Returns: (element-type MsgMailMessage) (transfer full): all mails the user can access
+ */
+GPtrArray *
+msg_mail_service_get_messages_array (MsgMailService  *self,
+                                     MsgMailFolder   *folder,
+                                     const char      *next_link,
+                                     char           **out_next_link,
+                                     const char      *delta_link,
+                                     char           **out_delta_link,
+                                     int              max_page_size,
+                                     GCancellable    *cancellable,
+                                     GError         **error)
+{
+  g_autoptr (MsgPageIterator) iter = NULL;
+  g_autoptr (GPtrArray) messages = NULL;
 
-      mail_object = json_array_get_object_element (array, index);
+  iter = msg_mail_service_iterate_messages (self, folder, next_link ? next_link : delta_link, max_page_size);
+  if (out_next_link)
+    msg_page_iterator_set_follow_next_link (iter, FALSE);
 
-      msg = msg_mail_message_new_from_json (mail_object, &local_error);
-      if (msg) {
-        list = g_list_append (list, msg);
-      } else {
-        g_warning ("Could not parse mail object: %s", local_error->message);
-        g_clear_error (&local_error);
-      }
-    }
+  messages = msg_page_iterator_collect (iter, cancellable, error);
+  if (!messages)
+    return NULL;
 
-    g_clear_pointer (&url, g_free);
+  if (msg_page_iterator_get_delta_link (iter) && out_delta_link)
+    *out_delta_link = g_strdup (msg_page_iterator_get_delta_link (iter));
 
-    if (json_object_has_member (root_object, "@odata.deltaLink") && out_delta_link) {
-      *out_delta_link = g_strdup (json_object_get_string_member (root_object, "@odata.deltaLink"));
-    }
+  if (out_next_link)
+    *out_next_link = g_strdup (msg_page_iterator_get_next_link (iter));
 
-    url = msg_service_get_next_link (root_object);
+  return g_steal_pointer (&messages);
+}
 
-    if (out_next_link) {
-      *out_next_link = g_strdup (url);
-      break;
-    }
-  } while (url != NULL);
+/**
+ * msg_mail_service_iterate_mail_folders:
+ * @self: a #MsgMailService
+ * @delta_url: (nullable): delta link of a previous query
+ *
+ * Creates an iterator over all mail folders. Pages are requested on
+ * demand while iterating.
+ *
+ * Returns: (transfer full): a new `MsgPageIterator` returning `MsgMailFolder`s
+ */
+MsgPageIterator *
+msg_mail_service_iterate_mail_folders (MsgMailService *self,
+                                       const char     *delta_url)
+{
+  g_autofree char *url = NULL;
+
+  if (delta_url) {
+    url = g_strdup (delta_url);
+  } else {
+    url = g_strconcat (MSG_API_ENDPOINT, "/me/mailFolders/delta", NULL);
+  }
 
-  return g_steal_pointer (&list);
+  return msg_page_iterator_new (MSG_SERVICE (self), url, (MsgPageIteratorItemFunc) msg_mail_folder_new_from_json);
 }
 
 /**
@@ -161,60 +231,57 @@ msg_mail_service_get_mail_folders (MsgMailService  *self,
                                    GCancellable    *cancellable,
                                    GError         **error)
 {
-  JsonObject *root_object = NULL;
-  g_autofree char *url = NULL;
+  g_autoptr (MsgPageIterator) iter = NULL;
   g_autolist (MsgMailFolder) list = NULL;
-  JsonArray *array = NULL;
-  guint array_length = 0, index = 0;
-  g_autoptr (GBytes) response = NULL;
-  g_autoptr (JsonParser) parser = NULL;
+  g_autoptr (GError) local_error = NULL;
+  MsgMailFolder *folder;
 
-  if (!msg_service_refresh_authorization (MSG_SERVICE (self), cancellable, error))
-    return NULL;
+  iter = msg_mail_service_iterate_mail_folders (self, delta_url);
+  while ((folder = msg_page_iterator_next (iter, cancellable, &local_error)))
+    list = g_list_prepend (list, folder);
 
-  if (delta_url) {
-    url = g_strdup (delta_url);
-  } else {
-    url = g_strconcat (MSG_API_ENDPOINT, "/me/mailFolders/delta", NULL);
+  if (local_error) {
+    g_propagate_error (error, g_steal_pointer (&local_error));
+    return NULL;
   }
 
-  do {
-    g_autoptr (SoupMessage) message = NULL;
-
-    message = msg_service_build_message (MSG_SERVICE (self), "GET", url, NULL, FALSE);
-    parser = msg_service_send_and_parse_response (MSG_SERVICE (self), message, &root_object, cancellable, error);
-    if (!parser)
-      return NULL;
-
-    array = json_object_get_array_member (root_object, "value");
-    g_assert (array != NULL);
+  if (msg_page_iterator_get_delta_link (iter) && delta_url_out)
+    *delta_url_out = g_strdup (msg_page_iterator_get_delta_link (iter));
 
-    array_length = json_array_get_length (array);
-    for (index = 0; index < array_length; index++) {
-      g_autoptr (GError) local_error = NULL;
-      MsgMailFolder *folder = NULL;
-      JsonObject *object = NULL;
-
-      object = json_array_get_object_element (array, index);
+  return g_list_reverse (g_steal_pointer (&list));
+}
 
-      folder = msg_mail_folder_new_from_json (object, &local_error);
-      if (folder) {
-        list = g_list_append (list, folder);
-      } else {
-        g_warning ("Could not parse mail folder object: %s", local_error->message);
-        g_clear_error (&local_error);
-      }
-    }
+/**
+ * msg_mail_service_get_mail_folders_array:
+ * @self: a #MsgMailService
+ * @delta_url: (nullable): delta link of a previous query
+ * @delta_url_out: new delta link
+ * @cancellable: a #GCancellable
+ * @error: a #GError
+ *
+ * Same as msg_mail_service_get_mail_folders(), but returns an array.
+ *
+ * Returns: (element-type MsgMailFolder) (transfer full): all mail folders the user can access
+ */
+GPtrArray *
+msg_mail_service_get_mail_folders_array (MsgMailService  *self,
+                                         const char      *delta_url,
+                                         char           **delta_url_out,
+                                         GCancellable    *cancellable,
+                                         GError         **error)
+{
+  g_autoptr (MsgPageIterator) iter = NULL;
+  g_autoptr (GPtrArray) folders = NULL;
 
-    if (json_object_has_member (root_object, "@odata.deltaLink") && delta_url_out) {
-      *delta_url_out = g_strdup (json_object_get_string_member (root_object, "@odata.deltaLink"));
-    }
+  iter = msg_mail_service_iterate_mail_folders (self, delta_url);
+  folders = msg_page_iterator_collect (iter, cancellable, error);
+  if (!folders)
+    return NULL;
 
-    g_clear_pointer (&url, g_free);
-    url = msg_service_get_next_link (root_object);
-  } while (url != NULL);
+  if (msg_page_iterator_get_delta_link (iter) && delta_url_out)
+    *delta_url_out = g_strdup (msg_page_iterator_get_delta_link (iter));
 
-  return g_steal_pointer (&list);
+  return g_steal_pointer (&folders);
 }
 
 /**
@@ -320,6 +387,65 @@ msg_mail_service_delete_message (MsgMailService  *self,
   return TRUE;
 }
 
+/**
+ * msg_mail_service_delete_messages:
+ * @self: a #MsgMailService
+ * @messages: (element-type MsgMailMessage): a list of #MsgMailMessage
+ * @cancellable: a #GCancellable
+ * @error: a #GError
+ *
+ * Deletes all @messages using batch requests. Processing stops at the
+ * first batch containing a failed request.
+ *
+ * Returns: %TRUE for succes, else &FALSE
+ */
+gboolean
+msg_mail_service_delete_messages (MsgMailService  *self,
+                                  GList           *messages,
+                                  GCancellable    *cancellable,
+                                  GError         **error)
+{
+  GList *iter = messages;
+
+  if (!msg_service_refresh_authorization (MSG_SERVICE (self), cancellable, error))
+    return FALSE;
+
+  while (iter) {
+    g_autoptr (MsgBatch) batch = msg_batch_new (MSG_SERVICE (self));
+    g_autoptr (GPtrArray) ids = g_ptr_array_new ();
+
+    for (; iter && !msg_batch_is_full (batch); iter = iter->next) {
+      g_autoptr (SoupMessage) soup_message = NULL;
+      g_autofree char *url = NULL;
+      const char *id;
+
+      url = g_strconcat (MSG_API_ENDPOINT, "/me/messages/", msg_mail_message_get_id (iter->data), NULL);
+      soup_message = msg_service_build_message (MSG_SERVICE (self), "DELETE", url, NULL, FALSE);
+      id = msg_batch_add (batch, soup_message, NULL, NULL);
+      if (!id) {
+        g_set_error (error,
+                     msg_error_quark (),
+                     MSG_ERROR_FAILED,
+                     "Could not add %s to batch request",
+                     url);
+        return FALSE;
+      }
+
+      g_ptr_array_add (ids, (gpointer)id);
+    }
+
+    if (!msg_batch_send (batch, cancellable, error))
+      return FALSE;
+
+    for (guint idx = 0; idx < ids->len; idx++) {
+      if (!msg_batch_check_response (batch, g_ptr_array_index (ids, idx), error))
+        return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
 /**
  * msg_mail_service_create_draft_message:
  * @self: a #MsgContextService
@@ -29,6 +29,12 @@ G_DECLARE_FINAL_TYPE (MsgMailService, msg_mail_service, MSG, MAIL_SERVICE, MsgSe
 
 MsgMailService *msg_mail_service_new (MsgAuthorizer *authorizer);
 
+MsgPageIterator *
+msg_mail_service_iterate_messages (MsgMailService *self,
+                                   MsgMailFolder  *folder,
+                                   const char     *link,
+                                   int             max_page_size);
+
 GList *
 msg_mail_service_get_messages (MsgMailService  *self,
                                MsgMailFolder   *folder,
@@ -40,6 +46,21 @@ msg_mail_service_get_messages (MsgMailService  *self,
                                GCancellable    *cancellable,
                                GError         **error);
 
+GPtrArray *
+msg_mail_service_get_messages_array (MsgMailService  *self,
+                                     MsgMailFolder   *folder,
+                                     const char      *next_link,
+                                     char           **out_next_link,
+                                     const char      *delta_link,
+                                     char           **out_delta_link,
+                                     int              max_page_size,
+                                     GCancellable    *cancellable,
+                                     GError         **error);
+
+MsgPageIterator *
+msg_mail_service_iterate_mail_folders (MsgMailService *self,
+                                       const char     *delta_url);
+
 GList *
 msg_mail_service_get_mail_folders (MsgMailService  *self,
                                    char            *delta_url,
@@ -47,6 +68,13 @@ msg_mail_service_get_mail_folders (MsgMailService  *self,
                                    GCancellable    *cancellable,
                                    GError         **error);
 
+GPtrArray *
+msg_mail_service_get_mail_folders_array (MsgMailService  *self,
+                                         const char      *delta_url,
+                                         char           **delta_url_out,
+                                         GCancellable    *cancellable,
+                                         GError         **error);
+
 MsgMailFolder *
 msg_mail_service_get_mail_folder (MsgMailService     *self,
                                   MsgMailFolderType   type,
@@ -65,6 +93,12 @@ msg_mail_service_delete_message (MsgMailService  *self,
                                  GCancellable    *cancellable,
                                  GError         **error);
 
+gboolean
+msg_mail_service_delete_messages (MsgMailService  *self,
+                                  GList           *messages,
+                                  GCancellable    *cancellable,
+                                  GError         **error);
+
 GBytes *
 msg_mail_service_get_mime_message (MsgMailService  *self,
                                    MsgMailMessage  *mail,
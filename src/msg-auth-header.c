@@ -0,0 +1,92 @@
+/* Copyright 2024 Jan-Michael Brummer <jan-michael.brummer1@volkswagen.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "msg-auth-header.h"
+
+/* The current header value is published through an atomic pointer.
+ * Replaced values are retired and only freed once no reader is active,
+ * so readers never see freed memory and never block. */
+struct _MsgAuthHeader {
+  char *current;
+  int readers;
+  /* Retired values, only accessed by the (serialized) writer */
+  GSList *retired;
+};
+
+MsgAuthHeader *
+msg_auth_header_new (void)
+{
+  return g_new0 (MsgAuthHeader, 1);
+}
+
+void
+msg_auth_header_free (MsgAuthHeader *self)
+{
+  g_slist_free_full (self->retired, g_free);
+  g_free (self->current);
+  g_free (self);
+}
+
+/**
+ * msg_auth_header_set_token:
+ * @self: a #MsgAuthHeader
+ * @access_token: (nullable): the new access token
+ *
+ * Publishes the header for @access_token. Calls have to be serialized by
+ * the caller, e.g. by the authorizer mutex.
+ */
+void
+msg_auth_header_set_token (MsgAuthHeader *self,
+                           const char    *access_token)
+{
+  char *value = access_token ? g_strconcat ("Bearer ", access_token, NULL) : NULL;
+  char *old;
+
+  old = g_atomic_pointer_exchange (&self->current, value);
+  if (old)
+    self->retired = g_slist_prepend (self->retired, old);
+
+  /* Readers starting from now on only see the new value */
+  if (g_atomic_int_get (&self->readers) == 0)
+    g_clear_slist (&self->retired, g_free);
+}
+
+/**
+ * msg_auth_header_apply:
+ * @self: a #MsgAuthHeader
+ * @message: a #SoupMessage
+ *
+ * Sets the current authorization header on @message.
+ *
+ * Returns: %TRUE if a header has been set
+ */
+gboolean
+msg_auth_header_apply (MsgAuthHeader *self,
+                       SoupMessage   *message)
+{
+  const char *value;
+
+  g_atomic_int_inc (&self->readers);
+
+  value = g_atomic_pointer_get (&self->current);
+  if (value)
+    soup_message_headers_replace (soup_message_get_request_headers (message), "Authorization", value);
+
+  g_atomic_int_dec_and_test (&self->readers);
+
+  return value != NULL;
+}
@@ -0,0 +1,43 @@
+/* Copyright 2024 Jan-Michael Brummer <jan-michael.brummer1@volkswagen.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <libsoup/soup.h>
+
+G_BEGIN_DECLS
+
+/* Internal pre-formatted authorization header which can be applied to
+ * messages without taking a lock */
+
+typedef struct _MsgAuthHeader MsgAuthHeader;
+
+MsgAuthHeader *
+msg_auth_header_new (void);
+
+void
+msg_auth_header_free (MsgAuthHeader *self);
+
+void
+msg_auth_header_set_token (MsgAuthHeader *self,
+                           const char    *access_token);
+
+gboolean
+msg_auth_header_apply (MsgAuthHeader *self,
+                       SoupMessage   *message);
+
+G_END_DECLS
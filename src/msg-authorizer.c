@@ -22,17 +22,216 @@
 
 G_DEFINE_INTERFACE (MsgAuthorizer, msg_authorizer, G_TYPE_OBJECT);
 
+/* Concurrent refreshes of one authorizer are coalesced into a single
+ * flight whose result is shared by all callers. */
+typedef struct {
+  gboolean in_flight;
+  guint generation;
+  gboolean result;
+  GError *error;
+  /* Waiting async callers, GTask */
+  GPtrArray *waiters;
+  /* Thread and main context of a native async flight, which only
+   * completes while that context is iterated */
+  GThread *thread;
+  GMainContext *context;
+} RefreshFlight;
+
+static GMutex flight_mutex;
+static GCond flight_cond;
+
 static void
-msg_authorizer_refresh_authorization_thread_func (GTask                            *task,
-                                                  gpointer                          object,
-                                                  __attribute__ ((unused)) gpointer data,
-                                                  GCancellable                     *cancellable)
+refresh_flight_free (RefreshFlight *flight)
+{
+  g_clear_pointer (&flight->context, g_main_context_unref);
+  g_clear_error (&flight->error);
+  g_ptr_array_unref (flight->waiters);
+  g_free (flight);
+}
+
+/* Must be called locked */
+static RefreshFlight *
+get_flight (MsgAuthorizer *iface)
 {
-  g_autoptr (GError) error = NULL;
+  static GQuark quark = 0;
+  RefreshFlight *flight;
+
+  if (!quark)
+    quark = g_quark_from_static_string ("msg-authorizer-refresh-flight");
 
-  msg_authorizer_refresh_authorization (MSG_AUTHORIZER (object), cancellable, &error);
-  if (error)
-    g_task_return_error (task, error);
+  flight = g_object_get_qdata (G_OBJECT (iface), quark);
+  if (!flight) {
+    flight = g_new0 (RefreshFlight, 1);
+    flight->waiters = g_ptr_array_new ();
+    g_object_set_qdata_full (G_OBJECT (iface), quark, flight, (GDestroyNotify)refresh_flight_free);
+  }
+
+  return flight;
+}
+
+/* Must be called locked. Whether waiting for the flight would block the
+ * thread which has to complete it */
+static gboolean
+flight_needs_caller (RefreshFlight *flight)
+{
+  return flight->context && (flight->thread == g_thread_self () || g_main_context_is_owner (flight->context));
+}
+
+static void flight_start (MsgAuthorizer *iface,
+                          gboolean       in_thread);
+
+/* Publishes the result of a flight, takes ownership of @error */
+static void
+flight_complete (MsgAuthorizer *iface,
+                 gboolean       result,
+                 GError        *error)
+{
+  RefreshFlight *flight;
+  g_autoptr (GPtrArray) waiters = NULL;
+
+  g_mutex_lock (&flight_mutex);
+
+  flight = get_flight (iface);
+  flight->generation++;
+  flight->result = result;
+  g_clear_error (&flight->error);
+  flight->error = error;
+  flight->thread = NULL;
+  g_clear_pointer (&flight->context, g_main_context_unref);
+
+  /* A cancelled leader must not fail the async callers waiting for it */
+  if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED) && flight->waiters->len > 0) {
+    g_cond_broadcast (&flight_cond);
+    g_mutex_unlock (&flight_mutex);
+
+    /* The leader thread may not run a main loop for async callbacks */
+    flight_start (iface, TRUE);
+    return;
+  }
+
+  flight->in_flight = FALSE;
+  waiters = g_steal_pointer (&flight->waiters);
+  flight->waiters = g_ptr_array_new ();
+
+  g_cond_broadcast (&flight_cond);
+  g_mutex_unlock (&flight_mutex);
+
+  for (guint index = 0; index < waiters->len; index++) {
+    GTask *task = g_ptr_array_index (waiters, index);
+    GCancellable *cancellable = g_task_get_cancellable (task);
+
+    g_cancellable_disconnect (cancellable, GPOINTER_TO_SIZE (g_task_get_task_data (task)));
+
+    if (error)
+      g_task_return_error (task, g_error_copy (error));
+    else
+      g_task_return_boolean (task, result);
+
+    g_object_unref (task);
+  }
+}
+
+static void
+flight_thread_func (GTask                            *task,
+                    gpointer                          object,
+                    __attribute__ ((unused)) gpointer data,
+                    __attribute__ ((unused)) GCancellable *cancellable)
+{
+  MsgAuthorizer *iface = MSG_AUTHORIZER (object);
+  GError *error = NULL;
+  gboolean result;
+
+  /* The flight is shared, so it is not bound to any caller's cancellable */
+  result = MSG_AUTHORIZER_GET_INTERFACE (iface)->refresh_authorization (iface, NULL, &error);
+  flight_complete (iface, result, error);
+
+  g_task_return_boolean (task, TRUE);
+}
+
+static void
+flight_async_cb (GObject      *source,
+                 GAsyncResult *result,
+                 __attribute__ ((unused)) gpointer user_data)
+{
+  MsgAuthorizer *iface = MSG_AUTHORIZER (source);
+  GError *error = NULL;
+  gboolean ret;
+
+  ret = MSG_AUTHORIZER_GET_INTERFACE (iface)->refresh_authorization_finish (iface, result, &error);
+  flight_complete (iface, ret, error);
+}
+
+/* Starts the shared refresh natively async if implemented, else in a thread */
+static void
+flight_start (MsgAuthorizer *iface,
+              gboolean       in_thread)
+{
+  MsgAuthorizerInterface *interface = MSG_AUTHORIZER_GET_INTERFACE (iface);
+  g_autoptr (GTask) task = NULL;
+
+  if (!in_thread && interface->refresh_authorization_async) {
+    RefreshFlight *flight;
+
+    g_mutex_lock (&flight_mutex);
+    flight = get_flight (iface);
+    flight->thread = g_thread_self ();
+    flight->context = g_main_context_ref_thread_default ();
+    g_mutex_unlock (&flight_mutex);
+
+    /* The flight is shared, so it is not bound to any caller's cancellable */
+    interface->refresh_authorization_async (iface, NULL, flight_async_cb, NULL);
+    return;
+  }
+
+  task = g_task_new (iface, NULL, NULL, NULL);
+  g_task_run_in_thread (task, flight_thread_func);
+}
+
+static gboolean
+flight_waiter_disconnect_cb (gpointer user_data)
+{
+  GTask *task = G_TASK (user_data);
+
+  g_cancellable_disconnect (g_task_get_cancellable (task), GPOINTER_TO_SIZE (g_task_get_task_data (task)));
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+flight_waiter_cancelled_cb (__attribute__ ((unused)) GCancellable *cancellable,
+                            gpointer                               user_data)
+{
+  GTask *task = G_TASK (user_data);
+  RefreshFlight *flight;
+  gboolean removed;
+
+  g_mutex_lock (&flight_mutex);
+  flight = get_flight (g_task_get_source_object (task));
+  removed = g_ptr_array_remove (flight->waiters, task);
+  g_mutex_unlock (&flight_mutex);
+
+  /* Otherwise the flight has already completed the task */
+  if (removed) {
+    g_autoptr (GSource) source = g_idle_source_new ();
+
+    g_task_return_error_if_cancelled (task);
+
+    /* Disconnecting from within the emission would deadlock */
+    g_source_set_callback (source, flight_waiter_disconnect_cb, g_object_ref (task), g_object_unref);
+    g_source_attach (source, g_task_get_context (task));
+
+    g_object_unref (task);
+  }
+}
+
+static void
+flight_sync_cancelled_cb (__attribute__ ((unused)) GCancellable *cancellable,
+                          __attribute__ ((unused)) gpointer      user_data)
+{
+  /* Wakes up sync waiters to check their cancellable */
+  g_mutex_lock (&flight_mutex);
+  g_cond_broadcast (&flight_cond);
+  g_mutex_unlock (&flight_mutex);
 }
 
 static void
@@ -69,6 +268,12 @@ msg_authorizer_process_request (MsgAuthorizer *iface,
  * held by it. See msg_authorizer_refresh_authorization_async() for the
  * asynchronous version of this call.
  *
+ * Concurrent sync and async refreshes of @iface are coalesced into a
+ * single refresh whose result is shared by all callers. A call from the
+ * thread whose main context has to complete an asynchronous refresh in
+ * progress does not wait for it, as that would deadlock, but refreshes on
+ * its own.
+ *
  * This method is thread safe.
  *
  * Returns: %TRUE if the authorizer now has a valid token.
@@ -78,8 +283,68 @@ msg_authorizer_refresh_authorization (MsgAuthorizer  *iface,
                                       GCancellable   *cancellable,
                                       GError        **error)
 {
+  RefreshFlight *flight;
+  GError *local_error = NULL;
+  gboolean result;
+
   g_return_val_if_fail (MSG_IS_AUTHORIZER (iface), FALSE);
-  return MSG_AUTHORIZER_GET_INTERFACE (iface)->refresh_authorization (iface, cancellable, error);
+
+  g_mutex_lock (&flight_mutex);
+  flight = get_flight (iface);
+
+  while (flight->in_flight && !flight_needs_caller (flight)) {
+    guint generation = flight->generation;
+    gulong handler_id = 0;
+
+    /* Not connected while locked, as the handler runs at once if already cancelled */
+    if (cancellable) {
+      g_mutex_unlock (&flight_mutex);
+      handler_id = g_cancellable_connect (cancellable, G_CALLBACK (flight_sync_cancelled_cb), NULL, NULL);
+      g_mutex_lock (&flight_mutex);
+    }
+
+    while (flight->in_flight && flight->generation == generation && !g_cancellable_is_cancelled (cancellable))
+      g_cond_wait (&flight_cond, &flight_mutex);
+
+    if (handler_id) {
+      g_mutex_unlock (&flight_mutex);
+      g_cancellable_disconnect (cancellable, handler_id);
+      g_mutex_lock (&flight_mutex);
+    }
+
+    if (g_cancellable_is_cancelled (cancellable)) {
+      g_mutex_unlock (&flight_mutex);
+      return !g_cancellable_set_error_if_cancelled (cancellable, error);
+    }
+
+    /* Share the result unless the leader has been cancelled */
+    if (flight->generation != generation && !g_error_matches (flight->error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+      result = flight->result;
+      if (flight->error)
+        g_propagate_error (error, g_error_copy (flight->error));
+      g_mutex_unlock (&flight_mutex);
+
+      return result;
+    }
+  }
+
+  if (flight->in_flight) {
+    g_mutex_unlock (&flight_mutex);
+
+    /* Not shared, the pending flight publishes its own result */
+    return MSG_AUTHORIZER_GET_INTERFACE (iface)->refresh_authorization (iface, cancellable, error);
+  }
+
+  flight->in_flight = TRUE;
+  g_mutex_unlock (&flight_mutex);
+
+  result = MSG_AUTHORIZER_GET_INTERFACE (iface)->refresh_authorization (iface, cancellable, &local_error);
+  flight_complete (iface, result, local_error ? g_error_copy (local_error) : NULL);
+
+  if (local_error)
+    g_propagate_error (error, local_error);
+
+  return result;
 }
 
 /**
@@ -108,14 +373,35 @@ msg_authorizer_refresh_authorization_async (MsgAuthorizer       *iface,
                                             gpointer             user_data)
 {
   GTask *task;
+  RefreshFlight *flight;
+  gboolean start;
+  gulong handler_id = 0;
 
   g_return_if_fail (MSG_IS_AUTHORIZER (iface));
 
   task = g_task_new (iface, cancellable, callback, user_data);
+  g_task_set_source_tag (task, msg_authorizer_refresh_authorization_async);
+
+  if (g_task_return_error_if_cancelled (task)) {
+    g_object_unref (task);
+    return;
+  }
 
-  g_task_run_in_thread (task, msg_authorizer_refresh_authorization_thread_func);
+  /* Not connected while locked, as the handler runs at once if already cancelled */
+  if (cancellable)
+    handler_id = g_cancellable_connect (cancellable, G_CALLBACK (flight_waiter_cancelled_cb), g_object_ref (task), g_object_unref);
+  g_task_set_task_data (task, GSIZE_TO_POINTER (handler_id), NULL);
 
-  g_object_unref (task);
+  g_mutex_lock (&flight_mutex);
+  flight = get_flight (iface);
+  start = !flight->in_flight;
+  flight->in_flight = TRUE;
+  /* The waiter list owns the reference */
+  g_ptr_array_add (flight->waiters, task);
+  g_mutex_unlock (&flight_mutex);
+
+  if (start)
+    flight_start (iface, FALSE);
 }
 
 /**
@@ -138,3 +424,25 @@ msg_authorizer_refresh_authorization_finish (MsgAuthorizer  *iface,
 
   return g_task_propagate_boolean (G_TASK (res), error);
 }
+
+/**
+ * msg_authorizer_invalidate_authorization:
+ * @iface: A #MsgAuthorizer.
+ *
+ * Marks the access token held by @iface as invalid, e.g. after the
+ * server answered with 401 Unauthorized, so that the next call of
+ * msg_authorizer_refresh_authorization() requests a new one.
+ *
+ * This method is thread safe.
+ */
+void
+msg_authorizer_invalidate_authorization (MsgAuthorizer *iface)
+{
+  MsgAuthorizerInterface *interface;
+
+  g_return_if_fail (MSG_IS_AUTHORIZER (iface));
+
+  interface = MSG_AUTHORIZER_GET_INTERFACE (iface);
+  if (interface->invalidate_authorization)
+    interface->invalidate_authorization (iface);
+}
@@ -37,8 +37,17 @@ typedef struct _MsgAuthorizerInterface MsgAuthorizerInterface;
  *   #SoupMessage. Types of messages include DELETE, GET and POST.
  * @refresh_authorization: A synchronous method to force a refresh of
  *   any authorization tokens held by the authorizer. It should return
- *   %TRUE on success. An asynchronous version will be defined by
- *   invoking this in a thread.
+ *   %TRUE on success. Unless @refresh_authorization_async is set, an
+ *   asynchronous version will be defined by invoking this in a thread.
+ * @invalidate_authorization: A method to mark the current access token
+ *   as no longer valid, e.g. after the server rejected it. The next
+ *   refresh will then request a new one. Optional.
+ * @refresh_authorization_async: An asynchronous version of
+ *   @refresh_authorization which does not block a thread. Optional, if
+ *   unset @refresh_authorization is invoked in a thread.
+ * @refresh_authorization_finish: Finishes
+ *   @refresh_authorization_async. Required if
+ *   @refresh_authorization_async is set.
  *
  * Interface structure for #MsgAuthorizer. All methods should be
  * thread safe.
@@ -52,6 +61,14 @@ struct _MsgAuthorizerInterface
   gboolean    (*refresh_authorization)       (MsgAuthorizer  *iface,
                                               GCancellable   *cancellable,
                                               GError        **error);
+  void        (*invalidate_authorization)    (MsgAuthorizer  *iface);
+  void        (*refresh_authorization_async) (MsgAuthorizer       *iface,
+                                              GCancellable        *cancellable,
+                                              GAsyncReadyCallback  callback,
+                                              gpointer             user_data);
+  gboolean    (*refresh_authorization_finish) (MsgAuthorizer  *iface,
+                                               GAsyncResult   *res,
+                                               GError        **error);
 };
 
 GType               msg_authorizer_get_type                       (void) G_GNUC_CONST;
@@ -63,5 +80,16 @@ gboolean            msg_authorizer_refresh_authorization          (MsgAuthorizer
                                                                    GCancellable   *cancellable,
                                                                    GError        **error);
 
+void                msg_authorizer_refresh_authorization_async    (MsgAuthorizer       *iface,
+                                                                   GCancellable        *cancellable,
+                                                                   GAsyncReadyCallback  callback,
+                                                                   gpointer             user_data);
+
+gboolean            msg_authorizer_refresh_authorization_finish   (MsgAuthorizer  *iface,
+                                                                   GAsyncResult   *res,
+                                                                   GError        **error);
+
+void                msg_authorizer_invalidate_authorization       (MsgAuthorizer  *iface);
+
 G_END_DECLS
 
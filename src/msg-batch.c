@@ -0,0 +1,810 @@
+/* Copyright 2024 Jan-Michael Brummer <jan-michael.brummer1@volkswagen.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "msg-batch.h"
+#include "msg-error.h"
+#include "msg-json-utils.h"
+#include "msg-private.h"
+
+/**
+ * MsgBatch:
+ *
+ * Combines up to %MSG_BATCH_MAX_REQUESTS requests into one JSON batch
+ * request, saving a network round trip per request.
+ *
+ * Requests are built as usual with msg_service_build_message() and added
+ * to the batch. After sending, the status, headers and body of each
+ * request can be queried using the id returned by msg_batch_add().
+ * Requests throttled by the server are resent automatically once their
+ * Retry-After delay has passed. After four rounds the 429 response is
+ * left to the caller.
+ */
+
+#define RETRY_MAX_ROUNDS 4
+
+typedef struct {
+  char *id;
+  char *method;
+  char *url;
+  JsonNode *headers;
+  JsonNode *body;
+  char *depends_on;
+
+  gboolean pending;
+  guint status;
+  SoupMessageHeaders *response_headers;
+  GBytes *response_body;
+} BatchRequest;
+
+struct _MsgBatch {
+  GObject parent_instance;
+
+  MsgService *service;
+  const char *endpoint;
+  GPtrArray *requests;
+  /* Rounds sent by the current msg_batch_send() */
+  guint rounds;
+};
+
+G_DEFINE_TYPE (MsgBatch, msg_batch, G_TYPE_OBJECT);
+
+static void
+batch_request_free (BatchRequest *request)
+{
+  g_clear_pointer (&request->id, g_free);
+  g_clear_pointer (&request->method, g_free);
+  g_clear_pointer (&request->url, g_free);
+  g_clear_pointer (&request->headers, json_node_unref);
+  g_clear_pointer (&request->body, json_node_unref);
+  g_clear_pointer (&request->depends_on, g_free);
+  g_clear_pointer (&request->response_headers, soup_message_headers_unref);
+  g_clear_pointer (&request->response_body, g_bytes_unref);
+  g_free (request);
+}
+
+static void
+msg_batch_dispose (GObject *object)
+{
+  MsgBatch *self = MSG_BATCH (object);
+
+  g_clear_object (&self->service);
+  g_clear_pointer (&self->requests, g_ptr_array_unref);
+
+  G_OBJECT_CLASS (msg_batch_parent_class)->dispose (object);
+}
+
+static void
+msg_batch_init (MsgBatch *self)
+{
+  self->requests = g_ptr_array_new_with_free_func ((GDestroyNotify)batch_request_free);
+}
+
+static void
+msg_batch_class_init (MsgBatchClass *class)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (class);
+
+  object_class->dispose = msg_batch_dispose;
+}
+
+/**
+ * msg_batch_new:
+ * @service: a #MsgService used to send the batch
+ *
+ * Creates a new `MsgBatch`.
+ *
+ * Returns: the newly created `MsgBatch`
+ */
+MsgBatch *
+msg_batch_new (MsgService *service)
+{
+  MsgBatch *self;
+
+  g_return_val_if_fail (MSG_IS_SERVICE (service), NULL);
+
+  self = g_object_new (MSG_TYPE_BATCH, NULL);
+  self->service = g_object_ref (service);
+
+  return self;
+}
+
+static BatchRequest *
+msg_batch_lookup (MsgBatch   *self,
+                  const char *id)
+{
+  if (!id)
+    return NULL;
+
+  for (guint idx = 0; idx < self->requests->len; idx++) {
+    BatchRequest *request = g_ptr_array_index (self->requests, idx);
+
+    if (g_strcmp0 (request->id, id) == 0)
+      return request;
+  }
+
+  return NULL;
+}
+
+static void
+add_request_header (const char *name,
+                    const char *value,
+                    gpointer    user_data)
+{
+  JsonObject *headers = user_data;
+
+  /* The batch request itself carries the authorization */
+  if (g_ascii_strcasecmp (name, "Authorization") == 0)
+    return;
+
+  json_object_set_string_member (headers, name, value);
+}
+
+/**
+ * msg_batch_add:
+ * @self: a #MsgBatch
+ * @message: a #SoupMessage created by msg_service_build_message()
+ * @body: (nullable): JSON request body
+ * @depends_on: (nullable): id of a request that must be executed before this one
+ *
+ * Adds @message to the batch. As the request body of a #SoupMessage
+ * cannot be read back, it needs to be passed separately as @body.
+ *
+ * Returns: (transfer none) (nullable): id of the request within the
+ *   batch, or %NULL if the batch is full or @message is invalid
+ */
+const char *
+msg_batch_add (MsgBatch    *self,
+               SoupMessage *message,
+               GBytes      *body,
+               const char  *depends_on)
+{
+  g_autoptr (JsonParser) parser = NULL;
+  g_autoptr (JsonNode) body_node = NULL;
+  g_autoptr (GError) error = NULL;
+  BatchRequest *request;
+  JsonObject *headers;
+  const char *endpoint;
+  const char *path;
+  const char *query;
+  GUri *uri;
+
+  g_return_val_if_fail (MSG_IS_BATCH (self), NULL);
+  g_return_val_if_fail (SOUP_IS_MESSAGE (message), NULL);
+
+  if (msg_batch_is_full (self))
+    return NULL;
+
+  if (depends_on && !msg_batch_lookup (self, depends_on)) {
+    g_warning ("Unknown batch dependency %s", depends_on);
+    return NULL;
+  }
+
+  uri = soup_message_get_uri (message);
+  path = g_uri_get_path (uri);
+  query = g_uri_get_query (uri);
+
+  if (g_str_has_prefix (path, "/v1.0/"))
+    endpoint = MSG_API_ENDPOINT;
+  else if (g_str_has_prefix (path, "/beta/"))
+    endpoint = MSG_BETA_API_ENDPOINT;
+  else {
+    g_warning ("Unsupported batch request path %s", path);
+    return NULL;
+  }
+
+  /* All requests of a batch are executed against the same API version */
+  if (self->endpoint && g_strcmp0 (self->endpoint, endpoint) != 0) {
+    g_warning ("Cannot mix API versions within one batch");
+    return NULL;
+  }
+
+  if (body) {
+    gsize length;
+    const char *data = g_bytes_get_data (body, &length);
+
+    parser = json_parser_new ();
+    if (!json_parser_load_from_data (parser, data, length, &error)) {
+      g_warning ("Invalid batch request body: %s", error->message);
+      return NULL;
+    }
+
+    body_node = json_node_copy (json_parser_get_root (parser));
+  }
+
+  self->endpoint = endpoint;
+
+  request = g_new0 (BatchRequest, 1);
+  request->id = g_strdup_printf ("%u", self->requests->len + 1);
+  request->method = g_strdup (soup_message_get_method (message));
+  request->url = g_strconcat (strchr (path + 1, '/'), query ? "?" : "", query ? query : "", NULL);
+  request->body = g_steal_pointer (&body_node);
+  request->depends_on = g_strdup (depends_on);
+
+  headers = json_object_new ();
+  soup_message_headers_foreach (soup_message_get_request_headers (message), add_request_header, headers);
+  if (request->body && !json_object_has_member (headers, "Content-Type"))
+    json_object_set_string_member (headers, "Content-Type", "application/json");
+
+  request->headers = json_node_new (JSON_NODE_OBJECT);
+  json_node_take_object (request->headers, headers);
+
+  g_ptr_array_add (self->requests, request);
+
+  return request->id;
+}
+
+/**
+ * msg_batch_get_size:
+ * @self: a #MsgBatch
+ *
+ * Get number of requests within batch.
+ *
+ * Returns: number of requests
+ */
+guint
+msg_batch_get_size (MsgBatch *self)
+{
+  g_return_val_if_fail (MSG_IS_BATCH (self), 0);
+
+  return self->requests->len;
+}
+
+/**
+ * msg_batch_is_full:
+ * @self: a #MsgBatch
+ *
+ * Checks whether the batch already contains %MSG_BATCH_MAX_REQUESTS requests.
+ *
+ * Returns: %TRUE if no further request can be added
+ */
+gboolean
+msg_batch_is_full (MsgBatch *self)
+{
+  g_return_val_if_fail (MSG_IS_BATCH (self), TRUE);
+
+  return self->requests->len >= MSG_BATCH_MAX_REQUESTS;
+}
+
+static SoupMessage *
+msg_batch_build_message (MsgBatch *self)
+{
+  g_autoptr (JsonBuilder) builder = NULL;
+  g_autoptr (JsonGenerator) generator = NULL;
+  g_autoptr (JsonNode) root = NULL;
+  g_autoptr (GBytes) bytes = NULL;
+  g_autofree char *url = NULL;
+  SoupMessage *message;
+  char *json;
+  gsize length;
+
+  builder = json_builder_new ();
+  json_builder_begin_object (builder);
+  json_builder_set_member_name (builder, "requests");
+  json_builder_begin_array (builder);
+
+  for (guint idx = 0; idx < self->requests->len; idx++) {
+    BatchRequest *request = g_ptr_array_index (self->requests, idx);
+    BatchRequest *dependency;
+
+    if (!request->pending)
+      continue;
+
+    json_builder_begin_object (builder);
+    json_builder_set_member_name (builder, "id");
+    json_builder_add_string_value (builder, request->id);
+    json_builder_set_member_name (builder, "method");
+    json_builder_add_string_value (builder, request->method);
+    json_builder_set_member_name (builder, "url");
+    json_builder_add_string_value (builder, request->url);
+    json_builder_set_member_name (builder, "headers");
+    json_builder_add_value (builder, json_node_copy (request->headers));
+
+    if (request->body) {
+      json_builder_set_member_name (builder, "body");
+      json_builder_add_value (builder, json_node_copy (request->body));
+    }
+
+    /* A dependency which already succeeded in a previous round is not part of this batch */
+    dependency = msg_batch_lookup (self, request->depends_on);
+    if (dependency && dependency->pending) {
+      json_builder_set_member_name (builder, "dependsOn");
+      json_builder_begin_array (builder);
+      json_builder_add_string_value (builder, dependency->id);
+      json_builder_end_array (builder);
+    }
+
+    json_builder_end_object (builder);
+  }
+
+  json_builder_end_array (builder);
+  json_builder_end_object (builder);
+
+  generator = json_generator_new ();
+  root = json_builder_get_root (builder);
+  json_generator_set_root (generator, root);
+  json = json_generator_to_data (generator, &length);
+  bytes = g_bytes_new_take (json, length);
+
+  url = g_strconcat (self->endpoint, "/$batch", NULL);
+  message = msg_service_build_message (self->service, "POST", url, NULL, FALSE);
+  soup_message_set_request_body_from_bytes (message, "application/json", bytes);
+
+  return message;
+}
+
+static GBytes *
+batch_response_body (JsonNode           *body,
+                     SoupMessageHeaders *headers)
+{
+  const char *content_type;
+  char *data;
+  gsize length;
+
+  if (!JSON_NODE_HOLDS_VALUE (body) || json_node_get_value_type (body) != G_TYPE_STRING) {
+    data = json_to_string (body, FALSE);
+    return g_bytes_new_take (data, strlen (data));
+  }
+
+  /* Non JSON content is returned base64 encoded */
+  content_type = soup_message_headers_get_content_type (headers, NULL);
+  if (content_type && !g_str_has_suffix (content_type, "json")) {
+    data = (char *)g_base64_decode (json_node_get_string (body), &length);
+    return g_bytes_new_take (data, length);
+  }
+
+  return g_bytes_new (json_node_get_string (body), strlen (json_node_get_string (body)));
+}
+
+static gboolean
+msg_batch_handle_response (MsgBatch  *self,
+                           GBytes    *bytes,
+                           GError   **error)
+{
+  g_autoptr (JsonParser) parser = NULL;
+  JsonObject *root_object = NULL;
+  JsonArray *responses;
+
+  parser = msg_service_parse_response (bytes, &root_object, error);
+  if (!parser)
+    return FALSE;
+
+  if (!json_object_has_member (root_object, "responses")) {
+    g_set_error (error,
+                 MSG_ERROR,
+                 MSG_ERROR_PROTOCOL_ERROR,
+                 "Invalid batch response, responses missing");
+    return FALSE;
+  }
+
+  responses = json_object_get_array_member (root_object, "responses");
+  for (guint idx = 0; idx < json_array_get_length (responses); idx++) {
+    JsonObject *response = json_array_get_object_element (responses, idx);
+    BatchRequest *request;
+
+    request = msg_batch_lookup (self, msg_json_object_get_string (response, "id"));
+    if (!request)
+      continue;
+
+    request->status = json_object_has_member (response, "status") ? json_object_get_int_member (response, "status") : 0;
+
+    g_clear_pointer (&request->response_headers, soup_message_headers_unref);
+    request->response_headers = soup_message_headers_new (SOUP_MESSAGE_HEADERS_RESPONSE);
+
+    if (json_object_has_member (response, "headers")) {
+      JsonObject *headers = json_object_get_object_member (response, "headers");
+      g_autoptr (GList) members = json_object_get_members (headers);
+
+      for (GList *iter = members; iter && iter->data; iter = iter->next) {
+        const char *value = msg_json_object_get_string (headers, iter->data);
+
+        if (value)
+          soup_message_headers_append (request->response_headers, iter->data, value);
+      }
+    }
+
+    g_clear_pointer (&request->response_body, g_bytes_unref);
+    if (json_object_has_member (response, "body"))
+      request->response_body = batch_response_body (json_object_get_member (response, "body"),
+                                                    request->response_headers);
+  }
+
+  /* Requests without an answer keep status 0 and are not resent */
+  for (guint idx = 0; idx < self->requests->len; idx++) {
+    BatchRequest *request = g_ptr_array_index (self->requests, idx);
+
+    request->pending = FALSE;
+  }
+
+  return TRUE;
+}
+
+/* Marks throttled requests and their failed dependents for another round.
+ * Returns the delay before the next round or -1 if the batch is complete
+ * or out of rounds. */
+static int
+msg_batch_schedule_retries (MsgBatch *self)
+{
+  gboolean changed = TRUE;
+  int delay = -1;
+
+  if (++self->rounds >= RETRY_MAX_ROUNDS)
+    return -1;
+
+  for (guint idx = 0; idx < self->requests->len; idx++) {
+    BatchRequest *request = g_ptr_array_index (self->requests, idx);
+    int retry_after;
+
+    if (request->status != SOUP_STATUS_TOO_MANY_REQUESTS)
+      continue;
+
+    retry_after = msg_batch_get_retry_after (self, request->id);
+    if (retry_after < 0)
+      continue;
+
+    request->pending = TRUE;
+    delay = MAX (delay, retry_after);
+  }
+
+  while (changed) {
+    changed = FALSE;
+
+    for (guint idx = 0; idx < self->requests->len; idx++) {
+      BatchRequest *request = g_ptr_array_index (self->requests, idx);
+      BatchRequest *dependency;
+
+      if (request->pending || request->status != SOUP_STATUS_FAILED_DEPENDENCY)
+        continue;
+
+      dependency = msg_batch_lookup (self, request->depends_on);
+      if (dependency && dependency->pending) {
+        request->pending = TRUE;
+        changed = TRUE;
+      }
+    }
+  }
+
+  if (delay >= 0)
+    msg_service_throttle (self->service, delay);
+
+  return delay;
+}
+
+static void
+msg_batch_reset (MsgBatch *self)
+{
+  self->rounds = 0;
+
+  for (guint idx = 0; idx < self->requests->len; idx++) {
+    BatchRequest *request = g_ptr_array_index (self->requests, idx);
+
+    request->pending = TRUE;
+    request->status = 0;
+    g_clear_pointer (&request->response_headers, soup_message_headers_unref);
+    g_clear_pointer (&request->response_body, g_bytes_unref);
+  }
+}
+
+/**
+ * msg_batch_send:
+ * @self: a #MsgBatch
+ * @cancellable: a #GCancellable
+ * @error: a #GError
+ *
+ * Sends all requests of the batch within one round trip. Results are
+ * available afterwards using the request ids. Note that a successful
+ * batch does not imply that each request succeeded, see
+ * msg_batch_check_response().
+ *
+ * Returns: %TRUE if the batch has been processed by the server
+ */
+gboolean
+msg_batch_send (MsgBatch      *self,
+                GCancellable  *cancellable,
+                GError       **error)
+{
+  g_return_val_if_fail (MSG_IS_BATCH (self), FALSE);
+
+  msg_batch_reset (self);
+
+  if (self->requests->len == 0)
+    return TRUE;
+
+  do {
+    g_autoptr (SoupMessage) message = NULL;
+    g_autoptr (GBytes) bytes = NULL;
+
+    message = msg_batch_build_message (self);
+    bytes = msg_service_send_and_read (self->service, message, cancellable, error);
+    if (!bytes)
+      return FALSE;
+
+    if (!msg_batch_handle_response (self, bytes, error))
+      return FALSE;
+  } while (msg_batch_schedule_retries (self) >= 0);
+
+  return TRUE;
+}
+
+static void
+send_async_round (GTask *task);
+
+static void
+send_async_cb (GObject      *source,
+               GAsyncResult *result,
+               gpointer      user_data)
+{
+  g_autoptr (GTask) task = user_data;
+  MsgBatch *self = g_task_get_source_object (task);
+  g_autoptr (GBytes) bytes = NULL;
+  GError *error = NULL;
+
+  bytes = msg_service_send_and_read_finish (MSG_SERVICE (source), result, &error);
+  if (!bytes || !msg_batch_handle_response (self, bytes, &error)) {
+    g_task_return_error (task, error);
+    return;
+  }
+
+  if (msg_batch_schedule_retries (self) >= 0) {
+    send_async_round (task);
+    return;
+  }
+
+  g_task_return_boolean (task, TRUE);
+}
+
+static void
+send_async_round (GTask *task)
+{
+  MsgBatch *self = g_task_get_source_object (task);
+  g_autoptr (SoupMessage) message = NULL;
+
+  message = msg_batch_build_message (self);
+  msg_service_send_and_read_async (self->service,
+                                   message,
+                                   g_task_get_priority (task),
+                                   g_task_get_cancellable (task),
+                                   send_async_cb,
+                                   g_object_ref (task));
+}
+
+/**
+ * msg_batch_send_async:
+ * @self: a #MsgBatch
+ * @io_priority: the I/O priority of the request
+ * @cancellable: a #GCancellable
+ * @callback: (scope async): a #GAsyncReadyCallback to call when the request is satisfied
+ * @user_data: (closure): the data to pass to @callback
+ *
+ * Asynchronously sends all requests of the batch. See msg_batch_send()
+ * for the synchronous version of this call.
+ */
+void
+msg_batch_send_async (MsgBatch            *self,
+                      int                  io_priority,
+                      GCancellable        *cancellable,
+                      GAsyncReadyCallback  callback,
+                      gpointer             user_data)
+{
+  g_autoptr (GTask) task = NULL;
+
+  g_return_if_fail (MSG_IS_BATCH (self));
+
+  task = g_task_new (self, cancellable, callback, user_data);
+  g_task_set_source_tag (task, msg_batch_send_async);
+  g_task_set_priority (task, io_priority);
+
+  msg_batch_reset (self);
+
+  if (self->requests->len == 0) {
+    g_task_return_boolean (task, TRUE);
+    return;
+  }
+
+  send_async_round (task);
+}
+
+/**
+ * msg_batch_send_finish:
+ * @self: a #MsgBatch
+ * @result: a #GAsyncResult
+ * @error: a #GError
+ *
+ * Finishes an asynchronous operation started with msg_batch_send_async().
+ *
+ * Returns: %TRUE if the batch has been processed by the server
+ */
+gboolean
+msg_batch_send_finish (MsgBatch      *self,
+                       GAsyncResult  *result,
+                       GError       **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, self), FALSE);
+  g_return_val_if_fail (g_async_result_is_tagged (result, msg_batch_send_async), FALSE);
+
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+/**
+ * msg_batch_get_status:
+ * @self: a #MsgBatch
+ * @id: request id
+ *
+ * Get HTTP status of request @id.
+ *
+ * Returns: status code or 0 if no response is available
+ */
+guint
+msg_batch_get_status (MsgBatch   *self,
+                      const char *id)
+{
+  BatchRequest *request;
+
+  g_return_val_if_fail (MSG_IS_BATCH (self), 0);
+
+  request = msg_batch_lookup (self, id);
+  return request ? request->status : 0;
+}
+
+/**
+ * msg_batch_get_response_headers:
+ * @self: a #MsgBatch
+ * @id: request id
+ *
+ * Get response headers of request @id.
+ *
+ * Returns: (transfer none) (nullable): response headers
+ */
+SoupMessageHeaders *
+msg_batch_get_response_headers (MsgBatch   *self,
+                                const char *id)
+{
+  BatchRequest *request;
+
+  g_return_val_if_fail (MSG_IS_BATCH (self), NULL);
+
+  request = msg_batch_lookup (self, id);
+  return request ? request->response_headers : NULL;
+}
+
+/**
+ * msg_batch_get_response_body:
+ * @self: a #MsgBatch
+ * @id: request id
+ *
+ * Get response body of request @id.
+ *
+ * Returns: (transfer none) (nullable): response body
+ */
+GBytes *
+msg_batch_get_response_body (MsgBatch   *self,
+                             const char *id)
+{
+  BatchRequest *request;
+
+  g_return_val_if_fail (MSG_IS_BATCH (self), NULL);
+
+  request = msg_batch_lookup (self, id);
+  return request ? request->response_body : NULL;
+}
+
+/**
+ * msg_batch_get_retry_after:
+ * @self: a #MsgBatch
+ * @id: request id
+ *
+ * Get Retry-After value of request @id.
+ *
+ * Returns: delay in seconds or -1 if not available
+ */
+int
+msg_batch_get_retry_after (MsgBatch   *self,
+                           const char *id)
+{
+  SoupMessageHeaders *headers;
+
+  g_return_val_if_fail (MSG_IS_BATCH (self), -1);
+
+  headers = msg_batch_get_response_headers (self, id);
+  if (!headers)
+    return -1;
+
+  return msg_service_parse_retry_after (soup_message_headers_get_one (headers, "Retry-After"));
+}
+
+/**
+ * msg_batch_check_response:
+ * @self: a #MsgBatch
+ * @id: request id
+ * @error: a #GError
+ *
+ * Checks whether request @id succeeded.
+ *
+ * Returns: %TRUE if request succeeded, otherwise %FALSE with @error set
+ */
+gboolean
+msg_batch_check_response (MsgBatch    *self,
+                          const char  *id,
+                          GError     **error)
+{
+  BatchRequest *request;
+  g_autoptr (GError) local_error = NULL;
+  g_autoptr (JsonParser) parser = NULL;
+
+  g_return_val_if_fail (MSG_IS_BATCH (self), FALSE);
+
+  request = msg_batch_lookup (self, id);
+  if (!request || request->status == 0) {
+    g_set_error (error,
+                 MSG_ERROR,
+                 MSG_ERROR_PROTOCOL_ERROR,
+                 "No response for batch request %s", id);
+    return FALSE;
+  }
+
+  if (SOUP_STATUS_IS_SUCCESSFUL (request->status))
+    return TRUE;
+
+  /* Prefer the error message returned by the server */
+  if (request->response_body) {
+    parser = msg_service_parse_response (request->response_body, NULL, &local_error);
+    if (local_error) {
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return FALSE;
+    }
+  }
+
+  g_set_error (error,
+               MSG_ERROR,
+               MSG_ERROR_FAILED,
+               "Batch request %s failed: %s", id, soup_status_get_phrase (request->status));
+  return FALSE;
+}
+
+/**
+ * msg_batch_parse_response:
+ * @self: a #MsgBatch
+ * @id: request id
+ * @object: a pointer to the returning root object
+ * @error: a #GError
+ *
+ * Checks the response of request @id and parses its body.
+ *
+ * Returns: (transfer full): a #JsonParser or %NULL on error
+ */
+JsonParser *
+msg_batch_parse_response (MsgBatch    *self,
+                          const char  *id,
+                          JsonObject **object,
+                          GError     **error)
+{
+  BatchRequest *request;
+
+  if (!msg_batch_check_response (self, id, error))
+    return NULL;
+
+  request = msg_batch_lookup (self, id);
+  if (!request->response_body) {
+    g_set_error (error,
+                 MSG_ERROR,
+                 MSG_ERROR_PROTOCOL_ERROR,
+                 "Empty response for batch request %s", id);
+    return NULL;
+  }
+
+  return msg_service_parse_response (request->response_body, object, error);
+}
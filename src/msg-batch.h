@@ -0,0 +1,97 @@
+/* Copyright 2024 Jan-Michael Brummer <jan-michael.brummer1@volkswagen.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <glib-object.h>
+#include <libsoup/soup.h>
+#include <json-glib/json-glib.h>
+
+#include "msg-service.h"
+
+G_BEGIN_DECLS
+
+/**
+ * MSG_BATCH_MAX_REQUESTS:
+ *
+ * Maximum number of requests MS Graph accepts within one batch.
+ */
+#define MSG_BATCH_MAX_REQUESTS 20
+
+#define MSG_TYPE_BATCH (msg_batch_get_type ())
+
+G_DECLARE_FINAL_TYPE (MsgBatch, msg_batch, MSG, BATCH, GObject);
+
+MsgBatch *
+msg_batch_new (MsgService *service);
+
+const char *
+msg_batch_add (MsgBatch    *self,
+               SoupMessage *message,
+               GBytes      *body,
+               const char  *depends_on);
+
+guint
+msg_batch_get_size (MsgBatch *self);
+
+gboolean
+msg_batch_is_full (MsgBatch *self);
+
+gboolean
+msg_batch_send (MsgBatch      *self,
+                GCancellable  *cancellable,
+                GError       **error);
+
+void
+msg_batch_send_async (MsgBatch            *self,
+                      int                  io_priority,
+                      GCancellable        *cancellable,
+                      GAsyncReadyCallback  callback,
+                      gpointer             user_data);
+
+gboolean
+msg_batch_send_finish (MsgBatch      *self,
+                       GAsyncResult  *result,
+                       GError       **error);
+
+guint
+msg_batch_get_status (MsgBatch   *self,
+                      const char *id);
+
+SoupMessageHeaders *
+msg_batch_get_response_headers (MsgBatch   *self,
+                                const char *id);
+
+GBytes *
+msg_batch_get_response_body (MsgBatch   *self,
+                             const char *id);
+
+int
+msg_batch_get_retry_after (MsgBatch   *self,
+                           const char *id);
+
+gboolean
+msg_batch_check_response (MsgBatch    *self,
+                          const char  *id,
+                          GError     **error);
+
+JsonParser *
+msg_batch_parse_response (MsgBatch    *self,
+                          const char  *id,
+                          JsonObject **object,
+                          GError     **error);
+
+G_END_DECLS
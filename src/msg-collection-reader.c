@@ -0,0 +1,466 @@
+/* Copyright 2024 Jan-Michael Brummer <jan-michael.brummer1@volkswagen.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "msg-collection-reader.h"
+#include "msg-error.h"
+#include "msg-json-utils.h"
+
+/**
+ * MsgCollectionReader:
+ *
+ * Streaming reader for collection responses of the form
+ * `{ "@odata.nextLink": ..., "value": [ ... ] }`.
+ *
+ * Instead of loading the whole page into a JSON tree, the response is
+ * tokenized while reading from the stream and one element of the
+ * `value` array is handed out at a time. Therefore peak memory usage is
+ * bound by the size of a single element instead of the whole page.
+ */
+
+#define READER_BUFFER_SIZE 8192
+
+typedef enum {
+  READER_STATE_START,
+  READER_STATE_MEMBERS,
+  READER_STATE_ARRAY,
+  READER_STATE_DONE,
+} ReaderState;
+
+struct _MsgCollectionReader {
+  GObject parent_instance;
+
+  GInputStream *stream;
+  ReaderState state;
+
+  char buffer[READER_BUFFER_SIZE];
+  gsize pos;
+  gsize len;
+
+  GString *scratch;
+  JsonParser *parser;
+
+  char *next_link;
+  char *delta_link;
+};
+
+G_DEFINE_TYPE (MsgCollectionReader, msg_collection_reader, G_TYPE_OBJECT);
+
+static void
+msg_collection_reader_finalize (GObject *object)
+{
+  MsgCollectionReader *self = MSG_COLLECTION_READER (object);
+
+  g_clear_object (&self->stream);
+  g_clear_object (&self->parser);
+  g_string_free (self->scratch, TRUE);
+  g_clear_pointer (&self->next_link, g_free);
+  g_clear_pointer (&self->delta_link, g_free);
+
+  G_OBJECT_CLASS (msg_collection_reader_parent_class)->finalize (object);
+}
+
+static void
+msg_collection_reader_init (MsgCollectionReader *self)
+{
+  self->scratch = g_string_sized_new (1024);
+  self->parser = json_parser_new ();
+}
+
+static void
+msg_collection_reader_class_init (MsgCollectionReaderClass *class)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (class);
+
+  object_class->finalize = msg_collection_reader_finalize;
+}
+
+/**
+ * msg_collection_reader_new:
+ * @stream: a #GInputStream containing a collection response
+ *
+ * Creates a new `MsgCollectionReader` reading from @stream.
+ *
+ * Returns: the newly created `MsgCollectionReader`
+ */
+MsgCollectionReader *
+msg_collection_reader_new (GInputStream *stream)
+{
+  MsgCollectionReader *self;
+
+  g_return_val_if_fail (G_IS_INPUT_STREAM (stream), NULL);
+
+  self = g_object_new (MSG_TYPE_COLLECTION_READER, NULL);
+  self->stream = g_object_ref (stream);
+
+  return self;
+}
+
+static gboolean
+reader_fill (MsgCollectionReader  *self,
+             GCancellable         *cancellable,
+             GError              **error)
+{
+  gssize read;
+
+  if (self->pos < self->len)
+    return TRUE;
+
+  read = g_input_stream_read (self->stream, self->buffer, READER_BUFFER_SIZE, cancellable, error);
+  if (read < 0)
+    return FALSE;
+
+  if (read == 0) {
+    g_set_error (error,
+                 MSG_ERROR,
+                 MSG_ERROR_PROTOCOL_ERROR,
+                 "Invalid response, unexpected end of collection");
+    return FALSE;
+  }
+
+  self->pos = 0;
+  self->len = read;
+
+  return TRUE;
+}
+
+/* Returns the next non whitespace character without consuming it */
+static gboolean
+reader_peek (MsgCollectionReader  *self,
+             char                 *out,
+             GCancellable         *cancellable,
+             GError              **error)
+{
+  while (TRUE) {
+    if (!reader_fill (self, cancellable, error))
+      return FALSE;
+
+    if (!g_ascii_isspace (self->buffer[self->pos])) {
+      *out = self->buffer[self->pos];
+      return TRUE;
+    }
+
+    self->pos++;
+  }
+}
+
+static gboolean
+reader_expect (MsgCollectionReader  *self,
+               char                  expected,
+               GCancellable         *cancellable,
+               GError              **error)
+{
+  char c;
+
+  if (!reader_peek (self, &c, cancellable, error))
+    return FALSE;
+
+  if (c != expected) {
+    g_set_error (error,
+                 MSG_ERROR,
+                 MSG_ERROR_PROTOCOL_ERROR,
+                 "Invalid response, expected '%c' but got '%c'", expected, c);
+    return FALSE;
+  }
+
+  self->pos++;
+  return TRUE;
+}
+
+/* Copies the raw text of the next JSON value into @out */
+static gboolean
+reader_capture_value (MsgCollectionReader  *self,
+                      GString              *out,
+                      GCancellable         *cancellable,
+                      GError              **error)
+{
+  gboolean in_string = FALSE;
+  gboolean escape = FALSE;
+  int depth = 0;
+  char c;
+
+  g_string_truncate (out, 0);
+
+  if (!reader_peek (self, &c, cancellable, error))
+    return FALSE;
+
+  if (c != '"' && c != '{' && c != '[') {
+    /* true, false, null or a number */
+    while (TRUE) {
+      if (!reader_fill (self, cancellable, error))
+        return FALSE;
+
+      c = self->buffer[self->pos];
+      if (c == ',' || c == '}' || c == ']' || g_ascii_isspace (c))
+        return TRUE;
+
+      g_string_append_c (out, c);
+      self->pos++;
+    }
+  }
+
+  while (TRUE) {
+    gsize start;
+
+    if (!reader_fill (self, cancellable, error))
+      return FALSE;
+
+    for (start = self->pos; self->pos < self->len; self->pos++) {
+      c = self->buffer[self->pos];
+
+      if (in_string) {
+        if (escape)
+          escape = FALSE;
+        else if (c == '\\')
+          escape = TRUE;
+        else if (c == '"')
+          in_string = FALSE;
+        else
+          continue;
+      } else if (c == '"') {
+        in_string = TRUE;
+      } else if (c == '{' || c == '[') {
+        depth++;
+      } else if (c == '}' || c == ']') {
+        depth--;
+      }
+
+      if (depth == 0 && !in_string) {
+        self->pos++;
+        g_string_append_len (out, self->buffer + start, self->pos - start);
+        return TRUE;
+      }
+    }
+
+    g_string_append_len (out, self->buffer + start, self->pos - start);
+  }
+}
+
+static JsonNode *
+reader_parse_scratch (MsgCollectionReader  *self,
+                      GError              **error)
+{
+  if (!json_parser_load_from_data (self->parser, self->scratch->str, self->scratch->len, error))
+    return NULL;
+
+  return json_parser_get_root (self->parser);
+}
+
+static char *
+reader_decode_string (MsgCollectionReader  *self,
+                      GError              **error)
+{
+  JsonNode *node;
+
+  /* Wrap the value so that escape sequences are handled by json-glib */
+  g_string_prepend (self->scratch, "[");
+  g_string_append_c (self->scratch, ']');
+
+  node = reader_parse_scratch (self, error);
+  if (!node)
+    return NULL;
+
+  if (json_node_get_value_type (json_array_get_element (json_node_get_array (node), 0)) != G_TYPE_STRING) {
+    g_set_error (error,
+                 MSG_ERROR,
+                 MSG_ERROR_PROTOCOL_ERROR,
+                 "Invalid response, link is not a string");
+    return NULL;
+  }
+
+  return g_strdup (json_array_get_string_element (json_node_get_array (node), 0));
+}
+
+static void
+reader_set_error_from_scratch (MsgCollectionReader  *self,
+                               GError              **error)
+{
+  JsonNode *node;
+  const char *message = NULL;
+
+  node = reader_parse_scratch (self, error);
+  if (!node)
+    return;
+
+  if (JSON_NODE_HOLDS_OBJECT (node))
+    message = msg_json_object_get_string (json_node_get_object (node), "message");
+
+  g_set_error_literal (error,
+                       MSG_ERROR,
+                       MSG_ERROR_FAILED,
+                       message ? message : "Unknown error");
+}
+
+static gboolean
+reader_handle_member (MsgCollectionReader  *self,
+                      GCancellable         *cancellable,
+                      GError              **error)
+{
+  g_autofree char *key = NULL;
+  char c;
+
+  if (!reader_peek (self, &c, cancellable, error))
+    return FALSE;
+
+  if (c != '"') {
+    g_set_error (error,
+                 MSG_ERROR,
+                 MSG_ERROR_PROTOCOL_ERROR,
+                 "Invalid response, expected member name");
+    return FALSE;
+  }
+
+  if (!reader_capture_value (self, self->scratch, cancellable, error))
+    return FALSE;
+
+  /* Strip quotes, member names of interest do not contain escapes */
+  key = g_strndup (self->scratch->str + 1, self->scratch->len - 2);
+
+  if (!reader_expect (self, ':', cancellable, error))
+    return FALSE;
+
+  if (g_strcmp0 (key, "value") == 0) {
+    if (!reader_expect (self, '[', cancellable, error))
+      return FALSE;
+
+    self->state = READER_STATE_ARRAY;
+    return TRUE;
+  }
+
+  if (!reader_capture_value (self, self->scratch, cancellable, error))
+    return FALSE;
+
+  if (g_strcmp0 (key, "@odata.nextLink") == 0) {
+    g_clear_pointer (&self->next_link, g_free);
+    self->next_link = reader_decode_string (self, error);
+    return self->next_link != NULL;
+  }
+
+  if (g_strcmp0 (key, "@odata.deltaLink") == 0) {
+    g_clear_pointer (&self->delta_link, g_free);
+    self->delta_link = reader_decode_string (self, error);
+    return self->delta_link != NULL;
+  }
+
+  if (g_strcmp0 (key, "error") == 0) {
+    reader_set_error_from_scratch (self, error);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/**
+ * msg_collection_reader_next:
+ * @self: a #MsgCollectionReader
+ * @cancellable: a #GCancellable
+ * @error: a #GError
+ *
+ * Reads the next element of the collection. In case the response
+ * contains an error object, @error is set accordingly.
+ *
+ * Returns: (transfer full) (nullable): the next element, or %NULL at
+ *   the end of the collection or on error
+ */
+JsonObject *
+msg_collection_reader_next (MsgCollectionReader  *self,
+                            GCancellable         *cancellable,
+                            GError              **error)
+{
+  g_return_val_if_fail (MSG_IS_COLLECTION_READER (self), NULL);
+
+  while (self->state != READER_STATE_DONE) {
+    gboolean ret = TRUE;
+    char c;
+
+    if (self->state == READER_STATE_START) {
+      ret = reader_expect (self, '{', cancellable, error);
+      self->state = READER_STATE_MEMBERS;
+    } else if (!reader_peek (self, &c, cancellable, error)) {
+      ret = FALSE;
+    } else if (c == ',') {
+      self->pos++;
+    } else if (self->state == READER_STATE_MEMBERS && c == '}') {
+      self->pos++;
+      self->state = READER_STATE_DONE;
+    } else if (self->state == READER_STATE_MEMBERS) {
+      ret = reader_handle_member (self, cancellable, error);
+    } else if (c == ']') {
+      self->pos++;
+      self->state = READER_STATE_MEMBERS;
+    } else {
+      JsonNode *node;
+
+      if (!reader_capture_value (self, self->scratch, cancellable, error))
+        break;
+
+      node = reader_parse_scratch (self, error);
+      if (!node)
+        break;
+
+      if (!JSON_NODE_HOLDS_OBJECT (node)) {
+        g_set_error (error,
+                     MSG_ERROR,
+                     MSG_ERROR_PROTOCOL_ERROR,
+                     "Invalid response, collection element is not an object");
+        break;
+      }
+
+      return json_object_ref (json_node_get_object (node));
+    }
+
+    if (!ret)
+      break;
+  }
+
+  self->state = READER_STATE_DONE;
+  return NULL;
+}
+
+/**
+ * msg_collection_reader_get_next_link:
+ * @self: a #MsgCollectionReader
+ *
+ * Get next link of the collection. It is available as soon as the
+ * reader passed it, at the latest once msg_collection_reader_next()
+ * returned %NULL.
+ *
+ * Returns: (transfer none) (nullable): next link
+ */
+const char *
+msg_collection_reader_get_next_link (MsgCollectionReader *self)
+{
+  g_return_val_if_fail (MSG_IS_COLLECTION_READER (self), NULL);
+
+  return self->next_link;
+}
+
+/**
+ * msg_collection_reader_get_delta_link:
+ * @self: a #MsgCollectionReader
+ *
+ * Get delta link of the collection. It is available as soon as the
+ * reader passed it, at the latest once msg_collection_reader_next()
+ * returned %NULL.
+ *
+ * Returns: (transfer none) (nullable): delta link
+ */
+const char *
+msg_collection_reader_get_delta_link (MsgCollectionReader *self)
+{
+  g_return_val_if_fail (MSG_IS_COLLECTION_READER (self), NULL);
+
+  return self->delta_link;
+}
@@ -0,0 +1,42 @@
+/* Copyright 2024 Jan-Michael Brummer <jan-michael.brummer1@volkswagen.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+#include <json-glib/json-glib.h>
+
+G_BEGIN_DECLS
+
+#define MSG_TYPE_COLLECTION_READER (msg_collection_reader_get_type ())
+
+G_DECLARE_FINAL_TYPE (MsgCollectionReader, msg_collection_reader, MSG, COLLECTION_READER, GObject);
+
+MsgCollectionReader *
+msg_collection_reader_new (GInputStream *stream);
+
+JsonObject *
+msg_collection_reader_next (MsgCollectionReader  *self,
+                            GCancellable         *cancellable,
+                            GError              **error);
+
+const char *
+msg_collection_reader_get_next_link (MsgCollectionReader *self);
+
+const char *
+msg_collection_reader_get_delta_link (MsgCollectionReader *self);
+
+G_END_DECLS
@@ -0,0 +1,393 @@
+/* Copyright 2024 Jan-Michael Brummer <jan-michael.brummer1@volkswagen.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <libsoup/soup.h>
+
+#include "msg-concurrency-limiter.h"
+
+/* The limit grows by one per window of healthy responses while it is
+ * fully used, and shrinks multiplicatively on throttling or when the
+ * latency spikes above its moving average. */
+#define LIMIT_INITIAL 4
+#define LIMIT_MIN 1
+#define LIMIT_MAX 64
+#define THROTTLED_BACKOFF 0.5
+#define LATENCY_BACKOFF 0.9
+#define LATENCY_SPIKE_FACTOR 3
+#define LATENCY_MIN_SAMPLES 10
+
+/* Sync waiters check their cancellable in this interval */
+#define POLL_INTERVAL (100 * G_TIME_SPAN_MILLISECOND)
+
+typedef struct {
+  /* Owned while queued */
+  GTask *task;
+  gulong cancelled_id;
+  gboolean admitted;
+} LimiterWaiter;
+
+struct _MsgConcurrencyLimiter {
+  GMutex mutex;
+  GCond cond;
+
+  double limit;
+  guint max_limit;
+  guint in_flight;
+  /* LimiterWaiter in arrival order */
+  GQueue waiters;
+
+  /* Smoothed latency in microseconds */
+  gint64 latency;
+  guint samples;
+  gint64 last_decrease;
+};
+
+MsgConcurrencyLimiter *
+msg_concurrency_limiter_new (void)
+{
+  MsgConcurrencyLimiter *limiter = g_new0 (MsgConcurrencyLimiter, 1);
+
+  g_mutex_init (&limiter->mutex);
+  g_cond_init (&limiter->cond);
+  g_queue_init (&limiter->waiters);
+  limiter->limit = LIMIT_INITIAL;
+  limiter->max_limit = LIMIT_MAX;
+
+  return limiter;
+}
+
+void
+msg_concurrency_limiter_free (MsgConcurrencyLimiter *limiter)
+{
+  /* Pending async waiters hold a reference to the owning service */
+  g_warn_if_fail (g_queue_is_empty (&limiter->waiters));
+
+  g_mutex_clear (&limiter->mutex);
+  g_cond_clear (&limiter->cond);
+  g_free (limiter);
+}
+
+/* Must be called locked */
+static gboolean
+limiter_has_capacity_locked (MsgConcurrencyLimiter *limiter)
+{
+  return limiter->in_flight < (guint)limiter->limit;
+}
+
+/* Must be called locked. Returns the admitted async waiters, which have to
+ * be completed unlocked. */
+static GSList *
+limiter_admit_locked (MsgConcurrencyLimiter *limiter)
+{
+  GSList *tasks = NULL;
+
+  while (limiter_has_capacity_locked (limiter) && !g_queue_is_empty (&limiter->waiters)) {
+    LimiterWaiter *waiter = g_queue_pop_head (&limiter->waiters);
+
+    waiter->admitted = TRUE;
+    limiter->in_flight++;
+
+    if (waiter->task)
+      tasks = g_slist_prepend (tasks, g_steal_pointer (&waiter->task));
+  }
+
+  g_cond_broadcast (&limiter->cond);
+
+  return g_slist_reverse (tasks);
+}
+
+static void
+limiter_complete_waiters (GSList *tasks)
+{
+  for (GSList *iter = tasks; iter; iter = iter->next) {
+    GTask *task = iter->data;
+    LimiterWaiter *waiter = g_task_get_task_data (task);
+
+    g_cancellable_disconnect (g_task_get_cancellable (task), waiter->cancelled_id);
+    g_task_return_boolean (task, TRUE);
+  }
+
+  g_slist_free_full (tasks, g_object_unref);
+}
+
+/**
+ * msg_concurrency_limiter_acquire:
+ * @limiter: a #MsgConcurrencyLimiter
+ * @cancellable: a #GCancellable
+ * @error: a #GError
+ *
+ * Blocks until the number of requests in flight is below the current
+ * limit. Each successful call must be balanced by
+ * msg_concurrency_limiter_release().
+ *
+ * Returns: %TRUE if the request may be sent, %FALSE on cancellation
+ */
+gboolean
+msg_concurrency_limiter_acquire (MsgConcurrencyLimiter  *limiter,
+                                 GCancellable           *cancellable,
+                                 GError                **error)
+{
+  LimiterWaiter waiter = { NULL, };
+
+  g_mutex_lock (&limiter->mutex);
+
+  if (limiter_has_capacity_locked (limiter) && g_queue_is_empty (&limiter->waiters)) {
+    limiter->in_flight++;
+    g_mutex_unlock (&limiter->mutex);
+    return TRUE;
+  }
+
+  g_queue_push_tail (&limiter->waiters, &waiter);
+
+  while (!waiter.admitted) {
+    g_cond_wait_until (&limiter->cond, &limiter->mutex, g_get_monotonic_time () + POLL_INTERVAL);
+
+    if (!waiter.admitted && g_cancellable_is_cancelled (cancellable)) {
+      g_queue_remove (&limiter->waiters, &waiter);
+      g_mutex_unlock (&limiter->mutex);
+      return !g_cancellable_set_error_if_cancelled (cancellable, error);
+    }
+  }
+
+  g_mutex_unlock (&limiter->mutex);
+
+  return TRUE;
+}
+
+static void
+limiter_waiter_cancelled_cb (__attribute__ ((unused)) GCancellable *cancellable,
+                             gpointer                               user_data)
+{
+  GTask *task = G_TASK (user_data);
+  MsgConcurrencyLimiter *limiter = g_object_get_data (G_OBJECT (task), "limiter");
+  LimiterWaiter *waiter = g_task_get_task_data (task);
+  gboolean removed;
+
+  g_mutex_lock (&limiter->mutex);
+  removed = !waiter->admitted && g_queue_remove (&limiter->waiters, waiter);
+  if (removed)
+    waiter->task = NULL;
+  g_mutex_unlock (&limiter->mutex);
+
+  /* Otherwise the request has already been admitted */
+  if (removed) {
+    g_task_return_error_if_cancelled (task);
+    g_object_unref (task);
+  }
+}
+
+/**
+ * msg_concurrency_limiter_acquire_async:
+ * @limiter: a #MsgConcurrencyLimiter
+ * @cancellable: a #GCancellable
+ * @callback: (scope async): a #GAsyncReadyCallback to call when the request is admitted
+ * @user_data: (closure): the data to pass to @callback
+ *
+ * Asynchronously waits until the number of requests in flight is below
+ * the current limit. The owner of @limiter has to outlive the call.
+ */
+void
+msg_concurrency_limiter_acquire_async (MsgConcurrencyLimiter *limiter,
+                                       GCancellable          *cancellable,
+                                       GAsyncReadyCallback    callback,
+                                       gpointer               user_data)
+{
+  g_autoptr (GTask) task = NULL;
+  LimiterWaiter *waiter;
+
+  task = g_task_new (NULL, cancellable, callback, user_data);
+  g_task_set_source_tag (task, msg_concurrency_limiter_acquire_async);
+
+  if (g_task_return_error_if_cancelled (task))
+    return;
+
+  g_mutex_lock (&limiter->mutex);
+
+  if (limiter_has_capacity_locked (limiter) && g_queue_is_empty (&limiter->waiters)) {
+    limiter->in_flight++;
+    g_mutex_unlock (&limiter->mutex);
+    g_task_return_boolean (task, TRUE);
+    return;
+  }
+
+  g_mutex_unlock (&limiter->mutex);
+
+  waiter = g_new0 (LimiterWaiter, 1);
+  g_task_set_task_data (task, waiter, g_free);
+  g_object_set_data (G_OBJECT (task), "limiter", limiter);
+
+  /* Not connected while locked, as the handler runs at once if already
+   * cancelled. Connected before queueing, so that completion always
+   * sees the handler id. */
+  if (cancellable)
+    waiter->cancelled_id = g_cancellable_connect (cancellable, G_CALLBACK (limiter_waiter_cancelled_cb), g_object_ref (task), g_object_unref);
+
+  g_mutex_lock (&limiter->mutex);
+
+  if (g_cancellable_is_cancelled (cancellable)) {
+    g_mutex_unlock (&limiter->mutex);
+    g_cancellable_disconnect (cancellable, waiter->cancelled_id);
+    g_task_return_error_if_cancelled (task);
+    return;
+  }
+
+  if (limiter_has_capacity_locked (limiter) && g_queue_is_empty (&limiter->waiters)) {
+    limiter->in_flight++;
+    g_mutex_unlock (&limiter->mutex);
+    g_cancellable_disconnect (cancellable, waiter->cancelled_id);
+    g_task_return_boolean (task, TRUE);
+    return;
+  }
+
+  /* The queue owns a reference until the waiter is admitted or cancelled */
+  waiter->task = g_object_ref (task);
+  g_queue_push_tail (&limiter->waiters, waiter);
+
+  g_mutex_unlock (&limiter->mutex);
+}
+
+/**
+ * msg_concurrency_limiter_acquire_finish:
+ * @result: a #GAsyncResult
+ * @error: a #GError
+ *
+ * Finishes an asynchronous operation started with
+ * msg_concurrency_limiter_acquire_async().
+ *
+ * Returns: %TRUE if the request may be sent, %FALSE on cancellation
+ */
+gboolean
+msg_concurrency_limiter_acquire_finish (GAsyncResult  *result,
+                                        GError       **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, NULL), FALSE);
+  g_return_val_if_fail (g_async_result_is_tagged (result, msg_concurrency_limiter_acquire_async), FALSE);
+
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+/* Must be called locked */
+static void
+limiter_decrease_locked (MsgConcurrencyLimiter *limiter,
+                         double                 factor)
+{
+  gint64 now = g_get_monotonic_time ();
+
+  /* Responses of requests sent before the last decrease do not count again */
+  if (limiter->last_decrease && now - limiter->last_decrease < limiter->latency)
+    return;
+
+  limiter->limit = MAX (limiter->limit * factor, LIMIT_MIN);
+  limiter->last_decrease = now;
+}
+
+/**
+ * msg_concurrency_limiter_release:
+ * @limiter: a #MsgConcurrencyLimiter
+ * @status: HTTP status of the response, or %SOUP_STATUS_NONE if no
+ *   response has been received
+ * @latency: time from sending the request until the response headers
+ *   arrived, in microseconds. Body transfer is excluded, so that large
+ *   downloads are not taken for congestion
+ *
+ * Releases a request admitted by msg_concurrency_limiter_acquire() and
+ * adapts the limit to the outcome of the request.
+ */
+void
+msg_concurrency_limiter_release (MsgConcurrencyLimiter *limiter,
+                                 guint                  status,
+                                 gint64                 latency)
+{
+  GSList *tasks;
+
+  g_mutex_lock (&limiter->mutex);
+
+  g_warn_if_fail (limiter->in_flight > 0);
+  limiter->in_flight--;
+
+  if (status == SOUP_STATUS_TOO_MANY_REQUESTS || status == SOUP_STATUS_SERVICE_UNAVAILABLE) {
+    limiter_decrease_locked (limiter, THROTTLED_BACKOFF);
+  } else if (status != SOUP_STATUS_NONE) {
+    if (limiter->samples >= LATENCY_MIN_SAMPLES && latency > limiter->latency * LATENCY_SPIKE_FACTOR)
+      limiter_decrease_locked (limiter, LATENCY_BACKOFF);
+    else if (limiter->in_flight + 1 >= (guint)limiter->limit)
+      limiter->limit = MIN (limiter->limit + 1 / limiter->limit, limiter->max_limit);
+
+    /* Moving average over about the last eight responses */
+    limiter->latency = limiter->samples ? limiter->latency + (latency - limiter->latency) / 8 : latency;
+    limiter->samples++;
+  }
+
+  tasks = limiter_admit_locked (limiter);
+
+  g_mutex_unlock (&limiter->mutex);
+
+  limiter_complete_waiters (tasks);
+}
+
+/**
+ * msg_concurrency_limiter_get_limit:
+ * @limiter: a #MsgConcurrencyLimiter
+ *
+ * Returns: the current maximal number of requests in flight
+ */
+guint
+msg_concurrency_limiter_get_limit (MsgConcurrencyLimiter *limiter)
+{
+  guint limit;
+
+  g_mutex_lock (&limiter->mutex);
+  limit = (guint)limiter->limit;
+  g_mutex_unlock (&limiter->mutex);
+
+  return limit;
+}
+
+/**
+ * msg_concurrency_limiter_get_in_flight:
+ * @limiter: a #MsgConcurrencyLimiter
+ *
+ * Returns: the number of requests in flight
+ */
+guint
+msg_concurrency_limiter_get_in_flight (MsgConcurrencyLimiter *limiter)
+{
+  guint in_flight;
+
+  g_mutex_lock (&limiter->mutex);
+  in_flight = limiter->in_flight;
+  g_mutex_unlock (&limiter->mutex);
+
+  return in_flight;
+}
+
+/**
+ * msg_concurrency_limiter_set_max_limit:
+ * @limiter: a #MsgConcurrencyLimiter
+ * @max_limit: upper bound of the limit
+ *
+ * Bounds the limit, e.g. to the number of connections of the session.
+ */
+void
+msg_concurrency_limiter_set_max_limit (MsgConcurrencyLimiter *limiter,
+                                       guint                  max_limit)
+{
+  g_mutex_lock (&limiter->mutex);
+  limiter->max_limit = MAX (max_limit, LIMIT_MIN);
+  limiter->limit = MIN (limiter->limit, limiter->max_limit);
+  g_mutex_unlock (&limiter->mutex);
+}
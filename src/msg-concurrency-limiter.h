@@ -0,0 +1,64 @@
+/* Copyright 2024 Jan-Michael Brummer <jan-michael.brummer1@volkswagen.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/* Internal adaptive (AIMD) cap on the in-flight requests of a MsgService */
+
+typedef struct _MsgConcurrencyLimiter MsgConcurrencyLimiter;
+
+MsgConcurrencyLimiter *
+msg_concurrency_limiter_new (void);
+
+void
+msg_concurrency_limiter_free (MsgConcurrencyLimiter *limiter);
+
+gboolean
+msg_concurrency_limiter_acquire (MsgConcurrencyLimiter  *limiter,
+                                 GCancellable           *cancellable,
+                                 GError                **error);
+
+void
+msg_concurrency_limiter_acquire_async (MsgConcurrencyLimiter *limiter,
+                                       GCancellable          *cancellable,
+                                       GAsyncReadyCallback    callback,
+                                       gpointer               user_data);
+
+gboolean
+msg_concurrency_limiter_acquire_finish (GAsyncResult  *result,
+                                        GError       **error);
+
+void
+msg_concurrency_limiter_release (MsgConcurrencyLimiter *limiter,
+                                 guint                  status,
+                                 gint64                 latency);
+
+guint
+msg_concurrency_limiter_get_limit (MsgConcurrencyLimiter *limiter);
+
+guint
+msg_concurrency_limiter_get_in_flight (MsgConcurrencyLimiter *limiter);
+
+void
+msg_concurrency_limiter_set_max_limit (MsgConcurrencyLimiter *limiter,
+                                       guint                  max_limit);
+
+G_END_DECLS
@@ -0,0 +1,341 @@
+/* Copyright 2024 Jan-Michael Brummer <jan-michael.brummer1@volkswagen.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <errno.h>
+#include <string.h>
+#include <glib/gstdio.h>
+#include <json-glib/json-glib.h>
+
+#include "msg-error.h"
+#include "msg-file-token-cache.h"
+
+/**
+ * MsgFileTokenCache:
+ *
+ * A #MsgTokenCache storing the tokens of each account in an encrypted
+ * file within a directory.
+ *
+ * The key supplied by the caller is used to derive an encryption and an
+ * authentication key. Tokens are encrypted with a HMAC-SHA256 based key
+ * stream using a random nonce per file and authenticated with
+ * HMAC-SHA256 (encrypt-then-MAC), so a file encrypted with another key
+ * or modified on disk is rejected.
+ */
+
+#define TOKEN_CACHE_MAGIC "MSGTC1"
+#define TOKEN_CACHE_MAGIC_LEN 6
+#define TOKEN_CACHE_NONCE_LEN 16
+#define TOKEN_CACHE_DIGEST_LEN 32
+
+struct _MsgFileTokenCache {
+  GObject parent_instance;
+
+  GMutex mutex;
+  char *directory;
+  guint8 encryption_key[TOKEN_CACHE_DIGEST_LEN];
+  guint8 authentication_key[TOKEN_CACHE_DIGEST_LEN];
+};
+
+static void token_cache_init (MsgTokenCacheInterface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (MsgFileTokenCache, msg_file_token_cache, G_TYPE_OBJECT,
+                         G_IMPLEMENT_INTERFACE (MSG_TYPE_TOKEN_CACHE, token_cache_init));
+
+static void
+hmac_sha256 (const guint8 *key,
+             gsize         key_len,
+             const guint8 *data,
+             gsize         data_len,
+             const guint8 *extra,
+             gsize         extra_len,
+             guint8       *digest)
+{
+  GHmac *hmac = g_hmac_new (G_CHECKSUM_SHA256, key, key_len);
+  gsize digest_len = TOKEN_CACHE_DIGEST_LEN;
+
+  g_hmac_update (hmac, data, data_len);
+  if (extra)
+    g_hmac_update (hmac, extra, extra_len);
+  g_hmac_get_digest (hmac, digest, &digest_len);
+  g_hmac_unref (hmac);
+}
+
+/* XORs @data with the key stream of @nonce */
+static void
+apply_key_stream (MsgFileTokenCache *self,
+                  const guint8      *nonce,
+                  guint8            *data,
+                  gsize              len)
+{
+  guint8 block[TOKEN_CACHE_DIGEST_LEN];
+  guint32 counter = 0;
+
+  for (gsize offset = 0; offset < len; offset += TOKEN_CACHE_DIGEST_LEN, counter++) {
+    guint32 be_counter = GUINT32_TO_BE (counter);
+
+    hmac_sha256 (self->encryption_key, TOKEN_CACHE_DIGEST_LEN,
+                 nonce, TOKEN_CACHE_NONCE_LEN,
+                 (const guint8 *)&be_counter, sizeof (be_counter),
+                 block);
+
+    for (gsize index = 0; index < TOKEN_CACHE_DIGEST_LEN && offset + index < len; index++)
+      data[offset + index] ^= block[index];
+  }
+}
+
+static void
+create_nonce (guint8 *nonce)
+{
+  g_autoptr (GFile) file = g_file_new_for_path ("/dev/urandom");
+  g_autoptr (GFileInputStream) stream = NULL;
+  gsize read = 0;
+
+  stream = g_file_read (file, NULL, NULL);
+  if (stream)
+    g_input_stream_read_all (G_INPUT_STREAM (stream), nonce, TOKEN_CACHE_NONCE_LEN, &read, NULL, NULL);
+
+  /* Fallback, a nonce only needs to be unique */
+  if (read != TOKEN_CACHE_NONCE_LEN) {
+    gint64 now = GINT64_TO_BE (g_get_real_time ());
+
+    memcpy (nonce, &now, sizeof (now));
+    for (gsize index = sizeof (now); index < TOKEN_CACHE_NONCE_LEN; index += sizeof (guint32)) {
+      guint32 random = g_random_int ();
+
+      memcpy (nonce + index, &random, sizeof (random));
+    }
+  }
+}
+
+static char *
+get_path (MsgFileTokenCache *self,
+          const char        *account)
+{
+  g_autofree char *checksum = g_compute_checksum_for_string (G_CHECKSUM_SHA256, account, -1);
+  g_autofree char *name = g_strconcat (checksum, ".token", NULL);
+
+  return g_build_filename (self->directory, name, NULL);
+}
+
+static gboolean
+file_token_cache_load (MsgTokenCache  *cache,
+                       const char     *account,
+                       char          **access_token,
+                       char          **refresh_token,
+                       gint64         *expires_at,
+                       GError        **error)
+{
+  MsgFileTokenCache *self = MSG_FILE_TOKEN_CACHE (cache);
+  g_autofree char *path = get_path (self, account);
+  g_autofree char *contents = NULL;
+  g_autoptr (JsonParser) parser = NULL;
+  g_autoptr (GError) local_error = NULL;
+  guint8 digest[TOKEN_CACHE_DIGEST_LEN];
+  guint8 *nonce;
+  guint8 *payload;
+  gsize payload_len;
+  guint8 difference = 0;
+  JsonObject *object;
+  gsize len;
+
+  if (!g_file_get_contents (path, &contents, &len, &local_error)) {
+    if (g_error_matches (local_error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+      return FALSE;
+
+    g_propagate_error (error, g_steal_pointer (&local_error));
+    return FALSE;
+  }
+
+  if (len < TOKEN_CACHE_MAGIC_LEN + TOKEN_CACHE_NONCE_LEN + TOKEN_CACHE_DIGEST_LEN ||
+      memcmp (contents, TOKEN_CACHE_MAGIC, TOKEN_CACHE_MAGIC_LEN) != 0) {
+    g_set_error (error, MSG_ERROR, MSG_ERROR_FAILED, "Invalid token cache file %s", path);
+    return FALSE;
+  }
+
+  nonce = (guint8 *)contents + TOKEN_CACHE_MAGIC_LEN;
+  payload = nonce + TOKEN_CACHE_NONCE_LEN;
+  payload_len = len - TOKEN_CACHE_MAGIC_LEN - TOKEN_CACHE_NONCE_LEN - TOKEN_CACHE_DIGEST_LEN;
+
+  /* Authenticate before decrypting, compared in constant time */
+  hmac_sha256 (self->authentication_key, TOKEN_CACHE_DIGEST_LEN,
+               (const guint8 *)contents, len - TOKEN_CACHE_DIGEST_LEN,
+               NULL, 0, digest);
+  for (gsize index = 0; index < TOKEN_CACHE_DIGEST_LEN; index++)
+    difference |= digest[index] ^ payload[payload_len + index];
+
+  if (difference != 0) {
+    g_set_error (error, MSG_ERROR, MSG_ERROR_FAILED, "Token cache file %s has been encrypted with another key or modified", path);
+    return FALSE;
+  }
+
+  apply_key_stream (self, nonce, payload, payload_len);
+
+  parser = json_parser_new ();
+  if (!json_parser_load_from_data (parser, (const char *)payload, payload_len, &local_error) ||
+      !JSON_NODE_HOLDS_OBJECT (json_parser_get_root (parser))) {
+    memset (payload, 0, payload_len);
+    g_set_error (error, MSG_ERROR, MSG_ERROR_PROTOCOL_ERROR, "Invalid token cache file %s", path);
+    return FALSE;
+  }
+  memset (payload, 0, payload_len);
+
+  object = json_node_get_object (json_parser_get_root (parser));
+  if (access_token)
+    *access_token = g_strdup (json_object_get_string_member_with_default (object, "access_token", NULL));
+  if (refresh_token)
+    *refresh_token = g_strdup (json_object_get_string_member_with_default (object, "refresh_token", NULL));
+  if (expires_at)
+    *expires_at = json_object_get_int_member_with_default (object, "expires_at", 0);
+
+  return TRUE;
+}
+
+static gboolean
+file_token_cache_store (MsgTokenCache  *cache,
+                        const char     *account,
+                        const char     *access_token,
+                        const char     *refresh_token,
+                        gint64          expires_at,
+                        GError        **error)
+{
+  MsgFileTokenCache *self = MSG_FILE_TOKEN_CACHE (cache);
+  g_autofree char *path = get_path (self, account);
+  g_autoptr (JsonBuilder) builder = json_builder_new ();
+  g_autoptr (JsonGenerator) generator = json_generator_new ();
+  g_autoptr (JsonNode) root = NULL;
+  g_autoptr (GByteArray) data = g_byte_array_new ();
+  g_autofree char *json = NULL;
+  guint8 nonce[TOKEN_CACHE_NONCE_LEN];
+  guint8 digest[TOKEN_CACHE_DIGEST_LEN];
+  gsize json_len;
+  gboolean ret;
+
+  json_builder_begin_object (builder);
+  if (access_token) {
+    json_builder_set_member_name (builder, "access_token");
+    json_builder_add_string_value (builder, access_token);
+    json_builder_set_member_name (builder, "expires_at");
+    json_builder_add_int_value (builder, expires_at);
+  }
+  json_builder_set_member_name (builder, "refresh_token");
+  json_builder_add_string_value (builder, refresh_token);
+  json_builder_end_object (builder);
+
+  root = json_builder_get_root (builder);
+  json_generator_set_root (generator, root);
+  json = json_generator_to_data (generator, &json_len);
+
+  create_nonce (nonce);
+
+  g_byte_array_append (data, (const guint8 *)TOKEN_CACHE_MAGIC, TOKEN_CACHE_MAGIC_LEN);
+  g_byte_array_append (data, nonce, TOKEN_CACHE_NONCE_LEN);
+  g_byte_array_append (data, (const guint8 *)json, json_len);
+  memset (json, 0, json_len);
+
+  apply_key_stream (self, nonce, data->data + TOKEN_CACHE_MAGIC_LEN + TOKEN_CACHE_NONCE_LEN, json_len);
+
+  hmac_sha256 (self->authentication_key, TOKEN_CACHE_DIGEST_LEN, data->data, data->len, NULL, 0, digest);
+  g_byte_array_append (data, digest, TOKEN_CACHE_DIGEST_LEN);
+
+  g_mutex_lock (&self->mutex);
+  ret = g_file_set_contents_full (path, (const char *)data->data, data->len, G_FILE_SET_CONTENTS_CONSISTENT, 0600, error);
+  g_mutex_unlock (&self->mutex);
+
+  return ret;
+}
+
+static void
+file_token_cache_remove (MsgTokenCache *cache,
+                         const char    *account)
+{
+  MsgFileTokenCache *self = MSG_FILE_TOKEN_CACHE (cache);
+  g_autofree char *path = get_path (self, account);
+
+  g_mutex_lock (&self->mutex);
+  g_unlink (path);
+  g_mutex_unlock (&self->mutex);
+}
+
+static void
+token_cache_init (MsgTokenCacheInterface *iface)
+{
+  iface->load = file_token_cache_load;
+  iface->store = file_token_cache_store;
+  iface->remove = file_token_cache_remove;
+}
+
+static void
+msg_file_token_cache_finalize (GObject *object)
+{
+  MsgFileTokenCache *self = MSG_FILE_TOKEN_CACHE (object);
+
+  memset (self->encryption_key, 0, sizeof (self->encryption_key));
+  memset (self->authentication_key, 0, sizeof (self->authentication_key));
+  g_free (self->directory);
+  g_mutex_clear (&self->mutex);
+
+  G_OBJECT_CLASS (msg_file_token_cache_parent_class)->finalize (object);
+}
+
+static void
+msg_file_token_cache_class_init (MsgFileTokenCacheClass *class)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (class);
+
+  object_class->finalize = msg_file_token_cache_finalize;
+}
+
+static void
+msg_file_token_cache_init (MsgFileTokenCache *self)
+{
+  g_mutex_init (&self->mutex);
+}
+
+/**
+ * msg_file_token_cache_new:
+ * @directory: directory holding the token files
+ * @key: secret key used to encrypt the token files
+ *
+ * Creates a new #MsgFileTokenCache. @directory is created with private
+ * permissions if it does not exist. @key should be at least 32 random
+ * bytes and has to be stored safely by the caller, e.g. in the keyring.
+ *
+ * Returns: (transfer full): a new #MsgFileTokenCache
+ */
+MsgFileTokenCache *
+msg_file_token_cache_new (const char *directory,
+                          GBytes     *key)
+{
+  MsgFileTokenCache *self;
+  const guint8 *key_data;
+  gsize key_len;
+
+  g_return_val_if_fail (directory != NULL, NULL);
+  g_return_val_if_fail (key != NULL && g_bytes_get_size (key) > 0, NULL);
+
+  self = g_object_new (MSG_TYPE_FILE_TOKEN_CACHE, NULL);
+  self->directory = g_strdup (directory);
+
+  if (g_mkdir_with_parents (directory, 0700) != 0)
+    g_warning ("Could not create token cache directory %s: %s", directory, g_strerror (errno));
+
+  key_data = g_bytes_get_data (key, &key_len);
+  hmac_sha256 (key_data, key_len, (const guint8 *)"encryption", strlen ("encryption"), NULL, 0, self->encryption_key);
+  hmac_sha256 (key_data, key_len, (const guint8 *)"authentication", strlen ("authentication"), NULL, 0, self->authentication_key);
+
+  return self;
+}
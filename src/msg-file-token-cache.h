@@ -0,0 +1,34 @@
+/* Copyright 2024 Jan-Michael Brummer <jan-michael.brummer1@volkswagen.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <glib-object.h>
+
+#include "msg-token-cache.h"
+
+G_BEGIN_DECLS
+
+#define MSG_TYPE_FILE_TOKEN_CACHE (msg_file_token_cache_get_type ())
+
+G_DECLARE_FINAL_TYPE (MsgFileTokenCache, msg_file_token_cache, MSG, FILE_TOKEN_CACHE, GObject);
+
+MsgFileTokenCache *
+msg_file_token_cache_new (const char *directory,
+                          GBytes     *key);
+
+G_END_DECLS
@@ -19,6 +19,7 @@
 #include <glib.h>
 #include <libsoup/soup.h>
 
+#include "msg-auth-header.h"
 #include "msg-authorizer.h"
 #include "msg-goa-authorizer.h"
 
@@ -36,10 +37,18 @@ struct _MsgGoaAuthorizerPrivate {
   GMutex mutex;
   GoaObject *goa_object;
   char *access_token;
-
-  SoupSession *session;
+  /* Pre-formatted header of access_token, read without lock */
+  MsgAuthHeader *auth_header;
+  /* Monotonic time in microseconds, 0 if the token must be revalidated */
+  gint64 expires_at;
+  gulong attention_needed_id;
+  gulong account_changed_id;
+  gulong oauth2_based_changed_id;
 };
 
+/* Cached access tokens are revalidated this long before they expire */
+#define TOKEN_EXPIRY_MARGIN (5 * 60 * G_USEC_PER_SEC)
+
 enum {
   PROP_0,
   PROP_GOA_OBJECT
@@ -52,26 +61,70 @@ G_DEFINE_TYPE_WITH_CODE (MsgGoaAuthorizer, msg_goa_authorizer, G_TYPE_OBJECT,
                          G_IMPLEMENT_INTERFACE (MSG_TYPE_AUTHORIZER,
                                                 msg_authorizer_interface_init));
 
+/* Must be called locked */
 static void
-msg_goa_authorizer_process_message (MsgAuthorizer *iface,
-                                    SoupMessage   *message)
+set_access_token_locked (MsgGoaAuthorizerPrivate *priv,
+                         char                    *access_token,
+                         int                      expires_in)
 {
-  MsgGoaAuthorizer *self = MSG_GOA_AUTHORIZER (iface);
-  MsgGoaAuthorizerPrivate *priv = self->priv;
-  g_autofree char *auth_value = NULL;
+  g_free (priv->access_token);
+  priv->access_token = access_token;
+  msg_auth_header_set_token (priv->auth_header, access_token);
+
+  /* GOA reports 0 if the lifetime is unknown, which is not cached */
+  priv->expires_at = (access_token && expires_in > 0) ? g_get_monotonic_time () + expires_in * G_USEC_PER_SEC : 0;
+}
+
+static gboolean
+has_valid_token (MsgGoaAuthorizerPrivate *priv)
+{
+  gboolean valid;
 
   g_mutex_lock (&priv->mutex);
+  valid = priv->access_token && priv->expires_at - TOKEN_EXPIRY_MARGIN > g_get_monotonic_time ();
+  g_mutex_unlock (&priv->mutex);
 
-  if (priv->access_token == NULL)
-    goto out;
+  return valid;
+}
 
-  auth_value = g_strconcat ("Bearer ", priv->access_token, NULL);
-  soup_message_headers_append (soup_message_get_request_headers (message), "Authorization", auth_value);
+static void
+msg_goa_authorizer_invalidate_authorization (MsgAuthorizer *iface)
+{
+  MsgGoaAuthorizerPrivate *priv = MSG_GOA_AUTHORIZER (iface)->priv;
 
-out:
+  g_mutex_lock (&priv->mutex);
+  priv->expires_at = 0;
   g_mutex_unlock (&priv->mutex);
 }
 
+/* Credentials changed or need attention, so revalidate on next refresh */
+static void
+attention_needed_cb (__attribute__ ((unused)) GObject    *object,
+                     __attribute__ ((unused)) GParamSpec *pspec,
+                     gpointer                             user_data)
+{
+  msg_goa_authorizer_invalidate_authorization (MSG_AUTHORIZER (user_data));
+}
+
+/* Same as GoaClient::account-changed, which is emitted for these proxies */
+static void
+account_changed_cb (__attribute__ ((unused)) GDBusProxy *proxy,
+                    __attribute__ ((unused)) GVariant   *changed_properties,
+                    __attribute__ ((unused)) GStrv       invalidated_properties,
+                    gpointer                             user_data)
+{
+  msg_goa_authorizer_invalidate_authorization (MSG_AUTHORIZER (user_data));
+}
+
+static void
+msg_goa_authorizer_process_message (MsgAuthorizer *iface,
+                                    SoupMessage   *message)
+{
+  MsgGoaAuthorizer *self = MSG_GOA_AUTHORIZER (iface);
+
+  msg_auth_header_apply (self->priv->auth_header, message);
+}
+
 static gboolean
 msg_goa_authorizer_refresh_authorization (MsgAuthorizer  *iface,
                                           GCancellable   *cancellable,
@@ -81,30 +134,118 @@ msg_goa_authorizer_refresh_authorization (MsgAuthorizer  *iface,
   MsgGoaAuthorizerPrivate *priv = self->priv;
   GoaAccount *account;
   GoaOAuth2Based *oauth2_based;
+  char *access_token = NULL;
+  int expires_in = 0;
   gboolean ret_val = FALSE;
 
-  g_mutex_lock (&priv->mutex);
-
-  g_clear_pointer (&priv->access_token, g_free);
+  /* Skip both D-Bus round trips while the cached token is valid */
+  if (has_valid_token (priv))
+    return TRUE;
 
   account = goa_object_peek_account (priv->goa_object);
   oauth2_based = goa_object_peek_oauth2_based (priv->goa_object);
 
+  /* The D-Bus calls are made unlocked, so that signing requests with
+   * the current token does not block on them */
   if (!goa_account_call_ensure_credentials_sync (account, NULL, cancellable, error))
     goto out;
 
-  if (!goa_oauth2_based_call_get_access_token_sync (oauth2_based, &priv->access_token, NULL, cancellable, error))
+  if (!goa_oauth2_based_call_get_access_token_sync (oauth2_based, &access_token, &expires_in, cancellable, error))
     goto out;
 
   ret_val = TRUE;
 
 out:
-
+  g_mutex_lock (&priv->mutex);
+  set_access_token_locked (priv, access_token, expires_in);
   g_mutex_unlock (&priv->mutex);
+
   return ret_val;
 }
 
 
+static void
+get_access_token_cb (GObject      *source,
+                     GAsyncResult *result,
+                     gpointer      user_data)
+{
+  g_autoptr (GTask) task = user_data;
+  MsgGoaAuthorizer *self = g_task_get_source_object (task);
+  MsgGoaAuthorizerPrivate *priv = self->priv;
+  char *access_token = NULL;
+  int expires_in = 0;
+  GError *error = NULL;
+
+  goa_oauth2_based_call_get_access_token_finish (GOA_OAUTH2_BASED (source), &access_token, &expires_in, result, &error);
+
+  g_mutex_lock (&priv->mutex);
+  set_access_token_locked (priv, access_token, expires_in);
+  g_mutex_unlock (&priv->mutex);
+
+  if (error)
+    g_task_return_error (task, error);
+  else
+    g_task_return_boolean (task, TRUE);
+}
+
+static void
+ensure_credentials_cb (GObject      *source,
+                       GAsyncResult *result,
+                       gpointer      user_data)
+{
+  g_autoptr (GTask) task = user_data;
+  MsgGoaAuthorizer *self = g_task_get_source_object (task);
+  GError *error = NULL;
+
+  if (!goa_account_call_ensure_credentials_finish (GOA_ACCOUNT (source), NULL, result, &error)) {
+    g_mutex_lock (&self->priv->mutex);
+    set_access_token_locked (self->priv, NULL, 0);
+    g_mutex_unlock (&self->priv->mutex);
+
+    g_task_return_error (task, error);
+    return;
+  }
+
+  goa_oauth2_based_call_get_access_token (goa_object_peek_oauth2_based (self->priv->goa_object),
+                                          g_task_get_cancellable (task),
+                                          get_access_token_cb,
+                                          g_object_ref (task));
+}
+
+static void
+msg_goa_authorizer_refresh_authorization_async (MsgAuthorizer       *iface,
+                                                GCancellable        *cancellable,
+                                                GAsyncReadyCallback  callback,
+                                                gpointer             user_data)
+{
+  MsgGoaAuthorizer *self = MSG_GOA_AUTHORIZER (iface);
+  g_autoptr (GTask) task = NULL;
+
+  task = g_task_new (self, cancellable, callback, user_data);
+  g_task_set_source_tag (task, msg_goa_authorizer_refresh_authorization_async);
+
+  if (has_valid_token (self->priv)) {
+    g_task_return_boolean (task, TRUE);
+    return;
+  }
+
+  goa_account_call_ensure_credentials (goa_object_peek_account (self->priv->goa_object),
+                                       cancellable,
+                                       ensure_credentials_cb,
+                                       g_object_ref (task));
+}
+
+static gboolean
+msg_goa_authorizer_refresh_authorization_finish (MsgAuthorizer  *iface,
+                                                 GAsyncResult   *result,
+                                                 GError        **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, iface), FALSE);
+  g_return_val_if_fail (g_async_result_is_tagged (result, msg_goa_authorizer_refresh_authorization_async), FALSE);
+
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
 static void
 msg_goa_authorizer_set_goa_object (MsgGoaAuthorizer *self,
                                    GoaObject        *goa_object)
@@ -122,6 +263,28 @@ msg_goa_authorizer_set_goa_object (MsgGoaAuthorizer *self,
 
   g_object_ref (goa_object);
   self->priv->goa_object = goa_object;
+  self->priv->attention_needed_id = g_signal_connect_object (account,
+                                                             "notify::attention-needed",
+                                                             G_CALLBACK (attention_needed_cb),
+                                                             self,
+                                                             0);
+
+  if (G_IS_DBUS_PROXY (account)) {
+    self->priv->account_changed_id = g_signal_connect_object (account,
+                                                              "g-properties-changed",
+                                                              G_CALLBACK (account_changed_cb),
+                                                              self,
+                                                              0);
+  }
+
+  if (G_IS_DBUS_PROXY (oauth2_based)) {
+    self->priv->oauth2_based_changed_id = g_signal_connect_object (oauth2_based,
+                                                                   "g-properties-changed",
+                                                                   G_CALLBACK (account_changed_cb),
+                                                                   self,
+                                                                   0);
+  }
+
   g_object_notify (G_OBJECT (self), "goa-object");
 }
 
@@ -130,6 +293,11 @@ msg_goa_authorizer_dispose (GObject *object)
 {
   MsgGoaAuthorizer *self = MSG_GOA_AUTHORIZER (object);
 
+  if (self->priv->goa_object) {
+    g_clear_signal_handler (&self->priv->attention_needed_id, goa_object_peek_account (self->priv->goa_object));
+    g_clear_signal_handler (&self->priv->account_changed_id, goa_object_peek_account (self->priv->goa_object));
+    g_clear_signal_handler (&self->priv->oauth2_based_changed_id, goa_object_peek_oauth2_based (self->priv->goa_object));
+  }
   g_clear_object (&self->priv->goa_object);
 
   G_OBJECT_CLASS (msg_goa_authorizer_parent_class)->dispose (object);
@@ -143,6 +311,7 @@ msg_goa_authorizer_finalize (GObject *object)
 
   g_mutex_clear (&priv->mutex);
   g_free (priv->access_token);
+  msg_auth_header_free (priv->auth_header);
 
   G_OBJECT_CLASS (msg_goa_authorizer_parent_class)->finalize (object);
 }
@@ -190,8 +359,7 @@ msg_goa_authorizer_init (MsgGoaAuthorizer *self)
 {
   self->priv = msg_goa_authorizer_get_instance_private (self);
   g_mutex_init (&self->priv->mutex);
-
-  self->priv->session = soup_session_new ();
+  self->priv->auth_header = msg_auth_header_new ();
 }
 
 static void
@@ -218,6 +386,9 @@ msg_authorizer_interface_init (MsgAuthorizerInterface *iface)
 {
   iface->process_request = msg_goa_authorizer_process_message;
   iface->refresh_authorization = msg_goa_authorizer_refresh_authorization;
+  iface->invalidate_authorization = msg_goa_authorizer_invalidate_authorization;
+  iface->refresh_authorization_async = msg_goa_authorizer_refresh_authorization_async;
+  iface->refresh_authorization_finish = msg_goa_authorizer_refresh_authorization_finish;
 }
 
 /**
@@ -25,7 +25,9 @@
 #include <libsoup/soup.h>
 
 #include "msg-input-stream.h"
+#include "msg-parallel-download.h"
 #include "msg-service.h"
+#include "msg-service-stats.h"
 
 static void msg_input_stream_seekable_iface_init (GSeekableIface *seekable_iface);
 
@@ -38,6 +40,13 @@ struct MsgInputStreamPrivate {
   char *range;
   goffset request_offset;
   goffset offset;
+
+  /* Parallel mode, enabled with a concurrency above 1 */
+  guint concurrency;
+  gsize segment_size;
+  MsgParallelDownload *download;
+  GBytes *segment;
+  gsize segment_offset;
 };
 
 G_DEFINE_TYPE_WITH_CODE (MsgInputStream, msg_input_stream, G_TYPE_INPUT_STREAM,
@@ -62,6 +71,8 @@ msg_input_stream_finalize (GObject *object)
   g_clear_object (&priv->msg);
   g_clear_object (&priv->stream);
   g_free (priv->range);
+  g_clear_pointer (&priv->download, msg_parallel_download_free);
+  g_clear_pointer (&priv->segment, g_bytes_unref);
 
   G_OBJECT_CLASS (msg_input_stream_parent_class)->finalize (object);
 }
@@ -115,6 +126,7 @@ msg_input_stream_ensure_msg (GInputStream *stream)
     priv->msg = msg_service_build_message (MSG_SERVICE (priv->service), "GET", priv->uri, NULL, FALSE);
     g_signal_connect (G_OBJECT (priv->msg), "restarted", G_CALLBACK (on_restarted), NULL);
     msg_authorizer_process_request (msg_service_get_authorizer (priv->service), priv->msg);
+    msg_service_track_message (priv->service, priv->msg);
 
     priv->offset = 0;
   }
@@ -152,6 +164,10 @@ typedef struct {
   gsize count;
 } ReadAfterSendData;
 
+static void read_throttle_callback (GObject      *object,
+                                    GAsyncResult *result,
+                                    gpointer      user_data);
+
 static void
 read_send_callback (GObject      *object,
                     GAsyncResult *result,
@@ -169,6 +185,13 @@ read_send_callback (GObject      *object,
     g_object_unref (task);
     return;
   }
+  if (msg_service_throttle_message (priv->service, priv->msg)){
+    g_input_stream_close (priv->stream, NULL, NULL);
+    g_clear_object (&priv->stream);
+    msg_service_wait_for_throttle_async (priv->service, g_task_get_cancellable (task),
+                                         read_throttle_callback, task);
+    return;
+  }
   if (!SOUP_STATUS_IS_SUCCESSFUL (soup_message_get_status (priv->msg))){
     if (soup_message_get_status (priv->msg) == SOUP_STATUS_REQUESTED_RANGE_NOT_SATISFIABLE){
       g_input_stream_close (priv->stream, NULL, NULL);
@@ -206,6 +229,95 @@ read_send_callback (GObject      *object,
                              read_callback, task);
 }
 
+static void
+read_throttle_callback (GObject      *object,
+                        GAsyncResult *result,
+                        gpointer      user_data)
+{
+  GTask *task = user_data;
+  GInputStream *vfsstream = g_task_get_source_object (task);
+  MsgInputStreamPrivate *priv = MSG_INPUT_STREAM (vfsstream)->priv;
+  GError *error = NULL;
+
+  if (!msg_service_wait_for_throttle_finish (MSG_SERVICE (object), result, &error)){
+    g_task_return_error (task, error);
+    g_object_unref (task);
+    return;
+  }
+
+  soup_session_send_async (msg_service_get_session (priv->service), priv->msg, G_PRIORITY_DEFAULT,
+                           g_task_get_cancellable (task), read_send_callback, task);
+}
+
+/* Reads from the segments of the parallel download, in order */
+static gssize
+msg_input_stream_read_parallel (GInputStream  *stream,
+                                void          *buffer,
+                                gsize          count,
+                                GCancellable  *cancellable,
+                                GError       **error)
+{
+  MsgInputStreamPrivate *priv = MSG_INPUT_STREAM (stream)->priv;
+  const guint8 *data;
+  gsize size = 0;
+
+  if (!priv->download) {
+    priv->download = msg_parallel_download_new (priv->service, priv->uri, priv->request_offset,
+                                                priv->concurrency, priv->segment_size, NULL);
+
+    if (!msg_parallel_download_start (priv->download, cancellable, error)) {
+      g_clear_pointer (&priv->download, msg_parallel_download_free);
+      return -1;
+    }
+  }
+
+  if (priv->segment)
+    size = g_bytes_get_size (priv->segment);
+
+  if (priv->segment_offset == size) {
+    GError *local_error = NULL;
+
+    g_clear_pointer (&priv->segment, g_bytes_unref);
+    priv->segment_offset = 0;
+
+    priv->segment = msg_parallel_download_next (priv->download, cancellable, &local_error);
+    if (!priv->segment) {
+      if (!local_error)
+        return 0;
+
+      g_propagate_error (error, local_error);
+      return -1;
+    }
+
+    size = g_bytes_get_size (priv->segment);
+  }
+
+  data = g_bytes_get_data (priv->segment, NULL);
+  count = MIN (count, size - priv->segment_offset);
+  memcpy (buffer, data + priv->segment_offset, count);
+  priv->segment_offset += count;
+  priv->offset += count;
+
+  return count;
+}
+
+static void
+read_parallel_thread (GTask        *task,
+                      gpointer      source_object,
+                      gpointer      task_data,
+                      GCancellable *cancellable)
+{
+  ReadAfterSendData *rasd = task_data;
+  GError *error = NULL;
+  gssize nread;
+
+  nread = msg_input_stream_read_parallel (G_INPUT_STREAM (source_object), rasd->buffer, rasd->count, cancellable, &error);
+  if (nread >= 0)
+    g_task_return_int (task, nread);
+  else
+    g_task_return_error (task, error);
+}
+
 static gssize
 msg_input_stream_read_fn (GInputStream  *stream,
                           void          *buffer,
@@ -215,13 +327,25 @@ msg_input_stream_read_fn (GInputStream  *stream,
 {
   MsgInputStreamPrivate *priv = MSG_INPUT_STREAM (stream)->priv;
 
+  if (priv->concurrency > 1)
+    return msg_input_stream_read_parallel (stream, buffer, count, cancellable, error);
+
   if (!priv->stream) {
     msg_input_stream_ensure_msg (stream);
 
 retry:
+    if (!msg_service_wait_for_throttle (priv->service, cancellable, error))
+      return -1;
+
     priv->stream = soup_session_send (msg_service_get_session (priv->service), priv->msg, cancellable, error);
-    if (msg_service_handle_rate_limiting (priv->msg))
+    if (!priv->stream)
+      return -1;
+
+    if (msg_service_throttle_message (priv->service, priv->msg)) {
+      g_input_stream_close (priv->stream, NULL, NULL);
+      g_clear_object (&priv->stream);
       goto retry;
+    }
   }
 
   return g_input_stream_read (priv->stream, buffer, count, cancellable, error);
@@ -242,6 +366,20 @@ msg_input_stream_read_async (GInputStream        *stream,
   task = g_task_new (stream, cancellable, callback, user_data);
   g_task_set_priority (task, io_priority);
 
+  /* Segments are waited for on a thread */
+  if (priv->concurrency > 1) {
+    ReadAfterSendData *rasd;
+
+    rasd = g_new (ReadAfterSendData, 1);
+    rasd->buffer = buffer;
+    rasd->count = count;
+    g_task_set_task_data (task, rasd, g_free);
+
+    g_task_run_in_thread (task, read_parallel_thread);
+    g_object_unref (task);
+    return;
+  }
+
   if (!priv->stream) {
     ReadAfterSendData *rasd;
 
@@ -251,8 +389,7 @@ msg_input_stream_read_async (GInputStream        *stream,
     g_task_set_task_data (task, rasd, g_free);
 
     msg_input_stream_ensure_msg (stream);
-    soup_session_send_async (msg_service_get_session (priv->service), priv->msg, G_PRIORITY_DEFAULT,
-                             cancellable, read_send_callback, task);
+    msg_service_wait_for_throttle_async (priv->service, cancellable, read_throttle_callback, task);
     return;
   }
 
@@ -298,6 +435,9 @@ msg_input_stream_close_async (GInputStream        *stream,
   task = g_task_new (stream, cancellable, callback, user_data);
   g_task_set_priority (task, io_priority);
 
+  g_clear_pointer (&priv->download, msg_parallel_download_free);
+  g_clear_pointer (&priv->segment, g_bytes_unref);
+
   if (priv->stream == NULL){
     g_task_return_boolean (task, TRUE);
     return;
@@ -341,7 +481,10 @@ msg_input_stream_seek (GSeekable                             *seekable,
   GInputStream *stream = G_INPUT_STREAM (seekable);
   MsgInputStreamPrivate *priv = MSG_INPUT_STREAM (seekable)->priv;
 
-  if (type == G_SEEK_END && priv->msg){
+  if (type == G_SEEK_END && priv->download){
+    type = G_SEEK_SET;
+    offset = msg_parallel_download_get_size (priv->download) + offset;
+  } else if (type == G_SEEK_END && priv->msg){
     goffset content_length = soup_message_headers_get_content_length (soup_message_get_response_headers (priv->msg));
 
     if (content_length){
@@ -371,6 +514,9 @@ msg_input_stream_seek (GSeekable                             *seekable,
   }
 
   g_clear_pointer (&priv->range, g_free);
+  g_clear_pointer (&priv->download, msg_parallel_download_free);
+  g_clear_pointer (&priv->segment, g_bytes_unref);
+  priv->segment_offset = 0;
 
   switch (type){
     case G_SEEK_CUR:
@@ -425,6 +571,35 @@ msg_input_stream_get_message (GInputStream *stream)
   return g_object_ref (priv->msg);
 }
 
+/**
+ * msg_input_stream_set_parallel:
+ * @stream: a #GInputStream
+ * @concurrency: number of byte ranges fetched at the same time, 1 to
+ *   download with a single request
+ * @segment_size: bytes per range, or 0 for
+ *   %MSG_INPUT_STREAM_DEFAULT_SEGMENT_SIZE
+ *
+ * Enables the parallel download mode for large files. The resource is
+ * split into byte ranges of @segment_size, which are fetched over up to
+ * @concurrency connections at once and reassembled in order. Requests
+ * after the first one go to the redirected download url directly.
+ *
+ * At most twice @concurrency segments are held in memory, while the
+ * reader lags behind. Must be called before the first read.
+ */
+void
+msg_input_stream_set_parallel (GInputStream *stream,
+                               guint         concurrency,
+                               gsize         segment_size)
+{
+  MsgInputStreamPrivate *priv = MSG_INPUT_STREAM (stream)->priv;
+
+  g_return_if_fail (priv->msg == NULL && priv->download == NULL);
+
+  priv->concurrency = concurrency;
+  priv->segment_size = segment_size ? segment_size : MSG_INPUT_STREAM_DEFAULT_SEGMENT_SIZE;
+}
+
 static void
 msg_input_stream_class_init (MsgInputStreamClass *klass)
 {
@@ -30,6 +30,8 @@ G_BEGIN_DECLS
 #define MSG_IS_INPUT_STREAM_CLASS(k)  (G_TYPE_CHECK_CLASS_TYPE ((k), MSG_TYPE_INPUT_STREAM))
 #define MSG_INPUT_STREAM_GET_CLASS(o) (G_TYPE_INSTANCE_GET_CLASS ((o), MSG_TYPE_INPUT_STREAM, MsgInputStreamClass))
 
+#define MSG_INPUT_STREAM_DEFAULT_SEGMENT_SIZE (8 * 1024 * 1024)
+
 typedef struct MsgInputStream         MsgInputStream;
 typedef struct MsgInputStreamPrivate  MsgInputStreamPrivate;
 typedef struct MsgInputStreamClass    MsgInputStreamClass;
@@ -70,5 +72,9 @@ gboolean      msg_input_stream_send_finish (GInputStream  *stream,
 
 SoupMessage  *msg_input_stream_get_message (GInputStream         *stream);
 
+void          msg_input_stream_set_parallel (GInputStream *stream,
+                                             guint         concurrency,
+                                             gsize         segment_size);
+
 G_END_DECLS
 
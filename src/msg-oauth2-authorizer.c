@@ -6,13 +6,18 @@
 
 #include <glib/gi18n-lib.h>
 
+#include "msg-auth-header.h"
 #include "msg-authorizer.h"
 #include "msg-oauth2-authorizer.h"
 #include "msg-error.h"
 #include "msg-service.h"
+#include "msg-token-cache.h"
 
 static void authorizer_init (MsgAuthorizerInterface *iface);
 
+/* Access tokens are refreshed this long before they expire */
+#define TOKEN_EXPIRY_MARGIN (5 * 60 * G_USEC_PER_SEC)
+
 struct _MsgOAuth2AuthorizerPrivate {
   SoupSession *session;
 
@@ -22,13 +27,21 @@ struct _MsgOAuth2AuthorizerPrivate {
   GMutex mutex;
 
   char *access_token;
+  /* Pre-formatted header of access_token, read without lock */
+  MsgAuthHeader *auth_header;
   char *refresh_token;
+  /* Wall clock time in microseconds, 0 if unknown */
+  gint64 expires_at;
+
+  MsgTokenCache *token_cache;
+  char *account;
 };
 
 enum {
   PROP_CLIENT_ID = 1,
   PROP_REDIRECT_URI,
   PROP_REFRESH_TOKEN,
+  PROP_SESSION,
 };
 
 G_DEFINE_TYPE_WITH_CODE (MsgOAuth2Authorizer, msg_oauth2_authorizer,
@@ -59,6 +72,9 @@ get_property (GObject    *object,
       g_value_set_string (value, priv->refresh_token);
       g_mutex_unlock (&priv->mutex);
       break;
+    case PROP_SESSION:
+      g_value_set_object (value, priv->session);
+      break;
     default:
       /* We don't have any other property... */
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
@@ -82,8 +98,10 @@ msg_oauth2_authorizer_set_refresh_token (MsgOAuth2Authorizer *self,
   }
 
   g_clear_pointer (&priv->access_token, g_free);
+  msg_auth_header_set_token (priv->auth_header, NULL);
   g_clear_pointer (&priv->refresh_token, g_free);
   priv->refresh_token = g_strdup (refresh_token);
+  priv->expires_at = 0;
 
   g_mutex_unlock (&priv->mutex);
 
@@ -110,12 +128,27 @@ set_property (GObject      *object,
       msg_oauth2_authorizer_set_refresh_token (self,
                                                g_value_get_string (value));
       break;
+    case PROP_SESSION:
+      priv->session = g_value_dup_object (value);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
       break;
   }
 }
 
+static void
+constructed (GObject *object)
+{
+  MsgOAuth2Authorizer *self = MSG_OAUTH2_AUTHORIZER (object);
+  MsgOAuth2AuthorizerPrivate *priv = msg_oauth2_authorizer_get_instance_private (self);
+
+  G_OBJECT_CLASS (msg_oauth2_authorizer_parent_class)->constructed (object);
+
+  if (!priv->session)
+    priv->session = soup_session_new ();
+}
+
 static void
 dispose (GObject *object)
 {
@@ -123,6 +156,7 @@ dispose (GObject *object)
   MsgOAuth2AuthorizerPrivate *priv = msg_oauth2_authorizer_get_instance_private (self);
 
   g_clear_object (&priv->session);
+  g_clear_object (&priv->token_cache);
 
   G_OBJECT_CLASS (msg_oauth2_authorizer_parent_class)->dispose (object);
 }
@@ -135,11 +169,14 @@ finalize (GObject *object)
 
   g_free (priv->client_id);
   g_free (priv->redirect_uri);
+  g_free (priv->account);
 
   g_mutex_lock (&priv->mutex);
   g_free (priv->access_token);
   g_mutex_unlock (&priv->mutex);
 
+  msg_auth_header_free (priv->auth_header);
+
   g_free (priv->refresh_token);
 
   g_mutex_clear (&priv->mutex);
@@ -155,6 +192,7 @@ msg_oauth2_authorizer_class_init (MsgOAuth2AuthorizerClass *klass)
 
   gobject_class->get_property = get_property;
   gobject_class->set_property = set_property;
+  gobject_class->constructed = constructed;
   gobject_class->dispose = dispose;
   gobject_class->finalize = finalize;
 
@@ -178,6 +216,13 @@ msg_oauth2_authorizer_class_init (MsgOAuth2AuthorizerClass *klass)
                                                         "The server provided refresh token.",
                                                         NULL,
                                                         G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_SESSION,
+                                   g_param_spec_object ("session",
+                                                        "Session",
+                                                        "The soup session used for token requests, e.g. one shared with the services.",
+                                                        SOUP_TYPE_SESSION,
+                                                        G_PARAM_CONSTRUCT_ONLY | G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
 }
 
 static void
@@ -186,20 +231,17 @@ msg_oauth2_authorizer_init (MsgOAuth2Authorizer *self)
   MsgOAuth2AuthorizerPrivate *priv = msg_oauth2_authorizer_get_instance_private (self);
 
   g_mutex_init (&priv->mutex);
-  priv->session = soup_session_new ();
+  priv->auth_header = msg_auth_header_new ();
 }
 
 static void
-sign_message_locked (MsgOAuth2Authorizer *self,
-                     SoupMessage         *message,
-                     const char          *access_token)
+process_request (MsgAuthorizer *self,
+                 SoupMessage   *message)
 {
+  MsgOAuth2AuthorizerPrivate *priv = msg_oauth2_authorizer_get_instance_private (MSG_OAUTH2_AUTHORIZER (self));
   GUri *message_uri;
-  g_autofree char *auth_header = NULL;
 
-  g_return_if_fail (MSG_IS_OAUTH2_AUTHORIZER (self));
   g_return_if_fail (SOUP_IS_MESSAGE (message));
-  g_return_if_fail (access_token != NULL && *access_token != '\0');
 
   message_uri = soup_message_get_uri (message);
 
@@ -208,26 +250,8 @@ sign_message_locked (MsgOAuth2Authorizer *self,
     return;
   }
 
-  /* Add the authorisation header. */
-  auth_header = g_strdup_printf ("Bearer %s", access_token);
-  soup_message_headers_append (soup_message_get_request_headers (message), "Authorization", auth_header);
-}
-
-static void
-process_request (MsgAuthorizer *self,
-                 SoupMessage   *message)
-{
-  MsgOAuth2AuthorizerPrivate *priv = msg_oauth2_authorizer_get_instance_private (MSG_OAUTH2_AUTHORIZER (self));
-
-  g_mutex_lock (&priv->mutex);
-
-  g_assert ((priv->access_token == NULL) || (priv->refresh_token != NULL));
-
-  if (priv->access_token != NULL) {
-    sign_message_locked (MSG_OAUTH2_AUTHORIZER (self), message, priv->access_token);
-  }
-
-  g_mutex_unlock (&priv->mutex);
+  /* Add the authorisation header without locking, see MsgAuthHeader */
+  msg_auth_header_apply (priv->auth_header, message);
 }
 
 static void
@@ -240,6 +264,7 @@ parse_grant_response (MsgOAuth2Authorizer  *self,
   JsonNode *root_node;
   JsonObject *root_object;
   const char *access_token = NULL, *refresh_token = NULL;
+  gint64 expires_in = 0;
   GError *child_error = NULL;
   const char *content = NULL;
   gsize len;
@@ -280,6 +305,15 @@ parse_grant_response (MsgOAuth2Authorizer  *self,
     refresh_token = json_object_get_string_member (root_object,
                                                    "refresh_token");
   }
+  if (json_object_has_member (root_object, "expires_in")) {
+    JsonNode *node = json_object_get_member (root_object, "expires_in");
+
+    /* Some endpoints send the lifetime as string */
+    if (json_node_get_value_type (node) == G_TYPE_STRING)
+      expires_in = g_ascii_strtoll (json_node_get_string (node), NULL, 10);
+    else if (JSON_NODE_HOLDS_VALUE (node))
+      expires_in = json_node_get_int (node);
+  }
 
   /* Always require an access token. */
   if (access_token == NULL || *access_token == '\0') {
@@ -317,6 +351,8 @@ done:
 
   g_free (priv->access_token);
   priv->access_token = g_strdup (access_token);
+  msg_auth_header_set_token (priv->auth_header, access_token);
+  priv->expires_at = (access_token && expires_in > 0) ? g_get_real_time () + expires_in * G_USEC_PER_SEC : 0;
 
   if (refresh_token != NULL) {
     g_free (priv->refresh_token);
@@ -424,23 +460,16 @@ authorizer_message_finished (__attribute__ ((unused)) SoupMessage *msg,
   g_bytes_unref (body);
 }
 
+/* Builds a POST to the token endpoint, must be called locked */
 static SoupMessage *
-build_authorization_message (MsgAuthorizer *self)
+build_token_message (MsgOAuth2Authorizer *self,
+                     char                *request_body)
 {
-  MsgOAuth2AuthorizerPrivate *priv;
+  MsgOAuth2AuthorizerPrivate *priv = msg_oauth2_authorizer_get_instance_private (self);
   SoupMessage *message = NULL;
   GUri *_uri = NULL;
-  gchar *request_body;
   GBytes *body;
 
-  priv = msg_oauth2_authorizer_get_instance_private (MSG_OAUTH2_AUTHORIZER (self));
-
-  /* Prepare the request */
-  request_body = soup_form_encode ("client_id", priv->client_id,
-                                   "refresh_token", priv->refresh_token,
-                                   "grant_type", "refresh_token",
-                                   NULL);
-
   /* Build the message */
   _uri = g_uri_build (SOUP_HTTP_URI_FLAGS,
                       "https", NULL, "login.microsoftonline.com",
@@ -461,45 +490,233 @@ build_authorization_message (MsgAuthorizer *self)
   return message;
 }
 
+static SoupMessage *
+build_authorization_message (MsgAuthorizer *self)
+{
+  MsgOAuth2AuthorizerPrivate *priv;
+  gchar *request_body;
+
+  priv = msg_oauth2_authorizer_get_instance_private (MSG_OAUTH2_AUTHORIZER (self));
+
+  /* Prepare the request */
+  request_body = soup_form_encode ("client_id", priv->client_id,
+                                   "refresh_token", priv->refresh_token,
+                                   "grant_type", "refresh_token",
+                                   NULL);
+
+  return build_token_message (MSG_OAUTH2_AUTHORIZER (self), request_body);
+}
+
+static SoupMessage *
+build_request_authorization_message (MsgOAuth2Authorizer *self,
+                                     const char          *authorization_code)
+{
+  MsgOAuth2AuthorizerPrivate *priv = msg_oauth2_authorizer_get_instance_private (self);
+  g_autofree char *scope = g_strdup ("files.readwrite offline_access");
+  char *request_body;
+
+  request_body = soup_form_encode ("client_id", priv->client_id,
+                                   "code", authorization_code,
+                                   "redirect_uri", priv->redirect_uri,
+                                   "grant_type", "authorization_code",
+                                   "scope", scope,
+                                   NULL);
+
+  return build_token_message (self, request_body);
+}
+
+/* Persists the current tokens in the token cache, if any */
+static void
+store_tokens (MsgOAuth2Authorizer *self)
+{
+  MsgOAuth2AuthorizerPrivate *priv = msg_oauth2_authorizer_get_instance_private (self);
+  g_autoptr (MsgTokenCache) token_cache = NULL;
+  g_autoptr (GError) error = NULL;
+  g_autofree char *account = NULL;
+  g_autofree char *access_token = NULL;
+  g_autofree char *refresh_token = NULL;
+  gint64 expires_at;
+
+  g_mutex_lock (&priv->mutex);
+  if (!priv->token_cache || !priv->refresh_token) {
+    g_mutex_unlock (&priv->mutex);
+    return;
+  }
+
+  token_cache = g_object_ref (priv->token_cache);
+  account = g_strdup (priv->account);
+  access_token = g_strdup (priv->access_token);
+  refresh_token = g_strdup (priv->refresh_token);
+  expires_at = priv->expires_at;
+  g_mutex_unlock (&priv->mutex);
+
+  if (!msg_token_cache_store (token_cache, account, access_token, refresh_token, expires_at, &error))
+    g_warning ("Could not store tokens: %s", error->message);
+}
+
+/* Handles the token endpoint response, takes ownership of @send_error */
 static gboolean
-refresh_authorization (MsgAuthorizer  *self,
-                       GCancellable   *cancellable,
-                       GError        **error)
+handle_grant_response (MsgOAuth2Authorizer  *self,
+                       SoupMessage          *message,
+                       GBytes               *response,
+                       GError               *send_error,
+                       GError              **error)
 {
-  MsgOAuth2AuthorizerPrivate *priv = msg_oauth2_authorizer_get_instance_private (MSG_OAUTH2_AUTHORIZER (self));
-  g_autoptr (SoupMessage) message = NULL;
   GError *local_error = NULL;
-  g_autoptr (GBytes) response = NULL;
-  g_autoptr (GBytes) body = NULL;
 
-  g_return_val_if_fail (MSG_IS_OAUTH2_AUTHORIZER (self), FALSE);
-
-  if (priv->refresh_token == NULL) {
+  if (send_error) {
+    g_propagate_error (error, send_error);
     return FALSE;
   }
 
-  message = build_authorization_message (self);
-  response = soup_session_send_and_read (priv->session, message, cancellable, &local_error);
-  if (local_error) {
-    parse_grant_error (response, &local_error);
+  if (!SOUP_STATUS_IS_SUCCESSFUL (soup_message_get_status (message))) {
+    parse_grant_error (response, error);
     return FALSE;
   }
 
   /* Parse and handle the response */
-  parse_grant_response (MSG_OAUTH2_AUTHORIZER (self), response, &local_error);
+  parse_grant_response (self, response, &local_error);
   if (local_error) {
     g_propagate_error (error, local_error);
     return FALSE;
   }
 
+  store_tokens (self);
+
   return TRUE;
 }
 
+/* Returns a token request if the access token has to be refreshed */
+static SoupMessage *
+prepare_refresh (MsgOAuth2Authorizer *self,
+                 gboolean            *ret)
+{
+  MsgOAuth2AuthorizerPrivate *priv = msg_oauth2_authorizer_get_instance_private (self);
+  SoupMessage *message = NULL;
+
+  g_mutex_lock (&priv->mutex);
+
+  if (priv->refresh_token == NULL) {
+    *ret = FALSE;
+  } else if (priv->access_token && priv->expires_at - TOKEN_EXPIRY_MARGIN > g_get_real_time ()) {
+    /* Keep using the current access token until it is about to expire */
+    *ret = TRUE;
+  } else {
+    message = build_authorization_message (MSG_AUTHORIZER (self));
+  }
+
+  g_mutex_unlock (&priv->mutex);
+
+  return message;
+}
+
+static gboolean
+refresh_authorization (MsgAuthorizer  *self,
+                       GCancellable   *cancellable,
+                       GError        **error)
+{
+  MsgOAuth2AuthorizerPrivate *priv = msg_oauth2_authorizer_get_instance_private (MSG_OAUTH2_AUTHORIZER (self));
+  g_autoptr (SoupMessage) message = NULL;
+  GError *local_error = NULL;
+  g_autoptr (GBytes) response = NULL;
+  gboolean ret = FALSE;
+
+  g_return_val_if_fail (MSG_IS_OAUTH2_AUTHORIZER (self), FALSE);
+
+  message = prepare_refresh (MSG_OAUTH2_AUTHORIZER (self), &ret);
+  if (!message)
+    return ret;
+
+  response = soup_session_send_and_read (priv->session, message, cancellable, &local_error);
+
+  return handle_grant_response (MSG_OAUTH2_AUTHORIZER (self), message, response, local_error, error);
+}
+
+static void
+token_request_cb (GObject      *source,
+                  GAsyncResult *result,
+                  gpointer      user_data)
+{
+  g_autoptr (GTask) task = user_data;
+  g_autoptr (GBytes) response = NULL;
+  GError *local_error = NULL;
+  GError *error = NULL;
+
+  response = soup_session_send_and_read_finish (SOUP_SESSION (source), result, &local_error);
+
+  if (handle_grant_response (g_task_get_source_object (task), g_task_get_task_data (task), response, local_error, &error))
+    g_task_return_boolean (task, TRUE);
+  else
+    g_task_return_error (task, error);
+}
+
+/* Sends @message to the token endpoint and completes @task with the result */
+static void
+send_token_request_async (GTask       *task,
+                          SoupMessage *message)
+{
+  MsgOAuth2AuthorizerPrivate *priv = msg_oauth2_authorizer_get_instance_private (g_task_get_source_object (task));
+
+  g_task_set_task_data (task, g_object_ref (message), g_object_unref);
+  soup_session_send_and_read_async (priv->session,
+                                    message,
+                                    G_PRIORITY_DEFAULT,
+                                    g_task_get_cancellable (task),
+                                    token_request_cb,
+                                    g_object_ref (task));
+}
+
+static void
+refresh_authorization_async (MsgAuthorizer       *self,
+                             GCancellable        *cancellable,
+                             GAsyncReadyCallback  callback,
+                             gpointer             user_data)
+{
+  g_autoptr (GTask) task = NULL;
+  g_autoptr (SoupMessage) message = NULL;
+  gboolean ret = FALSE;
+
+  task = g_task_new (self, cancellable, callback, user_data);
+  g_task_set_source_tag (task, refresh_authorization_async);
+
+  message = prepare_refresh (MSG_OAUTH2_AUTHORIZER (self), &ret);
+  if (!message) {
+    g_task_return_boolean (task, ret);
+    return;
+  }
+
+  send_token_request_async (task, message);
+}
+
+static gboolean
+refresh_authorization_finish (MsgAuthorizer  *self,
+                              GAsyncResult   *result,
+                              GError        **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, self), FALSE);
+  g_return_val_if_fail (g_async_result_is_tagged (result, refresh_authorization_async), FALSE);
+
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+static void
+invalidate_authorization (MsgAuthorizer *self)
+{
+  MsgOAuth2AuthorizerPrivate *priv = msg_oauth2_authorizer_get_instance_private (MSG_OAUTH2_AUTHORIZER (self));
+
+  g_mutex_lock (&priv->mutex);
+  priv->expires_at = 0;
+  g_mutex_unlock (&priv->mutex);
+}
+
 static void
 authorizer_init (MsgAuthorizerInterface *iface)
 {
   iface->process_request = process_request;
   iface->refresh_authorization = refresh_authorization;
+  iface->invalidate_authorization = invalidate_authorization;
+  iface->refresh_authorization_async = refresh_authorization_async;
+  iface->refresh_authorization_finish = refresh_authorization_finish;
 }
 
 MsgOAuth2Authorizer *
@@ -555,12 +772,8 @@ msg_oauth2_authorizer_request_authorization (MsgOAuth2Authorizer  *self,
 {
   MsgOAuth2AuthorizerPrivate *priv = msg_oauth2_authorizer_get_instance_private (self);
   g_autoptr (SoupMessage) message = NULL;
-  GUri *_uri = NULL;
-  char *request_body = NULL;
   GError *child_error = NULL;
   g_autoptr (GBytes) response = NULL;
-  g_autofree char *scope = g_strdup ("files.readwrite offline_access");
-  GBytes *body = NULL;
 
   g_return_val_if_fail (MSG_IS_OAUTH2_AUTHORIZER (self), FALSE);
   g_return_val_if_fail (authorization_code != NULL &&
@@ -569,64 +782,10 @@ msg_oauth2_authorizer_request_authorization (MsgOAuth2Authorizer  *self,
                         G_IS_CANCELLABLE (cancellable), FALSE);
   g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
 
-
-  request_body = soup_form_encode ("client_id", priv->client_id,
-                                   "code", authorization_code,
-                                   "redirect_uri", priv->redirect_uri,
-                                   "grant_type", "authorization_code",
-                                   "scope", scope,
-                                   NULL);
-
-  /* Build the message */
-  _uri = g_uri_build (SOUP_HTTP_URI_FLAGS, "https", NULL, "login.microsoftonline.com", msg_service_get_https_port (), "/common/oauth2/v2.0/token", NULL, NULL);
-  message = soup_message_new_from_uri (SOUP_METHOD_POST, _uri);
-  g_uri_unref (_uri);
-
-  g_signal_connect (message, "accept-certificate",
-                    G_CALLBACK (msg_service_accept_certificate_cb),
-                    priv->session);
-
-  body = g_bytes_new_take (request_body, strlen (request_body));
-
-  g_signal_connect (message, "starting", G_CALLBACK (authorizer_message_starting), body);
-  g_signal_connect (message, "finished", G_CALLBACK (authorizer_message_finished), body);
-
-  request_body = NULL;
-
+  message = build_request_authorization_message (self, authorization_code);
   response = soup_session_send_and_read (priv->session, message, cancellable, &child_error);
-  if (child_error) {
-    parse_grant_error (response, error);
-    return FALSE;
-  }
-
-  /* Parse and handle the response */
-  parse_grant_response (self, response, &child_error);
-
-  if (child_error != NULL) {
-    g_propagate_error (error, child_error);
-    return FALSE;
-  }
 
-  return TRUE;
-}
-
-static void
-request_authorization_thread (GTask        *task,
-                              gpointer      source_object,
-                              gpointer      task_data,
-                              GCancellable *cancellable)
-{
-  MsgOAuth2Authorizer *authorizer = MSG_OAUTH2_AUTHORIZER (source_object);
-  g_autoptr (GError) error = NULL;
-  const char *authorization_code = task_data;
-
-  if (!msg_oauth2_authorizer_request_authorization (authorizer,
-                                                    authorization_code,
-                                                    cancellable,
-                                                    &error))
-    g_task_return_error (task, g_steal_pointer (&error));
-  else
-    g_task_return_boolean (task, TRUE);
+  return handle_grant_response (self, message, response, child_error, error);
 }
 
 void
@@ -637,6 +796,7 @@ msg_oauth2_authorizer_request_authorization_async (MsgOAuth2Authorizer *self,
                                                    gpointer             user_data)
 {
   g_autoptr (GTask) task = NULL;
+  g_autoptr (SoupMessage) message = NULL;
 
   g_return_if_fail (MSG_IS_OAUTH2_AUTHORIZER (self));
   g_return_if_fail (authorization_code != NULL && *authorization_code != '\0');
@@ -644,8 +804,9 @@ msg_oauth2_authorizer_request_authorization_async (MsgOAuth2Authorizer *self,
 
   task = g_task_new (self, cancellable, callback, user_data);
   g_task_set_source_tag (task, msg_oauth2_authorizer_request_authorization_async);
-  g_task_set_task_data (task, g_strdup (authorization_code), (GDestroyNotify)g_free);
-  g_task_run_in_thread (task, request_authorization_thread);
+
+  message = build_request_authorization_message (self, authorization_code);
+  send_token_request_async (task, message);
 }
 
 gboolean
@@ -695,6 +856,77 @@ msg_oauth2_authorizer_dup_refresh_token (MsgOAuth2Authorizer *self)
   return refresh_token;
 }
 
+/**
+ * msg_oauth2_authorizer_set_token_cache:
+ * @self: a #MsgOAuth2Authorizer
+ * @token_cache: (nullable): a #MsgTokenCache
+ * @account: (nullable): account identifier within @token_cache
+ *
+ * Sets a cache persisting the tokens of @self under @account. Tokens
+ * stored before are restored right away, so a still valid access token
+ * is used without requesting a new one. Updated tokens are stored after
+ * each successful token request.
+ */
+void
+msg_oauth2_authorizer_set_token_cache (MsgOAuth2Authorizer *self,
+                                       MsgTokenCache       *token_cache,
+                                       const char          *account)
+{
+  MsgOAuth2AuthorizerPrivate *priv = msg_oauth2_authorizer_get_instance_private (self);
+  g_autoptr (GError) error = NULL;
+  g_autofree char *access_token = NULL;
+  g_autofree char *refresh_token = NULL;
+  gint64 expires_at = 0;
+  gboolean notify = FALSE;
+
+  g_return_if_fail (MSG_IS_OAUTH2_AUTHORIZER (self));
+  g_return_if_fail (token_cache == NULL || MSG_IS_TOKEN_CACHE (token_cache));
+  g_return_if_fail (token_cache == NULL || account != NULL);
+
+  if (token_cache && !msg_token_cache_load (token_cache, account, &access_token, &refresh_token, &expires_at, &error) && error)
+    g_warning ("Could not load tokens: %s", error->message);
+
+  g_mutex_lock (&priv->mutex);
+
+  g_set_object (&priv->token_cache, token_cache);
+  g_free (priv->account);
+  priv->account = g_strdup (account);
+
+  if (refresh_token) {
+    notify = g_strcmp0 (priv->refresh_token, refresh_token) != 0;
+
+    g_free (priv->refresh_token);
+    priv->refresh_token = g_steal_pointer (&refresh_token);
+    g_free (priv->access_token);
+    priv->access_token = g_steal_pointer (&access_token);
+    msg_auth_header_set_token (priv->auth_header, priv->access_token);
+    priv->expires_at = priv->access_token ? expires_at : 0;
+  }
+
+  g_mutex_unlock (&priv->mutex);
+
+  if (notify)
+    g_object_notify (G_OBJECT (self), "refresh-token");
+}
+
+/**
+ * msg_oauth2_authorizer_get_token_cache:
+ * @self: a #MsgOAuth2Authorizer
+ *
+ * Get the token cache of @self.
+ *
+ * Returns: (transfer none) (nullable): a #MsgTokenCache
+ */
+MsgTokenCache *
+msg_oauth2_authorizer_get_token_cache (MsgOAuth2Authorizer *self)
+{
+  MsgOAuth2AuthorizerPrivate *priv = msg_oauth2_authorizer_get_instance_private (self);
+
+  g_return_val_if_fail (MSG_IS_OAUTH2_AUTHORIZER (self), NULL);
+
+  return priv->token_cache;
+}
+
 void
 msg_oauth2_authorizer_test_save_credentials (MsgAuthorizer *self)
 {
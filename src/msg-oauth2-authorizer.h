@@ -2,6 +2,7 @@
 
 #include <glib-object.h>
 #include "msg-authorizer.h"
+#include "msg-token-cache.h"
 
 G_BEGIN_DECLS
 
@@ -45,6 +46,14 @@ msg_oauth2_authorizer_request_authorization (MsgOAuth2Authorizer  *self,
                                              GCancellable         *cancellable,
                                              GError              **error);
 
+void
+msg_oauth2_authorizer_set_token_cache (MsgOAuth2Authorizer *self,
+                                       MsgTokenCache       *token_cache,
+                                       const char          *account);
+
+MsgTokenCache *
+msg_oauth2_authorizer_get_token_cache (MsgOAuth2Authorizer *self);
+
 void
 msg_oauth2_authorizer_test_save_credentials (MsgAuthorizer *self);
 
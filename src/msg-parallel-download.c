@@ -0,0 +1,501 @@
+/* Copyright 2024 Jan-Michael Brummer <jan-michael.brummer1@volkswagen.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <libsoup/soup.h>
+
+#include "msg-parallel-download.h"
+
+/* Segments the reader may lag behind per worker, bounding the memory of
+ * reassembling the segments in order */
+#define READ_AHEAD 2
+
+/* Sync waiters check their cancellable in this interval */
+#define POLL_INTERVAL (100 * G_TIME_SPAN_MILLISECOND)
+
+/* The resource is split into segments of segment_size bytes. The first
+ * one is fetched by the caller to learn the total size, the others by a
+ * pool of worker threads. Segments are either written to the seekable
+ * sink as soon as they arrive, or handed out to the reader in order. */
+struct _MsgParallelDownload {
+  MsgService *service;
+  char *uri;
+  /* Set once the uri has been redirected to a pre-authenticated one */
+  gboolean preauthenticated;
+  goffset start;
+  guint concurrency;
+  gsize segment_size;
+  GOutputStream *sink;
+  /* Cancels the requests of all workers */
+  GCancellable *cancellable;
+
+  GMutex mutex;
+  GCond cond;
+  GPtrArray *workers;
+  /* Total size of the resource, -1 until known */
+  goffset size;
+  guint n_segments;
+  /* Next segment to fetch */
+  guint next;
+  /* Segments fetched, for the sink */
+  guint done;
+  /* Next segment handed out to the reader */
+  guint consumed;
+  /* Fetched segments not yet read, by index */
+  GHashTable *ready;
+  GError *error;
+  gboolean stopping;
+};
+
+/**
+ * msg_parallel_download_new:
+ * @service: a #MsgService
+ * @uri: the uri to download
+ * @start: offset to start the download at
+ * @concurrency: number of segments fetched at the same time
+ * @segment_size: bytes per request
+ * @sink: (nullable): a seekable stream the segments are written to at
+ *   their offset in the resource, or %NULL to read them with
+ *   msg_parallel_download_next()
+ *
+ * Prepares a download of @uri from @start on.
+ *
+ * Returns: (transfer full): a new #MsgParallelDownload
+ */
+MsgParallelDownload *
+msg_parallel_download_new (MsgService    *service,
+                           const char    *uri,
+                           goffset        start,
+                           guint          concurrency,
+                           gsize          segment_size,
+                           GOutputStream *sink)
+{
+  MsgParallelDownload *download = g_new0 (MsgParallelDownload, 1);
+
+  g_return_val_if_fail (segment_size > 0, NULL);
+  g_return_val_if_fail (!sink || G_IS_SEEKABLE (sink), NULL);
+
+  download->service = g_object_ref (service);
+  download->uri = g_strdup (uri);
+  download->start = start;
+  download->concurrency = MAX (concurrency, 1);
+  download->segment_size = segment_size;
+  download->sink = sink ? g_object_ref (sink) : NULL;
+  download->cancellable = g_cancellable_new ();
+  download->size = -1;
+
+  g_mutex_init (&download->mutex);
+  g_cond_init (&download->cond);
+  download->workers = g_ptr_array_new ();
+  download->ready = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)g_bytes_unref);
+
+  return download;
+}
+
+/**
+ * msg_parallel_download_free:
+ * @download: a #MsgParallelDownload
+ *
+ * Stops all workers and frees @download.
+ */
+void
+msg_parallel_download_free (MsgParallelDownload *download)
+{
+  g_mutex_lock (&download->mutex);
+  download->stopping = TRUE;
+  g_cond_broadcast (&download->cond);
+  g_mutex_unlock (&download->mutex);
+
+  g_cancellable_cancel (download->cancellable);
+  for (guint index = 0; index < download->workers->len; index++)
+    g_thread_join (g_ptr_array_index (download->workers, index));
+
+  g_ptr_array_unref (download->workers);
+  g_hash_table_unref (download->ready);
+  g_clear_error (&download->error);
+  g_mutex_clear (&download->mutex);
+  g_cond_clear (&download->cond);
+  g_clear_object (&download->cancellable);
+  g_clear_object (&download->sink);
+  g_clear_object (&download->service);
+  g_free (download->uri);
+  g_free (download);
+}
+
+static void
+on_restarted (SoupMessage                      *message,
+              __attribute__ ((unused)) gpointer user_data)
+{
+  /* Redirects lead to pre-authenticated urls, which refuse tokens */
+  soup_message_headers_remove (soup_message_get_request_headers (message), "Authorization");
+  g_object_set_data (G_OBJECT (message), "msg-redirected", GINT_TO_POINTER (TRUE));
+}
+
+/* Requests bytes @first to @last and checks that the server honoured the range */
+static GBytes *
+fetch_range (MsgParallelDownload  *download,
+             goffset               first,
+             goffset               last,
+             SoupMessage         **message_out,
+             GCancellable         *cancellable,
+             GError              **error)
+{
+  g_autoptr (SoupMessage) message = NULL;
+  g_autoptr (GBytes) bytes = NULL;
+  g_autofree char *range = NULL;
+  goffset range_start;
+  goffset range_end;
+  guint status;
+
+  message = msg_service_build_message (download->service, "GET", download->uri, NULL, FALSE);
+  if (!message) {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT, "Invalid download url");
+    return NULL;
+  }
+
+  if (download->preauthenticated)
+    g_object_set_data (G_OBJECT (message), "msg-preauthenticated", GINT_TO_POINTER (TRUE));
+  else
+    g_signal_connect (message, "restarted", G_CALLBACK (on_restarted), NULL);
+
+  range = g_strdup_printf ("bytes=%" G_GOFFSET_FORMAT "-%" G_GOFFSET_FORMAT, first, last);
+  soup_message_headers_replace (soup_message_get_request_headers (message), "Range", range);
+
+  bytes = msg_service_send_and_read (download->service, message, cancellable, error);
+  if (!bytes)
+    return NULL;
+
+  status = soup_message_get_status (message);
+  if (status == SOUP_STATUS_PARTIAL_CONTENT) {
+    if (!soup_message_headers_get_content_range (soup_message_get_response_headers (message), &range_start, &range_end, NULL) ||
+        range_start != first) {
+      g_set_error (error,
+                   G_IO_ERROR,
+                   G_IO_ERROR_FAILED,
+                   "Unexpected range for bytes %" G_GOFFSET_FORMAT "-%" G_GOFFSET_FORMAT,
+                   first,
+                   last);
+      return NULL;
+    }
+  } else if (status != SOUP_STATUS_OK && status != SOUP_STATUS_REQUESTED_RANGE_NOT_SATISFIABLE) {
+    g_set_error (error,
+                 G_IO_ERROR,
+                 G_IO_ERROR_FAILED,
+                 "HTTP Error: %s",
+                 soup_message_get_reason_phrase (message));
+    return NULL;
+  }
+
+  if (message_out)
+    *message_out = g_steal_pointer (&message);
+
+  return g_steal_pointer (&bytes);
+}
+
+/* Must be called locked */
+static void
+download_fail (MsgParallelDownload *download,
+               GError              *error)
+{
+  if (!download->error)
+    download->error = error;
+  else
+    g_error_free (error);
+
+  g_cond_broadcast (&download->cond);
+}
+
+/* Must be called locked */
+static gboolean
+download_store (MsgParallelDownload  *download,
+                guint                 index,
+                GBytes               *bytes,
+                GError              **error)
+{
+  goffset position = download->start + (goffset)index * download->segment_size;
+
+  if (!download->sink) {
+    g_hash_table_insert (download->ready, GUINT_TO_POINTER (index), g_bytes_ref (bytes));
+    return TRUE;
+  }
+
+  /* Writes are serialized, segments arrive much slower than they are written */
+  if (!g_seekable_seek (G_SEEKABLE (download->sink), position, G_SEEK_SET, NULL, error))
+    return FALSE;
+
+  if (!g_output_stream_write_all (download->sink,
+                                  g_bytes_get_data (bytes, NULL),
+                                  g_bytes_get_size (bytes),
+                                  NULL,
+                                  NULL,
+                                  error))
+    return FALSE;
+
+  download->done++;
+  return TRUE;
+}
+
+static gpointer
+worker_thread_func (gpointer user_data)
+{
+  MsgParallelDownload *download = user_data;
+
+  g_mutex_lock (&download->mutex);
+
+  while (TRUE) {
+    g_autoptr (GBytes) bytes = NULL;
+    GError *error = NULL;
+    goffset first;
+    goffset last;
+    guint index;
+
+    while (!download->stopping && !download->error && download->next < download->n_segments &&
+           !download->sink && download->next - download->consumed >= download->concurrency * READ_AHEAD)
+      g_cond_wait (&download->cond, &download->mutex);
+
+    if (download->stopping || download->error || download->next >= download->n_segments)
+      break;
+
+    index = download->next++;
+    first = download->start + (goffset)index * download->segment_size;
+    last = MIN (first + (goffset)download->segment_size, download->size) - 1;
+
+    g_mutex_unlock (&download->mutex);
+    bytes = fetch_range (download, first, last, NULL, download->cancellable, &error);
+    g_mutex_lock (&download->mutex);
+
+    if (bytes && (goffset)g_bytes_get_size (bytes) != last - first + 1)
+      g_set_error (&error, G_IO_ERROR, G_IO_ERROR_PARTIAL_INPUT, "Segment at %" G_GOFFSET_FORMAT " is incomplete", first);
+
+    if (!error)
+      download_store (download, index, bytes, &error);
+
+    if (error) {
+      download_fail (download, error);
+      g_mutex_unlock (&download->mutex);
+
+      /* Abort the segments of the other workers */
+      g_cancellable_cancel (download->cancellable);
+      return NULL;
+    }
+
+    g_cond_broadcast (&download->cond);
+  }
+
+  g_mutex_unlock (&download->mutex);
+
+  return NULL;
+}
+
+/**
+ * msg_parallel_download_start:
+ * @download: a #MsgParallelDownload
+ * @cancellable: a #GCancellable
+ * @error: a #GError
+ *
+ * Fetches the first segment, which tells the total size, and starts the
+ * workers for the remaining segments.
+ *
+ * Returns: %TRUE on success
+ */
+gboolean
+msg_parallel_download_start (MsgParallelDownload  *download,
+                             GCancellable         *cancellable,
+                             GError              **error)
+{
+  g_autoptr (SoupMessage) message = NULL;
+  g_autoptr (GBytes) bytes = NULL;
+  goffset total = -1;
+  goffset expected;
+  guint status;
+  guint workers;
+
+  bytes = fetch_range (download,
+                       download->start,
+                       download->start + download->segment_size - 1,
+                       &message,
+                       cancellable,
+                       error);
+  if (!bytes)
+    return FALSE;
+
+  status = soup_message_get_status (message);
+  if (status == SOUP_STATUS_PARTIAL_CONTENT) {
+    soup_message_headers_get_content_range (soup_message_get_response_headers (message), NULL, NULL, &total);
+    if (total < 0) {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED, "Size of %s is unknown", download->uri);
+      return FALSE;
+    }
+
+    /* Workers check their segments the same way */
+    expected = MIN (download->start + (goffset)download->segment_size, total) - download->start;
+    if ((goffset)g_bytes_get_size (bytes) != expected) {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_PARTIAL_INPUT, "Segment at %" G_GOFFSET_FORMAT " is incomplete", download->start);
+      return FALSE;
+    }
+  } else if (status == SOUP_STATUS_REQUESTED_RANGE_NOT_SATISFIABLE) {
+    /* Nothing left after start */
+    total = download->start;
+    g_clear_pointer (&bytes, g_bytes_unref);
+  } else if (download->start == 0) {
+    /* The server ignored the range and sent everything */
+    total = g_bytes_get_size (bytes);
+  } else {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED, "Server does not support ranges");
+    return FALSE;
+  }
+
+  /* Request further segments from the redirect target directly. Comparing
+   * the uri of the message would not do, it carries the service port. */
+  if (status == SOUP_STATUS_PARTIAL_CONTENT && g_object_get_data (G_OBJECT (message), "msg-redirected")) {
+    g_free (download->uri);
+    download->uri = g_uri_to_string (soup_message_get_uri (message));
+    download->preauthenticated = TRUE;
+  }
+
+  g_mutex_lock (&download->mutex);
+
+  download->size = total;
+  if (total > download->start)
+    download->n_segments = (total - download->start + download->segment_size - 1) / download->segment_size;
+  if (status != SOUP_STATUS_PARTIAL_CONTENT)
+    download->n_segments = bytes ? 1 : 0;
+
+  if (bytes && !download_store (download, 0, bytes, error)) {
+    g_mutex_unlock (&download->mutex);
+    return FALSE;
+  }
+  download->next = bytes ? 1 : 0;
+
+  workers = MIN (download->concurrency, download->n_segments - download->next);
+  for (guint index = 0; index < workers; index++)
+    g_ptr_array_add (download->workers, g_thread_new ("msg-download", worker_thread_func, download));
+
+  g_mutex_unlock (&download->mutex);
+
+  return TRUE;
+}
+
+/* Must be called locked, waits for a change or the poll interval */
+static gboolean
+download_wait (MsgParallelDownload  *download,
+               GCancellable         *cancellable,
+               GError              **error)
+{
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return FALSE;
+
+  g_cond_wait_until (&download->cond, &download->mutex, g_get_monotonic_time () + POLL_INTERVAL);
+
+  return TRUE;
+}
+
+/**
+ * msg_parallel_download_next:
+ * @download: a #MsgParallelDownload without sink
+ * @cancellable: a #GCancellable
+ * @error: a #GError
+ *
+ * Waits for the next segment in order.
+ *
+ * Returns: (transfer full): the next segment, or %NULL at the end or on error
+ */
+GBytes *
+msg_parallel_download_next (MsgParallelDownload  *download,
+                            GCancellable         *cancellable,
+                            GError              **error)
+{
+  GBytes *bytes = NULL;
+
+  g_return_val_if_fail (download->sink == NULL, NULL);
+
+  g_mutex_lock (&download->mutex);
+
+  while (download->consumed < download->n_segments) {
+    gpointer key = GUINT_TO_POINTER (download->consumed);
+
+    if (download->error) {
+      g_propagate_error (error, g_error_copy (download->error));
+      break;
+    }
+
+    if (g_hash_table_steal_extended (download->ready, key, NULL, (gpointer *)&bytes)) {
+      download->consumed++;
+      g_cond_broadcast (&download->cond);
+      break;
+    }
+
+    if (!download_wait (download, cancellable, error))
+      break;
+  }
+
+  g_mutex_unlock (&download->mutex);
+
+  return bytes;
+}
+
+/**
+ * msg_parallel_download_wait:
+ * @download: a #MsgParallelDownload with sink
+ * @cancellable: a #GCancellable
+ * @error: a #GError
+ *
+ * Waits until all segments have been written to the sink.
+ *
+ * Returns: %TRUE on success
+ */
+gboolean
+msg_parallel_download_wait (MsgParallelDownload  *download,
+                            GCancellable         *cancellable,
+                            GError              **error)
+{
+  gboolean ret = TRUE;
+
+  g_return_val_if_fail (download->sink != NULL, FALSE);
+
+  g_mutex_lock (&download->mutex);
+
+  while (download->done < download->n_segments) {
+    if (download->error) {
+      g_propagate_error (error, g_error_copy (download->error));
+      ret = FALSE;
+      break;
+    }
+
+    if (!download_wait (download, cancellable, error)) {
+      ret = FALSE;
+      break;
+    }
+  }
+
+  g_mutex_unlock (&download->mutex);
+
+  return ret;
+}
+
+/**
+ * msg_parallel_download_get_size:
+ * @download: a #MsgParallelDownload
+ *
+ * Get the total size of the resource, known once started.
+ *
+ * Returns: size in bytes or -1
+ */
+goffset
+msg_parallel_download_get_size (MsgParallelDownload *download)
+{
+  return download->size;
+}
@@ -0,0 +1,61 @@
+/* Copyright 2024 Jan-Michael Brummer <jan-michael.brummer1@volkswagen.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <gio/gio.h>
+
+#include "msg-service.h"
+
+G_BEGIN_DECLS
+
+/* Internal download of one resource in byte ranges fetched concurrently */
+
+typedef struct _MsgParallelDownload MsgParallelDownload;
+
+MsgParallelDownload *
+msg_parallel_download_new (MsgService    *service,
+                           const char    *uri,
+                           goffset        start,
+                           guint          concurrency,
+                           gsize          segment_size,
+                           GOutputStream *sink);
+
+void
+msg_parallel_download_free (MsgParallelDownload *download);
+
+gboolean
+msg_parallel_download_start (MsgParallelDownload  *download,
+                             GCancellable         *cancellable,
+                             GError              **error);
+
+GBytes *
+msg_parallel_download_next (MsgParallelDownload  *download,
+                            GCancellable         *cancellable,
+                            GError              **error);
+
+gboolean
+msg_parallel_download_wait (MsgParallelDownload  *download,
+                            GCancellable         *cancellable,
+                            GError              **error);
+
+goffset
+msg_parallel_download_get_size (MsgParallelDownload *download);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (MsgParallelDownload, msg_parallel_download_free);
+
+G_END_DECLS
@@ -0,0 +1,457 @@
+/* Copyright 2024 Jan-Michael Brummer <jan-michael.brummer1@volkswagen.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <glib/gstdio.h>
+
+#include "msg-response-cache.h"
+
+/**
+ * MsgResponseCache:
+ *
+ * Cache for responses carrying an ETag. Entries are kept in memory in
+ * least recently used order up to a maximal size and are optionally
+ * written to a directory, so they survive a restart.
+ *
+ * Responses are cached per url, therefore a cache must not be shared
+ * between services of different accounts.
+ */
+
+#define RESPONSE_CACHE_DEFAULT_SIZE (16 * 1024 * 1024)
+
+typedef struct {
+  char *key;
+  char *etag;
+  GBytes *body;
+  GList link;
+} CacheEntry;
+
+struct _MsgResponseCache {
+  GObject parent_instance;
+
+  GMutex mutex;
+  GHashTable *entries;
+  GQueue lru;
+  gsize size;
+  gsize max_size;
+  char *directory;
+
+  guint64 hits;
+  guint64 misses;
+};
+
+G_DEFINE_TYPE (MsgResponseCache, msg_response_cache, G_TYPE_OBJECT);
+
+static void
+cache_entry_free (CacheEntry *entry)
+{
+  g_free (entry->key);
+  g_free (entry->etag);
+  g_bytes_unref (entry->body);
+  g_free (entry);
+}
+
+static gsize
+cache_entry_size (CacheEntry *entry)
+{
+  return g_bytes_get_size (entry->body) + strlen (entry->key) + strlen (entry->etag);
+}
+
+static void
+msg_response_cache_finalize (GObject *object)
+{
+  MsgResponseCache *self = MSG_RESPONSE_CACHE (object);
+
+  /* Queue links are embedded into the entries freed by the table */
+  g_queue_init (&self->lru);
+  g_clear_pointer (&self->entries, g_hash_table_unref);
+  g_clear_pointer (&self->directory, g_free);
+  g_mutex_clear (&self->mutex);
+
+  G_OBJECT_CLASS (msg_response_cache_parent_class)->finalize (object);
+}
+
+static void
+msg_response_cache_init (MsgResponseCache *self)
+{
+  g_mutex_init (&self->mutex);
+  g_queue_init (&self->lru);
+  self->entries = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, (GDestroyNotify)cache_entry_free);
+}
+
+static void
+msg_response_cache_class_init (MsgResponseCacheClass *class)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (class);
+
+  object_class->finalize = msg_response_cache_finalize;
+}
+
+/**
+ * msg_response_cache_new:
+ * @max_size: maximal size of the memory cache in bytes, 0 for the default
+ * @directory: (nullable): directory to store responses in
+ *
+ * Creates a new response cache, which can be set on a service with
+ * msg_service_set_response_cache().
+ *
+ * Returns: (transfer full): a new `MsgResponseCache`
+ */
+MsgResponseCache *
+msg_response_cache_new (gsize       max_size,
+                        const char *directory)
+{
+  MsgResponseCache *self;
+
+  self = g_object_new (MSG_TYPE_RESPONSE_CACHE, NULL);
+  self->max_size = max_size ? max_size : RESPONSE_CACHE_DEFAULT_SIZE;
+
+  if (directory) {
+    if (g_mkdir_with_parents (directory, 0700) == 0)
+      self->directory = g_strdup (directory);
+    else
+      g_warning ("Could not create response cache directory %s: %s", directory, g_strerror (errno));
+  }
+
+  return self;
+}
+
+static char *
+cache_file_path (MsgResponseCache *self,
+                 const char       *key)
+{
+  g_autofree char *name = g_compute_checksum_for_string (G_CHECKSUM_SHA256, key, -1);
+
+  return g_build_filename (self->directory, name, NULL);
+}
+
+/* File layout: etag, NUL byte, body */
+static void
+cache_write_file (MsgResponseCache *self,
+                  CacheEntry       *entry)
+{
+  g_autofree char *path = NULL;
+  g_autoptr (GByteArray) data = NULL;
+  g_autoptr (GError) error = NULL;
+  gconstpointer body;
+  gsize body_len;
+
+  if (!self->directory)
+    return;
+
+  body = g_bytes_get_data (entry->body, &body_len);
+  data = g_byte_array_sized_new (strlen (entry->etag) + 1 + body_len);
+  g_byte_array_append (data, (const guint8 *)entry->etag, strlen (entry->etag) + 1);
+  g_byte_array_append (data, body, body_len);
+
+  path = cache_file_path (self, entry->key);
+  if (!g_file_set_contents_full (path, (const char *)data->data, data->len, G_FILE_SET_CONTENTS_CONSISTENT, 0600, &error))
+    g_debug ("Could not write response cache file: %s", error->message);
+}
+
+static CacheEntry *
+cache_read_file (MsgResponseCache *self,
+                 const char       *key)
+{
+  g_autofree char *path = NULL;
+  g_autofree char *contents = NULL;
+  CacheEntry *entry;
+  gsize len;
+  gsize etag_len;
+
+  if (!self->directory)
+    return NULL;
+
+  path = cache_file_path (self, key);
+  if (!g_file_get_contents (path, &contents, &len, NULL))
+    return NULL;
+
+  etag_len = strnlen (contents, len);
+  if (etag_len == 0 || etag_len == len)
+    return NULL;
+
+  entry = g_new0 (CacheEntry, 1);
+  entry->key = g_strdup (key);
+  entry->etag = g_strndup (contents, etag_len);
+  entry->body = g_bytes_new (contents + etag_len + 1, len - etag_len - 1);
+  entry->link.data = entry;
+
+  return entry;
+}
+
+static void
+cache_remove_entry (MsgResponseCache *self,
+                    CacheEntry       *entry)
+{
+  g_queue_unlink (&self->lru, &entry->link);
+  self->size -= cache_entry_size (entry);
+  g_hash_table_remove (self->entries, entry->key);
+}
+
+static void
+cache_insert_entry (MsgResponseCache *self,
+                    CacheEntry       *entry)
+{
+  CacheEntry *old = g_hash_table_lookup (self->entries, entry->key);
+
+  if (old)
+    cache_remove_entry (self, old);
+
+  /* Oversized entries would flush the whole memory cache */
+  if (cache_entry_size (entry) > self->max_size / 2) {
+    cache_entry_free (entry);
+    return;
+  }
+
+  g_hash_table_insert (self->entries, entry->key, entry);
+  g_queue_push_head_link (&self->lru, &entry->link);
+  self->size += cache_entry_size (entry);
+
+  while (self->size > self->max_size) {
+    GList *last = g_queue_peek_tail_link (&self->lru);
+
+    cache_remove_entry (self, last->data);
+  }
+}
+
+/* Looks up @key in memory and on disk, must be called locked */
+static CacheEntry *
+cache_lookup (MsgResponseCache *self,
+              const char       *key)
+{
+  CacheEntry *entry = g_hash_table_lookup (self->entries, key);
+
+  if (entry) {
+    g_queue_unlink (&self->lru, &entry->link);
+    g_queue_push_head_link (&self->lru, &entry->link);
+    return entry;
+  }
+
+  entry = cache_read_file (self, key);
+  if (!entry)
+    return NULL;
+
+  cache_insert_entry (self, entry);
+
+  /* Entry might have been too large for the memory cache */
+  return g_hash_table_lookup (self->entries, key);
+}
+
+/**
+ * msg_response_cache_lookup_etag:
+ * @self: a #MsgResponseCache
+ * @key: cache key
+ *
+ * Get the ETag of the cached response for @key, which can be used
+ * for a conditional request.
+ *
+ * Returns: (transfer full) (nullable): the ETag or %NULL if not cached
+ */
+char *
+msg_response_cache_lookup_etag (MsgResponseCache *self,
+                                const char       *key)
+{
+  CacheEntry *entry;
+  char *etag = NULL;
+
+  g_return_val_if_fail (MSG_IS_RESPONSE_CACHE (self), NULL);
+
+  g_mutex_lock (&self->mutex);
+  entry = cache_lookup (self, key);
+  if (entry)
+    etag = g_strdup (entry->etag);
+  g_mutex_unlock (&self->mutex);
+
+  return etag;
+}
+
+/**
+ * msg_response_cache_revalidated:
+ * @self: a #MsgResponseCache
+ * @key: cache key
+ * @etag: ETag sent with the conditional request
+ *
+ * Marks the cached response as still valid after the server answered
+ * a conditional request with 304 Not Modified and counts a hit.
+ *
+ * Returns: (transfer full) (nullable): the cached body or %NULL in case
+ *   the entry has been dropped meanwhile
+ */
+GBytes *
+msg_response_cache_revalidated (MsgResponseCache *self,
+                                const char       *key,
+                                const char       *etag)
+{
+  CacheEntry *entry;
+  GBytes *body = NULL;
+
+  g_return_val_if_fail (MSG_IS_RESPONSE_CACHE (self), NULL);
+
+  g_mutex_lock (&self->mutex);
+  entry = cache_lookup (self, key);
+  if (entry && g_strcmp0 (entry->etag, etag) == 0) {
+    self->hits++;
+    body = g_bytes_ref (entry->body);
+  }
+  g_mutex_unlock (&self->mutex);
+
+  return body;
+}
+
+/**
+ * msg_response_cache_update:
+ * @self: a #MsgResponseCache
+ * @key: cache key
+ * @etag: (nullable): ETag of the response
+ * @body: response body
+ *
+ * Stores a full response and counts a miss. Responses without ETag
+ * remove a previously cached entry.
+ */
+void
+msg_response_cache_update (MsgResponseCache *self,
+                           const char       *key,
+                           const char       *etag,
+                           GBytes           *body)
+{
+  CacheEntry *entry;
+
+  g_return_if_fail (MSG_IS_RESPONSE_CACHE (self));
+
+  g_mutex_lock (&self->mutex);
+  self->misses++;
+  g_mutex_unlock (&self->mutex);
+
+  if (!etag || !*etag || !body) {
+    msg_response_cache_remove (self, key);
+    return;
+  }
+
+  entry = g_new0 (CacheEntry, 1);
+  entry->key = g_strdup (key);
+  entry->etag = g_strdup (etag);
+  entry->body = g_bytes_ref (body);
+  entry->link.data = entry;
+
+  g_mutex_lock (&self->mutex);
+  cache_write_file (self, entry);
+  cache_insert_entry (self, entry);
+  g_mutex_unlock (&self->mutex);
+}
+
+/**
+ * msg_response_cache_remove:
+ * @self: a #MsgResponseCache
+ * @key: cache key
+ *
+ * Removes the cached response for @key from memory and disk.
+ */
+void
+msg_response_cache_remove (MsgResponseCache *self,
+                           const char       *key)
+{
+  CacheEntry *entry;
+
+  g_return_if_fail (MSG_IS_RESPONSE_CACHE (self));
+
+  g_mutex_lock (&self->mutex);
+  entry = g_hash_table_lookup (self->entries, key);
+  if (entry)
+    cache_remove_entry (self, entry);
+
+  if (self->directory) {
+    g_autofree char *path = cache_file_path (self, key);
+
+    g_unlink (path);
+  }
+  g_mutex_unlock (&self->mutex);
+}
+
+/**
+ * msg_response_cache_clear:
+ * @self: a #MsgResponseCache
+ *
+ * Removes all cached responses from memory and disk.
+ */
+void
+msg_response_cache_clear (MsgResponseCache *self)
+{
+  GDir *dir;
+  const char *name;
+
+  g_return_if_fail (MSG_IS_RESPONSE_CACHE (self));
+
+  g_mutex_lock (&self->mutex);
+  g_queue_init (&self->lru);
+  g_hash_table_remove_all (self->entries);
+  self->size = 0;
+
+  dir = self->directory ? g_dir_open (self->directory, 0, NULL) : NULL;
+  if (dir) {
+    while ((name = g_dir_read_name (dir))) {
+      g_autofree char *path = g_build_filename (self->directory, name, NULL);
+
+      g_unlink (path);
+    }
+
+    g_dir_close (dir);
+  }
+  g_mutex_unlock (&self->mutex);
+}
+
+/**
+ * msg_response_cache_get_hits:
+ * @self: a #MsgResponseCache
+ *
+ * Get number of responses served from the cache.
+ *
+ * Returns: number of cache hits
+ */
+guint64
+msg_response_cache_get_hits (MsgResponseCache *self)
+{
+  guint64 hits;
+
+  g_return_val_if_fail (MSG_IS_RESPONSE_CACHE (self), 0);
+
+  g_mutex_lock (&self->mutex);
+  hits = self->hits;
+  g_mutex_unlock (&self->mutex);
+
+  return hits;
+}
+
+/**
+ * msg_response_cache_get_misses:
+ * @self: a #MsgResponseCache
+ *
+ * Get number of cacheable requests which had to be transferred in full.
+ *
+ * Returns: number of cache misses
+ */
+guint64
+msg_response_cache_get_misses (MsgResponseCache *self)
+{
+  guint64 misses;
+
+  g_return_val_if_fail (MSG_IS_RESPONSE_CACHE (self), 0);
+
+  g_mutex_lock (&self->mutex);
+  misses = self->misses;
+  g_mutex_unlock (&self->mutex);
+
+  return misses;
+}
@@ -0,0 +1,59 @@
+/* Copyright 2024 Jan-Michael Brummer <jan-michael.brummer1@volkswagen.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <glib-object.h>
+
+G_BEGIN_DECLS
+
+#define MSG_TYPE_RESPONSE_CACHE (msg_response_cache_get_type ())
+
+G_DECLARE_FINAL_TYPE (MsgResponseCache, msg_response_cache, MSG, RESPONSE_CACHE, GObject);
+
+MsgResponseCache *
+msg_response_cache_new (gsize       max_size,
+                        const char *directory);
+
+char *
+msg_response_cache_lookup_etag (MsgResponseCache *self,
+                                const char       *key);
+
+GBytes *
+msg_response_cache_revalidated (MsgResponseCache *self,
+                                const char       *key,
+                                const char       *etag);
+
+void
+msg_response_cache_update (MsgResponseCache *self,
+                           const char       *key,
+                           const char       *etag,
+                           GBytes           *body);
+
+void
+msg_response_cache_remove (MsgResponseCache *self,
+                           const char       *key);
+
+void
+msg_response_cache_clear (MsgResponseCache *self);
+
+guint64
+msg_response_cache_get_hits (MsgResponseCache *self);
+
+guint64
+msg_response_cache_get_misses (MsgResponseCache *self);
+
+G_END_DECLS
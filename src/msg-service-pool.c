@@ -0,0 +1,687 @@
+/* Copyright 2024 Jan-Michael Brummer <jan-michael.brummer1@volkswagen.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "msg-service-pool.h"
+#include "msg-response-cache.h"
+
+/**
+ * MsgServicePool:
+ *
+ * Shares one #SoupSession between the services of many accounts and
+ * vends a #MsgDriveService, #MsgMailService and #MsgUserService per
+ * #MsgAuthorizer.
+ *
+ * Throttling and response caches are shared by the services of one
+ * account, but never between accounts. Requests of all
+ * vended services are admitted up to the connection limit of the
+ * session; once it is reached, waiting requests are admitted round
+ * robin across accounts, so a busy account cannot starve the others.
+ */
+
+/* Sync waiters check their cancellable in this interval */
+#define POOL_POLL_INTERVAL (100 * G_TIME_SPAN_MILLISECOND)
+
+typedef struct {
+  MsgAuthorizer *authorizer;
+  GWeakRef drive_service;
+  GWeakRef mail_service;
+  GWeakRef user_service;
+  MsgResponseCache *response_cache;
+  /* Throttle window of all services of the account (monotonic time) */
+  gint64 throttled_until;
+
+  /* PoolWaiter in arrival order */
+  GQueue waiters;
+  gboolean removed;
+} PoolAccount;
+
+typedef struct {
+  PoolAccount *account;
+  /* Owned while queued */
+  GTask *task;
+  gulong cancelled_id;
+  gboolean admitted;
+} PoolWaiter;
+
+struct _MsgServicePool {
+  GObject parent_instance;
+
+  SoupSession *session;
+  gsize response_cache_size;
+
+  GMutex mutex;
+  GCond cond;
+  GHashTable *accounts;
+  /* Accounts with waiters, admitted round robin */
+  GQueue ready;
+  guint in_flight;
+  guint max_in_flight;
+};
+
+G_DEFINE_TYPE (MsgServicePool, msg_service_pool, G_TYPE_OBJECT);
+
+static void
+pool_account_free (PoolAccount *account)
+{
+  g_clear_object (&account->authorizer);
+  g_weak_ref_clear (&account->drive_service);
+  g_weak_ref_clear (&account->mail_service);
+  g_weak_ref_clear (&account->user_service);
+  g_clear_object (&account->response_cache);
+  g_free (account);
+}
+
+/* Must be called locked */
+static PoolAccount *
+pool_get_account (MsgServicePool *self,
+                  MsgAuthorizer  *authorizer)
+{
+  PoolAccount *account = g_hash_table_lookup (self->accounts, authorizer);
+
+  if (!account) {
+    account = g_new0 (PoolAccount, 1);
+    account->authorizer = g_object_ref (authorizer);
+    g_weak_ref_init (&account->drive_service, NULL);
+    g_weak_ref_init (&account->mail_service, NULL);
+    g_weak_ref_init (&account->user_service, NULL);
+    g_queue_init (&account->waiters);
+    g_hash_table_insert (self->accounts, authorizer, account);
+  }
+
+  return account;
+}
+
+/* Must be called locked. Admits waiters round robin across accounts and
+ * returns the admitted async waiters, which have to be completed unlocked. */
+static GSList *
+pool_admit_locked (MsgServicePool *self)
+{
+  GSList *tasks = NULL;
+
+  while (self->in_flight < self->max_in_flight && !g_queue_is_empty (&self->ready)) {
+    PoolAccount *account = g_queue_pop_head (&self->ready);
+    PoolWaiter *waiter = g_queue_pop_head (&account->waiters);
+
+    waiter->admitted = TRUE;
+    self->in_flight++;
+
+    if (waiter->task)
+      tasks = g_slist_prepend (tasks, g_steal_pointer (&waiter->task));
+
+    if (!g_queue_is_empty (&account->waiters))
+      g_queue_push_tail (&self->ready, account);
+    else if (account->removed)
+      pool_account_free (account);
+  }
+
+  g_cond_broadcast (&self->cond);
+
+  return g_slist_reverse (tasks);
+}
+
+static void
+pool_complete_waiters (GSList *tasks)
+{
+  for (GSList *iter = tasks; iter; iter = iter->next) {
+    GTask *task = iter->data;
+    PoolWaiter *waiter = g_task_get_task_data (task);
+
+    g_cancellable_disconnect (g_task_get_cancellable (task), waiter->cancelled_id);
+    g_task_return_boolean (task, TRUE);
+  }
+
+  g_slist_free_full (tasks, g_object_unref);
+}
+
+/* Must be called locked */
+static void
+pool_enqueue_locked (MsgServicePool *self,
+                     PoolWaiter     *waiter)
+{
+  if (g_queue_is_empty (&waiter->account->waiters))
+    g_queue_push_tail (&self->ready, waiter->account);
+
+  g_queue_push_tail (&waiter->account->waiters, waiter);
+}
+
+/* Must be called locked, returns %TRUE if @waiter was still waiting */
+static gboolean
+pool_dequeue_locked (MsgServicePool *self,
+                     PoolWaiter     *waiter)
+{
+  PoolAccount *account = waiter->account;
+
+  if (waiter->admitted || !g_queue_remove (&account->waiters, waiter))
+    return FALSE;
+
+  if (g_queue_is_empty (&account->waiters)) {
+    g_queue_remove (&self->ready, account);
+
+    if (account->removed)
+      pool_account_free (account);
+  }
+
+  return TRUE;
+}
+
+static void
+msg_service_pool_finalize (GObject *object)
+{
+  MsgServicePool *self = MSG_SERVICE_POOL (object);
+
+  g_clear_object (&self->session);
+  g_hash_table_unref (self->accounts);
+  g_mutex_clear (&self->mutex);
+  g_cond_clear (&self->cond);
+
+  G_OBJECT_CLASS (msg_service_pool_parent_class)->finalize (object);
+}
+
+static void
+msg_service_pool_class_init (MsgServicePoolClass *class)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (class);
+
+  object_class->finalize = msg_service_pool_finalize;
+}
+
+static void
+msg_service_pool_init (MsgServicePool *self)
+{
+  g_mutex_init (&self->mutex);
+  g_cond_init (&self->cond);
+  self->accounts = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)pool_account_free);
+  g_queue_init (&self->ready);
+}
+
+/**
+ * msg_service_pool_new:
+ * @max_conns: maximal number of connections of the shared session, or 0
+ *   for the default
+ * @max_conns_per_host: maximal number of connections per host, or 0 for
+ *   the default
+ *
+ * Creates a new #MsgServicePool. At most @max_conns requests of all
+ * accounts are in flight at the same time.
+ *
+ * Returns: (transfer full): a new #MsgServicePool
+ */
+MsgServicePool *
+msg_service_pool_new (guint max_conns,
+                      guint max_conns_per_host)
+{
+  MsgServicePool *self = g_object_new (MSG_TYPE_SERVICE_POOL, NULL);
+
+  if (!max_conns)
+    max_conns = MSG_SERVICE_DEFAULT_MAX_CONNS;
+
+  self->session = msg_service_session_new (max_conns, max_conns_per_host, 0);
+  self->max_in_flight = max_conns;
+
+  return self;
+}
+
+/**
+ * msg_service_pool_get_session:
+ * @self: a #MsgServicePool
+ *
+ * Get the session shared by all vended services.
+ *
+ * Returns: (transfer none): a #SoupSession
+ */
+SoupSession *
+msg_service_pool_get_session (MsgServicePool *self)
+{
+  g_return_val_if_fail (MSG_IS_SERVICE_POOL (self), NULL);
+
+  return self->session;
+}
+
+/**
+ * msg_service_pool_set_response_cache_size:
+ * @self: a #MsgServicePool
+ * @size: maximal size of the in-memory response cache per account, 0
+ *   to disable caching
+ *
+ * Services vended afterwards share one #MsgResponseCache per account.
+ * Caches are never shared between accounts, as responses are cached per
+ * url.
+ */
+void
+msg_service_pool_set_response_cache_size (MsgServicePool *self,
+                                          gsize           size)
+{
+  g_return_if_fail (MSG_IS_SERVICE_POOL (self));
+
+  g_mutex_lock (&self->mutex);
+  self->response_cache_size = size;
+  g_mutex_unlock (&self->mutex);
+}
+
+static gpointer
+pool_get_service (MsgServicePool *self,
+                  MsgAuthorizer  *authorizer,
+                  GType           type)
+{
+  PoolAccount *account;
+  GWeakRef *ref;
+  MsgService *service;
+
+  g_return_val_if_fail (MSG_IS_SERVICE_POOL (self), NULL);
+  g_return_val_if_fail (MSG_IS_AUTHORIZER (authorizer), NULL);
+
+  g_mutex_lock (&self->mutex);
+
+  account = pool_get_account (self, authorizer);
+
+  if (type == MSG_TYPE_DRIVE_SERVICE)
+    ref = &account->drive_service;
+  else if (type == MSG_TYPE_MAIL_SERVICE)
+    ref = &account->mail_service;
+  else
+    ref = &account->user_service;
+
+  /* Services are owned by the caller, the pool only keeps weak refs */
+  service = g_weak_ref_get (ref);
+  if (!service) {
+    if (!account->response_cache && self->response_cache_size > 0)
+      account->response_cache = msg_response_cache_new (self->response_cache_size, NULL);
+
+    service = g_object_new (type,
+                            "authorizer", authorizer,
+                            "pool", self,
+                            "response-cache", account->response_cache,
+                            NULL);
+    g_weak_ref_set (ref, service);
+  }
+
+  g_mutex_unlock (&self->mutex);
+
+  return service;
+}
+
+/**
+ * msg_service_pool_get_drive_service:
+ * @self: a #MsgServicePool
+ * @authorizer: authorizer of the account
+ *
+ * Get the drive service of the account of @authorizer. A service is
+ * created on first use and reused while it is alive.
+ *
+ * Returns: (transfer full): a #MsgDriveService
+ */
+MsgDriveService *
+msg_service_pool_get_drive_service (MsgServicePool *self,
+                                    MsgAuthorizer  *authorizer)
+{
+  return pool_get_service (self, authorizer, MSG_TYPE_DRIVE_SERVICE);
+}
+
+/**
+ * msg_service_pool_get_mail_service:
+ * @self: a #MsgServicePool
+ * @authorizer: authorizer of the account
+ *
+ * Get the mail service of the account of @authorizer. A service is
+ * created on first use and reused while it is alive.
+ *
+ * Returns: (transfer full): a #MsgMailService
+ */
+MsgMailService *
+msg_service_pool_get_mail_service (MsgServicePool *self,
+                                   MsgAuthorizer  *authorizer)
+{
+  return pool_get_service (self, authorizer, MSG_TYPE_MAIL_SERVICE);
+}
+
+/**
+ * msg_service_pool_get_user_service:
+ * @self: a #MsgServicePool
+ * @authorizer: authorizer of the account
+ *
+ * Get the user service of the account of @authorizer. A service is
+ * created on first use and reused while it is alive.
+ *
+ * Returns: (transfer full): a #MsgUserService
+ */
+MsgUserService *
+msg_service_pool_get_user_service (MsgServicePool *self,
+                                   MsgAuthorizer  *authorizer)
+{
+  return pool_get_service (self, authorizer, MSG_TYPE_USER_SERVICE);
+}
+
+/**
+ * msg_service_pool_remove_account:
+ * @self: a #MsgServicePool
+ * @authorizer: authorizer of the account
+ *
+ * Drops the state kept for the account of @authorizer. Services already
+ * vended keep working, new ones are created on next request.
+ */
+void
+msg_service_pool_remove_account (MsgServicePool *self,
+                                 MsgAuthorizer  *authorizer)
+{
+  PoolAccount *account;
+
+  g_return_if_fail (MSG_IS_SERVICE_POOL (self));
+
+  g_mutex_lock (&self->mutex);
+
+  account = g_hash_table_lookup (self->accounts, authorizer);
+  if (account) {
+    g_hash_table_steal (self->accounts, authorizer);
+
+    /* Freed once its last waiter has been admitted */
+    if (g_queue_is_empty (&account->waiters))
+      pool_account_free (account);
+    else
+      account->removed = TRUE;
+  }
+
+  g_mutex_unlock (&self->mutex);
+}
+
+/**
+ * msg_service_pool_get_n_accounts:
+ * @self: a #MsgServicePool
+ *
+ * Get the number of accounts known to @self.
+ *
+ * Returns: number of accounts
+ */
+guint
+msg_service_pool_get_n_accounts (MsgServicePool *self)
+{
+  guint n_accounts;
+
+  g_return_val_if_fail (MSG_IS_SERVICE_POOL (self), 0);
+
+  g_mutex_lock (&self->mutex);
+  n_accounts = g_hash_table_size (self->accounts);
+  g_mutex_unlock (&self->mutex);
+
+  return n_accounts;
+}
+
+/**
+ * msg_service_pool_get_in_flight:
+ * @self: a #MsgServicePool
+ *
+ * Get the number of currently admitted requests.
+ *
+ * Returns: number of requests in flight
+ */
+guint
+msg_service_pool_get_in_flight (MsgServicePool *self)
+{
+  guint in_flight;
+
+  g_return_val_if_fail (MSG_IS_SERVICE_POOL (self), 0);
+
+  g_mutex_lock (&self->mutex);
+  in_flight = self->in_flight;
+  g_mutex_unlock (&self->mutex);
+
+  return in_flight;
+}
+
+/**
+ * msg_service_pool_acquire:
+ * @self: a #MsgServicePool
+ * @authorizer: authorizer of the requesting account
+ * @cancellable: a #GCancellable
+ * @error: a #GError
+ *
+ * Waits until a request of the account of @authorizer may be sent. Each
+ * successful call must be balanced by msg_service_pool_release().
+ *
+ * Returns: %TRUE if the request has been admitted, %FALSE on cancellation
+ */
+gboolean
+msg_service_pool_acquire (MsgServicePool  *self,
+                          MsgAuthorizer   *authorizer,
+                          GCancellable    *cancellable,
+                          GError         **error)
+{
+  PoolWaiter waiter = { NULL, };
+
+  g_return_val_if_fail (MSG_IS_SERVICE_POOL (self), FALSE);
+
+  g_mutex_lock (&self->mutex);
+
+  if (self->in_flight < self->max_in_flight && g_queue_is_empty (&self->ready)) {
+    self->in_flight++;
+    g_mutex_unlock (&self->mutex);
+    return TRUE;
+  }
+
+  waiter.account = pool_get_account (self, authorizer);
+  pool_enqueue_locked (self, &waiter);
+
+  while (!waiter.admitted) {
+    g_cond_wait_until (&self->cond, &self->mutex, g_get_monotonic_time () + POOL_POLL_INTERVAL);
+
+    if (g_cancellable_is_cancelled (cancellable) && pool_dequeue_locked (self, &waiter)) {
+      g_mutex_unlock (&self->mutex);
+      return !g_cancellable_set_error_if_cancelled (cancellable, error);
+    }
+  }
+
+  g_mutex_unlock (&self->mutex);
+
+  return TRUE;
+}
+
+static void
+pool_waiter_cancelled_cb (__attribute__ ((unused)) GCancellable *cancellable,
+                          gpointer                               user_data)
+{
+  GTask *task = G_TASK (user_data);
+  MsgServicePool *self = g_task_get_source_object (task);
+  PoolWaiter *waiter = g_task_get_task_data (task);
+  gboolean removed;
+
+  /* Without a task the waiter is not queued yet or already admitted */
+  g_mutex_lock (&self->mutex);
+  removed = waiter->task && pool_dequeue_locked (self, waiter);
+  if (removed)
+    waiter->task = NULL;
+  g_mutex_unlock (&self->mutex);
+
+  if (removed) {
+    g_task_return_error_if_cancelled (task);
+    g_object_unref (task);
+  }
+}
+
+/**
+ * msg_service_pool_acquire_async:
+ * @self: a #MsgServicePool
+ * @authorizer: authorizer of the requesting account
+ * @cancellable: a #GCancellable
+ * @callback: (scope async): a #GAsyncReadyCallback to call when the request is admitted
+ * @user_data: (closure): the data to pass to @callback
+ *
+ * Asynchronously waits until a request of the account of @authorizer
+ * may be sent. See msg_service_pool_acquire() for the synchronous
+ * version of this call.
+ */
+void
+msg_service_pool_acquire_async (MsgServicePool      *self,
+                                MsgAuthorizer       *authorizer,
+                                GCancellable        *cancellable,
+                                GAsyncReadyCallback  callback,
+                                gpointer             user_data)
+{
+  g_autoptr (GTask) task = NULL;
+  PoolWaiter *waiter;
+
+  g_return_if_fail (MSG_IS_SERVICE_POOL (self));
+
+  task = g_task_new (self, cancellable, callback, user_data);
+  g_task_set_source_tag (task, msg_service_pool_acquire_async);
+
+  if (g_task_return_error_if_cancelled (task))
+    return;
+
+  g_mutex_lock (&self->mutex);
+
+  if (self->in_flight < self->max_in_flight && g_queue_is_empty (&self->ready)) {
+    self->in_flight++;
+    g_mutex_unlock (&self->mutex);
+    g_task_return_boolean (task, TRUE);
+    return;
+  }
+
+  g_mutex_unlock (&self->mutex);
+
+  waiter = g_new0 (PoolWaiter, 1);
+  g_task_set_task_data (task, waiter, g_free);
+
+  /* Not connected while locked, as the handler runs at once if already
+   * cancelled. Connected before queueing, so that completion always
+   * sees the handler id. */
+  if (cancellable)
+    waiter->cancelled_id = g_cancellable_connect (cancellable, G_CALLBACK (pool_waiter_cancelled_cb), g_object_ref (task), g_object_unref);
+
+  g_mutex_lock (&self->mutex);
+
+  if (g_cancellable_is_cancelled (cancellable)) {
+    g_mutex_unlock (&self->mutex);
+    g_cancellable_disconnect (cancellable, waiter->cancelled_id);
+    g_task_return_error_if_cancelled (task);
+    return;
+  }
+
+  if (self->in_flight < self->max_in_flight && g_queue_is_empty (&self->ready)) {
+    self->in_flight++;
+    g_mutex_unlock (&self->mutex);
+    g_cancellable_disconnect (cancellable, waiter->cancelled_id);
+    g_task_return_boolean (task, TRUE);
+    return;
+  }
+
+  /* The queue owns a reference until the waiter is admitted or cancelled */
+  waiter->task = g_object_ref (task);
+  waiter->account = pool_get_account (self, authorizer);
+  pool_enqueue_locked (self, waiter);
+
+  g_mutex_unlock (&self->mutex);
+}
+
+/**
+ * msg_service_pool_acquire_finish:
+ * @self: a #MsgServicePool
+ * @result: a #GAsyncResult
+ * @error: a #GError
+ *
+ * Finishes an asynchronous operation started with
+ * msg_service_pool_acquire_async().
+ *
+ * Returns: %TRUE if the request has been admitted, %FALSE on cancellation
+ */
+gboolean
+msg_service_pool_acquire_finish (MsgServicePool  *self,
+                                 GAsyncResult    *result,
+                                 GError         **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, self), FALSE);
+  g_return_val_if_fail (g_async_result_is_tagged (result, msg_service_pool_acquire_async), FALSE);
+
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+/**
+ * msg_service_pool_throttle:
+ * @self: a #MsgServicePool
+ * @authorizer: authorizer of the throttled account
+ * @until: end of the throttle window in monotonic time
+ *
+ * Holds back the requests of all services of the account of @authorizer
+ * until @until, as the server throttles per account and not per service.
+ * An already active throttle window is only ever extended.
+ */
+void
+msg_service_pool_throttle (MsgServicePool *self,
+                           MsgAuthorizer  *authorizer,
+                           gint64          until)
+{
+  PoolAccount *account;
+
+  g_return_if_fail (MSG_IS_SERVICE_POOL (self));
+  g_return_if_fail (MSG_IS_AUTHORIZER (authorizer));
+
+  g_mutex_lock (&self->mutex);
+  account = pool_get_account (self, authorizer);
+  account->throttled_until = MAX (account->throttled_until, until);
+  g_mutex_unlock (&self->mutex);
+}
+
+/**
+ * msg_service_pool_get_throttled_until:
+ * @self: a #MsgServicePool
+ * @authorizer: authorizer of an account
+ *
+ * Get the end of the throttle window of the account of @authorizer set by
+ * msg_service_pool_throttle().
+ *
+ * Returns: end of the window in monotonic time, in the past or 0 if the
+ *   account is not throttled
+ */
+gint64
+msg_service_pool_get_throttled_until (MsgServicePool *self,
+                                      MsgAuthorizer  *authorizer)
+{
+  PoolAccount *account;
+  gint64 until = 0;
+
+  g_return_val_if_fail (MSG_IS_SERVICE_POOL (self), 0);
+
+  g_mutex_lock (&self->mutex);
+  account = g_hash_table_lookup (self->accounts, authorizer);
+  if (account)
+    until = account->throttled_until;
+  g_mutex_unlock (&self->mutex);
+
+  return until;
+}
+
+/**
+ * msg_service_pool_release:
+ * @self: a #MsgServicePool
+ *
+ * Releases a request admitted by msg_service_pool_acquire() and admits
+ * the next waiting one.
+ */
+void
+msg_service_pool_release (MsgServicePool *self)
+{
+  GSList *tasks;
+
+  g_return_if_fail (MSG_IS_SERVICE_POOL (self));
+
+  g_mutex_lock (&self->mutex);
+  g_warn_if_fail (self->in_flight > 0);
+  if (self->in_flight > 0)
+    self->in_flight--;
+  tasks = pool_admit_locked (self);
+  g_mutex_unlock (&self->mutex);
+
+  pool_complete_waiters (tasks);
+}
@@ -0,0 +1,97 @@
+/* Copyright 2024 Jan-Michael Brummer <jan-michael.brummer1@volkswagen.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <glib-object.h>
+#include <libsoup/soup.h>
+
+#include <msg-authorizer.h>
+#include <drive/msg-drive-service.h>
+#include <mail/msg-mail-service.h>
+#include <user/msg-user-service.h>
+
+G_BEGIN_DECLS
+
+#define MSG_TYPE_SERVICE_POOL (msg_service_pool_get_type ())
+
+G_DECLARE_FINAL_TYPE (MsgServicePool, msg_service_pool, MSG, SERVICE_POOL, GObject);
+
+MsgServicePool *
+msg_service_pool_new (guint max_conns,
+                      guint max_conns_per_host);
+
+SoupSession *
+msg_service_pool_get_session (MsgServicePool *self);
+
+void
+msg_service_pool_set_response_cache_size (MsgServicePool *self,
+                                          gsize           size);
+
+MsgDriveService *
+msg_service_pool_get_drive_service (MsgServicePool *self,
+                                    MsgAuthorizer  *authorizer);
+
+MsgMailService *
+msg_service_pool_get_mail_service (MsgServicePool *self,
+                                   MsgAuthorizer  *authorizer);
+
+MsgUserService *
+msg_service_pool_get_user_service (MsgServicePool *self,
+                                   MsgAuthorizer  *authorizer);
+
+void
+msg_service_pool_remove_account (MsgServicePool *self,
+                                 MsgAuthorizer  *authorizer);
+
+guint
+msg_service_pool_get_n_accounts (MsgServicePool *self);
+
+guint
+msg_service_pool_get_in_flight (MsgServicePool *self);
+
+gboolean
+msg_service_pool_acquire (MsgServicePool  *self,
+                          MsgAuthorizer   *authorizer,
+                          GCancellable    *cancellable,
+                          GError         **error);
+
+void
+msg_service_pool_acquire_async (MsgServicePool      *self,
+                                MsgAuthorizer       *authorizer,
+                                GCancellable        *cancellable,
+                                GAsyncReadyCallback  callback,
+                                gpointer             user_data);
+
+gboolean
+msg_service_pool_acquire_finish (MsgServicePool  *self,
+                                 GAsyncResult    *result,
+                                 GError         **error);
+
+void
+msg_service_pool_release (MsgServicePool *self);
+
+void
+msg_service_pool_throttle (MsgServicePool *self,
+                           MsgAuthorizer  *authorizer,
+                           gint64          until);
+
+gint64
+msg_service_pool_get_throttled_until (MsgServicePool *self,
+                                      MsgAuthorizer  *authorizer);
+
+G_END_DECLS
@@ -0,0 +1,333 @@
+/* Copyright 2024 Jan-Michael Brummer <jan-michael.brummer1@volkswagen.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "msg-service-stats.h"
+
+/* Histogram bucket i counts durations below 2^i ms, the last one all others */
+#define HISTOGRAM_BUCKETS 17
+
+typedef struct {
+  guint64 count;
+  guint64 sum_ms;
+  guint64 buckets[HISTOGRAM_BUCKETS];
+} Histogram;
+
+typedef struct {
+  guint64 requests;
+  GHashTable *status;
+  guint64 retries;
+  guint64 retry_wait_ms;
+  guint64 bytes_sent;
+  guint64 bytes_received;
+  Histogram ttfb;
+  Histogram latency;
+} EndpointStats;
+
+struct _MsgServiceStats {
+  GMutex mutex;
+  GHashTable *endpoints;
+};
+
+static void
+endpoint_stats_free (EndpointStats *endpoint)
+{
+  g_hash_table_unref (endpoint->status);
+  g_free (endpoint);
+}
+
+MsgServiceStats *
+msg_service_stats_new (void)
+{
+  MsgServiceStats *stats = g_new0 (MsgServiceStats, 1);
+
+  g_mutex_init (&stats->mutex);
+  stats->endpoints = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify)endpoint_stats_free);
+
+  return stats;
+}
+
+void
+msg_service_stats_free (MsgServiceStats *stats)
+{
+  g_hash_table_unref (stats->endpoints);
+  g_mutex_clear (&stats->mutex);
+  g_free (stats);
+}
+
+static gboolean
+is_id_segment (const char *segment)
+{
+  if (strlen (segment) > 20)
+    return TRUE;
+
+  for (const char *p = segment; *p; p++) {
+    if (g_ascii_isdigit (*p) || strchr ("!@=.,'", *p))
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
+/**
+ * msg_service_stats_get_endpoint:
+ * @message: a #SoupMessage
+ *
+ * Creates the endpoint template of @message by replacing ids within the
+ * path, e.g. `GET /drives/{id}/items/{id}/children`.
+ *
+ * Returns: (transfer full): endpoint template
+ */
+char *
+msg_service_stats_get_endpoint (SoupMessage *message)
+{
+  GString *endpoint = g_string_new (soup_message_get_method (message));
+  g_auto (GStrv) segments = NULL;
+  const char *path = g_uri_get_path (soup_message_get_uri (message));
+  gboolean skipped_version = FALSE;
+
+  g_string_append_c (endpoint, ' ');
+  segments = g_strsplit (path, "/", -1);
+
+  for (guint index = 0; segments[index]; index++) {
+    const char *segment = segments[index];
+
+    if (!*segment)
+      continue;
+
+    /* API version is not part of the endpoint */
+    if (!skipped_version && (g_strcmp0 (segment, "v1.0") == 0 || g_strcmp0 (segment, "beta") == 0)) {
+      skipped_version = TRUE;
+      continue;
+    }
+
+    /* Path based addressing, e.g. root:/folder/file.txt: */
+    if (strchr (segment, ':')) {
+      g_autofree char *name = g_strndup (segment, strcspn (segment, ":"));
+
+      g_string_append_printf (endpoint, "/%s:{path}", name);
+      break;
+    }
+
+    g_string_append_c (endpoint, '/');
+    g_string_append (endpoint, is_id_segment (segment) ? "{id}" : segment);
+  }
+
+  if (endpoint->str[endpoint->len - 1] == ' ')
+    g_string_append_c (endpoint, '/');
+
+  return g_string_free (endpoint, FALSE);
+}
+
+/* Must be called locked */
+static EndpointStats *
+stats_lookup (MsgServiceStats *stats,
+              SoupMessage     *message)
+{
+  g_autofree char *name = msg_service_stats_get_endpoint (message);
+  EndpointStats *endpoint = g_hash_table_lookup (stats->endpoints, name);
+
+  if (!endpoint) {
+    endpoint = g_new0 (EndpointStats, 1);
+    endpoint->status = g_hash_table_new (g_direct_hash, g_direct_equal);
+    g_hash_table_insert (stats->endpoints, g_steal_pointer (&name), endpoint);
+  }
+
+  return endpoint;
+}
+
+static void
+histogram_add (Histogram *histogram,
+               guint64    ms)
+{
+  guint bucket = 0;
+
+  while (bucket < HISTOGRAM_BUCKETS - 1 && ms >= (G_GUINT64_CONSTANT (1) << bucket))
+    bucket++;
+
+  histogram->count++;
+  histogram->sum_ms += ms;
+  histogram->buckets[bucket]++;
+}
+
+/**
+ * msg_service_stats_record_message:
+ * @stats: a #MsgServiceStats
+ * @message: a finished #SoupMessage collecting metrics
+ *
+ * Records status, transferred bytes and timings of @message.
+ */
+void
+msg_service_stats_record_message (MsgServiceStats *stats,
+                                  SoupMessage     *message)
+{
+  SoupMessageMetrics *metrics = soup_message_get_metrics (message);
+  EndpointStats *endpoint;
+  guint status = soup_message_get_status (message);
+  guint64 count;
+
+  g_mutex_lock (&stats->mutex);
+
+  endpoint = stats_lookup (stats, message);
+  endpoint->requests++;
+
+  count = GPOINTER_TO_UINT (g_hash_table_lookup (endpoint->status, GUINT_TO_POINTER (status)));
+  g_hash_table_insert (endpoint->status, GUINT_TO_POINTER (status), GUINT_TO_POINTER (count + 1));
+
+  if (metrics) {
+    guint64 fetch_start = soup_message_metrics_get_fetch_start (metrics);
+    guint64 response_start = soup_message_metrics_get_response_start (metrics);
+    guint64 response_end = soup_message_metrics_get_response_end (metrics);
+
+    endpoint->bytes_sent += soup_message_metrics_get_request_header_bytes_sent (metrics) +
+                            soup_message_metrics_get_request_body_bytes_sent (metrics);
+    endpoint->bytes_received += soup_message_metrics_get_response_header_bytes_received (metrics) +
+                                soup_message_metrics_get_response_body_bytes_received (metrics);
+
+    /* Timestamps are in microseconds, unset ones are 0 */
+    if (fetch_start && response_start >= fetch_start)
+      histogram_add (&endpoint->ttfb, (response_start - fetch_start) / 1000);
+
+    if (fetch_start && response_end >= fetch_start)
+      histogram_add (&endpoint->latency, (response_end - fetch_start) / 1000);
+  }
+
+  g_mutex_unlock (&stats->mutex);
+}
+
+/**
+ * msg_service_stats_record_retry:
+ * @stats: a #MsgServiceStats
+ * @message: a #SoupMessage which is going to be resent
+ * @delay_ms: time waited before resending
+ *
+ * Records a retry of @message, e.g. due to throttling.
+ */
+void
+msg_service_stats_record_retry (MsgServiceStats *stats,
+                                SoupMessage     *message,
+                                gint64           delay_ms)
+{
+  EndpointStats *endpoint;
+
+  g_mutex_lock (&stats->mutex);
+
+  endpoint = stats_lookup (stats, message);
+  endpoint->retries++;
+  endpoint->retry_wait_ms += MAX (delay_ms, 0);
+
+  g_mutex_unlock (&stats->mutex);
+}
+
+static JsonNode *
+histogram_to_json (Histogram *histogram)
+{
+  g_autoptr (JsonBuilder) builder = json_builder_new ();
+
+  json_builder_begin_object (builder);
+  json_builder_set_member_name (builder, "count");
+  json_builder_add_int_value (builder, histogram->count);
+  json_builder_set_member_name (builder, "sum-ms");
+  json_builder_add_int_value (builder, histogram->sum_ms);
+  json_builder_set_member_name (builder, "buckets");
+  json_builder_begin_array (builder);
+  for (guint index = 0; index < HISTOGRAM_BUCKETS; index++)
+    json_builder_add_int_value (builder, histogram->buckets[index]);
+  json_builder_end_array (builder);
+  json_builder_end_object (builder);
+
+  return json_builder_get_root (builder);
+}
+
+/**
+ * msg_service_stats_to_json:
+ * @stats: a #MsgServiceStats
+ *
+ * Creates a snapshot of all recorded statistics.
+ *
+ * Returns: (transfer full): a #JsonNode holding an object
+ */
+JsonNode *
+msg_service_stats_to_json (MsgServiceStats *stats)
+{
+  g_autoptr (JsonBuilder) builder = json_builder_new ();
+  GHashTableIter iter;
+  gpointer key;
+  gpointer value;
+
+  g_mutex_lock (&stats->mutex);
+
+  json_builder_begin_object (builder);
+
+  g_hash_table_iter_init (&iter, stats->endpoints);
+  while (g_hash_table_iter_next (&iter, &key, &value)) {
+    EndpointStats *endpoint = value;
+    GHashTableIter status_iter;
+    gpointer status;
+    gpointer count;
+
+    json_builder_set_member_name (builder, key);
+    json_builder_begin_object (builder);
+
+    json_builder_set_member_name (builder, "requests");
+    json_builder_add_int_value (builder, endpoint->requests);
+
+    json_builder_set_member_name (builder, "status");
+    json_builder_begin_object (builder);
+    g_hash_table_iter_init (&status_iter, endpoint->status);
+    while (g_hash_table_iter_next (&status_iter, &status, &count)) {
+      g_autofree char *name = g_strdup_printf ("%u", GPOINTER_TO_UINT (status));
+
+      json_builder_set_member_name (builder, name);
+      json_builder_add_int_value (builder, GPOINTER_TO_UINT (count));
+    }
+    json_builder_end_object (builder);
+
+    json_builder_set_member_name (builder, "retries");
+    json_builder_add_int_value (builder, endpoint->retries);
+    json_builder_set_member_name (builder, "retry-wait-ms");
+    json_builder_add_int_value (builder, endpoint->retry_wait_ms);
+    json_builder_set_member_name (builder, "bytes-sent");
+    json_builder_add_int_value (builder, endpoint->bytes_sent);
+    json_builder_set_member_name (builder, "bytes-received");
+    json_builder_add_int_value (builder, endpoint->bytes_received);
+    json_builder_set_member_name (builder, "ttfb");
+    json_builder_add_value (builder, histogram_to_json (&endpoint->ttfb));
+    json_builder_set_member_name (builder, "latency");
+    json_builder_add_value (builder, histogram_to_json (&endpoint->latency));
+
+    json_builder_end_object (builder);
+  }
+
+  json_builder_end_object (builder);
+
+  g_mutex_unlock (&stats->mutex);
+
+  return json_builder_get_root (builder);
+}
+
+/**
+ * msg_service_stats_reset:
+ * @stats: a #MsgServiceStats
+ *
+ * Drops all recorded statistics.
+ */
+void
+msg_service_stats_reset (MsgServiceStats *stats)
+{
+  g_mutex_lock (&stats->mutex);
+  g_hash_table_remove_all (stats->endpoints);
+  g_mutex_unlock (&stats->mutex);
+}
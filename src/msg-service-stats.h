@@ -0,0 +1,58 @@
+/* Copyright 2024 Jan-Michael Brummer <jan-michael.brummer1@volkswagen.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <libsoup/soup.h>
+#include <json-glib/json-glib.h>
+
+#include "msg-service.h"
+
+G_BEGIN_DECLS
+
+/* Internal per endpoint request statistics of a MsgService */
+
+typedef struct _MsgServiceStats MsgServiceStats;
+
+MsgServiceStats *
+msg_service_stats_new (void);
+
+void
+msg_service_stats_free (MsgServiceStats *stats);
+
+char *
+msg_service_stats_get_endpoint (SoupMessage *message);
+
+void
+msg_service_stats_record_message (MsgServiceStats *stats,
+                                  SoupMessage     *message);
+
+void
+msg_service_stats_record_retry (MsgServiceStats *stats,
+                                SoupMessage     *message,
+                                gint64           delay_ms);
+
+JsonNode *
+msg_service_stats_to_json (MsgServiceStats *stats);
+
+void
+msg_service_stats_reset (MsgServiceStats *stats);
+
+void
+msg_service_track_message (MsgService  *self,
+                           SoupMessage *message);
+
+G_END_DECLS
@@ -17,23 +17,61 @@
 #include "config.h"
 #include "msg-service.h"
 
+#include "msg-concurrency-limiter.h"
 #include "msg-error.h"
 #include "msg-json-utils.h"
 #include "msg-private.h"
+#include "msg-response-cache.h"
+#include "msg-service-pool.h"
+#include "msg-service-stats.h"
 
 typedef struct _MsgServicePrivate MsgServicePrivate;
 struct _MsgServicePrivate {
   MsgAuthorizer *authorizer;
   SoupSession *session;
+  MsgServicePool *pool;
+
+  /* Throttling: requests are held back until throttled_until (monotonic time) */
+  GMutex throttle_mutex;
+  GCond throttle_cond;
+  gint64 throttled_until;
+
+  /* Retry budget in thousandths of a retry, guarded by throttle_mutex */
+  int retry_budget;
+
+  /* Adaptive cap on the requests in flight of this account */
+  MsgConcurrencyLimiter *limiter;
+
+  gboolean prefetch_pages;
+  MsgResponseCache *response_cache;
+  MsgServiceStats *stats;
 };
 
 G_DEFINE_TYPE_WITH_PRIVATE (MsgService, msg_service, G_TYPE_OBJECT);
 
+/* Transient failures are retried with decorrelated jitter backoff */
+#define RETRY_MAX_ATTEMPTS 4
+#define RETRY_BASE_DELAY_MS 500
+#define RETRY_MAX_DELAY_MS 30000
+
+/* Each retry costs one token, each successful request earns a tenth of
+ * one, so that retries cannot amplify an outage */
+#define RETRY_BUDGET_MAX 10000
+#define RETRY_BUDGET_COST 1000
+#define RETRY_BUDGET_DEPOSIT 100
+
+/* Retry-After: 0 would resend throttled requests at once */
+#define THROTTLE_MIN_SECONDS 1
+
 #define MSG_SERVICE_GET_PRIVATE(o)  ((MsgServicePrivate *)msg_service_get_instance_private ((o)))
 
 enum {
   PROP_0,
   PROP_AUTHORIZER,
+  PROP_SESSION,
+  PROP_PREFETCH_PAGES,
+  PROP_RESPONSE_CACHE,
+  PROP_POOL,
   PROP_COUNT
 };
 
@@ -144,6 +182,287 @@ msg_service_build_message (MsgService *self,
   return message;
 }
 
+/* Returns the cache key in case @message is cacheable and adds a
+ * conditional header if a response is already cached. */
+static char *
+msg_service_cache_prepare (MsgService   *self,
+                           SoupMessage  *message,
+                           char        **etag)
+{
+  MsgServicePrivate *priv = MSG_SERVICE_GET_PRIVATE (self);
+  SoupMessageHeaders *headers = soup_message_get_request_headers (message);
+  char *key;
+
+  if (!priv->response_cache || g_strcmp0 (soup_message_get_method (message), SOUP_METHOD_GET) != 0)
+    return NULL;
+
+  /* Conditional and partial requests are handled by the caller */
+  if (soup_message_headers_get_one (headers, "If-None-Match") ||
+      soup_message_headers_get_one (headers, "If-Match") ||
+      soup_message_headers_get_one (headers, "Range"))
+    return NULL;
+
+  key = g_uri_to_string (soup_message_get_uri (message));
+  *etag = msg_response_cache_lookup_etag (priv->response_cache, key);
+  if (*etag)
+    soup_message_headers_replace (headers, "If-None-Match", *etag);
+
+  return key;
+}
+
+/* Replaces @bytes by the cached body on 304 or stores a fresh response.
+ * Returns %FALSE in case the request has to be sent again unconditionally,
+ * as the cached response is gone in the meantime. */
+static gboolean
+msg_service_cache_process (MsgService   *self,
+                           SoupMessage  *message,
+                           const char   *key,
+                           char        **etag,
+                           GBytes      **bytes)
+{
+  MsgServicePrivate *priv = MSG_SERVICE_GET_PRIVATE (self);
+  guint status = soup_message_get_status (message);
+
+  if (status == SOUP_STATUS_NOT_MODIFIED && *etag) {
+    GBytes *cached = msg_response_cache_revalidated (priv->response_cache, key, *etag);
+
+    if (!cached) {
+      soup_message_headers_remove (soup_message_get_request_headers (message), "If-None-Match");
+      g_clear_pointer (etag, g_free);
+      g_clear_pointer (bytes, g_bytes_unref);
+      return FALSE;
+    }
+
+    g_bytes_unref (*bytes);
+    *bytes = cached;
+  } else if (status == SOUP_STATUS_OK) {
+    const char *response_etag = soup_message_headers_get_one (soup_message_get_response_headers (message), "ETag");
+
+    msg_response_cache_update (priv->response_cache, key, response_etag, *bytes);
+  }
+
+  return TRUE;
+}
+
+static gboolean
+is_idempotent (SoupMessage *message)
+{
+  const char *method = soup_message_get_method (message);
+
+  return g_strcmp0 (method, SOUP_METHOD_GET) == 0 ||
+         g_strcmp0 (method, SOUP_METHOD_HEAD) == 0 ||
+         g_strcmp0 (method, SOUP_METHOD_PUT) == 0 ||
+         g_strcmp0 (method, SOUP_METHOD_DELETE) == 0;
+}
+
+static gboolean
+is_transient_error (const GError *error)
+{
+  if (error->domain == G_TLS_ERROR)
+    return error->code == G_TLS_ERROR_MISC || error->code == G_TLS_ERROR_EOF;
+
+  return g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CONNECTION_CLOSED) ||
+         g_error_matches (error, G_IO_ERROR, G_IO_ERROR_BROKEN_PIPE) ||
+         g_error_matches (error, G_IO_ERROR, G_IO_ERROR_NOT_CONNECTED) ||
+         g_error_matches (error, G_IO_ERROR, G_IO_ERROR_TIMED_OUT) ||
+         g_error_matches (error, G_IO_ERROR, G_IO_ERROR_PARTIAL_INPUT);
+}
+
+/* Returns the delay in ms before @message should be resent after
+ * @attempt failed attempts, or -1 if the result is final. @backoff keeps
+ * the previous delay for decorrelated jitter. */
+static gint64
+msg_service_get_retry_delay (MsgService   *self,
+                             SoupMessage  *message,
+                             const GError *error,
+                             guint         attempt,
+                             gint64       *backoff)
+{
+  MsgServicePrivate *priv = MSG_SERVICE_GET_PRIVATE (self);
+  gboolean transient;
+  gint64 delay;
+  int retry_after = -1;
+
+  if (error) {
+    transient = is_transient_error (error) && is_idempotent (message);
+  } else {
+    guint status = soup_message_get_status (message);
+
+    retry_after = msg_service_get_retry_after (message);
+    if (status == SOUP_STATUS_TOO_MANY_REQUESTS && retry_after >= 0)
+      msg_service_throttle (self, MAX (retry_after, THROTTLE_MIN_SECONDS));
+
+    /* Other methods may have taken effect already, unless a Retry-After
+     * tells that the request has not been processed */
+    if (is_idempotent (message))
+      transient = status == SOUP_STATUS_SERVICE_UNAVAILABLE ||
+                  status == SOUP_STATUS_GATEWAY_TIMEOUT ||
+                  status == SOUP_STATUS_TOO_MANY_REQUESTS;
+    else
+      transient = (status == SOUP_STATUS_SERVICE_UNAVAILABLE ||
+                   status == SOUP_STATUS_TOO_MANY_REQUESTS) && retry_after >= 0;
+  }
+
+  g_mutex_lock (&priv->throttle_mutex);
+  if (!transient) {
+    priv->retry_budget = MIN (priv->retry_budget + RETRY_BUDGET_DEPOSIT, RETRY_BUDGET_MAX);
+    g_mutex_unlock (&priv->throttle_mutex);
+    return -1;
+  }
+
+  if (attempt >= RETRY_MAX_ATTEMPTS || priv->retry_budget < RETRY_BUDGET_COST) {
+    g_mutex_unlock (&priv->throttle_mutex);
+    return -1;
+  }
+
+  priv->retry_budget -= RETRY_BUDGET_COST;
+  g_mutex_unlock (&priv->throttle_mutex);
+
+  /* Decorrelated jitter: random between base and three times the last delay */
+  delay = g_random_double_range (RETRY_BASE_DELAY_MS, MAX (*backoff, RETRY_BASE_DELAY_MS) * 3);
+  delay = MIN (delay, RETRY_MAX_DELAY_MS);
+  *backoff = delay;
+
+  if (retry_after > 0)
+    delay = MAX (delay, (gint64)retry_after * 1000);
+
+  msg_service_stats_record_retry (priv->stats, message, delay);
+
+  return delay;
+}
+
+/* Sleeps for @delay ms unless @cancellable is cancelled */
+static gboolean
+msg_service_backoff (gint64         delay,
+                     GCancellable  *cancellable,
+                     GError       **error)
+{
+  GPollFD poll_fd;
+
+  if (g_cancellable_make_pollfd (cancellable, &poll_fd)) {
+    g_poll (&poll_fd, 1, delay);
+    g_cancellable_release_fd (cancellable);
+  } else {
+    g_usleep (delay * 1000);
+  }
+
+  return !g_cancellable_set_error_if_cancelled (cancellable, error);
+}
+
+/* Messages to pre-authenticated urls, e.g. upload sessions, must not
+ * carry the access token of the account */
+static gboolean
+is_preauthenticated (SoupMessage *message)
+{
+  return g_object_get_data (G_OBJECT (message), "msg-preauthenticated") != NULL;
+}
+
+/* Whether the access token of @message has been rejected */
+static gboolean
+is_unauthorized (SoupMessage *message,
+                 GBytes      *bytes)
+{
+  guint status = soup_message_get_status (message);
+  gsize len;
+  const char *data;
+
+  if (is_preauthenticated (message))
+    return FALSE;
+
+  if (status == SOUP_STATUS_UNAUTHORIZED)
+    return TRUE;
+
+  if (!bytes || status < 400)
+    return FALSE;
+
+  data = g_bytes_get_data (bytes, &len);
+  return data && g_strstr_len (data, len, "\"InvalidAuthenticationToken\"") != NULL;
+}
+
+static void
+msg_service_sign_message (MsgService  *self,
+                          SoupMessage *message)
+{
+  MsgServicePrivate *priv = MSG_SERVICE_GET_PRIVATE (self);
+
+  soup_message_headers_remove (soup_message_get_request_headers (message), "Authorization");
+  if (!is_preauthenticated (message))
+    msg_authorizer_process_request (priv->authorizer, message);
+}
+
+/* Refreshes the rejected access token, shared with concurrent callers,
+ * and signs @message again */
+static gboolean
+msg_service_reauthorize (MsgService    *self,
+                         SoupMessage   *message,
+                         GCancellable  *cancellable,
+                         GError       **error)
+{
+  MsgServicePrivate *priv = MSG_SERVICE_GET_PRIVATE (self);
+
+  msg_authorizer_invalidate_authorization (priv->authorizer);
+  if (!msg_authorizer_refresh_authorization (priv->authorizer, cancellable, error))
+    return FALSE;
+
+  msg_service_sign_message (self, message);
+  return TRUE;
+}
+
+/* Waits until the concurrency limit, and the pool if any, admit a request */
+static gboolean
+msg_service_admit (MsgService    *self,
+                   GCancellable  *cancellable,
+                   GError       **error)
+{
+  MsgServicePrivate *priv = MSG_SERVICE_GET_PRIVATE (self);
+
+  if (!msg_concurrency_limiter_acquire (priv->limiter, cancellable, error))
+    return FALSE;
+
+  if (priv->pool && !msg_service_pool_acquire (priv->pool, priv->authorizer, cancellable, error)) {
+    msg_concurrency_limiter_release (priv->limiter, SOUP_STATUS_NONE, 0);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/* Time until the response headers of @message, as the send_and_read
+ * variants only return once the whole body has been received */
+static gint64
+msg_service_get_latency (SoupMessage *message,
+                         gint64       started)
+{
+  SoupMessageMetrics *metrics = soup_message_get_metrics (message);
+
+  if (metrics) {
+    guint64 fetch_start = soup_message_metrics_get_fetch_start (metrics);
+    guint64 response_start = soup_message_metrics_get_response_start (metrics);
+
+    if (fetch_start && response_start >= fetch_start)
+      return response_start - fetch_start;
+  }
+
+  return g_get_monotonic_time () - started;
+}
+
+/* Balances msg_service_admit() and adapts the concurrency limit */
+static void
+msg_service_dismiss (MsgService  *self,
+                     SoupMessage *message,
+                     gboolean     responded,
+                     gint64       started)
+{
+  MsgServicePrivate *priv = MSG_SERVICE_GET_PRIVATE (self);
+
+  if (priv->pool)
+    msg_service_pool_release (priv->pool);
+
+  msg_concurrency_limiter_release (priv->limiter,
+                                   responded ? soup_message_get_status (message) : SOUP_STATUS_NONE,
+                                   msg_service_get_latency (message, started));
+}
+
 /**
  * msg_service_send:
  * @self: a msg service
@@ -151,7 +470,13 @@ msg_service_build_message (MsgService *self,
  * @cancellable: a #GCancellable
  * @error: a #Gerror
  *
- * Adds authorizer information to `message` and send it.
+ * Adds authorizer information to `message` and send it. Transient
+ * failures of idempotent requests (503, 504, 429 and connection resets)
+ * are resent with jittered exponential backoff as long as the retry
+ * budget of the service allows. Other requests are only resent on 429
+ * and 503 with a Retry-After header. Throttled requests count as
+ * retries as well and hold back the whole service. If the access token is rejected, it is
+ * refreshed and @message is replayed once.
  *
  * Returns: (transfer full): a #GInputStream
  */
@@ -163,13 +488,57 @@ msg_service_send (MsgService    *self,
 {
   MsgServicePrivate *priv = MSG_SERVICE_GET_PRIVATE (self);
   GInputStream *stream;
+  gboolean reauthorized = FALSE;
+  guint attempt = 0;
+  gint64 backoff = 0;
+  gint64 delay;
+  gint64 started;
 
-  msg_authorizer_process_request (priv->authorizer, message);
+  msg_service_sign_message (self, message);
+  msg_service_track_message (self, message);
 
 retry:
-  stream = soup_session_send (priv->session, message, cancellable, error);
-  if (msg_service_handle_rate_limiting (message))
-    goto retry;
+  {
+    g_autoptr (GError) local_error = NULL;
+
+    if (!msg_service_wait_for_throttle (self, cancellable, error))
+      return NULL;
+
+    if (!msg_service_admit (self, cancellable, error))
+      return NULL;
+
+    started = g_get_monotonic_time ();
+    stream = soup_session_send (priv->session, message, cancellable, &local_error);
+    msg_service_dismiss (self, message, stream != NULL, started);
+
+    delay = msg_service_get_retry_delay (self, message, local_error, attempt++, &backoff);
+    if (delay >= 0) {
+      if (stream) {
+        g_input_stream_close (stream, NULL, NULL);
+        g_clear_object (&stream);
+      }
+
+      if (!msg_service_backoff (delay, cancellable, error))
+        return NULL;
+
+      goto retry;
+    }
+
+    /* Replay once with a fresh token */
+    if (stream && !reauthorized && is_unauthorized (message, NULL)) {
+      reauthorized = TRUE;
+      g_input_stream_close (stream, NULL, NULL);
+      g_clear_object (&stream);
+
+      if (!msg_service_reauthorize (self, message, cancellable, error))
+        return NULL;
+
+      goto retry;
+    }
+
+    if (local_error)
+      g_propagate_error (error, g_steal_pointer (&local_error));
+  }
 
   return stream;
 }
@@ -192,13 +561,61 @@ msg_service_send_and_read (MsgService    *self,
                            GError       **error)
 {
   MsgServicePrivate *priv = MSG_SERVICE_GET_PRIVATE (self);
+  g_autofree char *cache_key = NULL;
+  g_autofree char *cache_etag = NULL;
   GBytes *bytes;
+  gboolean reauthorized = FALSE;
+  guint attempt = 0;
+  gint64 backoff = 0;
+  gint64 delay;
+  gint64 started;
 
-  msg_authorizer_process_request (priv->authorizer, message);
+  msg_service_sign_message (self, message);
+  msg_service_track_message (self, message);
+  cache_key = msg_service_cache_prepare (self, message, &cache_etag);
 
 retry:
-  bytes = soup_session_send_and_read (priv->session, message, cancellable, error);
-  if (msg_service_handle_rate_limiting (message))
+  {
+    g_autoptr (GError) local_error = NULL;
+
+    if (!msg_service_wait_for_throttle (self, cancellable, error))
+      return NULL;
+
+    if (!msg_service_admit (self, cancellable, error))
+      return NULL;
+
+    started = g_get_monotonic_time ();
+    bytes = soup_session_send_and_read (priv->session, message, cancellable, &local_error);
+    msg_service_dismiss (self, message, bytes != NULL, started);
+
+    delay = msg_service_get_retry_delay (self, message, local_error, attempt++, &backoff);
+    if (delay >= 0) {
+      g_clear_pointer (&bytes, g_bytes_unref);
+
+      if (!msg_service_backoff (delay, cancellable, error))
+        return NULL;
+
+      goto retry;
+    }
+
+    if (local_error) {
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return NULL;
+    }
+
+    /* Replay once with a fresh token */
+    if (!reauthorized && is_unauthorized (message, bytes)) {
+      reauthorized = TRUE;
+      g_clear_pointer (&bytes, g_bytes_unref);
+
+      if (!msg_service_reauthorize (self, message, cancellable, error))
+        return NULL;
+
+      goto retry;
+    }
+  }
+
+  if (cache_key && !msg_service_cache_process (self, message, cache_key, &cache_etag, &bytes))
     goto retry;
 
   return bytes;
@@ -222,250 +639,1991 @@ msg_service_send_and_parse_response (MsgService    *self,
                                      GCancellable  *cancellable,
                                      GError       **error)
 {
-  MsgServicePrivate *priv = MSG_SERVICE_GET_PRIVATE (self);
   g_autoptr (GBytes) response = NULL;
 
-retry:
-  msg_authorizer_process_request (priv->authorizer, message);
-
-  response = soup_session_send_and_read (priv->session, message, cancellable, error);
-  if (msg_service_handle_rate_limiting (message))
-    goto retry;
-
+  response = msg_service_send_and_read (self, message, cancellable, error);
   if (!response)
     return NULL;
 
   return msg_service_parse_response (response, object, error);
 }
 
+/**
+ * msg_service_send_and_read_collection:
+ * @self: a msg service
+ * @message: a #SoupMessage
+ * @cancellable: a #GCancellable
+ * @error: a #GError
+ *
+ * Sends `message` and returns a reader for the collection response,
+ * handing out one element after another while the response is received.
+ *
+ * Returns: (transfer full): a #MsgCollectionReader or %NULL on error
+ */
+MsgCollectionReader *
+msg_service_send_and_read_collection (MsgService    *self,
+                                      SoupMessage   *message,
+                                      GCancellable  *cancellable,
+                                      GError       **error)
+{
+  g_autoptr (GInputStream) stream = NULL;
+
+  stream = msg_service_send (self, message, cancellable, error);
+  if (!stream)
+    return NULL;
+
+  return msg_collection_reader_new (stream);
+}
+
+typedef struct {
+  SoupMessage *message;
+  int io_priority;
+  gboolean read_body;
+  char *cache_key;
+  char *cache_etag;
+  guint attempt;
+  gint64 backoff;
+  gboolean reauthorized;
+  gint64 started;
+} SendAsyncData;
 
 static void
-msg_service_set_authorizer (MsgService    *self,
-                            MsgAuthorizer *authorizer)
+send_async_data_free (SendAsyncData *data)
 {
-  MsgServicePrivate *priv = MSG_SERVICE_GET_PRIVATE (self);
+  g_clear_object (&data->message);
+  g_free (data->cache_key);
+  g_free (data->cache_etag);
+  g_free (data);
+}
 
-  g_return_if_fail (MSG_IS_SERVICE (self));
-  g_return_if_fail (authorizer == NULL || MSG_IS_AUTHORIZER (authorizer));
+static void send_async_start (GTask *task);
 
-  g_clear_object (&priv->authorizer);
-  priv->authorizer = authorizer;
-  if (priv->authorizer)
-    g_object_ref (priv->authorizer);
+static gboolean
+send_async_backoff_cb (gpointer user_data)
+{
+  GTask *task = G_TASK (user_data);
 
-  g_object_notify (G_OBJECT (self), "authorizer");
+  if (!g_task_return_error_if_cancelled (task))
+    send_async_start (task);
+
+  return G_SOURCE_REMOVE;
 }
 
-static void
-msg_service_set_property (GObject      *object,
-                          guint         property_id,
-                          const GValue *value,
-                          GParamSpec   *pspec)
+/* Schedules a resend of the task message in case the result is transient */
+static gboolean
+send_async_retry (GTask        *task,
+                  const GError *error)
 {
-  MsgService *self = MSG_SERVICE (object);
+  SendAsyncData *data = g_task_get_task_data (task);
+  GCancellable *cancellable = g_task_get_cancellable (task);
+  GSource *source;
+  gint64 delay;
 
-  switch (property_id) {
-    case PROP_AUTHORIZER:
-      msg_service_set_authorizer (self, MSG_AUTHORIZER (g_value_get_object (value)));
-      break;
-    default:
-      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
-      break;
+  delay = msg_service_get_retry_delay (g_task_get_source_object (task), data->message, error, data->attempt++, &data->backoff);
+  if (delay < 0)
+    return FALSE;
+
+  source = g_timeout_source_new (delay);
+  g_source_set_callback (source, send_async_backoff_cb, g_object_ref (task), g_object_unref);
+
+  if (cancellable) {
+    GSource *cancel_source = g_cancellable_source_new (cancellable);
+
+    g_source_set_dummy_callback (cancel_source);
+    g_source_add_child_source (source, cancel_source);
+    g_source_unref (cancel_source);
   }
+
+  g_source_attach (source, g_task_get_context (task));
+  g_source_unref (source);
+
+  return TRUE;
 }
 
 static void
-msg_service_get_property (GObject                         *object,
-                          guint                            property_id,
-                          __attribute__ ((unused)) GValue *value,
-                          GParamSpec                      *pspec)
+send_async_reauthorize_cb (GObject      *source,
+                           GAsyncResult *result,
+                           gpointer      user_data)
 {
-  switch (property_id) {
-    default:
-      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
-      break;
+  g_autoptr (GTask) task = user_data;
+  SendAsyncData *data = g_task_get_task_data (task);
+  GError *error = NULL;
+
+  if (!msg_authorizer_refresh_authorization_finish (MSG_AUTHORIZER (source), result, &error)) {
+    g_task_return_error (task, error);
+    return;
   }
+
+  msg_service_sign_message (g_task_get_source_object (task), data->message);
+  send_async_start (task);
 }
 
-static void
-soup_log_printer (__attribute__ ((unused)) SoupLogger        *logger,
-                  __attribute__ ((unused)) SoupLoggerLogLevel level,
-                  char                                        direction,
-                  const char                                 *data,
-                  __attribute__ ((unused)) gpointer           user_data)
+/* Replays the task message once with a fresh token in case it has been rejected */
+static gboolean
+send_async_reauthorize (GTask  *task,
+                        GBytes *bytes)
 {
-  g_debug ("%c %s", direction, data);
+  MsgServicePrivate *priv = MSG_SERVICE_GET_PRIVATE (g_task_get_source_object (task));
+  SendAsyncData *data = g_task_get_task_data (task);
+
+  if (data->reauthorized || !is_unauthorized (data->message, bytes))
+    return FALSE;
+
+  data->reauthorized = TRUE;
+  msg_authorizer_invalidate_authorization (priv->authorizer);
+  msg_authorizer_refresh_authorization_async (priv->authorizer,
+                                              g_task_get_cancellable (task),
+                                              send_async_reauthorize_cb,
+                                              g_object_ref (task));
+
+  return TRUE;
 }
 
-SoupLoggerLogLevel
-msg_service_get_log_level (void)
+static void
+send_async_ready_cb (GObject      *source,
+                     GAsyncResult *result,
+                     gpointer      user_data)
 {
-  static int level = -1;
+  g_autoptr (GTask) task = user_data;
+  SendAsyncData *data = g_task_get_task_data (task);
+  g_autoptr (GError) error = NULL;
 
-  if (level < 0) {
-    const char *env = g_getenv ("MSG_DEBUG");
+  if (data->read_body) {
+    g_autoptr (GBytes) bytes = NULL;
 
-    if (env != NULL) {
-      level = atoi (env);
-    } else {
-      level = 0;
+    bytes = soup_session_send_and_read_finish (SOUP_SESSION (source), result, &error);
+    msg_service_dismiss (g_task_get_source_object (task), data->message, bytes != NULL, data->started);
+    if (send_async_retry (task, error))
+      return;
+
+    if (!bytes) {
+      g_task_return_error (task, g_steal_pointer (&error));
+      return;
+    }
+
+    if (send_async_reauthorize (task, bytes))
+      return;
+
+    if (data->cache_key && !msg_service_cache_process (g_task_get_source_object (task), data->message, data->cache_key, &data->cache_etag, &bytes)) {
+      send_async_start (task);
+      return;
+    }
+
+    g_task_return_pointer (task, g_steal_pointer (&bytes), (GDestroyNotify)g_bytes_unref);
+  } else {
+    g_autoptr (GInputStream) stream = NULL;
+
+    stream = soup_session_send_finish (SOUP_SESSION (source), result, &error);
+    msg_service_dismiss (g_task_get_source_object (task), data->message, stream != NULL, data->started);
+    if (send_async_retry (task, error)) {
+      if (stream)
+        g_input_stream_close_async (stream, data->io_priority, NULL, NULL, NULL);
+      return;
+    }
+
+    if (!stream) {
+      g_task_return_error (task, g_steal_pointer (&error));
+      return;
+    }
+
+    if (send_async_reauthorize (task, NULL)) {
+      g_input_stream_close_async (stream, data->io_priority, NULL, NULL, NULL);
+      return;
     }
+
+    g_task_return_pointer (task, g_steal_pointer (&stream), g_object_unref);
   }
+}
 
-  return level;
+static void
+send_async_send (GTask *task)
+{
+  MsgServicePrivate *priv = MSG_SERVICE_GET_PRIVATE (g_task_get_source_object (task));
+  SendAsyncData *data = g_task_get_task_data (task);
+
+  data->started = g_get_monotonic_time ();
+
+  if (data->read_body)
+    soup_session_send_and_read_async (priv->session,
+                                      data->message,
+                                      data->io_priority,
+                                      g_task_get_cancellable (task),
+                                      send_async_ready_cb,
+                                      g_object_ref (task));
+  else
+    soup_session_send_async (priv->session,
+                             data->message,
+                             data->io_priority,
+                             g_task_get_cancellable (task),
+                             send_async_ready_cb,
+                             g_object_ref (task));
 }
 
 static void
-msg_service_init (MsgService *self)
+send_async_admitted_cb (GObject      *source,
+                        GAsyncResult *result,
+                        gpointer      user_data)
 {
-  MsgServicePrivate *priv = MSG_SERVICE_GET_PRIVATE (self);
+  g_autoptr (GTask) task = user_data;
+  MsgServicePrivate *priv = MSG_SERVICE_GET_PRIVATE (g_task_get_source_object (task));
+  GError *error = NULL;
+
+  if (!msg_service_pool_acquire_finish (MSG_SERVICE_POOL (source), result, &error)) {
+    msg_concurrency_limiter_release (priv->limiter, SOUP_STATUS_NONE, 0);
+    g_task_return_error (task, error);
+    return;
+  }
 
-  priv->session = soup_session_new ();
+  send_async_send (task);
+}
 
-  /* Iff MSG_LAX_SSL_CERTIFICATES=1, relax SSL certificate validation to allow using invalid/unsigned certificates for testing. */
-  if (g_strcmp0 (g_getenv ("MSG_LAX_SSL_CERTIFICATES"), "1") == 0) {
-    g_object_set_data (G_OBJECT (priv->session), "msg-lax-ssl", (gpointer)TRUE);
+static void
+send_async_limited_cb (__attribute__ ((unused)) GObject *source,
+                       GAsyncResult                     *result,
+                       gpointer                          user_data)
+{
+  g_autoptr (GTask) task = user_data;
+  MsgServicePrivate *priv = MSG_SERVICE_GET_PRIVATE (g_task_get_source_object (task));
+  GError *error = NULL;
+
+  if (!msg_concurrency_limiter_acquire_finish (result, &error)) {
+    g_task_return_error (task, error);
+    return;
   }
 
-  if (msg_service_get_log_level () > SOUP_LOGGER_LOG_NONE) {
-    g_autoptr (SoupLogger) logger = NULL;
+  if (priv->pool)
+    msg_service_pool_acquire_async (priv->pool,
+                                    priv->authorizer,
+                                    g_task_get_cancellable (task),
+                                    send_async_admitted_cb,
+                                    g_object_ref (task));
+  else
+    send_async_send (task);
+}
 
-    logger = soup_logger_new (msg_service_get_log_level ());
-    soup_logger_set_printer (logger, (SoupLoggerPrinter)soup_log_printer, NULL, NULL);
-    soup_session_add_feature (priv->session, SOUP_SESSION_FEATURE (logger));
+static void
+send_async_throttle_cb (GObject      *source,
+                        GAsyncResult *result,
+                        gpointer      user_data)
+{
+  g_autoptr (GTask) task = user_data;
+  MsgService *self = MSG_SERVICE (source);
+  MsgServicePrivate *priv = MSG_SERVICE_GET_PRIVATE (self);
+  GError *error = NULL;
+
+  if (!msg_service_wait_for_throttle_finish (self, result, &error)) {
+    g_task_return_error (task, error);
+    return;
   }
+
+  msg_concurrency_limiter_acquire_async (priv->limiter,
+                                         g_task_get_cancellable (task),
+                                         send_async_limited_cb,
+                                         g_object_ref (task));
 }
 
 static void
-msg_service_class_init (MsgServiceClass *class)
+send_async_start (GTask *task)
 {
-  GObjectClass *object_class = G_OBJECT_CLASS (class);
+  msg_service_wait_for_throttle_async (g_task_get_source_object (task),
+                                       g_task_get_cancellable (task),
+                                       send_async_throttle_cb,
+                                       g_object_ref (task));
+}
 
-  object_class->set_property = msg_service_set_property;
-  object_class->get_property = msg_service_get_property;
+static GTask *
+send_async_task_new (MsgService          *self,
+                     SoupMessage         *message,
+                     int                  io_priority,
+                     gboolean             read_body,
+                     GCancellable        *cancellable,
+                     GAsyncReadyCallback  callback,
+                     gpointer             user_data)
+{
+  SendAsyncData *data;
+  GTask *task;
 
-  properties [PROP_AUTHORIZER] = g_param_spec_object ("authorizer",
+  task = g_task_new (self, cancellable, callback, user_data);
+
+  data = g_new0 (SendAsyncData, 1);
+  data->message = g_object_ref (message);
+  data->io_priority = io_priority;
+  data->read_body = read_body;
+  g_task_set_task_data (task, data, (GDestroyNotify)send_async_data_free);
+
+  msg_service_sign_message (self, message);
+  msg_service_track_message (self, message);
+  if (read_body)
+    data->cache_key = msg_service_cache_prepare (self, message, &data->cache_etag);
+
+  return task;
+}
+
+/**
+ * msg_service_send_async:
+ * @self: a msg service
+ * @message: a #SoupMessage
+ * @io_priority: the I/O priority of the request
+ * @cancellable: a #GCancellable
+ * @callback: (scope async): a #GAsyncReadyCallback to call when the request is satisfied
+ * @user_data: (closure): the data to pass to @callback
+ *
+ * Asynchronously adds authorizer information to `message` and sends it.
+ * See msg_service_send() for the synchronous version of this call.
+ */
+void
+msg_service_send_async (MsgService          *self,
+                        SoupMessage         *message,
+                        int                  io_priority,
+                        GCancellable        *cancellable,
+                        GAsyncReadyCallback  callback,
+                        gpointer             user_data)
+{
+  g_autoptr (GTask) task = NULL;
+
+  g_return_if_fail (MSG_IS_SERVICE (self));
+  g_return_if_fail (SOUP_IS_MESSAGE (message));
+
+  task = send_async_task_new (self, message, io_priority, FALSE, cancellable, callback, user_data);
+  g_task_set_source_tag (task, msg_service_send_async);
+
+  send_async_start (task);
+}
+
+/**
+ * msg_service_send_finish:
+ * @self: a msg service
+ * @result: a #GAsyncResult
+ * @error: a #GError
+ *
+ * Finishes an asynchronous operation started with msg_service_send_async().
+ *
+ * Returns: (transfer full): a #GInputStream or %NULL on error.
+ */
+GInputStream *
+msg_service_send_finish (MsgService    *self,
+                         GAsyncResult  *result,
+                         GError       **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, self), NULL);
+  g_return_val_if_fail (g_async_result_is_tagged (result, msg_service_send_async), NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+/**
+ * msg_service_send_and_read_async:
+ * @self: a msg service
+ * @message: a #SoupMessage
+ * @io_priority: the I/O priority of the request
+ * @cancellable: a #GCancellable
+ * @callback: (scope async): a #GAsyncReadyCallback to call when the request is satisfied
+ * @user_data: (closure): the data to pass to @callback
+ *
+ * Asynchronously adds authorizer information to `message`, sends it and
+ * reads the complete response body. See msg_service_send_and_read() for
+ * the synchronous version of this call.
+ */
+void
+msg_service_send_and_read_async (MsgService          *self,
+                                 SoupMessage         *message,
+                                 int                  io_priority,
+                                 GCancellable        *cancellable,
+                                 GAsyncReadyCallback  callback,
+                                 gpointer             user_data)
+{
+  g_autoptr (GTask) task = NULL;
+
+  g_return_if_fail (MSG_IS_SERVICE (self));
+  g_return_if_fail (SOUP_IS_MESSAGE (message));
+
+  task = send_async_task_new (self, message, io_priority, TRUE, cancellable, callback, user_data);
+  g_task_set_source_tag (task, msg_service_send_and_read_async);
+
+  send_async_start (task);
+}
+
+/**
+ * msg_service_send_and_read_finish:
+ * @self: a msg service
+ * @result: a #GAsyncResult
+ * @error: a #GError
+ *
+ * Finishes an asynchronous operation started with msg_service_send_and_read_async().
+ *
+ * Returns: (transfer full): a #GBytes or %NULL on error.
+ */
+GBytes *
+msg_service_send_and_read_finish (MsgService    *self,
+                                  GAsyncResult  *result,
+                                  GError       **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, self), NULL);
+  g_return_val_if_fail (g_async_result_is_tagged (result, msg_service_send_and_read_async), NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+static void
+parse_response_thread (GTask                             *task,
+                       __attribute__ ((unused)) gpointer  source_object,
+                       gpointer                           task_data,
+                       __attribute__ ((unused)) GCancellable *cancellable)
+{
+  GBytes *bytes = task_data;
+  GError *error = NULL;
+  JsonParser *parser;
+
+  parser = msg_service_parse_response (bytes, NULL, &error);
+  if (!parser)
+    g_task_return_error (task, error);
+  else
+    g_task_return_pointer (task, parser, g_object_unref);
+}
+
+static void
+send_and_parse_response_read_cb (GObject      *source,
+                                 GAsyncResult *result,
+                                 gpointer      user_data)
+{
+  g_autoptr (GTask) task = user_data;
+  GError *error = NULL;
+  GBytes *bytes;
+
+  bytes = msg_service_send_and_read_finish (MSG_SERVICE (source), result, &error);
+  if (!bytes) {
+    g_task_return_error (task, error);
+    return;
+  }
+
+  /* Parse the response in a worker thread to keep the main loop responsive */
+  g_task_set_task_data (task, bytes, (GDestroyNotify)g_bytes_unref);
+  g_task_run_in_thread (task, parse_response_thread);
+}
+
+/**
+ * msg_service_send_and_parse_response_async:
+ * @self: a msg service
+ * @message: a #SoupMessage
+ * @io_priority: the I/O priority of the request
+ * @cancellable: a #GCancellable
+ * @callback: (scope async): a #GAsyncReadyCallback to call when the request is satisfied
+ * @user_data: (closure): the data to pass to @callback
+ *
+ * A combination of `msg_service_send_and_read_async` and `msg_service_parse_response`.
+ * The response is parsed in a worker thread.
+ */
+void
+msg_service_send_and_parse_response_async (MsgService          *self,
+                                           SoupMessage         *message,
+                                           int                  io_priority,
+                                           GCancellable        *cancellable,
+                                           GAsyncReadyCallback  callback,
+                                           gpointer             user_data)
+{
+  GTask *task;
+
+  g_return_if_fail (MSG_IS_SERVICE (self));
+  g_return_if_fail (SOUP_IS_MESSAGE (message));
+
+  task = g_task_new (self, cancellable, callback, user_data);
+  g_task_set_source_tag (task, msg_service_send_and_parse_response_async);
+  g_task_set_priority (task, io_priority);
+
+  msg_service_send_and_read_async (self, message, io_priority, cancellable, send_and_parse_response_read_cb, task);
+}
+
+/**
+ * msg_service_send_and_parse_response_finish:
+ * @self: a msg service
+ * @result: a #GAsyncResult
+ * @object: a pointer to the returning root object
+ * @error: a #GError
+ *
+ * Finishes an asynchronous operation started with
+ * msg_service_send_and_parse_response_async().
+ *
+ * Returns: (transfer full): a #JsonParser or %NULL on error
+ */
+JsonParser *
+msg_service_send_and_parse_response_finish (MsgService    *self,
+                                            GAsyncResult  *result,
+                                            JsonObject   **object,
+                                            GError       **error)
+{
+  JsonParser *parser;
+
+  g_return_val_if_fail (g_task_is_valid (result, self), NULL);
+  g_return_val_if_fail (g_async_result_is_tagged (result, msg_service_send_and_parse_response_async), NULL);
+
+  parser = g_task_propagate_pointer (G_TASK (result), error);
+  if (parser && object)
+    *object = json_node_get_object (json_parser_get_root (parser));
+
+  return parser;
+}
+
+static void
+refresh_authorization_cb (GObject      *source,
+                          GAsyncResult *result,
+                          gpointer      user_data)
+{
+  g_autoptr (GTask) task = user_data;
+  GError *error = NULL;
+
+  if (!msg_authorizer_refresh_authorization_finish (MSG_AUTHORIZER (source), result, &error))
+    g_task_return_error (task, error);
+  else
+    g_task_return_boolean (task, TRUE);
+}
+
+/**
+ * msg_service_refresh_authorization_async:
+ * @self: a msg service
+ * @cancellable: a #GCancellable
+ * @callback: (scope async): a #GAsyncReadyCallback to call when the request is satisfied
+ * @user_data: (closure): the data to pass to @callback
+ *
+ * Asynchronously refreshes the authorization of the service authorizer.
+ */
+void
+msg_service_refresh_authorization_async (MsgService          *self,
+                                         GCancellable        *cancellable,
+                                         GAsyncReadyCallback  callback,
+                                         gpointer             user_data)
+{
+  MsgServicePrivate *priv = MSG_SERVICE_GET_PRIVATE (self);
+  g_autoptr (GTask) task = NULL;
+
+  g_return_if_fail (MSG_IS_SERVICE (self));
+
+  task = g_task_new (self, cancellable, callback, user_data);
+  g_task_set_source_tag (task, msg_service_refresh_authorization_async);
+
+  if (!priv->authorizer) {
+    g_task_return_new_error (task, MSG_ERROR, MSG_ERROR_FAILED, "Authorizer is NULL");
+    return;
+  }
+
+  msg_authorizer_refresh_authorization_async (priv->authorizer, cancellable, refresh_authorization_cb, g_steal_pointer (&task));
+}
+
+/**
+ * msg_service_refresh_authorization_finish:
+ * @self: a msg service
+ * @result: a #GAsyncResult
+ * @error: a #GError
+ *
+ * Finishes an asynchronous operation started with
+ * msg_service_refresh_authorization_async().
+ *
+ * Returns: %TRUE if the authorizer now has a valid token.
+ */
+gboolean
+msg_service_refresh_authorization_finish (MsgService    *self,
+                                          GAsyncResult  *result,
+                                          GError       **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, self), FALSE);
+
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+static void
+msg_service_set_authorizer (MsgService    *self,
+                            MsgAuthorizer *authorizer)
+{
+  MsgServicePrivate *priv = MSG_SERVICE_GET_PRIVATE (self);
+
+  g_return_if_fail (MSG_IS_SERVICE (self));
+  g_return_if_fail (authorizer == NULL || MSG_IS_AUTHORIZER (authorizer));
+
+  g_clear_object (&priv->authorizer);
+  priv->authorizer = authorizer;
+  if (priv->authorizer)
+    g_object_ref (priv->authorizer);
+
+  g_object_notify (G_OBJECT (self), "authorizer");
+}
+
+static void
+msg_service_set_property (GObject      *object,
+                          guint         property_id,
+                          const GValue *value,
+                          GParamSpec   *pspec)
+{
+  MsgService *self = MSG_SERVICE (object);
+  MsgServicePrivate *priv = MSG_SERVICE_GET_PRIVATE (self);
+
+  switch (property_id) {
+    case PROP_AUTHORIZER:
+      msg_service_set_authorizer (self, MSG_AUTHORIZER (g_value_get_object (value)));
+      break;
+    case PROP_SESSION:
+      g_set_object (&priv->session, g_value_get_object (value));
+      break;
+    case PROP_PREFETCH_PAGES:
+      msg_service_set_prefetch_pages (self, g_value_get_boolean (value));
+      break;
+    case PROP_RESPONSE_CACHE:
+      msg_service_set_response_cache (self, g_value_get_object (value));
+      break;
+    case PROP_POOL:
+      g_set_object (&priv->pool, g_value_get_object (value));
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+      break;
+  }
+}
+
+static void
+msg_service_get_property (GObject    *object,
+                          guint       property_id,
+                          GValue     *value,
+                          GParamSpec *pspec)
+{
+  MsgService *self = MSG_SERVICE (object);
+
+  switch (property_id) {
+    case PROP_SESSION:
+      g_value_set_object (value, msg_service_get_session (self));
+      break;
+    case PROP_PREFETCH_PAGES:
+      g_value_set_boolean (value, msg_service_get_prefetch_pages (self));
+      break;
+    case PROP_RESPONSE_CACHE:
+      g_value_set_object (value, msg_service_get_response_cache (self));
+      break;
+    case PROP_POOL:
+      g_value_set_object (value, msg_service_get_pool (self));
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+      break;
+  }
+}
+
+static void
+soup_log_printer (__attribute__ ((unused)) SoupLogger        *logger,
+                  __attribute__ ((unused)) SoupLoggerLogLevel level,
+                  char                                        direction,
+                  const char                                 *data,
+                  __attribute__ ((unused)) gpointer           user_data)
+{
+  g_debug ("%c %s", direction, data);
+}
+
+SoupLoggerLogLevel
+msg_service_get_log_level (void)
+{
+  static int level = -1;
+
+  if (level < 0) {
+    const char *env = g_getenv ("MSG_DEBUG");
+
+    if (env != NULL) {
+      level = atoi (env);
+    } else {
+      level = 0;
+    }
+  }
+
+  return level;
+}
+
+static void
+msg_service_finalize (GObject *object)
+{
+  MsgService *self = MSG_SERVICE (object);
+  MsgServicePrivate *priv = MSG_SERVICE_GET_PRIVATE (self);
+
+  g_clear_object (&priv->authorizer);
+  g_clear_object (&priv->session);
+  g_clear_object (&priv->pool);
+  g_clear_object (&priv->response_cache);
+  g_clear_pointer (&priv->stats, msg_service_stats_free);
+  g_clear_pointer (&priv->limiter, msg_concurrency_limiter_free);
+  g_mutex_clear (&priv->throttle_mutex);
+  g_cond_clear (&priv->throttle_cond);
+
+  G_OBJECT_CLASS (msg_service_parent_class)->finalize (object);
+}
+
+/**
+ * msg_service_session_new:
+ * @max_conns: maximal number of connections, 0 for the default
+ * @max_conns_per_host: maximal number of connections per host, 0 for the default
+ * @idle_timeout: seconds after which idle connections are closed, 0 for the default
+ *
+ * Creates a session configured for MS Graph requests. The session can
+ * be shared between services and authorizers through their "session"
+ * property, so that all of them use one connection pool.
+ *
+ * Returns: (transfer full): a new #SoupSession
+ */
+SoupSession *
+msg_service_session_new (guint max_conns,
+                         guint max_conns_per_host,
+                         guint idle_timeout)
+{
+  SoupSession *session;
+
+  session = soup_session_new_with_options ("max-conns", max_conns ? max_conns : MSG_SERVICE_DEFAULT_MAX_CONNS,
+                                           "max-conns-per-host", max_conns_per_host ? max_conns_per_host : MSG_SERVICE_DEFAULT_MAX_CONNS_PER_HOST,
+                                           "idle-timeout", idle_timeout ? idle_timeout : MSG_SERVICE_DEFAULT_IDLE_TIMEOUT,
+                                           NULL);
+
+  /* Iff MSG_LAX_SSL_CERTIFICATES=1, relax SSL certificate validation to allow using invalid/unsigned certificates for testing. */
+  if (g_strcmp0 (g_getenv ("MSG_LAX_SSL_CERTIFICATES"), "1") == 0) {
+    g_object_set_data (G_OBJECT (session), "msg-lax-ssl", (gpointer)TRUE);
+  }
+
+  if (msg_service_get_log_level () > SOUP_LOGGER_LOG_NONE) {
+    g_autoptr (SoupLogger) logger = NULL;
+
+    logger = soup_logger_new (msg_service_get_log_level ());
+    soup_logger_set_printer (logger, (SoupLoggerPrinter)soup_log_printer, NULL, NULL);
+    soup_session_add_feature (session, SOUP_SESSION_FEATURE (logger));
+  }
+
+  return session;
+}
+
+static void
+msg_service_constructed (GObject *object)
+{
+  MsgService *self = MSG_SERVICE (object);
+  MsgServicePrivate *priv = MSG_SERVICE_GET_PRIVATE (self);
+
+  G_OBJECT_CLASS (msg_service_parent_class)->constructed (object);
+
+  if (!priv->session && priv->pool)
+    priv->session = g_object_ref (msg_service_pool_get_session (priv->pool));
+
+  if (!priv->session)
+    priv->session = msg_service_session_new (0, 0, 0);
+
+  /* More requests in flight than connections would only queue in the session */
+  msg_concurrency_limiter_set_max_limit (priv->limiter, soup_session_get_max_conns (priv->session));
+}
+
+static void
+msg_service_init (MsgService *self)
+{
+  MsgServicePrivate *priv = MSG_SERVICE_GET_PRIVATE (self);
+
+  g_mutex_init (&priv->throttle_mutex);
+  g_cond_init (&priv->throttle_cond);
+  priv->retry_budget = RETRY_BUDGET_MAX;
+  priv->stats = msg_service_stats_new ();
+  priv->limiter = msg_concurrency_limiter_new ();
+}
+
+static void
+msg_service_class_init (MsgServiceClass *class)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (class);
+
+  object_class->constructed = msg_service_constructed;
+  object_class->finalize = msg_service_finalize;
+  object_class->set_property = msg_service_set_property;
+  object_class->get_property = msg_service_get_property;
+
+  properties [PROP_AUTHORIZER] = g_param_spec_object ("authorizer",
                                                       "Authorizer",
                                                       "The authorizer for this service",
                                                       MSG_TYPE_AUTHORIZER,
                                                       G_PARAM_STATIC_STRINGS | G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY);
 
-  g_object_class_install_properties (object_class, PROP_COUNT, properties);
+  properties [PROP_SESSION] = g_param_spec_object ("session",
+                                                   "Session",
+                                                   "The soup session, a new one is created if unset",
+                                                   SOUP_TYPE_SESSION,
+                                                   G_PARAM_STATIC_STRINGS | G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+
+  properties [PROP_PREFETCH_PAGES] = g_param_spec_boolean ("prefetch-pages",
+                                                           "Prefetch pages",
+                                                           "Request the next page of a collection while the current one is read",
+                                                           FALSE,
+                                                           G_PARAM_STATIC_STRINGS | G_PARAM_READWRITE | G_PARAM_EXPLICIT_NOTIFY);
+
+  properties [PROP_RESPONSE_CACHE] = g_param_spec_object ("response-cache",
+                                                          "Response cache",
+                                                          "Cache for responses carrying an ETag",
+                                                          MSG_TYPE_RESPONSE_CACHE,
+                                                          G_PARAM_STATIC_STRINGS | G_PARAM_READWRITE | G_PARAM_EXPLICIT_NOTIFY);
+
+  properties [PROP_POOL] = g_param_spec_object ("pool",
+                                                "Pool",
+                                                "The service pool sharing its session and admitting requests",
+                                                MSG_TYPE_SERVICE_POOL,
+                                                G_PARAM_STATIC_STRINGS | G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+
+  g_object_class_install_properties (object_class, PROP_COUNT, properties);
+}
+
+/**
+ * msg_service_parse_response:
+ * @bytes: input bytes containing response buffer
+ * @object: a pointer to the returning root object
+ * @error: a #GError
+ *
+ * Parse response data and check for errors. In case
+ * no errors are found, return json root object.
+ *
+ * Returns: (transfer full): a #JsonParser
+ */
+JsonParser *
+msg_service_parse_response (GBytes      *bytes,
+                            JsonObject **object,
+                            GError     **error)
+{
+  g_autoptr (JsonParser) parser = NULL;
+  JsonObject *root_object = NULL;
+  JsonNode *root = NULL;
+  const char *content;
+  gsize len;
+
+  content = g_bytes_get_data (bytes, &len);
+
+  parser = json_parser_new ();
+  if (!json_parser_load_from_data (parser, content, len, error))
+    return NULL;
+
+  root = json_parser_get_root (parser);
+  if (!JSON_NODE_HOLDS_OBJECT (root)) {
+    g_set_error (error,
+                 msg_error_quark (),
+                 MSG_ERROR_FAILED,
+                 "Invalid response, didn't get JSON object");
+    return NULL;
+  }
+
+  root_object = json_node_get_object (root);
+  /* g_print (json_to_string (root, TRUE)); */
+
+  if (json_object_has_member (root_object, "error")) {
+    JsonObject *error_object = json_object_get_object_member (root_object, "error");
+    const char *message = json_object_get_string_member (error_object, "message");
+
+    g_set_error_literal (error,
+                         MSG_ERROR,
+                         MSG_ERROR_FAILED,
+                         message);
+    return NULL;
+  }
+
+  if (object)
+    *object = root_object;
+
+  return g_steal_pointer (&parser);
+}
+
+/**
+ * msg_service_get_session:
+ * @self: a #MsgService
+ *
+ * Get related soup session
+ *
+ * Returns: (transfer none): a #SoupSession
+ */
+SoupSession *
+msg_service_get_session (MsgService *self)
+{
+  MsgServicePrivate *priv = MSG_SERVICE_GET_PRIVATE (self);
+  return priv->session;
+}
+
+/**
+ * msg_service_get_pool:
+ * @self: a #MsgService
+ *
+ * Get the pool @self has been created by.
+ *
+ * Returns: (transfer none) (nullable): a #MsgServicePool
+ */
+MsgServicePool *
+msg_service_get_pool (MsgService *self)
+{
+  MsgServicePrivate *priv = MSG_SERVICE_GET_PRIVATE (self);
+  return priv->pool;
+}
+
+/**
+ * msg_service_get_authorizer:
+ * @self: a #MsgService
+ *
+ * Get related authorizer.
+ *
+ * Returns: (transfer none): a #MsgAuthorizer
+ */
+MsgAuthorizer *
+msg_service_get_authorizer (MsgService *self)
+{
+  MsgServicePrivate *priv = MSG_SERVICE_GET_PRIVATE (self);
+  return priv->authorizer;
+}
+
+/**
+ * msg_service_set_prefetch_pages:
+ * @self: a #MsgService
+ * @prefetch: whether to prefetch pages
+ *
+ * Enables pipelined paging for iterators created for this service. The
+ * request for the next page is sent as soon as its link has been read,
+ * while the items of the current page are still being handed out. In
+ * case the iteration is stopped early, one page may be requested in vain.
+ */
+void
+msg_service_set_prefetch_pages (MsgService *self,
+                                gboolean    prefetch)
+{
+  MsgServicePrivate *priv = MSG_SERVICE_GET_PRIVATE (self);
+
+  g_return_if_fail (MSG_IS_SERVICE (self));
+
+  prefetch = !!prefetch;
+  if (priv->prefetch_pages == prefetch)
+    return;
+
+  priv->prefetch_pages = prefetch;
+  g_object_notify_by_pspec (G_OBJECT (self), properties[PROP_PREFETCH_PAGES]);
+}
+
+/**
+ * msg_service_get_prefetch_pages:
+ * @self: a #MsgService
+ *
+ * Get whether pages are prefetched, see msg_service_set_prefetch_pages().
+ *
+ * Returns: %TRUE if pages are prefetched
+ */
+gboolean
+msg_service_get_prefetch_pages (MsgService *self)
+{
+  MsgServicePrivate *priv = MSG_SERVICE_GET_PRIVATE (self);
+
+  g_return_val_if_fail (MSG_IS_SERVICE (self), FALSE);
+
+  return priv->prefetch_pages;
+}
+
+/**
+ * msg_service_set_response_cache:
+ * @self: a #MsgService
+ * @cache: (nullable): a #MsgResponseCache
+ *
+ * Sets a cache for GET responses read in full. Requests for cached
+ * responses are sent with `If-None-Match` and the cached body is
+ * returned in case the server answers with 304 Not Modified.
+ */
+void
+msg_service_set_response_cache (MsgService       *self,
+                                MsgResponseCache *cache)
+{
+  MsgServicePrivate *priv = MSG_SERVICE_GET_PRIVATE (self);
+
+  g_return_if_fail (MSG_IS_SERVICE (self));
+
+  if (g_set_object (&priv->response_cache, cache))
+    g_object_notify_by_pspec (G_OBJECT (self), properties[PROP_RESPONSE_CACHE]);
+}
+
+/**
+ * msg_service_get_response_cache:
+ * @self: a #MsgService
+ *
+ * Get response cache of this service.
+ *
+ * Returns: (transfer none) (nullable): a #MsgResponseCache
+ */
+MsgResponseCache *
+msg_service_get_response_cache (MsgService *self)
+{
+  MsgServicePrivate *priv = MSG_SERVICE_GET_PRIVATE (self);
+
+  g_return_val_if_fail (MSG_IS_SERVICE (self), NULL);
+
+  return priv->response_cache;
+}
+
+static void
+tracked_message_finished_cb (SoupMessage *message,
+                             gpointer     user_data)
+{
+  MsgServicePrivate *priv = MSG_SERVICE_GET_PRIVATE (MSG_SERVICE (user_data));
+
+  msg_service_stats_record_message (priv->stats, message);
+
+  /* The access token has been rejected, request a new one on next refresh */
+  if (is_unauthorized (message, NULL) && priv->authorizer)
+    msg_authorizer_invalidate_authorization (priv->authorizer);
+}
+
+/**
+ * msg_service_track_message:
+ * @self: a #MsgService
+ * @message: a #SoupMessage
+ *
+ * Records statistics of @message each time it has been sent and
+ * invalidates the access token once the server rejected it.
+ */
+void
+msg_service_track_message (MsgService  *self,
+                           SoupMessage *message)
+{
+  if (g_object_get_data (G_OBJECT (message), "msg-stats-tracked"))
+    return;
+
+  soup_message_add_flags (message, SOUP_MESSAGE_COLLECT_METRICS);
+  g_signal_connect_data (message,
+                         "finished",
+                         G_CALLBACK (tracked_message_finished_cb),
+                         g_object_ref (self),
+                         (GClosureNotify)g_object_unref,
+                         0);
+  g_object_set_data (G_OBJECT (message), "msg-stats-tracked", GINT_TO_POINTER (TRUE));
+}
+
+/**
+ * msg_service_get_concurrency_limit:
+ * @self: a #MsgService
+ *
+ * Get the current maximal number of requests in flight. The limit grows
+ * slowly while responses are healthy and is cut on throttling (429,
+ * 503) or latency spikes.
+ *
+ * Returns: the current concurrency limit
+ */
+guint
+msg_service_get_concurrency_limit (MsgService *self)
+{
+  MsgServicePrivate *priv = MSG_SERVICE_GET_PRIVATE (self);
+  return msg_concurrency_limiter_get_limit (priv->limiter);
+}
+
+/**
+ * msg_service_get_in_flight:
+ * @self: a #MsgService
+ *
+ * Get the number of requests of @self currently in flight.
+ *
+ * Returns: number of requests in flight
+ */
+guint
+msg_service_get_in_flight (MsgService *self)
+{
+  MsgServicePrivate *priv = MSG_SERVICE_GET_PRIVATE (self);
+  return msg_concurrency_limiter_get_in_flight (priv->limiter);
+}
+
+/**
+ * msg_service_set_max_concurrency:
+ * @self: a #MsgService
+ * @max_concurrency: upper bound of the concurrency limit
+ *
+ * Bounds the adaptive concurrency limit. Defaults to the maximal number
+ * of connections of the session.
+ */
+void
+msg_service_set_max_concurrency (MsgService *self,
+                                 guint       max_concurrency)
+{
+  MsgServicePrivate *priv = MSG_SERVICE_GET_PRIVATE (self);
+  msg_concurrency_limiter_set_max_limit (priv->limiter, max_concurrency);
+}
+
+/**
+ * msg_service_get_stats:
+ * @self: a #MsgService
+ *
+ * Get request statistics per endpoint template, such as
+ * `GET /drives/{id}/items/{id}/children`. Each endpoint object holds
+ * the number of requests, a status code distribution, retries and time
+ * waited before retrying, transferred bytes, as well as histograms for
+ * time to first byte and total latency. Histogram bucket i counts
+ * durations below 2^i ms, the last bucket all longer ones.
+ *
+ * Returns: (transfer full): a #JsonNode holding an object keyed by endpoint
+ */
+JsonNode *
+msg_service_get_stats (MsgService *self)
+{
+  MsgServicePrivate *priv = MSG_SERVICE_GET_PRIVATE (self);
+
+  g_return_val_if_fail (MSG_IS_SERVICE (self), NULL);
+
+  return msg_service_stats_to_json (priv->stats);
+}
+
+/**
+ * msg_service_reset_stats:
+ * @self: a #MsgService
+ *
+ * Drops all request statistics.
+ */
+void
+msg_service_reset_stats (MsgService *self)
+{
+  MsgServicePrivate *priv = MSG_SERVICE_GET_PRIVATE (self);
+
+  g_return_if_fail (MSG_IS_SERVICE (self));
+
+  msg_service_stats_reset (priv->stats);
+}
+
+/**
+ * msg_service_get_next_link:
+ * @object: a #JsonObject
+ *
+ * Get next link
+ *
+ * Returns: (transfer full): next link or %NULL if not available
+ */
+char *
+msg_service_get_next_link (JsonObject *object)
+{
+  return g_strdup (msg_json_object_get_string (object, "@odata.nextLink"));
+}
+
+/**
+ * msg_service_parse_retry_after:
+ * @retry_after: value of a Retry-After header
+ *
+ * Parses a Retry-After header value. Both the delay-seconds and the
+ * HTTP-date form are supported.
+ *
+ * Returns: delay in seconds or -1 if not available
+ */
+int
+msg_service_parse_retry_after (const char *retry_after)
+{
+  g_autoptr (GDateTime) date = NULL;
+  g_autoptr (GDateTime) now = NULL;
+  GTimeSpan diff;
+  char *end = NULL;
+  gint64 seconds;
+
+  if (!retry_after)
+    return -1;
+
+  seconds = g_ascii_strtoll (retry_after, &end, 10);
+  if (end != retry_after && *end == '\0')
+    return CLAMP (seconds, 0, G_MAXINT);
+
+  date = soup_date_time_new_from_http_string (retry_after);
+  if (!date)
+    return -1;
+
+  now = g_date_time_new_now_utc ();
+  diff = g_date_time_difference (date, now);
+
+  /* Round up so that we never retry before the requested date */
+  return CLAMP ((diff + G_USEC_PER_SEC - 1) / G_USEC_PER_SEC, 0, G_MAXINT);
+}
+
+/**
+ * msg_service_get_retry_after:
+ * @msg: a #SoupMessage
+ *
+ * Get the value of the Retry-After response header.
+ *
+ * Returns: delay in seconds or -1 if not available
+ */
+int
+msg_service_get_retry_after (SoupMessage *msg)
+{
+  return msg_service_parse_retry_after (soup_message_headers_get_one (soup_message_get_response_headers (msg), "retry-after"));
+}
+
+/**
+ * msg_service_throttle:
+ * @self: a #MsgService
+ * @seconds: delay in seconds
+ *
+ * Holds back all further requests of this service for @seconds. Services
+ * vended by a #MsgServicePool share the throttle window of their account.
+ * An already active throttle window is only ever extended.
+ */
+void
+msg_service_throttle (MsgService *self,
+                      int         seconds)
+{
+  MsgServicePrivate *priv = MSG_SERVICE_GET_PRIVATE (self);
+  gint64 until;
+
+  g_return_if_fail (MSG_IS_SERVICE (self));
+
+  until = g_get_monotonic_time () + MAX (seconds, 0) * G_USEC_PER_SEC;
+
+  g_mutex_lock (&priv->throttle_mutex);
+  priv->throttled_until = MAX (priv->throttled_until, until);
+  g_mutex_unlock (&priv->throttle_mutex);
+
+  if (priv->pool)
+    msg_service_pool_throttle (priv->pool, priv->authorizer, until);
+
+  g_debug ("Request throttled, retrying in %d seconds", seconds);
+}
+
+/**
+ * msg_service_throttle_message:
+ * @self: a #MsgService
+ * @msg: a sent #SoupMessage
+ *
+ * Checks whether @msg has been throttled by the server. In that case
+ * all further requests of this service are held back until the time
+ * requested by the Retry-After header has passed.
+ *
+ * Returns: %TRUE if @msg has been throttled and should be sent again
+ */
+gboolean
+msg_service_throttle_message (MsgService  *self,
+                              SoupMessage *msg)
+{
+  int seconds;
+
+  if (soup_message_get_status (msg) != SOUP_STATUS_TOO_MANY_REQUESTS)
+    return FALSE;
+
+  seconds = msg_service_get_retry_after (msg);
+  if (seconds < 0)
+    return FALSE;
+
+  seconds = MAX (seconds, THROTTLE_MIN_SECONDS);
+  msg_service_stats_record_retry (MSG_SERVICE_GET_PRIVATE (self)->stats, msg, seconds * 1000);
+  msg_service_throttle (self, seconds);
+
+  return TRUE;
+}
+
+/* Must be called with throttle_mutex held */
+static gint64
+msg_service_get_throttled_until_locked (MsgService *self)
+{
+  MsgServicePrivate *priv = MSG_SERVICE_GET_PRIVATE (self);
+
+  if (priv->pool)
+    return MAX (priv->throttled_until, msg_service_pool_get_throttled_until (priv->pool, priv->authorizer));
+
+  return priv->throttled_until;
+}
+
+static gint64
+msg_service_get_throttle_delay (MsgService *self)
+{
+  MsgServicePrivate *priv = MSG_SERVICE_GET_PRIVATE (self);
+  gint64 delay;
+
+  g_mutex_lock (&priv->throttle_mutex);
+  delay = msg_service_get_throttled_until_locked (self) - g_get_monotonic_time ();
+  g_mutex_unlock (&priv->throttle_mutex);
+
+  return MAX (delay, 0);
+}
+
+static void
+throttle_cancelled_cb (__attribute__ ((unused)) GCancellable *cancellable,
+                       MsgServicePrivate                     *priv)
+{
+  g_mutex_lock (&priv->throttle_mutex);
+  g_cond_broadcast (&priv->throttle_cond);
+  g_mutex_unlock (&priv->throttle_mutex);
+}
+
+/**
+ * msg_service_wait_for_throttle:
+ * @self: a #MsgService
+ * @cancellable: a #GCancellable
+ * @error: a #GError
+ *
+ * Blocks until the service is no longer throttled or @cancellable is
+ * cancelled. Returns immediately if the service is not throttled.
+ *
+ * Returns: %TRUE if requests can be sent, %FALSE on cancellation
+ */
+gboolean
+msg_service_wait_for_throttle (MsgService    *self,
+                               GCancellable  *cancellable,
+                               GError       **error)
+{
+  MsgServicePrivate *priv = MSG_SERVICE_GET_PRIVATE (self);
+  gulong handler_id = 0;
+
+  if (msg_service_get_throttle_delay (self) == 0)
+    return TRUE;
+
+  if (cancellable)
+    handler_id = g_cancellable_connect (cancellable, G_CALLBACK (throttle_cancelled_cb), priv, NULL);
+
+  g_mutex_lock (&priv->throttle_mutex);
+  while (!g_cancellable_is_cancelled (cancellable)) {
+    gint64 until = msg_service_get_throttled_until_locked (self);
+
+    if (g_get_monotonic_time () >= until)
+      break;
+
+    g_cond_wait_until (&priv->throttle_cond, &priv->throttle_mutex, until);
+  }
+  g_mutex_unlock (&priv->throttle_mutex);
+
+  if (handler_id)
+    g_cancellable_disconnect (cancellable, handler_id);
+
+  return !g_cancellable_set_error_if_cancelled (cancellable, error);
+}
+
+static void throttle_schedule (GTask  *task,
+                               gint64  delay);
+
+static gboolean
+throttle_timeout_cb (gpointer user_data)
+{
+  GTask *task = G_TASK (user_data);
+  MsgService *self = g_task_get_source_object (task);
+  gint64 delay;
+
+  if (g_task_return_error_if_cancelled (task))
+    return G_SOURCE_REMOVE;
+
+  /* Another response may have extended the throttle window meanwhile */
+  delay = msg_service_get_throttle_delay (self);
+  if (delay > 0)
+    throttle_schedule (task, delay);
+  else
+    g_task_return_boolean (task, TRUE);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+throttle_schedule (GTask  *task,
+                   gint64  delay)
+{
+  GCancellable *cancellable = g_task_get_cancellable (task);
+  GSource *source;
+
+  source = g_timeout_source_new (delay / 1000 + 1);
+  g_source_set_callback (source, throttle_timeout_cb, g_object_ref (task), g_object_unref);
+
+  if (cancellable) {
+    GSource *cancel_source = g_cancellable_source_new (cancellable);
+
+    /* Wake up the timeout source as soon as the operation is cancelled */
+    g_source_set_dummy_callback (cancel_source);
+    g_source_add_child_source (source, cancel_source);
+    g_source_unref (cancel_source);
+  }
+
+  g_source_attach (source, g_task_get_context (task));
+  g_source_unref (source);
+}
+
+/**
+ * msg_service_wait_for_throttle_async:
+ * @self: a #MsgService
+ * @cancellable: a #GCancellable
+ * @callback: (scope async): a #GAsyncReadyCallback to call when the request is satisfied
+ * @user_data: (closure): the data to pass to @callback
+ *
+ * Asynchronously waits until the service is no longer throttled. The
+ * request is parked on a timer of the thread-default main context, so
+ * the main loop keeps running while waiting.
+ */
+void
+msg_service_wait_for_throttle_async (MsgService          *self,
+                                     GCancellable        *cancellable,
+                                     GAsyncReadyCallback  callback,
+                                     gpointer             user_data)
+{
+  g_autoptr (GTask) task = NULL;
+  gint64 delay;
+
+  task = g_task_new (self, cancellable, callback, user_data);
+  g_task_set_source_tag (task, msg_service_wait_for_throttle_async);
+
+  delay = msg_service_get_throttle_delay (self);
+  if (delay == 0) {
+    g_task_return_boolean (task, TRUE);
+    return;
+  }
+
+  throttle_schedule (task, delay);
 }
 
 /**
- * msg_service_parse_response:
- * @bytes: input bytes containing response buffer
- * @object: a pointer to the returning root object
+ * msg_service_wait_for_throttle_finish:
+ * @self: a #MsgService
+ * @result: a #GAsyncResult
  * @error: a #GError
  *
- * Parse response data and check for errors. In case
- * no errors are found, return json root object.
+ * Finishes an asynchronous operation started with
+ * msg_service_wait_for_throttle_async().
  *
- * Returns: (transfer full): a #JsonParser
+ * Returns: %TRUE if requests can be sent, %FALSE on cancellation
  */
-JsonParser *
-msg_service_parse_response (GBytes      *bytes,
-                            JsonObject **object,
-                            GError     **error)
+gboolean
+msg_service_wait_for_throttle_finish (MsgService    *self,
+                                      GAsyncResult  *result,
+                                      GError       **error)
 {
-  g_autoptr (JsonParser) parser = NULL;
-  JsonObject *root_object = NULL;
-  JsonNode *root = NULL;
-  const char *content;
-  gsize len;
+  g_return_val_if_fail (g_task_is_valid (result, self), FALSE);
+  g_return_val_if_fail (g_async_result_is_tagged (result, msg_service_wait_for_throttle_async), FALSE);
 
-  content = g_bytes_get_data (bytes, &len);
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
 
-  parser = json_parser_new ();
-  if (!json_parser_load_from_data (parser, content, len, error))
-    return NULL;
+/**
+ * msg_service_handle_rate_limiting:
+ * @msg: a #SoupMessage
+ *
+ * Blocks the calling thread in case @msg has been throttled.
+ *
+ * Deprecated: Use msg_service_throttle_message() and
+ *   msg_service_wait_for_throttle() instead, which can be cancelled
+ *   and do not block the calling thread in async code.
+ *
+ * Returns: %TRUE if @msg has been throttled and should be sent again
+ */
+gboolean
+msg_service_handle_rate_limiting (SoupMessage *msg)
+{
+  if (soup_message_get_status (msg) == 429) {
+    int seconds = msg_service_get_retry_after (msg);
 
-  root = json_parser_get_root (parser);
-  if (!JSON_NODE_HOLDS_OBJECT (root)) {
-    g_set_error (error,
-                 msg_error_quark (),
-                 MSG_ERROR_FAILED,
-                 "Invalid response, didn't get JSON object");
-    return NULL;
+    if (seconds >= 0) {
+      g_usleep (seconds * G_USEC_PER_SEC);
+      return TRUE;
+    }
   }
 
-  root_object = json_node_get_object (root);
-  /* g_print (json_to_string (root, TRUE)); */
+  return FALSE;
+}
 
-  if (json_object_has_member (root_object, "error")) {
-    JsonObject *error_object = json_object_get_object_member (root_object, "error");
-    const char *message = json_object_get_string_member (error_object, "message");
+/**
+ * MsgPageIterator:
+ *
+ * Lazily iterates over all elements of a paged collection. The next
+ * page is only requested once all items of the current page have been
+ * handed out, so that the first items are available after the first
+ * response and iteration can be stopped at any time by dropping the
+ * iterator.
+ *
+ * With #MsgService:prefetch-pages enabled the next page is requested in
+ * the GTask thread pool as soon as its link is known.
+ */
+typedef struct {
+  MsgService *service;
+  SoupMessage *message;
+  GCancellable *cancellable;
+  GTask *task;
 
-    g_set_error_literal (error,
-                         MSG_ERROR,
-                         MSG_ERROR_FAILED,
-                         message);
+  GMutex mutex;
+  GCond cond;
+  gboolean done;
+
+  MsgCollectionReader *reader;
+  GError *error;
+} PagePrefetch;
+
+struct _MsgPageIterator {
+  GObject parent_instance;
+
+  MsgService *service;
+  MsgPageIteratorItemFunc item_func;
+  SoupMessageHeaders *headers;
+  gboolean follow_next_link;
+  gboolean authorized;
+
+  char *url;
+  MsgCollectionReader *reader;
+  PagePrefetch *prefetch;
+
+  char *next_link;
+  char *delta_link;
+};
+
+G_DEFINE_TYPE (MsgPageIterator, msg_page_iterator, G_TYPE_OBJECT);
+
+/* Owned by the task, so the worker never outlives its state */
+static void
+page_prefetch_free (PagePrefetch *prefetch)
+{
+  g_clear_object (&prefetch->service);
+  g_clear_object (&prefetch->message);
+  g_clear_object (&prefetch->cancellable);
+  g_clear_object (&prefetch->reader);
+  g_clear_error (&prefetch->error);
+  g_mutex_clear (&prefetch->mutex);
+  g_cond_clear (&prefetch->cond);
+  g_free (prefetch);
+}
+
+static void
+page_prefetch_thread (GTask                            *task,
+                      __attribute__ ((unused)) gpointer object,
+                      gpointer                          task_data,
+                      GCancellable                     *cancellable)
+{
+  PagePrefetch *prefetch = task_data;
+  MsgCollectionReader *reader;
+  GError *error = NULL;
+
+  reader = msg_service_send_and_read_collection (prefetch->service,
+                                                 prefetch->message,
+                                                 cancellable,
+                                                 &error);
+
+  g_mutex_lock (&prefetch->mutex);
+  prefetch->reader = reader;
+  prefetch->error = error;
+  prefetch->done = TRUE;
+  g_cond_signal (&prefetch->cond);
+  g_mutex_unlock (&prefetch->mutex);
+
+  g_task_return_boolean (task, TRUE);
+}
+
+/* Waits for the prefetch task and drops @prefetch, returning its reader */
+static MsgCollectionReader *
+page_prefetch_finish (PagePrefetch  *prefetch,
+                      GError       **error)
+{
+  MsgCollectionReader *reader;
+
+  /* The task is completed in the creating thread's main context, which
+   * the sync API does not iterate, so wait for the worker directly */
+  g_mutex_lock (&prefetch->mutex);
+  while (!prefetch->done)
+    g_cond_wait (&prefetch->cond, &prefetch->mutex);
+
+  reader = g_steal_pointer (&prefetch->reader);
+  if (prefetch->error)
+    g_propagate_error (error, g_steal_pointer (&prefetch->error));
+  g_mutex_unlock (&prefetch->mutex);
+
+  g_object_unref (prefetch->task);
+
+  return reader;
+}
+
+static void
+page_prefetch_cancelled_cb (__attribute__ ((unused)) GCancellable *cancellable,
+                            gpointer                               user_data)
+{
+  g_cancellable_cancel (user_data);
+}
+
+static void
+page_prefetch_cancel (PagePrefetch *prefetch)
+{
+  g_autoptr (MsgCollectionReader) reader = NULL;
+
+  g_cancellable_cancel (prefetch->cancellable);
+  reader = page_prefetch_finish (prefetch, NULL);
+}
+
+static void
+msg_page_iterator_finalize (GObject *object)
+{
+  MsgPageIterator *self = MSG_PAGE_ITERATOR (object);
+
+  g_clear_pointer (&self->prefetch, page_prefetch_cancel);
+
+  g_clear_object (&self->service);
+  g_clear_object (&self->reader);
+  g_clear_pointer (&self->headers, soup_message_headers_unref);
+  g_clear_pointer (&self->url, g_free);
+  g_clear_pointer (&self->next_link, g_free);
+  g_clear_pointer (&self->delta_link, g_free);
+
+  G_OBJECT_CLASS (msg_page_iterator_parent_class)->finalize (object);
+}
+
+static void
+msg_page_iterator_init (MsgPageIterator *self)
+{
+  self->headers = soup_message_headers_new (SOUP_MESSAGE_HEADERS_REQUEST);
+  self->follow_next_link = TRUE;
+}
+
+static void
+msg_page_iterator_class_init (MsgPageIteratorClass *class)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (class);
+
+  object_class->finalize = msg_page_iterator_finalize;
+}
+
+/**
+ * msg_page_iterator_new:
+ * @service: a #MsgService
+ * @url: url of the first page
+ * @item_func: (scope forever): function creating items out of collection elements
+ *
+ * Creates a new `MsgPageIterator` for the collection at @url.
+ *
+ * Returns: (transfer full): the newly created `MsgPageIterator`
+ */
+MsgPageIterator *
+msg_page_iterator_new (MsgService              *service,
+                       const char              *url,
+                       MsgPageIteratorItemFunc  item_func)
+{
+  MsgPageIterator *self;
+
+  g_return_val_if_fail (MSG_IS_SERVICE (service), NULL);
+  g_return_val_if_fail (url != NULL, NULL);
+  g_return_val_if_fail (item_func != NULL, NULL);
+
+  self = g_object_new (MSG_TYPE_PAGE_ITERATOR, NULL);
+  self->service = g_object_ref (service);
+  self->url = g_strdup (url);
+  self->item_func = item_func;
+
+  return self;
+}
+
+/**
+ * msg_page_iterator_add_header:
+ * @self: a #MsgPageIterator
+ * @name: header name
+ * @value: header value
+ *
+ * Adds a request header, which is sent with every page request.
+ */
+void
+msg_page_iterator_add_header (MsgPageIterator *self,
+                              const char      *name,
+                              const char      *value)
+{
+  g_return_if_fail (MSG_IS_PAGE_ITERATOR (self));
+
+  soup_message_headers_append (self->headers, name, value);
+}
+
+/**
+ * msg_page_iterator_set_follow_next_link:
+ * @self: a #MsgPageIterator
+ * @follow: whether to request further pages
+ *
+ * By default all pages are iterated. In case @follow is %FALSE the
+ * iteration stops after the first page and the link to the next page
+ * is available through msg_page_iterator_get_next_link().
+ */
+void
+msg_page_iterator_set_follow_next_link (MsgPageIterator *self,
+                                        gboolean         follow)
+{
+  g_return_if_fail (MSG_IS_PAGE_ITERATOR (self));
+
+  self->follow_next_link = follow;
+}
+
+static void
+copy_header (const char *name,
+             const char *value,
+             gpointer    user_data)
+{
+  soup_message_headers_append (user_data, name, value);
+}
+
+static SoupMessage *
+msg_page_iterator_build_message (MsgPageIterator  *self,
+                                 const char       *url,
+                                 GError          **error)
+{
+  SoupMessage *message;
+
+  message = msg_service_build_message (self->service, "GET", url, NULL, FALSE);
+  if (!message) {
+    g_set_error (error, MSG_ERROR, MSG_ERROR_FAILED, "Invalid page url %s", url);
     return NULL;
   }
 
-  if (object)
-    *object = root_object;
+  soup_message_headers_foreach (self->headers, copy_header, soup_message_get_request_headers (message));
 
-  return g_steal_pointer (&parser);
+  return message;
+}
+
+static void
+msg_page_iterator_start_prefetch (MsgPageIterator *self,
+                                  const char      *url)
+{
+  PagePrefetch *prefetch;
+  SoupMessage *message;
+
+  /* Invalid links are reported once the page is requested regularly */
+  message = msg_page_iterator_build_message (self, url, NULL);
+  if (!message)
+    return;
+
+  prefetch = g_new0 (PagePrefetch, 1);
+  prefetch->service = g_object_ref (self->service);
+  prefetch->message = message;
+  prefetch->cancellable = g_cancellable_new ();
+  g_mutex_init (&prefetch->mutex);
+  g_cond_init (&prefetch->cond);
+
+  prefetch->task = g_task_new (NULL, prefetch->cancellable, NULL, NULL);
+  g_task_set_task_data (prefetch->task, prefetch, (GDestroyNotify) page_prefetch_free);
+  g_task_run_in_thread (prefetch->task, page_prefetch_thread);
+
+  self->prefetch = prefetch;
+}
+
+static gboolean
+msg_page_iterator_request_page (MsgPageIterator  *self,
+                                GCancellable     *cancellable,
+                                GError          **error)
+{
+  g_autoptr (SoupMessage) message = NULL;
+  g_autofree char *url = g_steal_pointer (&self->url);
+
+  if (self->prefetch) {
+    gulong handler_id = 0;
+
+    /* Forward cancellation of the caller to the running request */
+    if (cancellable)
+      handler_id = g_cancellable_connect (cancellable,
+                                          G_CALLBACK (page_prefetch_cancelled_cb),
+                                          g_object_ref (self->prefetch->cancellable),
+                                          g_object_unref);
+    self->reader = page_prefetch_finish (g_steal_pointer (&self->prefetch), error);
+    if (handler_id)
+      g_cancellable_disconnect (cancellable, handler_id);
+
+    return self->reader != NULL;
+  }
+
+  if (!self->authorized) {
+    if (!msg_service_refresh_authorization (self->service, cancellable, error))
+      return FALSE;
+
+    self->authorized = TRUE;
+  }
+
+  message = msg_page_iterator_build_message (self, url, error);
+  if (!message)
+    return FALSE;
+
+  self->reader = msg_service_send_and_read_collection (self->service, message, cancellable, error);
+  return self->reader != NULL;
+}
+
+static void
+msg_page_iterator_finish_page (MsgPageIterator *self)
+{
+  g_clear_pointer (&self->next_link, g_free);
+  self->next_link = g_strdup (msg_collection_reader_get_next_link (self->reader));
+
+  if (msg_collection_reader_get_delta_link (self->reader)) {
+    g_clear_pointer (&self->delta_link, g_free);
+    self->delta_link = g_strdup (msg_collection_reader_get_delta_link (self->reader));
+  }
+
+  if (self->follow_next_link && self->next_link)
+    self->url = g_strdup (self->next_link);
+
+  /* A prefetched page without a matching link cannot be used */
+  if (self->prefetch && !self->url)
+    g_clear_pointer (&self->prefetch, page_prefetch_cancel);
+
+  g_clear_object (&self->reader);
 }
 
 /**
- * msg_service_get_session:
- * @self: a #MsgService
+ * msg_page_iterator_next:
+ * @self: a #MsgPageIterator
+ * @cancellable: a #GCancellable
+ * @error: a #GError
  *
- * Get related soup session
+ * Returns the next item of the collection, requesting the next page
+ * if required. Elements which cannot be converted into an item are
+ * skipped with a warning.
  *
- * Returns: (transfer none): a #SoupSession
+ * Returns: (transfer full) (nullable): the next item, or %NULL at the
+ *   end of the collection or on error
  */
-SoupSession *
-msg_service_get_session (MsgService *self)
+gpointer
+msg_page_iterator_next (MsgPageIterator  *self,
+                        GCancellable     *cancellable,
+                        GError          **error)
 {
-  MsgServicePrivate *priv = MSG_SERVICE_GET_PRIVATE (self);
-  return priv->session;
+  g_return_val_if_fail (MSG_IS_PAGE_ITERATOR (self), NULL);
+
+  while (TRUE) {
+    g_autoptr (JsonObject) object = NULL;
+    g_autoptr (GError) local_error = NULL;
+    gpointer item;
+
+    if (!self->reader) {
+      if (!self->url)
+        return NULL;
+
+      if (!msg_page_iterator_request_page (self, cancellable, error))
+        return NULL;
+    }
+
+    object = msg_collection_reader_next (self->reader, cancellable, &local_error);
+    if (local_error) {
+      /* Errors are final, there is no way to resume the page */
+      g_clear_object (&self->reader);
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return NULL;
+    }
+
+    if (!self->prefetch && self->follow_next_link && msg_service_get_prefetch_pages (self->service)) {
+      const char *next_link = msg_collection_reader_get_next_link (self->reader);
+
+      if (next_link)
+        msg_page_iterator_start_prefetch (self, next_link);
+    }
+
+    if (!object) {
+      msg_page_iterator_finish_page (self);
+      continue;
+    }
+
+    item = self->item_func (object, &local_error);
+    if (!item) {
+      g_warning ("Could not parse collection item: %s", local_error ? local_error->message : "unknown error");
+      continue;
+    }
+
+    return item;
+  }
+}
+
+static void
+page_iterator_next_thread (GTask        *task,
+                           gpointer      source_object,
+                           __attribute__ ((unused)) gpointer task_data,
+                           GCancellable *cancellable)
+{
+  GError *error = NULL;
+  gpointer item;
+
+  item = msg_page_iterator_next (source_object, cancellable, &error);
+  if (error)
+    g_task_return_error (task, error);
+  else
+    g_task_return_pointer (task, item, g_object_unref);
 }
 
 /**
- * msg_service_get_authorizer:
- * @self: a #MsgService
- *
- * Get related authorizer.
+ * msg_page_iterator_next_async:
+ * @self: a #MsgPageIterator
+ * @io_priority: the I/O priority of the request
+ * @cancellable: a #GCancellable
+ * @callback: (scope async): a #GAsyncReadyCallback to call when the request is satisfied
+ * @user_data: (closure): the data to pass to @callback
  *
- * Returns: (transfer none): a #MsgAuthorizer
+ * Asynchronously returns the next item of the collection. Only one
+ * operation may be pending at a time.
  */
-MsgAuthorizer *
-msg_service_get_authorizer (MsgService *self)
+void
+msg_page_iterator_next_async (MsgPageIterator     *self,
+                              int                  io_priority,
+                              GCancellable        *cancellable,
+                              GAsyncReadyCallback  callback,
+                              gpointer             user_data)
 {
-  MsgServicePrivate *priv = MSG_SERVICE_GET_PRIVATE (self);
-  return priv->authorizer;
+  g_autoptr (GTask) task = NULL;
+
+  g_return_if_fail (MSG_IS_PAGE_ITERATOR (self));
+
+  task = g_task_new (self, cancellable, callback, user_data);
+  g_task_set_source_tag (task, msg_page_iterator_next_async);
+  g_task_set_priority (task, io_priority);
+  g_task_run_in_thread (task, page_iterator_next_thread);
 }
 
 /**
- * msg_service_get_next_link:
- * @object: a #JsonObject
+ * msg_page_iterator_next_finish:
+ * @self: a #MsgPageIterator
+ * @result: a #GAsyncResult
+ * @error: a #GError
  *
- * Get next link
+ * Finishes an asynchronous operation started with msg_page_iterator_next_async().
  *
- * Returns: (transfer full): next link or %NULL if not available
+ * Returns: (transfer full) (nullable): the next item, or %NULL at the
+ *   end of the collection or on error
  */
-char *
-msg_service_get_next_link (JsonObject *object)
+gpointer
+msg_page_iterator_next_finish (MsgPageIterator  *self,
+                               GAsyncResult     *result,
+                               GError          **error)
 {
-  return g_strdup (msg_json_object_get_string (object, "@odata.nextLink"));
+  g_return_val_if_fail (g_task_is_valid (result, self), NULL);
+  g_return_val_if_fail (g_async_result_is_tagged (result, msg_page_iterator_next_async), NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
 }
 
-gboolean
-msg_service_handle_rate_limiting (SoupMessage *msg)
+/**
+ * msg_page_iterator_collect:
+ * @self: a #MsgPageIterator
+ * @cancellable: a #GCancellable
+ * @error: a #GError
+ *
+ * Reads all remaining items of the collection into an array.
+ *
+ * Returns: (element-type GObject) (transfer full): all remaining items
+ *   or %NULL on error
+ */
+GPtrArray *
+msg_page_iterator_collect (MsgPageIterator  *self,
+                           GCancellable     *cancellable,
+                           GError          **error)
 {
-  if (soup_message_get_status (msg) == 429) {
-    const char *retry_after = soup_message_headers_get_one (soup_message_get_response_headers (msg), "retry-after");
+  g_autoptr (GPtrArray) items = NULL;
+  g_autoptr (GError) local_error = NULL;
+  gpointer item;
 
-    if (retry_after) {
-      int seconds = atoi (retry_after);
-      g_usleep (seconds * G_USEC_PER_SEC);
-      return TRUE;
-    }
+  g_return_val_if_fail (MSG_IS_PAGE_ITERATOR (self), NULL);
+
+  items = g_ptr_array_new_with_free_func (g_object_unref);
+  while ((item = msg_page_iterator_next (self, cancellable, &local_error)))
+    g_ptr_array_add (items, item);
+
+  if (local_error) {
+    g_propagate_error (error, g_steal_pointer (&local_error));
+    return NULL;
   }
 
-  return FALSE;
+  return g_steal_pointer (&items);
+}
+
+/**
+ * msg_page_iterator_get_next_link:
+ * @self: a #MsgPageIterator
+ *
+ * Get next link of the last completely read page.
+ *
+ * Returns: (transfer none) (nullable): next link
+ */
+const char *
+msg_page_iterator_get_next_link (MsgPageIterator *self)
+{
+  g_return_val_if_fail (MSG_IS_PAGE_ITERATOR (self), NULL);
+
+  return self->next_link;
+}
+
+/**
+ * msg_page_iterator_get_delta_link:
+ * @self: a #MsgPageIterator
+ *
+ * Get delta link, which is returned with the last page of a delta query.
+ *
+ * Returns: (transfer none) (nullable): delta link
+ */
+const char *
+msg_page_iterator_get_delta_link (MsgPageIterator *self)
+{
+  g_return_val_if_fail (MSG_IS_PAGE_ITERATOR (self), NULL);
+
+  return self->delta_link;
 }
@@ -21,6 +21,8 @@
 #include <json-glib/json-glib.h>
 
 #include "msg-authorizer.h"
+#include "msg-collection-reader.h"
+#include "msg-response-cache.h"
 
 G_BEGIN_DECLS
 
@@ -32,6 +34,13 @@ struct _MsgServiceClass {
 
 G_DECLARE_DERIVABLE_TYPE (MsgService, msg_service, MSG, SERVICE, GObject);
 
+#define MSG_SERVICE_DEFAULT_MAX_CONNS 10
+#define MSG_SERVICE_DEFAULT_MAX_CONNS_PER_HOST 2
+#define MSG_SERVICE_DEFAULT_IDLE_TIMEOUT 60
+
+/* Declared in msg-service-pool.h, which depends on the services */
+typedef struct _MsgServicePool MsgServicePool;
+
 gboolean
 msg_service_refresh_authorization(MsgService    *self,
                                   GCancellable  *cancellable,
@@ -73,9 +82,53 @@ msg_service_get_https_port (void);
 SoupSession *
 msg_service_get_session (MsgService *self);
 
+SoupSession *
+msg_service_session_new (guint max_conns,
+                         guint max_conns_per_host,
+                         guint idle_timeout);
+
 MsgAuthorizer *
 msg_service_get_authorizer (MsgService *self);
 
+MsgServicePool *
+msg_service_get_pool (MsgService *self);
+
+void
+msg_service_set_prefetch_pages (MsgService *self,
+                                gboolean    prefetch);
+
+gboolean
+msg_service_get_prefetch_pages (MsgService *self);
+
+void
+msg_service_set_response_cache (MsgService       *self,
+                                MsgResponseCache *cache);
+
+MsgResponseCache *
+msg_service_get_response_cache (MsgService *self);
+
+guint
+msg_service_get_concurrency_limit (MsgService *self);
+
+guint
+msg_service_get_in_flight (MsgService *self);
+
+void
+msg_service_set_max_concurrency (MsgService *self,
+                                 guint       max_concurrency);
+
+JsonNode *
+msg_service_get_stats (MsgService *self);
+
+void
+msg_service_reset_stats (MsgService *self);
+
+MsgCollectionReader *
+msg_service_send_and_read_collection (MsgService    *self,
+                                      SoupMessage   *message,
+                                      GCancellable  *cancellable,
+                                      GError       **error);
+
 JsonParser *
 msg_service_send_and_parse_response (MsgService    *self,
                                      SoupMessage   *message,
@@ -86,7 +139,148 @@ msg_service_send_and_parse_response (MsgService    *self,
 char *
 msg_service_get_next_link (JsonObject *object);
 
+int
+msg_service_parse_retry_after (const char *retry_after);
+
+int
+msg_service_get_retry_after (SoupMessage *msg);
+
+G_DEPRECATED_FOR (msg_service_throttle_message)
 gboolean
 msg_service_handle_rate_limiting (SoupMessage *msg);
 
+void
+msg_service_throttle (MsgService *self,
+                      int         seconds);
+
+gboolean
+msg_service_throttle_message (MsgService  *self,
+                              SoupMessage *msg);
+
+gboolean
+msg_service_wait_for_throttle (MsgService    *self,
+                               GCancellable  *cancellable,
+                               GError       **error);
+
+void
+msg_service_wait_for_throttle_async (MsgService          *self,
+                                     GCancellable        *cancellable,
+                                     GAsyncReadyCallback  callback,
+                                     gpointer             user_data);
+
+gboolean
+msg_service_wait_for_throttle_finish (MsgService    *self,
+                                      GAsyncResult  *result,
+                                      GError       **error);
+
+void
+msg_service_refresh_authorization_async (MsgService          *self,
+                                         GCancellable        *cancellable,
+                                         GAsyncReadyCallback  callback,
+                                         gpointer             user_data);
+
+gboolean
+msg_service_refresh_authorization_finish (MsgService    *self,
+                                          GAsyncResult  *result,
+                                          GError       **error);
+
+void
+msg_service_send_async (MsgService          *self,
+                        SoupMessage         *message,
+                        int                  io_priority,
+                        GCancellable        *cancellable,
+                        GAsyncReadyCallback  callback,
+                        gpointer             user_data);
+
+GInputStream *
+msg_service_send_finish (MsgService    *self,
+                         GAsyncResult  *result,
+                         GError       **error);
+
+void
+msg_service_send_and_read_async (MsgService          *self,
+                                 SoupMessage         *message,
+                                 int                  io_priority,
+                                 GCancellable        *cancellable,
+                                 GAsyncReadyCallback  callback,
+                                 gpointer             user_data);
+
+GBytes *
+msg_service_send_and_read_finish (MsgService    *self,
+                                  GAsyncResult  *result,
+                                  GError       **error);
+
+void
+msg_service_send_and_parse_response_async (MsgService          *self,
+                                           SoupMessage         *message,
+                                           int                  io_priority,
+                                           GCancellable        *cancellable,
+                                           GAsyncReadyCallback  callback,
+                                           gpointer             user_data);
+
+JsonParser *
+msg_service_send_and_parse_response_finish (MsgService    *self,
+                                            GAsyncResult  *result,
+                                            JsonObject   **object,
+                                            GError       **error);
+
+/**
+ * MsgPageIteratorItemFunc:
+ * @object: a collection element
+ * @error: a #GError
+ *
+ * Creates an item object out of a collection element, e.g.
+ * msg_drive_item_new_from_json().
+ *
+ * Returns: (transfer full): a new #GObject or %NULL on error
+ */
+typedef gpointer (*MsgPageIteratorItemFunc) (JsonObject  *object,
+                                             GError     **error);
+
+#define MSG_TYPE_PAGE_ITERATOR (msg_page_iterator_get_type ())
+
+G_DECLARE_FINAL_TYPE (MsgPageIterator, msg_page_iterator, MSG, PAGE_ITERATOR, GObject);
+
+MsgPageIterator *
+msg_page_iterator_new (MsgService              *service,
+                       const char              *url,
+                       MsgPageIteratorItemFunc  item_func);
+
+void
+msg_page_iterator_add_header (MsgPageIterator *self,
+                              const char      *name,
+                              const char      *value);
+
+void
+msg_page_iterator_set_follow_next_link (MsgPageIterator *self,
+                                        gboolean         follow);
+
+gpointer
+msg_page_iterator_next (MsgPageIterator  *self,
+                        GCancellable     *cancellable,
+                        GError          **error);
+
+void
+msg_page_iterator_next_async (MsgPageIterator     *self,
+                              int                  io_priority,
+                              GCancellable        *cancellable,
+                              GAsyncReadyCallback  callback,
+                              gpointer             user_data);
+
+gpointer
+msg_page_iterator_next_finish (MsgPageIterator  *self,
+                               GAsyncResult     *result,
+                               GError          **error);
+
+GPtrArray *
+msg_page_iterator_collect (MsgPageIterator  *self,
+                           GCancellable     *cancellable,
+                           GError          **error);
+
+const char *
+msg_page_iterator_get_next_link (MsgPageIterator *self);
+
+const char *
+msg_page_iterator_get_delta_link (MsgPageIterator *self);
+
 G_END_DECLS
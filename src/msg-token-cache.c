@@ -0,0 +1,105 @@
+/* Copyright 2024 Jan-Michael Brummer <jan-michael.brummer1@volkswagen.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "msg-token-cache.h"
+
+/**
+ * MsgTokenCache:
+ *
+ * Persistent storage for the tokens of an authorizer, so that a new
+ * process can reuse a still valid access token instead of requesting
+ * one first.
+ */
+
+G_DEFINE_INTERFACE (MsgTokenCache, msg_token_cache, G_TYPE_OBJECT);
+
+static void
+msg_token_cache_default_init (__attribute__ ((unused)) MsgTokenCacheInterface *iface)
+{
+}
+
+/**
+ * msg_token_cache_load:
+ * @self: a #MsgTokenCache
+ * @account: account identifier
+ * @access_token: (out) (transfer full): return location for the access token
+ * @refresh_token: (out) (transfer full): return location for the refresh token
+ * @expires_at: (out): return location for the expiry of the access token
+ *   as wall clock time in microseconds, 0 if unknown
+ * @error: a #GError
+ *
+ * Loads the tokens stored for @account.
+ *
+ * Returns: %TRUE if tokens have been found, %FALSE if not or on error
+ */
+gboolean
+msg_token_cache_load (MsgTokenCache  *self,
+                      const char     *account,
+                      char          **access_token,
+                      char          **refresh_token,
+                      gint64         *expires_at,
+                      GError        **error)
+{
+  g_return_val_if_fail (MSG_IS_TOKEN_CACHE (self), FALSE);
+  g_return_val_if_fail (account != NULL, FALSE);
+
+  return MSG_TOKEN_CACHE_GET_IFACE (self)->load (self, account, access_token, refresh_token, expires_at, error);
+}
+
+/**
+ * msg_token_cache_store:
+ * @self: a #MsgTokenCache
+ * @account: account identifier
+ * @access_token: (nullable): the access token
+ * @refresh_token: the refresh token
+ * @expires_at: expiry of @access_token as wall clock time in microseconds
+ * @error: a #GError
+ *
+ * Stores the tokens of @account, replacing previously stored ones.
+ *
+ * Returns: %TRUE on success
+ */
+gboolean
+msg_token_cache_store (MsgTokenCache  *self,
+                       const char     *account,
+                       const char     *access_token,
+                       const char     *refresh_token,
+                       gint64          expires_at,
+                       GError        **error)
+{
+  g_return_val_if_fail (MSG_IS_TOKEN_CACHE (self), FALSE);
+  g_return_val_if_fail (account != NULL, FALSE);
+
+  return MSG_TOKEN_CACHE_GET_IFACE (self)->store (self, account, access_token, refresh_token, expires_at, error);
+}
+
+/**
+ * msg_token_cache_remove:
+ * @self: a #MsgTokenCache
+ * @account: account identifier
+ *
+ * Removes the tokens stored for @account.
+ */
+void
+msg_token_cache_remove (MsgTokenCache *self,
+                        const char    *account)
+{
+  g_return_if_fail (MSG_IS_TOKEN_CACHE (self));
+  g_return_if_fail (account != NULL);
+
+  MSG_TOKEN_CACHE_GET_IFACE (self)->remove (self, account);
+}
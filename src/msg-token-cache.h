@@ -0,0 +1,79 @@
+/* Copyright 2024 Jan-Michael Brummer <jan-michael.brummer1@volkswagen.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <glib-object.h>
+
+G_BEGIN_DECLS
+
+#define MSG_TYPE_TOKEN_CACHE (msg_token_cache_get_type ())
+
+G_DECLARE_INTERFACE (MsgTokenCache, msg_token_cache, MSG, TOKEN_CACHE, GObject);
+
+/**
+ * MsgTokenCacheInterface:
+ * @parent_iface: The parent interface.
+ * @load: Loads the tokens of an account. Returns %FALSE without setting
+ *   an error if no tokens are stored for the account.
+ * @store: Stores the tokens of an account, replacing previous ones.
+ * @remove: Removes the tokens of an account.
+ *
+ * Interface structure for #MsgTokenCache. All methods should be
+ * thread safe.
+ */
+struct _MsgTokenCacheInterface
+{
+  GTypeInterface parent_iface;
+
+  gboolean    (*load)                        (MsgTokenCache  *self,
+                                              const char     *account,
+                                              char          **access_token,
+                                              char          **refresh_token,
+                                              gint64         *expires_at,
+                                              GError        **error);
+  gboolean    (*store)                       (MsgTokenCache  *self,
+                                              const char     *account,
+                                              const char     *access_token,
+                                              const char     *refresh_token,
+                                              gint64          expires_at,
+                                              GError        **error);
+  void        (*remove)                      (MsgTokenCache  *self,
+                                              const char     *account);
+};
+
+gboolean
+msg_token_cache_load (MsgTokenCache  *self,
+                      const char     *account,
+                      char          **access_token,
+                      char          **refresh_token,
+                      gint64         *expires_at,
+                      GError        **error);
+
+gboolean
+msg_token_cache_store (MsgTokenCache  *self,
+                       const char     *account,
+                       const char     *access_token,
+                       const char     *refresh_token,
+                       gint64          expires_at,
+                       GError        **error);
+
+void
+msg_token_cache_remove (MsgTokenCache *self,
+                        const char    *account);
+
+G_END_DECLS
@@ -20,6 +20,7 @@
 #include <stdio.h>
 
 #include "msg-authorizer.h"
+#include "msg-batch.h"
 #include "msg-error.h"
 #include "msg-private.h"
 #include "msg-service.h"
@@ -88,6 +89,78 @@ msg_user_service_get_user (MsgUserService  *self,
   return msg_user_new_from_json (root_object, error);
 }
 
+/**
+ * msg_user_service_get_users:
+ * @self: a #MsgUserService
+ * @names: (array zero-terminated=1): %NULL terminated list of user names
+ * @cancellable: a #GCancellable
+ * @error: a #GError
+ *
+ * Get user information for several users at once using batch requests.
+ * Unknown users are skipped.
+ *
+ * Returns: (element-type MsgUser) (transfer full): list of found users
+ */
+GList *
+msg_user_service_get_users (MsgUserService      *self,
+                            const char * const  *names,
+                            GCancellable        *cancellable,
+                            GError             **error)
+{
+  GList *list = NULL;
+  guint idx = 0;
+
+  if (!msg_service_refresh_authorization (MSG_SERVICE (self), cancellable, error))
+    return NULL;
+
+  while (names && names[idx]) {
+    g_autoptr (MsgBatch) batch = msg_batch_new (MSG_SERVICE (self));
+    g_autoptr (GPtrArray) ids = g_ptr_array_new ();
+
+    for (; names[idx] && !msg_batch_is_full (batch); idx++) {
+      g_autoptr (SoupMessage) message = NULL;
+      g_autofree char *url = NULL;
+      const char *id;
+
+      url = g_strconcat (MSG_BETA_API_ENDPOINT, "/me/contacts/users/", names[idx], NULL);
+      message = msg_service_build_message (MSG_SERVICE (self), "GET", url, NULL, FALSE);
+      id = msg_batch_add (batch, message, NULL, NULL);
+      if (!id) {
+        g_set_error (error,
+                     msg_error_quark (),
+                     MSG_ERROR_FAILED,
+                     "Could not add %s to batch request",
+                     url);
+        g_list_free_full (list, g_object_unref);
+        return NULL;
+      }
+
+      g_ptr_array_add (ids, (gpointer)id);
+    }
+
+    if (!msg_batch_send (batch, cancellable, error)) {
+      g_list_free_full (list, g_object_unref);
+      return NULL;
+    }
+
+    for (guint i = 0; i < ids->len; i++) {
+      g_autoptr (JsonParser) parser = NULL;
+      JsonObject *root_object = NULL;
+      MsgUser *user;
+
+      parser = msg_batch_parse_response (batch, g_ptr_array_index (ids, i), &root_object, NULL);
+      if (!parser)
+        continue;
+
+      user = msg_user_new_from_json (root_object, NULL);
+      if (user)
+        list = g_list_prepend (list, user);
+    }
+  }
+
+  return g_list_reverse (list);
+}
+
 /**
  * msg_user_service_get_photo:
  * @self: a #MsgUserService
@@ -117,7 +190,8 @@ msg_user_service_get_photo (MsgUserService  *self,
   message = msg_service_build_message (MSG_SERVICE (self), "GET", url, NULL, FALSE);
   photo = msg_service_send_and_read (MSG_SERVICE (self), message, cancellable, error);
 
-  if (soup_message_get_status (message) == SOUP_STATUS_OK) {
+  /* Not modified responses are answered from the response cache */
+  if (soup_message_get_status (message) == SOUP_STATUS_OK || soup_message_get_status (message) == SOUP_STATUS_NOT_MODIFIED) {
     return g_steal_pointer (&photo);
   }
 
@@ -129,6 +203,23 @@ msg_user_service_get_photo (MsgUserService  *self,
   return NULL;
 }
 
+/**
+ * msg_user_service_iterate_contact_folders:
+ * @self: a #MsgUserService
+ *
+ * Creates an iterator over all contact folders. Pages are requested on
+ * demand while iterating.
+ *
+ * Returns: (transfer full): a new `MsgPageIterator` returning `MsgUserContactFolder`s
+ */
+MsgPageIterator *
+msg_user_service_iterate_contact_folders (MsgUserService *self)
+{
+  g_autofree char *url = g_strconcat (MSG_API_ENDPOINT, "/me/contactFolders", NULL);
+
+  return msg_page_iterator_new (MSG_SERVICE (self), url, (MsgPageIteratorItemFunc) msg_user_contact_folder_new_from_json);
+}
+
 /**
  * msg_user_service_get_contact_folders:
  * @self: a #MsgUserService
@@ -144,52 +235,38 @@ msg_user_service_get_contact_folders (MsgUserService  *self,
                                       GCancellable    *cancellable,
                                       GError         **error)
 {
-  JsonObject *root_object = NULL;
-  g_autofree char *url = NULL;
+  g_autoptr (MsgPageIterator) iter = NULL;
   g_autolist (MsgUserContactFolder) list = NULL;
-  JsonArray *array = NULL;
-  guint array_length = 0, index = 0;
-  g_autoptr (GBytes) response = NULL;
-  g_autoptr (JsonParser) parser = NULL;
-
-  if (!msg_service_refresh_authorization (MSG_SERVICE (self), cancellable, error))
-    return NULL;
-
-  url = g_strconcat (MSG_API_ENDPOINT, "/me/contactFolders", NULL);
+  g_autoptr (GError) local_error = NULL;
+  MsgUserContactFolder *item;
 
-  do {
-    g_autoptr (SoupMessage) message = NULL;
+  iter = msg_user_service_iterate_contact_folders (self);
+  while ((item = msg_page_iterator_next (iter, cancellable, &local_error)))
+    list = g_list_prepend (list, item);
 
-    message = msg_service_build_message (MSG_SERVICE (self), "GET", url, NULL, FALSE);
-    parser = msg_service_send_and_parse_response (MSG_SERVICE (self), message, &root_object, cancellable, error);
-    if (!parser)
-      return NULL;
-
-    array = json_object_get_array_member (root_object, "value");
-    g_assert (array != NULL);
-
-    array_length = json_array_get_length (array);
-    for (index = 0; index < array_length; index++) {
-      g_autoptr (GError) local_error = NULL;
-      MsgUserContactFolder *folder = NULL;
-      JsonObject *object = NULL;
-
-      object = json_array_get_object_element (array, index);
+  if (local_error) {
+    g_propagate_error (error, g_steal_pointer (&local_error));
+    return NULL;
+  }
 
-      folder = msg_user_contact_folder_new_from_json (object, &local_error);
-      if (folder) {
-        list = g_list_append (list, folder);
-      } else {
-        g_warning ("Could not parse contact folder object: %s", local_error->message);
-        g_clear_error (&local_error);
-      }
-    }
+  return g_list_reverse (g_steal_pointer (&list));
+}
 
-    g_clear_pointer (&url, g_free);
-    url = msg_service_get_next_link (root_object);
-  } while (url != NULL);
+/**
+ * msg_user_service_iterate_contacts:
+ * @self: a #MsgUserService
+ *
+ * Creates an iterator over all contacts within users 'Contact' folder.
+ * Pages are requested on demand while iterating.
+ *
+ * Returns: (transfer full): a new `MsgPageIterator` returning `MsgUser`s
+ */
+MsgPageIterator *
+msg_user_service_iterate_contacts (MsgUserService *self)
+{
+  g_autofree char *url = g_strconcat (MSG_API_ENDPOINT, "/me/contacts/", NULL);
 
-  return g_steal_pointer (&list);
+  return msg_page_iterator_new (MSG_SERVICE (self), url, (MsgPageIteratorItemFunc) msg_user_new_from_json);
 }
 
 /**
@@ -207,53 +284,66 @@ msg_user_service_get_contacts (MsgUserService  *self,
                                GCancellable    *cancellable,
                                GError         **error)
 {
-  g_autoptr (SoupMessage) soup_message = NULL;
-  g_autofree char *url = NULL;
-  JsonObject *root_object = NULL;
+  g_autoptr (MsgPageIterator) iter = NULL;
   g_autolist (MsgUser) list = NULL;
-  JsonArray *array = NULL;
-  guint array_length = 0, index = 0;
-  g_autoptr (GBytes) response = NULL;
-  g_autoptr (JsonParser) parser = NULL;
-
-  if (!msg_service_refresh_authorization (MSG_SERVICE (self), cancellable, error))
-    return NULL;
+  g_autoptr (GError) local_error = NULL;
+  MsgUser *item;
 
-  url = g_strconcat (MSG_API_ENDPOINT, "/me/contacts/", NULL);
+  iter = msg_user_service_iterate_contacts (self);
+  while ((item = msg_page_iterator_next (iter, cancellable, &local_error)))
+    list = g_list_prepend (list, item);
 
-  do {
-    g_autoptr (SoupMessage) message = NULL;
-
-    message = msg_service_build_message (MSG_SERVICE (self), "GET", url, NULL, FALSE);
-    parser = msg_service_send_and_parse_response (MSG_SERVICE (self), message, &root_object, cancellable, error);
-    if (!parser)
-      return NULL;
+  if (local_error) {
+    g_propagate_error (error, g_steal_pointer (&local_error));
+    return NULL;
+  }
 
-    array = json_object_get_array_member (root_object, "value");
-    g_assert (array != NULL);
+  return g_list_reverse (g_steal_pointer (&list));
+}
 
-    array_length = json_array_get_length (array);
-    for (index = 0; index < array_length; index++) {
-      g_autoptr (GError) local_error = NULL;
-      MsgUser *user = NULL;
-      JsonObject *object = NULL;
+/**
+ * msg_user_service_get_contacts_array:
+ * @self: a #MsgUserService
+ * @cancellable: a #GCancellable
+ * @error: a #GError
+ *
+ * Same as msg_user_service_get_contacts(), but returns an array.
+ *
+ * Returns: (element-type MsgUser) (transfer full): all contacts in users contact folder
+ */
+GPtrArray *
+msg_user_service_get_contacts_array (MsgUserService  *self,
+                                     GCancellable    *cancellable,
+                                     GError         **error)
+{
+  g_autoptr (MsgPageIterator) iter = NULL;
 
-      object = json_array_get_object_element (array, index);
+  iter = msg_user_service_iterate_contacts (self);
+  return msg_page_iterator_collect (iter, cancellable, error);
+}
 
-      user = msg_user_new_from_json (object, &local_error);
-      if (user) {
-        list = g_list_append (list, user);
-      } else {
-        g_warning ("Could not parse contact user object: %s", local_error->message);
-        g_clear_error (&local_error);
-      }
-    }
+/**
+ * msg_user_service_iterate_find_users:
+ * @self: a #MsgUserService
+ * @display_name: name to search
+ *
+ * Creates an iterator over all users with the given @display_name.
+ * Pages are requested on demand while iterating. (Business accounts only!)
+ *
+ * Returns: (transfer full): a new `MsgPageIterator` returning `MsgUser`s
+ */
+MsgPageIterator *
+msg_user_service_iterate_find_users (MsgUserService *self,
+                                     const char     *display_name)
+{
+  MsgPageIterator *iter;
+  g_autofree char *url = NULL;
 
-    g_clear_pointer (&url, g_free);
-    url = msg_service_get_next_link (root_object);
-  } while (url != NULL);
+  url = g_strconcat (MSG_API_ENDPOINT, "/users?$search=\"displayName:", display_name, "\"", NULL);
+  iter = msg_page_iterator_new (MSG_SERVICE (self), url, (MsgPageIteratorItemFunc) msg_user_new_from_json);
+  msg_page_iterator_add_header (iter, "ConsistencyLevel", "eventual");
 
-  return g_steal_pointer (&list);
+  return iter;
 }
 
 /**
@@ -273,52 +363,42 @@ msg_user_service_find_users (MsgUserService  *self,
                              GCancellable    *cancellable,
                              GError         **error)
 {
-  g_autoptr (SoupMessage) soup_message = NULL;
-  g_autofree char *url = NULL;
-  JsonObject *root_object = NULL;
+  g_autoptr (MsgPageIterator) iter = NULL;
   g_autolist (MsgUser) list = NULL;
-  JsonArray *array = NULL;
-  guint array_length = 0, index = 0;
-  g_autoptr (GBytes) response = NULL;
-  g_autoptr (JsonParser) parser = NULL;
-
-  if (!msg_service_refresh_authorization (MSG_SERVICE (self), cancellable, error))
-    return NULL;
-
-  url = g_strconcat (MSG_API_ENDPOINT, "/users?$search=\"displayName:", display_name, "\"", NULL);
-
-  do {
-    g_autoptr (SoupMessage) message = NULL;
-
-    message = msg_service_build_message (MSG_SERVICE (self), "GET", url, NULL, FALSE);
-    soup_message_headers_append (soup_message_get_request_headers (message), "ConsistencyLevel", "eventual");
-    parser = msg_service_send_and_parse_response (MSG_SERVICE (self), message, &root_object, cancellable, error);
-    if (!parser)
-      return NULL;
+  g_autoptr (GError) local_error = NULL;
+  MsgUser *item;
 
-    array = json_object_get_array_member (root_object, "value");
-    g_assert (array != NULL);
+  iter = msg_user_service_iterate_find_users (self, display_name);
+  while ((item = msg_page_iterator_next (iter, cancellable, &local_error)))
+    list = g_list_prepend (list, item);
 
-    array_length = json_array_get_length (array);
-    for (index = 0; index < array_length; index++) {
-      g_autoptr (GError) local_error = NULL;
-      MsgUser *user = NULL;
-      JsonObject *object = NULL;
-
-      object = json_array_get_object_element (array, index);
+  if (local_error) {
+    g_propagate_error (error, g_steal_pointer (&local_error));
+    return NULL;
+  }
 
-      user = msg_user_new_from_json (object, &local_error);
-      if (user) {
-        list = g_list_append (list, user);
-      } else {
-        g_warning ("Could not parse contact user object: %s", local_error->message);
-        g_clear_error (&local_error);
-      }
-    }
+  return g_list_reverse (g_steal_pointer (&list));
+}
 
-    g_clear_pointer (&url, g_free);
-    url = msg_service_get_next_link (root_object);
-  } while (url != NULL);
+/**
+ * msg_user_service_find_users_array:
+ * @self: a #MsgUserService
+ * @display_name: name to search
+ * @cancellable: a #GCancellable
+ * @error: a #GError
+ *
+ * Same as msg_user_service_find_users(), but returns an array.
+ *
+ * Returns: (element-type MsgUser) (transfer full): all users with the given name
+ */
+GPtrArray *
+msg_user_service_find_users_array (MsgUserService  *self,
+                                   const char      *display_name,
+                                   GCancellable    *cancellable,
+                                   GError         **error)
+{
+  g_autoptr (MsgPageIterator) iter = NULL;
 
-  return g_steal_pointer (&list);
+  iter = msg_user_service_iterate_find_users (self, display_name);
+  return msg_page_iterator_collect (iter, cancellable, error);
 }
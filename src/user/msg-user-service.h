@@ -34,23 +34,50 @@ msg_user_service_get_user (MsgUserService  *self,
                            GCancellable    *cancellable,
                            GError         **error);
 
+GList *
+msg_user_service_get_users (MsgUserService      *self,
+                            const char * const  *names,
+                            GCancellable        *cancellable,
+                            GError             **error);
+
 GBytes *
 msg_user_service_get_photo (MsgUserService  *self,
                             const char      *mail,
                             GCancellable    *cancellable,
                             GError         **error);
 
+MsgPageIterator *
+msg_user_service_iterate_contacts (MsgUserService *self);
+
 GList *
 msg_user_service_get_contacts (MsgUserService  *self,
                                GCancellable    *cancellable,
                                GError         **error);
 
+GPtrArray *
+msg_user_service_get_contacts_array (MsgUserService  *self,
+                                     GCancellable    *cancellable,
+                                     GError         **error);
+
+MsgPageIterator *
+msg_user_service_iterate_find_users (MsgUserService *self,
+                                     const char     *display_name);
+
 GList *
 msg_user_service_find_users (MsgUserService  *self,
                              const char      *name,
                              GCancellable    *cancellable,
                              GError         **error);
 
+GPtrArray *
+msg_user_service_find_users_array (MsgUserService  *self,
+                                   const char      *display_name,
+                                   GCancellable    *cancellable,
+                                   GError         **error);
+
+MsgPageIterator *
+msg_user_service_iterate_contact_folders (MsgUserService *self);
+
 GList *
 msg_user_service_get_contact_folders (MsgUserService  *self,
                                       GCancellable    *cancellable,
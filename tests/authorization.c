@@ -1,4 +1,9 @@
+#include <glib/gstdio.h>
+
 #include "src/msg-authorizer.h"
+#include "src/msg-error.h"
+#include "src/msg-file-token-cache.h"
+#include "src/msg-oauth2-authorizer.h"
 #include "msg-dummy-authorizer.h"
 #include "common.h"
 
@@ -40,6 +45,208 @@ test_authorizer_refresh_authorization (AuthorizerData *data,
   g_assert_cmpuint (GPOINTER_TO_UINT (g_object_get_data (G_OBJECT (data->authorizer), "counter")), ==, 1);
 }
 
+static gpointer
+refresh_authorization_thread (gpointer user_data)
+{
+  return GINT_TO_POINTER (msg_authorizer_refresh_authorization (MSG_AUTHORIZER (user_data), NULL, NULL));
+}
+
+typedef struct {
+  MsgAuthorizer *authorizer;
+  GCancellable *cancellable;
+  GThread *thread;
+} RefreshWaiter;
+
+static gpointer
+refresh_waiter_thread (gpointer user_data)
+{
+  RefreshWaiter *waiter = user_data;
+
+  return GINT_TO_POINTER (msg_authorizer_refresh_authorization (waiter->authorizer, waiter->cancellable, NULL));
+}
+
+static void
+refresh_authorization_async_cb (GObject      *source,
+                                GAsyncResult *result,
+                                gpointer      user_data)
+{
+  GMainLoop *loop = user_data;
+  g_autoptr (GError) error = NULL;
+
+  g_assert_true (msg_authorizer_refresh_authorization_finish (MSG_AUTHORIZER (source), result, &error));
+  g_assert_no_error (error);
+
+  g_main_loop_quit (loop);
+}
+
+/* Test that concurrent sync and async refreshes share one refresh of the implementation */
+static void
+test_authorizer_refresh_authorization_single_flight (AuthorizerData *data,
+                                                     __attribute__ ((unused)) gconstpointer   user_data)
+{
+  g_autoptr (GMainLoop) loop = g_main_loop_new (NULL, FALSE);
+  guint cancelled_id = g_signal_lookup ("cancelled", G_TYPE_CANCELLABLE);
+  MsgDummyAuthorizerGate gate = { 0, };
+  RefreshWaiter waiters[4];
+  GThread *leader;
+
+  g_mutex_init (&gate.mutex);
+  g_cond_init (&gate.cond);
+  g_object_set_data (G_OBJECT (data->authorizer), "counter", GUINT_TO_POINTER (0));
+  g_object_set_data (G_OBJECT (data->authorizer), "gate", &gate);
+
+  leader = g_thread_new ("leader", refresh_authorization_thread, data->authorizer);
+
+  /* Wait until the leader is held within the implementation */
+  g_mutex_lock (&gate.mutex);
+  while (gate.entered == 0)
+    g_cond_wait (&gate.cond, &gate.mutex);
+  g_mutex_unlock (&gate.mutex);
+
+  for (guint index = 0; index < G_N_ELEMENTS (waiters); index++) {
+    waiters[index].authorizer = data->authorizer;
+    waiters[index].cancellable = g_cancellable_new ();
+    waiters[index].thread = g_thread_new ("waiter", refresh_waiter_thread, &waiters[index]);
+  }
+
+  /* Sync waiters watch their cancellable while waiting for the flight */
+  for (guint index = 0; index < G_N_ELEMENTS (waiters); index++) {
+    while (!g_signal_has_handler_pending (waiters[index].cancellable, cancelled_id, 0, FALSE))
+      g_thread_yield ();
+  }
+
+  /* Async callers join the flight before returning */
+  msg_authorizer_refresh_authorization_async (data->authorizer, NULL, refresh_authorization_async_cb, loop);
+
+  g_mutex_lock (&gate.mutex);
+  gate.open = TRUE;
+  g_cond_broadcast (&gate.cond);
+  g_mutex_unlock (&gate.mutex);
+
+  g_main_loop_run (loop);
+
+  g_assert_true (GPOINTER_TO_INT (g_thread_join (leader)));
+  for (guint index = 0; index < G_N_ELEMENTS (waiters); index++) {
+    g_assert_true (GPOINTER_TO_INT (g_thread_join (waiters[index].thread)));
+    g_object_unref (waiters[index].cancellable);
+  }
+
+  g_assert_cmpuint (gate.entered, ==, 1);
+  g_assert_cmpuint (GPOINTER_TO_UINT (g_object_get_data (G_OBJECT (data->authorizer), "counter")), ==, 1);
+
+  g_object_set_data (G_OBJECT (data->authorizer), "gate", NULL);
+  g_cond_clear (&gate.cond);
+  g_mutex_clear (&gate.mutex);
+}
+
+/* Test that a sync refresh does not wait for an async refresh which only completes in its own main context */
+static void
+test_authorizer_refresh_authorization_same_thread (AuthorizerData *data,
+                                                   __attribute__ ((unused)) gconstpointer   user_data)
+{
+  g_autoptr (GMainLoop) loop = g_main_loop_new (NULL, FALSE);
+  g_autoptr (GError) error = NULL;
+
+  g_object_set_data (G_OBJECT (data->authorizer), "counter", GUINT_TO_POINTER (0));
+
+  /* The result of the async refresh is only delivered once the loop runs */
+  msg_authorizer_refresh_authorization_async (data->authorizer, NULL, refresh_authorization_async_cb, loop);
+  g_assert_cmpuint (GPOINTER_TO_UINT (g_object_get_data (G_OBJECT (data->authorizer), "counter")), ==, 1);
+
+  g_assert_true (msg_authorizer_refresh_authorization (data->authorizer, NULL, &error));
+  g_assert_no_error (error);
+  g_assert_cmpuint (GPOINTER_TO_UINT (g_object_get_data (G_OBJECT (data->authorizer), "counter")), ==, 2);
+
+  g_main_loop_run (loop);
+}
+
+/* Test that invalidating an authorizer which does not implement it is a no-op */
+static void
+test_authorizer_invalidate_authorization (AuthorizerData *data,
+                                          __attribute__ ((unused)) gconstpointer   user_data)
+{
+  gboolean success;
+  GError *error = NULL;
+
+  g_object_set_data (G_OBJECT (data->authorizer), "counter", GUINT_TO_POINTER (0));
+
+  msg_authorizer_invalidate_authorization (data->authorizer);
+
+  success = msg_authorizer_refresh_authorization (data->authorizer, NULL, &error);
+  g_assert_no_error (error);
+  g_assert (success == TRUE);
+
+  g_assert_cmpuint (GPOINTER_TO_UINT (g_object_get_data (G_OBJECT (data->authorizer), "counter")), ==, 1);
+}
+
+
+/* Test that tokens survive in an encrypted file and are reused by a new authorizer without a token request */
+static void
+test_authorizer_token_cache (void)
+{
+  g_autoptr (GBytes) key = g_bytes_new_static ("0123456789abcdef0123456789abcdef", 32);
+  g_autoptr (GBytes) other_key = g_bytes_new_static ("fedcba9876543210fedcba9876543210", 32);
+  g_autoptr (MsgFileTokenCache) cache = NULL;
+  g_autoptr (MsgFileTokenCache) other_cache = NULL;
+  g_autoptr (MsgOAuth2Authorizer) authorizer = NULL;
+  g_autoptr (SoupMessage) message = NULL;
+  g_autoptr (GMainLoop) loop = NULL;
+  g_autoptr (GError) error = NULL;
+  g_autofree char *directory = NULL;
+  g_autofree char *checksum = NULL;
+  g_autofree char *name = NULL;
+  g_autofree char *path = NULL;
+  g_autofree char *contents = NULL;
+  g_autofree char *access_token = NULL;
+  g_autofree char *refresh_token = NULL;
+  gint64 expires_at = g_get_real_time () + G_USEC_PER_SEC * 3600;
+  gint64 loaded_expires_at = 0;
+  gsize len;
+
+  directory = g_dir_make_tmp ("msgraph-token-cache-XXXXXX", &error);
+  g_assert_no_error (error);
+
+  cache = msg_file_token_cache_new (directory, key);
+  g_assert_true (msg_token_cache_store (MSG_TOKEN_CACHE (cache), "account", "access-secret", "refresh-secret", expires_at, &error));
+  g_assert_no_error (error);
+
+  /* Nothing is readable on disk */
+  checksum = g_compute_checksum_for_string (G_CHECKSUM_SHA256, "account", -1);
+  name = g_strconcat (checksum, ".token", NULL);
+  path = g_build_filename (directory, name, NULL);
+  g_assert_true (g_file_get_contents (path, &contents, &len, NULL));
+  g_assert_null (g_strstr_len (contents, len, "secret"));
+
+  g_assert_true (msg_token_cache_load (MSG_TOKEN_CACHE (cache), "account", &access_token, &refresh_token, &loaded_expires_at, &error));
+  g_assert_no_error (error);
+  g_assert_cmpstr (access_token, ==, "access-secret");
+  g_assert_cmpstr (refresh_token, ==, "refresh-secret");
+  g_assert_cmpint (loaded_expires_at, ==, expires_at);
+
+  g_assert_false (msg_token_cache_load (MSG_TOKEN_CACHE (cache), "unknown", NULL, NULL, NULL, &error));
+  g_assert_no_error (error);
+
+  other_cache = msg_file_token_cache_new (directory, other_key);
+  g_assert_false (msg_token_cache_load (MSG_TOKEN_CACHE (other_cache), "account", NULL, NULL, NULL, &error));
+  g_assert_error (error, MSG_ERROR, MSG_ERROR_FAILED);
+
+  /* A warm start uses the cached access token */
+  authorizer = msg_oauth2_authorizer_new ("client-id", "https://localhost/");
+  msg_oauth2_authorizer_set_token_cache (authorizer, MSG_TOKEN_CACHE (cache), "account");
+  g_assert_true (msg_authorizer_refresh_authorization (MSG_AUTHORIZER (authorizer), NULL, NULL));
+
+  loop = g_main_loop_new (NULL, FALSE);
+  msg_authorizer_refresh_authorization_async (MSG_AUTHORIZER (authorizer), NULL, refresh_authorization_async_cb, loop);
+  g_main_loop_run (loop);
+
+  message = soup_message_new (SOUP_METHOD_GET, "https://graph.microsoft.com/v1.0/me");
+  msg_authorizer_process_request (MSG_AUTHORIZER (authorizer), message);
+  g_assert_cmpstr (soup_message_headers_get_one (soup_message_get_request_headers (message), "Authorization"), ==, "Bearer access-secret");
+
+  msg_token_cache_remove (MSG_TOKEN_CACHE (cache), "account");
+  g_assert_false (g_file_test (path, G_FILE_TEST_EXISTS));
+  g_rmdir (directory);
+}
 
 int
 main (int argc, char *argv[])
@@ -54,6 +261,26 @@ main (int argc, char *argv[])
               set_up_normal_authorizer_data,
               test_authorizer_refresh_authorization,
               tear_down_authorizer_data);
+  g_test_add ("/authorizer/refresh-authorization/single-flight",
+              AuthorizerData,
+              NULL,
+              set_up_normal_authorizer_data,
+              test_authorizer_refresh_authorization_single_flight,
+              tear_down_authorizer_data);
+  g_test_add ("/authorizer/refresh-authorization/same-thread",
+              AuthorizerData,
+              NULL,
+              set_up_normal_authorizer_data,
+              test_authorizer_refresh_authorization_same_thread,
+              tear_down_authorizer_data);
+  g_test_add ("/authorizer/invalidate-authorization",
+              AuthorizerData,
+              NULL,
+              set_up_normal_authorizer_data,
+              test_authorizer_invalidate_authorization,
+              tear_down_authorizer_data);
+
+  g_test_add_func ("/authorizer/token-cache", test_authorizer_token_cache);
 
   retval = g_test_run ();
 
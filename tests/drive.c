@@ -1,8 +1,13 @@
+#include <glib/gstdio.h>
+
 #include "src/msg-authorizer.h"
 #include "src/drive/msg-drive-service.h"
 #include "src/drive/msg-drive-item-file.h"
+#include "src/drive/msg-drive-upload-journal.h"
+#include "src/drive/msg-drive-upload-stream.h"
 #include "src/msg-service.h"
 #include "src/msg-input-stream.h"
+#include "src/msg-parallel-download.h"
 
 #include "common.h"
 #include "msg-dummy-authorizer.h"
@@ -409,6 +414,637 @@ test_download_url (void)
   uhm_server_end_trace (mock_server);
 }
 
+static void
+test_upload_journal (void)
+{
+  g_autoptr (GError) error = NULL;
+  g_autofree char *directory = NULL;
+  g_autofree char *path = NULL;
+  g_autofree char *other_path = NULL;
+  g_autofree char *source_path = NULL;
+  g_autofree char *fingerprint = NULL;
+  g_autofree char *changed_fingerprint = NULL;
+  g_autoptr (GFile) source = NULL;
+  g_autoptr (GFileInfo) info = NULL;
+  g_autoptr (MsgDriveUploadJournal) journal = NULL;
+  g_autoptr (MsgDriveUploadJournal) loaded = NULL;
+  g_autoptr (GDateTime) now = g_date_time_new_now_utc ();
+  g_autoptr (GDateTime) later = g_date_time_add_hours (now, 1);
+
+  directory = g_dir_make_tmp ("msg-upload-XXXXXX", &error);
+  g_assert_no_error (error);
+
+  source_path = g_build_filename (directory, "source", NULL);
+  g_assert_true (g_file_set_contents (source_path, "0123456789", -1, NULL));
+  source = g_file_new_for_path (source_path);
+
+  path = msg_drive_upload_journal_get_path (directory, "drive", "item", source);
+  other_path = msg_drive_upload_journal_get_path (directory, "drive", "other-item", source);
+  g_assert_cmpstr (path, !=, other_path);
+  g_assert_null (msg_drive_upload_journal_load (path));
+
+  info = g_file_query_info (source, G_FILE_ATTRIBUTE_STANDARD_SIZE "," G_FILE_ATTRIBUTE_TIME_MODIFIED "," G_FILE_ATTRIBUTE_ETAG_VALUE, G_FILE_QUERY_INFO_NONE, NULL, &error);
+  g_assert_no_error (error);
+  fingerprint = msg_drive_upload_journal_fingerprint (info);
+
+  journal = g_new0 (MsgDriveUploadJournal, 1);
+  journal->upload_url = g_strdup ("https://api.onedrive.com/rup/session");
+  journal->expiration = g_date_time_format_iso8601 (later);
+  journal->offset = 327680;
+  journal->fingerprint = g_strdup (fingerprint);
+  g_assert_true (msg_drive_upload_journal_save (journal, path, &error));
+  g_assert_no_error (error);
+
+  loaded = msg_drive_upload_journal_load (path);
+  g_assert_nonnull (loaded);
+  g_assert_cmpstr (loaded->upload_url, ==, journal->upload_url);
+  g_assert_cmpint (loaded->offset, ==, 327680);
+  g_assert_cmpstr (loaded->fingerprint, ==, fingerprint);
+  g_assert_false (msg_drive_upload_journal_is_expired (loaded));
+
+  g_free (loaded->expiration);
+  loaded->expiration = g_date_time_format_iso8601 (now);
+  g_assert_true (msg_drive_upload_journal_is_expired (loaded));
+
+  /* Modifying the source changes its fingerprint */
+  g_assert_true (g_file_set_contents (source_path, "0123456789abcdef", -1, NULL));
+  g_clear_object (&info);
+  info = g_file_query_info (source, G_FILE_ATTRIBUTE_STANDARD_SIZE "," G_FILE_ATTRIBUTE_TIME_MODIFIED "," G_FILE_ATTRIBUTE_ETAG_VALUE, G_FILE_QUERY_INFO_NONE, NULL, &error);
+  g_assert_no_error (error);
+  changed_fingerprint = msg_drive_upload_journal_fingerprint (info);
+  g_assert_cmpstr (changed_fingerprint, !=, fingerprint);
+
+  g_assert_cmpint (g_unlink (path), ==, 0);
+  g_assert_cmpint (g_unlink (source_path), ==, 0);
+  g_assert_cmpint (g_rmdir (directory), ==, 0);
+}
+
+#define UPLOAD_FRAGMENTS_URL "https://api.onedrive.com/rup/4f62a7105c03556e/eyJSZXNvdXJjZUlEIjoiNEY2MkE3MTA1QzAzNTU2RSExMzgyIn0/4w8hXkD7X2hRCUlObIbZ9Q"
+#define UPLOAD_SPOOLED_URL "https://graph.microsoft.com/v1.0/drives/4f62a7105c03556e/items/4F62A7105C03556E!1380:/Spooled.bin:/"
+
+static void
+upload_request_queued_cb (__attribute__ ((unused)) SoupSession *session,
+                          SoupMessage                          *message,
+                          gpointer                              user_data)
+{
+  GPtrArray *ranges = user_data;
+  const char *range = soup_message_headers_get_one (soup_message_get_request_headers (message), "Content-Range");
+
+  /* Fragments are sent one after the other, never concurrently */
+  if (range)
+    g_ptr_array_add (ranges, g_strdup (range));
+}
+
+static void
+upload_offset_cb (GObject                             *object,
+                  __attribute__ ((unused)) GParamSpec *pspec,
+                  gpointer                             user_data)
+{
+  GArray *offsets = user_data;
+  goffset offset = msg_drive_upload_stream_get_offset (MSG_DRIVE_UPLOAD_STREAM (object));
+
+  /* Emitted by the writing thread, not the sender */
+  g_assert_true (g_thread_self () == g_object_get_data (object, "writer"));
+  g_array_append_val (offsets, offset);
+}
+
+static guint8 *
+create_upload_data (gsize size)
+{
+  guint8 *data = g_malloc (size);
+
+  for (gsize index = 0; index < size; index++)
+    data[index] = index % 251;
+
+  return data;
+}
+
+static void
+test_upload_fragments (void)
+{
+  const goffset size = 2 * MSG_DRIVE_UPLOAD_FRAGMENT_ALIGNMENT + 100;
+  g_autofree guint8 *data = create_upload_data (size);
+  g_autoptr (GPtrArray) ranges = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr (GArray) offsets = g_array_new (FALSE, FALSE, sizeof (goffset));
+  g_autoptr (GOutputStream) stream = NULL;
+  g_autoptr (MsgDriveItem) item = NULL;
+  g_autoptr (GError) error = NULL;
+  gulong handler_id;
+
+  if (uhm_server_get_enable_online (mock_server)) {
+    g_test_skip ("Upload sessions expire, the trace can only be replayed");
+    return;
+  }
+
+  msg_test_mock_server_start_trace (mock_server, "upload-fragments");
+  handler_id = g_signal_connect (msg_service_get_session (service), "request-queued", G_CALLBACK (upload_request_queued_cb), ranges);
+
+  /* Two intermediate fragments answered with 202, the last one with 201 */
+  stream = msg_drive_upload_stream_new (service, UPLOAD_FRAGMENTS_URL, size, MSG_DRIVE_UPLOAD_FRAGMENT_ALIGNMENT);
+  g_object_set_data (G_OBJECT (stream), "writer", g_thread_self ());
+  g_signal_connect (stream, "notify::offset", G_CALLBACK (upload_offset_cb), offsets);
+  g_assert_true (g_output_stream_write_all (stream, data, size, NULL, NULL, &error));
+  g_assert_no_error (error);
+  g_assert_true (g_output_stream_close (stream, NULL, &error));
+  g_assert_no_error (error);
+
+  g_signal_handler_disconnect (msg_service_get_session (service), handler_id);
+  uhm_server_end_trace (mock_server);
+
+  g_assert_cmpuint (ranges->len, ==, 3);
+  g_assert_cmpstr (g_ptr_array_index (ranges, 0), ==, "bytes 0-327679/655460");
+  g_assert_cmpstr (g_ptr_array_index (ranges, 1), ==, "bytes 327680-655359/655460");
+  g_assert_cmpstr (g_ptr_array_index (ranges, 2), ==, "bytes 655360-655459/655460");
+
+  g_assert_cmpuint (offsets->len, ==, 3);
+  g_assert_cmpint (g_array_index (offsets, goffset, 0), ==, MSG_DRIVE_UPLOAD_FRAGMENT_ALIGNMENT);
+  g_assert_cmpint (g_array_index (offsets, goffset, 1), ==, 2 * MSG_DRIVE_UPLOAD_FRAGMENT_ALIGNMENT);
+  g_assert_cmpint (g_array_index (offsets, goffset, 2), ==, size);
+
+  /* The item hash matches the uploaded content */
+  item = msg_drive_upload_stream_get_item (MSG_DRIVE_UPLOAD_STREAM (stream), &error);
+  g_assert_no_error (error);
+  g_assert_cmpstr (msg_drive_item_get_name (item), ==, "Fragments.bin");
+  g_assert_cmpint (msg_drive_item_get_size (item), ==, size);
+}
+
+static void
+test_upload_spooled (void)
+{
+  const goffset size = MSG_DRIVE_UPLOAD_DEFAULT_FRAGMENT_SIZE + 100;
+  g_autofree guint8 *data = create_upload_data (size);
+  g_autoptr (GPtrArray) ranges = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr (GOutputStream) stream = NULL;
+  g_autoptr (MsgDriveItem) item = NULL;
+  g_autoptr (GError) error = NULL;
+  gulong handler_id;
+
+  if (uhm_server_get_enable_online (mock_server)) {
+    g_test_skip ("Upload sessions expire, the trace can only be replayed");
+    return;
+  }
+
+  msg_test_mock_server_start_trace (mock_server, "upload-spooled");
+  handler_id = g_signal_connect (msg_service_get_session (service), "request-queued", G_CALLBACK (upload_request_queued_cb), ranges);
+
+  /* Without a size every fragment is only sent on close with the total */
+  stream = msg_drive_upload_stream_new_deferred (service, UPLOAD_SPOOLED_URL "content", UPLOAD_SPOOLED_URL "createUploadSession", -1);
+  g_assert_true (g_output_stream_write_all (stream, data, size, NULL, NULL, &error));
+  g_assert_no_error (error);
+  g_assert_null (msg_drive_upload_stream_get_upload_url (MSG_DRIVE_UPLOAD_STREAM (stream)));
+  g_assert_cmpuint (ranges->len, ==, 0);
+
+  g_assert_true (g_output_stream_close (stream, NULL, &error));
+  g_assert_no_error (error);
+
+  g_signal_handler_disconnect (msg_service_get_session (service), handler_id);
+  uhm_server_end_trace (mock_server);
+
+  g_assert_cmpuint (ranges->len, ==, 2);
+  g_assert_cmpstr (g_ptr_array_index (ranges, 0), ==, "bytes 0-10485759/10485860");
+  g_assert_cmpstr (g_ptr_array_index (ranges, 1), ==, "bytes 10485760-10485859/10485860");
+
+  item = msg_drive_upload_stream_get_item (MSG_DRIVE_UPLOAD_STREAM (stream), &error);
+  g_assert_no_error (error);
+  g_assert_cmpstr (msg_drive_item_get_name (item), ==, "Spooled.bin");
+}
+
+#define UPLOAD_SIZED_PARENT "{\"id\":\"4F62A7105C03556E!1380\",\"name\":\"test\",\"folder\":{},\"parentReference\":{\"driveId\":\"4f62a7105c03556e\"}}"
+
+static void
+test_upload_sized (void)
+{
+  const goffset size = MSG_DRIVE_UPLOAD_DEFAULT_FRAGMENT_SIZE + 100;
+  g_autofree guint8 *data = create_upload_data (size);
+  g_autoptr (GPtrArray) ranges = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr (JsonParser) parser = json_parser_new ();
+  g_autoptr (GOutputStream) stream = NULL;
+  g_autoptr (MsgDriveItem) parent = NULL;
+  g_autoptr (MsgDriveItem) item = NULL;
+  g_autoptr (GError) error = NULL;
+  gulong handler_id;
+
+  if (uhm_server_get_enable_online (mock_server)) {
+    g_test_skip ("Upload sessions expire, the trace can only be replayed");
+    return;
+  }
+
+  g_assert_true (json_parser_load_from_data (parser, UPLOAD_SIZED_PARENT, -1, &error));
+  g_assert_no_error (error);
+  parent = msg_drive_item_new_from_json (json_node_get_object (json_parser_get_root (parser)), &error);
+  g_assert_no_error (error);
+
+  msg_test_mock_server_start_trace (mock_server, "upload-sized");
+  handler_id = g_signal_connect (msg_service_get_session (service), "request-queued", G_CALLBACK (upload_request_queued_cb), ranges);
+
+  /* With a known size the first fragment is sent while writing, nothing is spooled */
+  stream = msg_drive_service_add_file (MSG_DRIVE_SERVICE (service), parent, "Sized.bin", size, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (g_output_stream_write_all (stream, data, size, NULL, NULL, &error));
+  g_assert_no_error (error);
+  g_assert_nonnull (msg_drive_upload_stream_get_upload_url (MSG_DRIVE_UPLOAD_STREAM (stream)));
+
+  g_assert_true (g_output_stream_close (stream, NULL, &error));
+  g_assert_no_error (error);
+
+  g_signal_handler_disconnect (msg_service_get_session (service), handler_id);
+  uhm_server_end_trace (mock_server);
+
+  g_assert_cmpuint (ranges->len, ==, 2);
+  g_assert_cmpstr (g_ptr_array_index (ranges, 0), ==, "bytes 0-10485759/10485860");
+  g_assert_cmpstr (g_ptr_array_index (ranges, 1), ==, "bytes 10485760-10485859/10485860");
+
+  item = msg_drive_upload_stream_get_item (MSG_DRIVE_UPLOAD_STREAM (stream), &error);
+  g_assert_no_error (error);
+  g_assert_cmpstr (msg_drive_item_get_name (item), ==, "Sized.bin");
+}
+
+static void
+test_upload_size_mismatch (void)
+{
+  g_autoptr (GOutputStream) stream = NULL;
+  g_autoptr (GError) error = NULL;
+  gsize written;
+
+  /* Neither case reaches the server */
+  stream = msg_drive_upload_stream_new (service, UPLOAD_FRAGMENTS_URL, 10, 0);
+  g_assert_false (g_output_stream_write_all (stream, "0123456789a", 11, &written, NULL, &error));
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT);
+  g_assert_cmpuint (written, ==, 0);
+  g_clear_error (&error);
+
+  g_assert_true (g_output_stream_write_all (stream, "01234", 5, NULL, NULL, &error));
+  g_assert_no_error (error);
+  g_assert_false (g_output_stream_close (stream, NULL, &error));
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_PARTIAL_INPUT);
+  g_assert_cmpint (msg_drive_upload_stream_get_offset (MSG_DRIVE_UPLOAD_STREAM (stream)), ==, 0);
+}
+
+#define PARALLEL_DOWNLOAD_URL "https://graph.microsoft.com/v1.0/drives/4f62a7105c03556e/items/4F62A7105C03556E!1400/content"
+
+/* Trace bodies end with a newline, so do the segments of the traces */
+#define PARALLEL_SEGMENT_SIZE 4
+
+static void
+download_request_queued_cb (__attribute__ ((unused)) SoupSession *session,
+                            SoupMessage                          *message,
+                            gpointer                              user_data)
+{
+  GPtrArray *requests = user_data;
+  SoupMessageHeaders *headers = soup_message_get_request_headers (message);
+  gboolean is_signed;
+
+  /* Only used with a single worker, segments are requested one at a time */
+  is_signed = soup_message_headers_get_one (headers, "Authorization") ||
+              soup_message_headers_get_one (headers, "process_request_null");
+  g_ptr_array_add (requests, g_strdup_printf ("%s %s",
+                                              g_uri_get_host (soup_message_get_uri (message)),
+                                              is_signed ? "signed" : "unsigned"));
+}
+
+/* Concatenates the segments handed out by @download in order */
+static GBytes *
+read_segments (MsgParallelDownload  *download,
+               GError              **error)
+{
+  GByteArray *data = g_byte_array_new ();
+  GBytes *bytes;
+
+  while ((bytes = msg_parallel_download_next (download, NULL, error))) {
+    g_byte_array_append (data, g_bytes_get_data (bytes, NULL), g_bytes_get_size (bytes));
+    g_bytes_unref (bytes);
+  }
+
+  return g_byte_array_free_to_bytes (data);
+}
+
+static void
+test_parallel_download_redirect (void)
+{
+  g_autoptr (GPtrArray) requests = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr (MsgParallelDownload) download = NULL;
+  g_autoptr (GBytes) data = NULL;
+  g_autoptr (GError) error = NULL;
+  gulong handler_id;
+
+  if (uhm_server_get_enable_online (mock_server)) {
+    g_test_skip ("The item does not exist, the trace can only be replayed");
+    return;
+  }
+
+  msg_test_mock_server_start_trace (mock_server, "parallel-download-redirect");
+  handler_id = g_signal_connect (msg_service_get_session (service), "request-queued", G_CALLBACK (download_request_queued_cb), requests);
+
+  /* The first segment is redirected, the second one is requested from the target */
+  download = msg_parallel_download_new (service, PARALLEL_DOWNLOAD_URL, 0, 1, PARALLEL_SEGMENT_SIZE, NULL);
+  g_assert_true (msg_parallel_download_start (download, NULL, &error));
+  g_assert_no_error (error);
+  g_assert_cmpint (msg_parallel_download_get_size (download), ==, 8);
+
+  data = read_segments (download, &error);
+  g_assert_no_error (error);
+  g_assert_cmpmem (g_bytes_get_data (data, NULL), g_bytes_get_size (data), "012\n456\n", 8);
+
+  g_clear_pointer (&download, msg_parallel_download_free);
+  g_signal_handler_disconnect (msg_service_get_session (service), handler_id);
+  uhm_server_end_trace (mock_server);
+
+  /* The pre-authenticated target must not get the access token */
+  g_assert_cmpuint (requests->len, ==, 2);
+  g_assert_cmpstr (g_ptr_array_index (requests, 0), ==, "graph.microsoft.com signed");
+  g_assert_cmpstr (g_ptr_array_index (requests, 1), ==, "npwwvq.am.files.1drv.com unsigned");
+}
+
+static void
+test_parallel_download_offset (void)
+{
+  g_autoptr (GOutputStream) sink = g_memory_output_stream_new_resizable ();
+  g_autoptr (MsgParallelDownload) download = NULL;
+  g_autoptr (GError) error = NULL;
+  const char *data;
+
+  if (uhm_server_get_enable_online (mock_server)) {
+    g_test_skip ("The item does not exist, the trace can only be replayed");
+    return;
+  }
+
+  msg_test_mock_server_start_trace (mock_server, "parallel-download-offset");
+
+  /* Segments are written at their offset in the resource */
+  download = msg_parallel_download_new (service, PARALLEL_DOWNLOAD_URL, 4, 1, PARALLEL_SEGMENT_SIZE, sink);
+  g_assert_true (msg_parallel_download_start (download, NULL, &error));
+  g_assert_no_error (error);
+  g_assert_true (msg_parallel_download_wait (download, NULL, &error));
+  g_assert_no_error (error);
+
+  g_clear_pointer (&download, msg_parallel_download_free);
+  uhm_server_end_trace (mock_server);
+
+  data = g_memory_output_stream_get_data (G_MEMORY_OUTPUT_STREAM (sink));
+  g_assert_cmpuint (g_memory_output_stream_get_data_size (G_MEMORY_OUTPUT_STREAM (sink)), ==, 10);
+  g_assert_cmpmem (data + 4, 6, "456\n8\n", 6);
+}
+
+static void
+test_parallel_download_empty (void)
+{
+  g_autoptr (GOutputStream) sink = g_memory_output_stream_new_resizable ();
+  g_autoptr (MsgParallelDownload) download = NULL;
+  g_autoptr (GBytes) bytes = NULL;
+  g_autoptr (GError) error = NULL;
+
+  if (uhm_server_get_enable_online (mock_server)) {
+    g_test_skip ("The item does not exist, the trace can only be replayed");
+    return;
+  }
+
+  msg_test_mock_server_start_trace (mock_server, "parallel-download-empty");
+
+  /* No range of an empty file is satisfiable, which is not an error */
+  download = msg_parallel_download_new (service, PARALLEL_DOWNLOAD_URL, 0, 2, PARALLEL_SEGMENT_SIZE, NULL);
+  g_assert_true (msg_parallel_download_start (download, NULL, &error));
+  g_assert_no_error (error);
+  g_assert_cmpint (msg_parallel_download_get_size (download), ==, 0);
+  bytes = msg_parallel_download_next (download, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_null (bytes);
+  g_clear_pointer (&download, msg_parallel_download_free);
+
+  download = msg_parallel_download_new (service, PARALLEL_DOWNLOAD_URL, 0, 2, PARALLEL_SEGMENT_SIZE, sink);
+  g_assert_true (msg_parallel_download_start (download, NULL, &error));
+  g_assert_no_error (error);
+  g_assert_true (msg_parallel_download_wait (download, NULL, &error));
+  g_assert_no_error (error);
+  g_assert_cmpuint (g_memory_output_stream_get_data_size (G_MEMORY_OUTPUT_STREAM (sink)), ==, 0);
+
+  g_clear_pointer (&download, msg_parallel_download_free);
+  uhm_server_end_trace (mock_server);
+}
+
+static void
+test_parallel_download_short (void)
+{
+  g_autoptr (GOutputStream) sink = g_memory_output_stream_new_resizable ();
+  g_autoptr (MsgParallelDownload) download = NULL;
+  g_autoptr (GError) error = NULL;
+
+  if (uhm_server_get_enable_online (mock_server)) {
+    g_test_skip ("The item does not exist, the trace can only be replayed");
+    return;
+  }
+
+  msg_test_mock_server_start_trace (mock_server, "parallel-download-short");
+
+  /* A short first segment is detected before any worker starts */
+  download = msg_parallel_download_new (service, PARALLEL_DOWNLOAD_URL, 0, 1, PARALLEL_SEGMENT_SIZE, NULL);
+  g_assert_false (msg_parallel_download_start (download, NULL, &error));
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_PARTIAL_INPUT);
+  g_clear_error (&error);
+  g_clear_pointer (&download, msg_parallel_download_free);
+
+  /* A short segment of a worker fails the whole download */
+  download = msg_parallel_download_new (service, PARALLEL_DOWNLOAD_URL, 0, 1, PARALLEL_SEGMENT_SIZE, sink);
+  g_assert_true (msg_parallel_download_start (download, NULL, &error));
+  g_assert_no_error (error);
+  g_assert_false (msg_parallel_download_wait (download, NULL, &error));
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_PARTIAL_INPUT);
+
+  g_clear_pointer (&download, msg_parallel_download_free);
+  uhm_server_end_trace (mock_server);
+}
+
+#define SEGMENT_SERVER_CONTENT "0123456789ab"
+
+/* Serves SEGMENT_SERVER_CONTENT in ranges on its own thread. The trace
+ * replay answers requests strictly in order, so segments arriving out
+ * of order need a server of their own. */
+typedef struct {
+  GMutex mutex;
+  GCond cond;
+  GThread *thread;
+  GMainLoop *loop;
+  guint port;
+  /* Second segment, held back until the last one has been sent */
+  SoupServerMessage *held;
+  gboolean last_sent;
+} SegmentServer;
+
+static void
+segment_server_finished_cb (__attribute__ ((unused)) SoupServerMessage *message,
+                            gpointer                                    user_data)
+{
+  SegmentServer *server = user_data;
+
+  server->last_sent = TRUE;
+  if (server->held) {
+    soup_server_message_unpause (server->held);
+    g_clear_object (&server->held);
+  }
+}
+
+static void
+segment_server_handler_cb (__attribute__ ((unused)) SoupServer *soup_server,
+                           SoupServerMessage                   *message,
+                           __attribute__ ((unused)) const char *path,
+                           __attribute__ ((unused)) GHashTable *query,
+                           gpointer                             user_data)
+{
+  SegmentServer *server = user_data;
+  SoupMessageHeaders *headers = soup_server_message_get_request_headers (message);
+  goffset total = sizeof (SEGMENT_SERVER_CONTENT) - 1;
+  SoupRange *ranges = NULL;
+  int length;
+  goffset first;
+  goffset last;
+
+  if (!soup_message_headers_get_ranges (headers, total, &ranges, &length)) {
+    soup_server_message_set_status (message, SOUP_STATUS_BAD_REQUEST, NULL);
+    return;
+  }
+
+  first = ranges[0].start;
+  last = ranges[0].end;
+  soup_message_headers_free_ranges (headers, ranges);
+
+  soup_server_message_set_status (message, SOUP_STATUS_PARTIAL_CONTENT, NULL);
+  soup_message_headers_set_content_range (soup_server_message_get_response_headers (message), first, last, total);
+  soup_server_message_set_response (message,
+                                    "application/octet-stream",
+                                    SOUP_MEMORY_STATIC,
+                                    SEGMENT_SERVER_CONTENT + first,
+                                    last - first + 1);
+
+  if (first == 2 * PARALLEL_SEGMENT_SIZE) {
+    g_signal_connect (message, "finished", G_CALLBACK (segment_server_finished_cb), server);
+  } else if (first == PARALLEL_SEGMENT_SIZE && !server->last_sent) {
+    server->held = g_object_ref (message);
+    soup_server_message_pause (message);
+  }
+}
+
+static gpointer
+segment_server_thread_func (gpointer user_data)
+{
+  SegmentServer *server = user_data;
+  g_autoptr (GMainContext) context = g_main_context_new ();
+  g_autoptr (SoupServer) soup_server = NULL;
+  g_autoptr (GTlsCertificate) cert = NULL;
+  g_autofree char *cert_path = NULL;
+  g_autofree char *key_path = NULL;
+  GSList *uris;
+  g_autoptr (GError) error = NULL;
+
+  g_main_context_push_thread_default (context);
+
+  cert_path = g_test_build_filename (G_TEST_DIST, "cert.pem", NULL);
+  key_path = g_test_build_filename (G_TEST_DIST, "key.pem", NULL);
+  cert = g_tls_certificate_new_from_files (cert_path, key_path, &error);
+  g_assert_no_error (error);
+
+  soup_server = soup_server_new ("tls-certificate", cert, NULL);
+  soup_server_add_handler (soup_server, NULL, segment_server_handler_cb, server, NULL);
+  soup_server_listen_local (soup_server, 0, SOUP_SERVER_LISTEN_IPV4_ONLY | SOUP_SERVER_LISTEN_HTTPS, &error);
+  g_assert_no_error (error);
+
+  uris = soup_server_get_uris (soup_server);
+  g_mutex_lock (&server->mutex);
+  server->port = g_uri_get_port (uris->data);
+  server->loop = g_main_loop_new (context, FALSE);
+  g_cond_signal (&server->cond);
+  g_mutex_unlock (&server->mutex);
+  g_slist_free_full (uris, (GDestroyNotify)g_uri_unref);
+
+  g_main_loop_run (server->loop);
+
+  g_clear_object (&server->held);
+  g_clear_object (&soup_server);
+  g_main_context_pop_thread_default (context);
+
+  return NULL;
+}
+
+static SegmentServer *
+segment_server_start (void)
+{
+  SegmentServer *server = g_new0 (SegmentServer, 1);
+
+  g_mutex_init (&server->mutex);
+  g_cond_init (&server->cond);
+  server->thread = g_thread_new ("segment-server", segment_server_thread_func, server);
+
+  g_mutex_lock (&server->mutex);
+  while (!server->loop)
+    g_cond_wait (&server->cond, &server->mutex);
+  g_mutex_unlock (&server->mutex);
+
+  return server;
+}
+
+static void
+segment_server_stop (SegmentServer *server)
+{
+  g_main_loop_quit (server->loop);
+  g_thread_join (server->thread);
+  g_main_loop_unref (server->loop);
+  g_mutex_clear (&server->mutex);
+  g_cond_clear (&server->cond);
+  g_free (server);
+}
+
+static void
+test_parallel_download_out_of_order (void)
+{
+  g_autoptr (MsgService) local_service = NULL;
+  g_autofree char *saved_port = g_strdup (g_getenv ("MSG_HTTPS_PORT"));
+
+  local_service = MSG_SERVICE (msg_drive_service_new (msg_service_get_authorizer (service)));
+  soup_session_set_proxy_resolver (msg_service_get_session (local_service), NULL);
+
+  /* The last of three segments arrives before the second one, both in
+   * the reader and in the sink case */
+  for (guint mode = 0; mode < 2; mode++) {
+    g_autoptr (GOutputStream) sink = mode ? g_memory_output_stream_new_resizable () : NULL;
+    g_autoptr (MsgParallelDownload) download = NULL;
+    g_autoptr (GBytes) data = NULL;
+    g_autoptr (GError) error = NULL;
+    g_autofree char *port = NULL;
+    SegmentServer *server;
+
+    server = segment_server_start ();
+    port = g_strdup_printf ("%u", server->port);
+    g_setenv ("MSG_HTTPS_PORT", port, TRUE);
+
+    download = msg_parallel_download_new (local_service, "https://127.0.0.1/segments", 0, 2, PARALLEL_SEGMENT_SIZE, sink);
+    g_assert_true (msg_parallel_download_start (download, NULL, &error));
+    g_assert_no_error (error);
+
+    if (sink) {
+      g_assert_true (msg_parallel_download_wait (download, NULL, &error));
+      g_assert_no_error (error);
+    } else {
+      data = read_segments (download, &error);
+      g_assert_no_error (error);
+    }
+
+    g_clear_pointer (&download, msg_parallel_download_free);
+    segment_server_stop (server);
+
+    if (sink) {
+      g_assert_true (g_output_stream_close (sink, NULL, &error));
+      g_assert_no_error (error);
+      data = g_memory_output_stream_steal_as_bytes (G_MEMORY_OUTPUT_STREAM (sink));
+    }
+
+    g_assert_cmpmem (g_bytes_get_data (data, NULL), g_bytes_get_size (data),
+                     SEGMENT_SERVER_CONTENT, sizeof (SEGMENT_SERVER_CONTENT) - 1);
+  }
+
+  if (saved_port)
+    g_setenv ("MSG_HTTPS_PORT", saved_port, TRUE);
+  else
+    g_unsetenv ("MSG_HTTPS_PORT");
+}
+
 static void
 mock_server_notify_resolver_cb (GObject                             *object,
                                 __attribute__ ((unused)) GParamSpec *pspec,
@@ -426,6 +1062,7 @@ mock_server_notify_resolver_cb (GObject                             *object,
     g_print ("Add resolver to %s\n", ip_address);
     /* uhm_resolver_add_A (resolver, "login.microsoftonline.com", ip_address); */
     uhm_resolver_add_A (resolver, "graph.microsoft.com", ip_address);
+    uhm_resolver_add_A (resolver, "api.onedrive.com", ip_address);
     uhm_resolver_add_A (resolver, "npwwvq.am.files.1drv.com", ip_address);
     uhm_resolver_add_A (resolver, "iqfaiw.am.files.1drv.com", ip_address);
   }
@@ -510,6 +1147,16 @@ main (int    argc,
 
   g_test_add_func ("/drive/properties", test_drive);
   g_test_add_func ("/drive/shared_with_me", test_shared_with_me);
+  g_test_add_func ("/drive/upload_journal", test_upload_journal);
+  g_test_add_func ("/drive/upload/fragments", test_upload_fragments);
+  g_test_add_func ("/drive/upload/spooled", test_upload_spooled);
+  g_test_add_func ("/drive/upload/sized", test_upload_sized);
+  g_test_add_func ("/drive/upload/size_mismatch", test_upload_size_mismatch);
+  g_test_add_func ("/drive/parallel_download/redirect", test_parallel_download_redirect);
+  g_test_add_func ("/drive/parallel_download/offset", test_parallel_download_offset);
+  g_test_add_func ("/drive/parallel_download/empty", test_parallel_download_empty);
+  g_test_add_func ("/drive/parallel_download/short", test_parallel_download_short);
+  g_test_add_func ("/drive/parallel_download/out_of_order", test_parallel_download_out_of_order);
 
   g_test_add ("/drive/item/properties",
                    TempItemData,
@@ -1,3 +1,5 @@
+#include <glib/gstdio.h>
+
 #include "src/msg-authorizer.h"
 #include "src/mail/msg-mail-folder.h"
 #include "src/mail/msg-mail-service.h"
@@ -345,6 +347,162 @@ test_get_folder_id (void)
   uhm_server_end_trace (mock_server);
 }
 
+#define PERF_PAGE_SIZE 500
+#define PERF_FOLDER_URL "https://graph.microsoft.com/v1.0/me/mailFolders/perf/messages/delta"
+
+/* Writes a delta listing of @count messages split into pages linked by
+ * @odata.nextLink, the last page carrying the @odata.deltaLink. The trace
+ * is replayed twice, once per listing function.
+ */
+static void
+create_delta_trace (GFile      *directory,
+                    const char *name,
+                    guint       count)
+{
+  g_autoptr (GString) trace = g_string_new (NULL);
+  g_autoptr (GString) hosts = g_string_new (NULL);
+  g_autoptr (GFile) file = NULL;
+  g_autofree char *path = NULL;
+  g_autofree char *hosts_path = NULL;
+  g_autoptr (GError) error = NULL;
+  guint pages = (count + PERF_PAGE_SIZE - 1) / PERF_PAGE_SIZE;
+
+  for (guint run = 0; run < 2; run++) {
+    for (guint page = 0; page < pages; page++) {
+      guint first = page * PERF_PAGE_SIZE;
+      guint last = MIN (first + PERF_PAGE_SIZE, count);
+
+      g_string_append_printf (trace,
+                              "> GET /v1.0/me/mailFolders/perf/messages/delta?$skiptoken=%u HTTP/2\n"
+                              "> Soup-Host: graph.microsoft.com\n"
+                              "> Prefer: odata.maxpagesize=%u\n"
+                              "  \n"
+                              "< HTTP/2 200 OK\n"
+                              "< Content-Type: application/json;odata.metadata=minimal;odata.streaming=true;IEEE754Compatible=false;charset=utf-8\n"
+                              "< odata-version: 4.0\n"
+                              "< \n"
+                              "< {\"@odata.context\":\"https://graph.microsoft.com/v1.0/$metadata#Collection(message)\",",
+                              page,
+                              PERF_PAGE_SIZE);
+
+      if (page + 1 < pages)
+        g_string_append_printf (trace, "\"@odata.nextLink\":\"" PERF_FOLDER_URL "?$skiptoken=%u\",", page + 1);
+      else
+        g_string_append (trace, "\"@odata.deltaLink\":\"" PERF_FOLDER_URL "?$deltatoken=perf\",");
+
+      g_string_append (trace, "\"value\":[");
+      for (guint index = first; index < last; index++) {
+        g_string_append_printf (trace,
+                                "%s{\"id\":\"AAMkAD%08u\",\"subject\":\"Message %u\",\"isRead\":false,"
+                                "\"hasAttachments\":false,\"receivedDateTime\":\"2024-11-25T19:04:53Z\",\"bodyPreview\":\"Preview\","
+                                "\"from\":{\"emailAddress\":{\"name\":\"Sender\",\"address\":\"sender@example.com\"}},"
+                                "\"toRecipients\":[],\"ccRecipients\":[]}",
+                                index > first ? "," : "",
+                                index,
+                                index);
+      }
+      g_string_append (trace, "]}\n  \n");
+      g_string_append (hosts, "graph.microsoft.com\n");
+    }
+  }
+
+  file = g_file_get_child (directory, name);
+  path = g_file_get_path (file);
+  hosts_path = g_strconcat (path, ".hosts", NULL);
+
+  g_file_set_contents (path, trace->str, trace->len, &error);
+  g_assert_no_error (error);
+  g_file_set_contents (hosts_path, hosts->str, hosts->len, &error);
+  g_assert_no_error (error);
+}
+
+static void
+measure_get_messages (const char *name,
+                      guint       count,
+                      double     *list_elapsed,
+                      double     *array_elapsed)
+{
+  g_autoptr (GError) error = NULL;
+  g_autoptr (GPtrArray) array = NULL;
+  g_autofree char *delta_link = NULL;
+  GList *list;
+
+  msg_test_mock_server_start_trace (mock_server, name);
+
+  g_test_timer_start ();
+  list = msg_mail_service_get_messages (MSG_MAIL_SERVICE (service), NULL, PERF_FOLDER_URL "?$skiptoken=0", NULL, NULL, NULL, PERF_PAGE_SIZE, NULL, &error);
+  *list_elapsed = g_test_timer_elapsed ();
+  g_assert_no_error (error);
+  g_assert_cmpuint (g_list_length (list), ==, count);
+  g_list_free_full (list, g_object_unref);
+
+  g_test_timer_start ();
+  array = msg_mail_service_get_messages_array (MSG_MAIL_SERVICE (service), NULL, PERF_FOLDER_URL "?$skiptoken=0", NULL, NULL, &delta_link, PERF_PAGE_SIZE, NULL, &error);
+  *array_elapsed = g_test_timer_elapsed ();
+  g_assert_no_error (error);
+  g_assert_cmpuint (array->len, ==, count);
+  g_assert_cmpstr (delta_link, ==, PERF_FOLDER_URL "?$deltatoken=perf");
+
+  uhm_server_end_trace (mock_server);
+}
+
+static void
+test_get_messages_perf (void)
+{
+  const char *traces[] = { "get-messages-small", "get-messages-large" };
+  g_autoptr (GFile) directory = NULL;
+  g_autoptr (GFile) trace_directory = NULL;
+  g_autofree char *tmp = NULL;
+  g_autofree char *path = NULL;
+  g_autoptr (GError) error = NULL;
+  double small_list, small_array;
+  double large_list, large_array;
+
+  if (!g_test_perf ()) {
+    g_test_skip ("Performance tests are disabled, use -m perf");
+    return;
+  }
+
+  if (uhm_server_get_enable_online (mock_server)) {
+    g_test_skip ("Performance tests replay generated traces only");
+    return;
+  }
+
+  tmp = g_dir_make_tmp ("msgraph-perf-XXXXXX", &error);
+  g_assert_no_error (error);
+  directory = g_file_new_for_path (tmp);
+
+  create_delta_trace (directory, traces[0], 10000);
+  create_delta_trace (directory, traces[1], 100000);
+
+  uhm_server_set_trace_directory (mock_server, directory);
+
+  measure_get_messages (traces[0], 10000, &small_list, &small_array);
+  measure_get_messages (traces[1], 100000, &large_list, &large_array);
+
+  path = g_test_build_filename (G_TEST_DIST, "traces/mail", NULL);
+  trace_directory = g_file_new_for_path (path);
+  uhm_server_set_trace_directory (mock_server, trace_directory);
+
+  g_test_minimized_result (large_array, "Listing 100000 messages into an array: %.3f s", large_array);
+  g_test_message ("Listing 100000 messages into a list: %.3f s", large_list);
+  g_test_message ("Listing 10000 messages: list %.3f s, array %.3f s", small_list, small_array);
+
+  /* Linear scaling results in a factor of 10, quadratic in 100. Twice the
+   * linear factor leaves room for allocator and cache effects. */
+  g_assert_cmpfloat (large_list, <, small_list * 20);
+  g_assert_cmpfloat (large_array, <, small_array * 20);
+
+  for (guint i = 0; i < G_N_ELEMENTS (traces); i++) {
+    g_autofree char *trace = g_build_filename (tmp, traces[i], NULL);
+    g_autofree char *hosts = g_strconcat (trace, ".hosts", NULL);
+
+    g_assert_cmpint (g_unlink (trace), ==, 0);
+    g_assert_cmpint (g_unlink (hosts), ==, 0);
+  }
+  g_assert_cmpint (g_rmdir (tmp), ==, 0);
+}
+
 int
 main (int    argc,
       char **argv)
@@ -389,6 +547,7 @@ main (int    argc,
                    teardown_temp_message);
 
   g_test_add_func ("/mailservice/get/folder_id", test_get_folder_id);
+  g_test_add_func ("/mailservice/get/messages_perf", test_get_messages_perf);
 
   retval = g_test_run ();
 
@@ -42,6 +42,8 @@ msg_dummy_authorizer_refresh_authorization (MsgAuthorizer  *self,
                                             GCancellable   *cancellable,
                                             GError        **error)
 {
+  MsgDummyAuthorizerGate *gate;
+
   /* Check the inputs */
   g_assert (MSG_IS_AUTHORIZER (self));
   g_assert (cancellable == NULL || G_IS_CANCELLABLE (cancellable));
@@ -50,6 +52,17 @@ msg_dummy_authorizer_refresh_authorization (MsgAuthorizer  *self,
   /* Increment the counter on the authorizer so we know if this function's been called more than once */
   g_object_set_data (G_OBJECT (self), "counter", GUINT_TO_POINTER (GPOINTER_TO_UINT (g_object_get_data (G_OBJECT (self), "counter")) + 1));
 
+  /* Hold the refresh at the gate if requested */
+  gate = g_object_get_data (G_OBJECT (self), "gate");
+  if (gate) {
+    g_mutex_lock (&gate->mutex);
+    gate->entered++;
+    g_cond_broadcast (&gate->cond);
+    while (!gate->open)
+      g_cond_wait (&gate->cond, &gate->mutex);
+    g_mutex_unlock (&gate->mutex);
+  }
+
   /* If we're instructed to set an error, do so (with an arbitrary error code) */
   if (g_object_get_data (G_OBJECT (self), "error") != NULL) {
     /* g_set_error_literal (error, MSG_SERVICE_ERROR, MSG_SERVICE_ERROR_PROTOCOL_ERROR, "Error message"); */
@@ -59,11 +72,39 @@ msg_dummy_authorizer_refresh_authorization (MsgAuthorizer  *self,
   return TRUE;
 }
 
+static void
+msg_dummy_authorizer_refresh_authorization_async (MsgAuthorizer       *self,
+                                                  GCancellable        *cancellable,
+                                                  GAsyncReadyCallback  callback,
+                                                  gpointer             user_data)
+{
+  g_autoptr (GTask) task = g_task_new (self, cancellable, callback, user_data);
+  GError *error = NULL;
+  gboolean result;
+
+  /* Returned at once, the callback is still invoked from the caller's main context */
+  result = msg_dummy_authorizer_refresh_authorization (self, cancellable, &error);
+  if (error)
+    g_task_return_error (task, error);
+  else
+    g_task_return_boolean (task, result);
+}
+
+static gboolean
+msg_dummy_authorizer_refresh_authorization_finish (__attribute__ ((unused)) MsgAuthorizer *self,
+                                                   GAsyncResult                          *result,
+                                                   GError                               **error)
+{
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
 static void
 msg_authorizer_interface_init (MsgAuthorizerInterface *iface)
 {
   iface->process_request = msg_dummy_authorizer_process_request;
   iface->refresh_authorization = msg_dummy_authorizer_refresh_authorization;
+  iface->refresh_authorization_async = msg_dummy_authorizer_refresh_authorization_async;
+  iface->refresh_authorization_finish = msg_dummy_authorizer_refresh_authorization_finish;
 }
 
 /*
@@ -47,6 +47,14 @@ struct _MsgDummyAuthorizerClass
   GObjectClass parent_class;
 };
 
+/* Set as "gate" data to hold refreshes until @open is set */
+typedef struct {
+  GMutex mutex;
+  GCond cond;
+  guint entered;
+  gboolean open;
+} MsgDummyAuthorizerGate;
+
 MsgDummyAuthorizer *
 msg_dummy_authorizer_new (void);
 
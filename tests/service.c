@@ -1,8 +1,21 @@
+#include <glib/gstdio.h>
+
 #include "src/msg-authorizer.h"
+#include "src/msg-batch.h"
+#include "src/msg-collection-reader.h"
+#include "src/msg-concurrency-limiter.h"
+#include "src/msg-error.h"
+#include "src/msg-response-cache.h"
 #include "src/msg-service.h"
+#include "src/msg-service-pool.h"
+#include "src/msg-service-stats.h"
 #include "src/drive/msg-drive-service.h"
+#include "src/mail/msg-mail-service.h"
 
 #include "common.h"
+#include "msg-dummy-authorizer.h"
+
+static UhmServer *mock_server = NULL;
 
 static void
 test_response (void)
@@ -58,6 +71,12 @@ test_service (void)
   g_assert (message);
   g_clear_object (&message);
 
+  g_assert_false (msg_service_get_prefetch_pages (service));
+  g_object_set (service, "prefetch-pages", TRUE, NULL);
+  g_assert_true (msg_service_get_prefetch_pages (service));
+  msg_service_set_prefetch_pages (service, FALSE);
+  g_assert_false (msg_service_get_prefetch_pages (service));
+
   g_test_expect_message ("GLib-GObject", G_LOG_LEVEL_CRITICAL, "*g_object_get_is_valid_property*MsgDriveService*");
   GValue val;
   g_object_get_property (G_OBJECT (service), "invlid", &val);
@@ -66,16 +85,918 @@ test_service (void)
   /* g_test_trap_assert_stderr ("*CRITICAL*g_object_get_is_valid_property*MsgDriveService*"); */
 }
 
+static void
+test_shared_session (void)
+{
+  g_autoptr (SoupSession) session = NULL;
+  g_autoptr (MsgService) drive_service = NULL;
+  g_autoptr (MsgService) mail_service = NULL;
+  g_autoptr (MsgService) own_service = NULL;
+
+  session = msg_service_session_new (8, 4, 30);
+  g_assert_cmpuint (soup_session_get_max_conns (session), ==, 8);
+  g_assert_cmpuint (soup_session_get_max_conns_per_host (session), ==, 4);
+  g_assert_cmpuint (soup_session_get_idle_timeout (session), ==, 30);
+
+  drive_service = g_object_new (MSG_TYPE_DRIVE_SERVICE, "session", session, NULL);
+  mail_service = g_object_new (MSG_TYPE_MAIL_SERVICE, "session", session, NULL);
+  g_assert_true (msg_service_get_session (drive_service) == session);
+  g_assert_true (msg_service_get_session (mail_service) == session);
+
+  own_service = MSG_SERVICE (msg_drive_service_new (NULL));
+  g_assert_nonnull (msg_service_get_session (own_service));
+  g_assert_true (msg_service_get_session (own_service) != session);
+}
+
+static void
+pool_acquire_cb (GObject      *source,
+                 GAsyncResult *result,
+                 gpointer      user_data)
+{
+  gboolean *admitted = user_data;
+
+  *admitted = msg_service_pool_acquire_finish (MSG_SERVICE_POOL (source), result, NULL);
+}
+
+static void
+test_service_pool (void)
+{
+  g_autoptr (MsgServicePool) pool = NULL;
+  g_autoptr (MsgAuthorizer) first = NULL;
+  g_autoptr (MsgAuthorizer) second = NULL;
+  g_autoptr (MsgDriveService) drive_service = NULL;
+  g_autoptr (MsgDriveService) same_drive_service = NULL;
+  g_autoptr (MsgDriveService) other_drive_service = NULL;
+  g_autoptr (MsgMailService) mail_service = NULL;
+  g_autoptr (GCancellable) cancellable = NULL;
+  g_autoptr (GError) error = NULL;
+  gboolean first_admitted = FALSE;
+  gboolean second_admitted = FALSE;
+
+  pool = msg_service_pool_new (1, 1);
+  msg_service_pool_set_response_cache_size (pool, 1024);
+  first = MSG_AUTHORIZER (msg_dummy_authorizer_new ());
+  second = MSG_AUTHORIZER (msg_dummy_authorizer_new ());
+
+  /* Services are reused per account and share the session */
+  drive_service = msg_service_pool_get_drive_service (pool, first);
+  same_drive_service = msg_service_pool_get_drive_service (pool, first);
+  other_drive_service = msg_service_pool_get_drive_service (pool, second);
+  mail_service = msg_service_pool_get_mail_service (pool, first);
+  g_assert_true (drive_service == same_drive_service);
+  g_assert_true (drive_service != other_drive_service);
+  g_assert_true (msg_service_get_pool (MSG_SERVICE (drive_service)) == pool);
+  g_assert_true (msg_service_get_session (MSG_SERVICE (drive_service)) == msg_service_pool_get_session (pool));
+  g_assert_true (msg_service_get_session (MSG_SERVICE (other_drive_service)) == msg_service_pool_get_session (pool));
+  g_assert_cmpuint (msg_service_pool_get_n_accounts (pool), ==, 2);
+
+  /* Response caches are per account */
+  g_assert_nonnull (msg_service_get_response_cache (MSG_SERVICE (drive_service)));
+  g_assert_true (msg_service_get_response_cache (MSG_SERVICE (drive_service)) == msg_service_get_response_cache (MSG_SERVICE (mail_service)));
+  g_assert_true (msg_service_get_response_cache (MSG_SERVICE (drive_service)) != msg_service_get_response_cache (MSG_SERVICE (other_drive_service)));
+
+  /* Waiting requests are admitted round robin */
+  g_assert_true (msg_service_pool_acquire (pool, first, NULL, NULL));
+  g_assert_cmpuint (msg_service_pool_get_in_flight (pool), ==, 1);
+
+  msg_service_pool_acquire_async (pool, first, NULL, pool_acquire_cb, &first_admitted);
+  msg_service_pool_acquire_async (pool, second, NULL, pool_acquire_cb, &second_admitted);
+
+  cancellable = g_cancellable_new ();
+  g_cancellable_cancel (cancellable);
+  g_assert_false (msg_service_pool_acquire (pool, second, cancellable, &error));
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+
+  msg_service_pool_release (pool);
+  while (!first_admitted)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert_false (second_admitted);
+
+  msg_service_pool_release (pool);
+  while (!second_admitted)
+    g_main_context_iteration (NULL, TRUE);
+
+  msg_service_pool_release (pool);
+  g_assert_cmpuint (msg_service_pool_get_in_flight (pool), ==, 0);
+
+  /* Throttling holds back all services of the account, but no other account */
+  g_clear_error (&error);
+  msg_service_throttle (MSG_SERVICE (drive_service), 60);
+  g_assert_false (msg_service_wait_for_throttle (MSG_SERVICE (mail_service), cancellable, &error));
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+  g_assert_true (msg_service_wait_for_throttle (MSG_SERVICE (other_drive_service), cancellable, NULL));
+
+  msg_service_pool_remove_account (pool, second);
+  g_assert_cmpuint (msg_service_pool_get_n_accounts (pool), ==, 1);
+}
+
+static void
+limiter_acquire_cb (__attribute__ ((unused)) GObject *source,
+                    GAsyncResult                     *result,
+                    gpointer                          user_data)
+{
+  gboolean *admitted = user_data;
+
+  *admitted = msg_concurrency_limiter_acquire_finish (result, NULL);
+}
+
+static void
+test_concurrency_limiter (void)
+{
+  MsgConcurrencyLimiter *limiter = msg_concurrency_limiter_new ();
+  g_autoptr (MsgService) service = NULL;
+  g_autoptr (GCancellable) cancellable = NULL;
+  g_autoptr (GError) error = NULL;
+  gboolean admitted = FALSE;
+
+  g_assert_cmpuint (msg_concurrency_limiter_get_limit (limiter), ==, 4);
+  for (guint index = 0; index < 4; index++)
+    g_assert_true (msg_concurrency_limiter_acquire (limiter, NULL, NULL));
+  g_assert_cmpuint (msg_concurrency_limiter_get_in_flight (limiter), ==, 4);
+
+  cancellable = g_cancellable_new ();
+  g_cancellable_cancel (cancellable);
+  g_assert_false (msg_concurrency_limiter_acquire (limiter, cancellable, &error));
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+
+  msg_concurrency_limiter_acquire_async (limiter, NULL, limiter_acquire_cb, &admitted);
+  g_assert_false (admitted);
+
+  /* Healthy responses while saturated raise the limit additively */
+  msg_concurrency_limiter_release (limiter, SOUP_STATUS_OK, 1000);
+  while (!admitted)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert_cmpuint (msg_concurrency_limiter_get_in_flight (limiter), ==, 4);
+  for (guint index = 0; index < 4; index++) {
+    msg_concurrency_limiter_release (limiter, SOUP_STATUS_OK, 1000);
+    g_assert_true (msg_concurrency_limiter_acquire (limiter, NULL, NULL));
+  }
+  g_assert_cmpuint (msg_concurrency_limiter_get_limit (limiter), ==, 5);
+
+  /* Throttling cuts it multiplicatively */
+  msg_concurrency_limiter_release (limiter, SOUP_STATUS_TOO_MANY_REQUESTS, 1000);
+  g_assert_cmpuint (msg_concurrency_limiter_get_limit (limiter), ==, 2);
+
+  /* Failures without a response leave it alone */
+  while (msg_concurrency_limiter_get_in_flight (limiter) > 0)
+    msg_concurrency_limiter_release (limiter, SOUP_STATUS_NONE, 0);
+  g_assert_cmpuint (msg_concurrency_limiter_get_limit (limiter), ==, 2);
+
+  msg_concurrency_limiter_set_max_limit (limiter, 1);
+  g_assert_cmpuint (msg_concurrency_limiter_get_limit (limiter), ==, 1);
+  msg_concurrency_limiter_free (limiter);
+
+  service = MSG_SERVICE (msg_drive_service_new (NULL));
+  g_assert_cmpuint (msg_service_get_concurrency_limit (service), ==, 4);
+  g_assert_cmpuint (msg_service_get_in_flight (service), ==, 0);
+  msg_service_set_max_concurrency (service, 2);
+  g_assert_cmpuint (msg_service_get_concurrency_limit (service), ==, 2);
+}
+
+static void
+test_retry_after (void)
+{
+  g_autoptr (MsgService) service = NULL;
+  g_autoptr (SoupMessage) message = NULL;
+  g_autoptr (GCancellable) cancellable = NULL;
+  g_autoptr (GDateTime) now = NULL;
+  g_autoptr (GDateTime) later = NULL;
+  g_autoptr (GError) error = NULL;
+  g_autofree char *date = NULL;
+  SoupMessageHeaders *headers;
+  int seconds;
+
+  message = soup_message_new ("GET", "https://graph.microsoft.com");
+  headers = soup_message_get_response_headers (message);
+  g_assert_cmpint (msg_service_get_retry_after (message), ==, -1);
+
+  soup_message_headers_replace (headers, "Retry-After", "120");
+  g_assert_cmpint (msg_service_get_retry_after (message), ==, 120);
+
+  soup_message_headers_replace (headers, "Retry-After", "nonsense");
+  g_assert_cmpint (msg_service_get_retry_after (message), ==, -1);
+
+  now = g_date_time_new_now_utc ();
+  later = g_date_time_add_seconds (now, 60);
+  date = soup_date_time_to_string (later, SOUP_DATE_HTTP);
+  soup_message_headers_replace (headers, "Retry-After", date);
+  seconds = msg_service_get_retry_after (message);
+  g_assert_cmpint (seconds, >=, 58);
+  g_assert_cmpint (seconds, <=, 61);
+
+  soup_message_headers_replace (headers, "Retry-After", "Wed, 21 Oct 2015 07:28:00 GMT");
+  g_assert_cmpint (msg_service_get_retry_after (message), ==, 0);
+
+  /* Service is not throttled, so waiting must not block even if cancelled */
+  service = MSG_SERVICE (msg_drive_service_new (NULL));
+  cancellable = g_cancellable_new ();
+  g_cancellable_cancel (cancellable);
+  g_assert_true (msg_service_wait_for_throttle (service, cancellable, &error));
+  g_assert_no_error (error);
+}
+
+static MsgService *
+create_mock_service (MsgAuthorizer *authorizer)
+{
+  MsgService *service = MSG_SERVICE (msg_drive_service_new (authorizer));
+
+  soup_session_set_proxy_resolver (msg_service_get_session (service), G_PROXY_RESOLVER (uhm_server_get_resolver (mock_server)));
+
+  return service;
+}
+
+static JsonParser *
+request_me (MsgService  *service,
+            GError     **error)
+{
+  g_autoptr (SoupMessage) message = NULL;
+
+  message = msg_service_build_message (service, "GET", "https://graph.microsoft.com/v1.0/me", NULL, FALSE);
+
+  return msg_service_send_and_parse_response (service, message, NULL, NULL, error);
+}
+
+/* Returns the statistics of @endpoint, @stats must stay alive */
+static JsonObject *
+get_endpoint_stats (JsonNode   *stats,
+                    const char *endpoint)
+{
+  g_assert_true (json_object_has_member (json_node_get_object (stats), endpoint));
+
+  return json_object_get_object_member (json_node_get_object (stats), endpoint);
+}
+
+static void
+test_retry_transient (void)
+{
+  g_autoptr (MsgAuthorizer) authorizer = NULL;
+  g_autoptr (MsgService) service = NULL;
+  g_autoptr (JsonNode) stats = NULL;
+  JsonObject *endpoint;
+  JsonObject *status;
+
+  if (uhm_server_get_enable_online (mock_server)) {
+    g_test_skip ("Transient failures can only be replayed");
+    return;
+  }
+
+  authorizer = MSG_AUTHORIZER (msg_dummy_authorizer_new ());
+  service = create_mock_service (authorizer);
+
+  msg_test_mock_server_start_trace (mock_server, "retry-transient");
+
+  /* 503, 504 and 429 without Retry-After are each followed by a 200 */
+  for (guint index = 0; index < 3; index++) {
+    g_autoptr (JsonParser) parser = NULL;
+    g_autoptr (GError) error = NULL;
+
+    parser = request_me (service, &error);
+    g_assert_no_error (error);
+    g_assert_nonnull (parser);
+  }
+
+  uhm_server_end_trace (mock_server);
+
+  stats = msg_service_get_stats (service);
+  endpoint = get_endpoint_stats (stats, "GET /me");
+  g_assert_cmpint (json_object_get_int_member (endpoint, "requests"), ==, 6);
+  g_assert_cmpint (json_object_get_int_member (endpoint, "retries"), ==, 3);
+
+  status = json_object_get_object_member (endpoint, "status");
+  g_assert_cmpint (json_object_get_int_member (status, "503"), ==, 1);
+  g_assert_cmpint (json_object_get_int_member (status, "504"), ==, 1);
+  g_assert_cmpint (json_object_get_int_member (status, "429"), ==, 1);
+  g_assert_cmpint (json_object_get_int_member (status, "200"), ==, 3);
+}
+
+static void
+test_retry_exhausted (void)
+{
+  g_autoptr (MsgAuthorizer) authorizer = NULL;
+  g_autoptr (MsgService) service = NULL;
+  /* Four retries per request until the budget of ten retries is spent */
+  const gint64 requests[] = { 5, 10, 13 };
+
+  if (!g_test_slow ()) {
+    g_test_skip ("Waiting for the backoff takes long, use -m slow");
+    return;
+  }
+
+  if (uhm_server_get_enable_online (mock_server)) {
+    g_test_skip ("Transient failures can only be replayed");
+    return;
+  }
+
+  authorizer = MSG_AUTHORIZER (msg_dummy_authorizer_new ());
+  service = create_mock_service (authorizer);
+
+  msg_test_mock_server_start_trace (mock_server, "retry-exhausted");
+
+  for (guint index = 0; index < G_N_ELEMENTS (requests); index++) {
+    g_autoptr (JsonParser) parser = NULL;
+    g_autoptr (JsonNode) stats = NULL;
+    g_autoptr (GError) error = NULL;
+    JsonObject *endpoint;
+
+    /* The last 503 is handed to the caller */
+    parser = request_me (service, &error);
+    g_assert_error (error, MSG_ERROR, MSG_ERROR_FAILED);
+    g_assert_null (parser);
+
+    stats = msg_service_get_stats (service);
+    endpoint = get_endpoint_stats (stats, "GET /me");
+    g_assert_cmpint (json_object_get_int_member (endpoint, "requests"), ==, requests[index]);
+    g_assert_cmpint (json_object_get_int_member (endpoint, "retries"), ==, requests[index] - index - 1);
+  }
+
+  uhm_server_end_trace (mock_server);
+}
+
+static guint
+send_mail (MsgService *service)
+{
+  g_autoptr (SoupMessage) message = NULL;
+  g_autoptr (GBytes) bytes = NULL;
+  g_autoptr (GError) error = NULL;
+  const char *body = "{\"message\": {\"subject\": \"Test\"}}";
+
+  message = msg_service_build_message (service, "POST", "https://graph.microsoft.com/v1.0/me/sendMail", NULL, FALSE);
+  soup_message_set_request_body_from_bytes (message, "application/json", g_bytes_new_static (body, strlen (body)));
+
+  bytes = msg_service_send_and_read (service, message, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (bytes);
+
+  return soup_message_get_status (message);
+}
+
+static void
+test_retry_post (void)
+{
+  g_autoptr (MsgAuthorizer) authorizer = NULL;
+  g_autoptr (MsgService) service = NULL;
+  g_autoptr (JsonNode) stats = NULL;
+  JsonObject *endpoint;
+
+  if (uhm_server_get_enable_online (mock_server)) {
+    g_test_skip ("Transient failures can only be replayed");
+    return;
+  }
+
+  authorizer = MSG_AUTHORIZER (msg_dummy_authorizer_new ());
+  service = create_mock_service (authorizer);
+
+  msg_test_mock_server_start_trace (mock_server, "retry-post");
+
+  /* The mail may have been sent before the gateway timed out */
+  g_assert_cmpuint (send_mail (service), ==, SOUP_STATUS_GATEWAY_TIMEOUT);
+
+  /* Retry-After tells that the request has not been processed */
+  g_assert_cmpuint (send_mail (service), ==, SOUP_STATUS_ACCEPTED);
+
+  uhm_server_end_trace (mock_server);
+
+  stats = msg_service_get_stats (service);
+  endpoint = get_endpoint_stats (stats, "POST /me/sendMail");
+  g_assert_cmpint (json_object_get_int_member (endpoint, "requests"), ==, 3);
+  g_assert_cmpint (json_object_get_int_member (endpoint, "retries"), ==, 1);
+}
+
+static void
+test_retry_throttled (void)
+{
+  g_autoptr (MsgAuthorizer) authorizer = NULL;
+  g_autoptr (MsgService) service = NULL;
+  g_autoptr (JsonParser) parser = NULL;
+  g_autoptr (JsonNode) stats = NULL;
+  g_autoptr (GError) error = NULL;
+  JsonObject *endpoint;
+  gint64 started;
+
+  if (!g_test_slow ()) {
+    g_test_skip ("Waiting for the throttle takes long, use -m slow");
+    return;
+  }
+
+  if (uhm_server_get_enable_online (mock_server)) {
+    g_test_skip ("Throttling can only be replayed");
+    return;
+  }
+
+  authorizer = MSG_AUTHORIZER (msg_dummy_authorizer_new ());
+  service = create_mock_service (authorizer);
+
+  msg_test_mock_server_start_trace (mock_server, "retry-throttled");
+
+  /* Retry-After: 0 is waited for at least a second and counts as retry */
+  started = g_get_monotonic_time ();
+  parser = request_me (service, &error);
+  g_assert_error (error, MSG_ERROR, MSG_ERROR_FAILED);
+  g_assert_null (parser);
+  g_assert_cmpint (g_get_monotonic_time () - started, >=, 4 * G_TIME_SPAN_SECOND);
+
+  uhm_server_end_trace (mock_server);
+
+  stats = msg_service_get_stats (service);
+  endpoint = get_endpoint_stats (stats, "GET /me");
+  g_assert_cmpint (json_object_get_int_member (endpoint, "requests"), ==, 5);
+  g_assert_cmpint (json_object_get_int_member (endpoint, "retries"), ==, 4);
+}
+
+static void
+test_reauthorize (void)
+{
+  g_autoptr (MsgAuthorizer) authorizer = NULL;
+  g_autoptr (MsgService) service = NULL;
+  g_autoptr (JsonParser) parser = NULL;
+  g_autoptr (GError) error = NULL;
+
+  if (uhm_server_get_enable_online (mock_server)) {
+    g_test_skip ("Rejected tokens can only be replayed");
+    return;
+  }
+
+  authorizer = MSG_AUTHORIZER (msg_dummy_authorizer_new ());
+  service = create_mock_service (authorizer);
+
+  /* A rejected token is refreshed once and the request replayed */
+  msg_test_mock_server_start_trace (mock_server, "reauthorize");
+  parser = request_me (service, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (parser);
+  uhm_server_end_trace (mock_server);
+
+  g_assert_cmpuint (GPOINTER_TO_UINT (g_object_get_data (G_OBJECT (authorizer), "counter")), ==, 1);
+  g_clear_object (&parser);
+
+  /* Rejecting the fresh token as well is handed to the caller */
+  msg_test_mock_server_start_trace (mock_server, "reauthorize-rejected");
+  parser = request_me (service, &error);
+  g_assert_error (error, MSG_ERROR, MSG_ERROR_FAILED);
+  g_assert_null (parser);
+  uhm_server_end_trace (mock_server);
+
+  g_assert_cmpuint (GPOINTER_TO_UINT (g_object_get_data (G_OBJECT (authorizer), "counter")), ==, 2);
+}
+
+#define PREFETCH_URL "https://graph.microsoft.com/v1.0/me/messages"
+
+typedef struct {
+  GMutex mutex;
+  GCond cond;
+  guint count;
+} RequestCounter;
+
+static void
+request_counter_queued_cb (__attribute__ ((unused)) SoupSession *session,
+                           __attribute__ ((unused)) SoupMessage *message,
+                           gpointer                              user_data)
+{
+  RequestCounter *counter = user_data;
+
+  /* Prefetched pages are queued by a worker thread */
+  g_mutex_lock (&counter->mutex);
+  counter->count++;
+  g_cond_broadcast (&counter->cond);
+  g_mutex_unlock (&counter->mutex);
+}
+
+/* Waits up to five seconds for @count requests to be queued */
+static gboolean
+request_counter_wait (RequestCounter *counter,
+                      guint           count)
+{
+  gint64 end_time = g_get_monotonic_time () + 5 * G_TIME_SPAN_SECOND;
+  gboolean ret;
+
+  g_mutex_lock (&counter->mutex);
+  while (counter->count < count) {
+    if (!g_cond_wait_until (&counter->cond, &counter->mutex, end_time))
+      break;
+  }
+  ret = counter->count >= count;
+  g_mutex_unlock (&counter->mutex);
+
+  return ret;
+}
+
+static gpointer
+create_item_id (JsonObject                        *object,
+                __attribute__ ((unused)) GError  **error)
+{
+  return g_strdup (json_object_get_string_member (object, "id"));
+}
+
+static void
+test_prefetch_pages (void)
+{
+  g_autoptr (MsgAuthorizer) authorizer = NULL;
+  g_autoptr (MsgService) service = NULL;
+  g_autoptr (MsgPageIterator) iter = NULL;
+  g_autoptr (GError) error = NULL;
+  RequestCounter counter = { 0 };
+  gulong handler_id;
+  char *id;
+  guint count = 0;
+
+  if (uhm_server_get_enable_online (mock_server)) {
+    g_test_skip ("The pages are made up, the trace can only be replayed");
+    return;
+  }
+
+  authorizer = MSG_AUTHORIZER (msg_dummy_authorizer_new ());
+  service = create_mock_service (authorizer);
+  msg_service_set_prefetch_pages (service, TRUE);
+  g_mutex_init (&counter.mutex);
+  g_cond_init (&counter.cond);
+  handler_id = g_signal_connect (msg_service_get_session (service), "request-queued", G_CALLBACK (request_counter_queued_cb), &counter);
+
+  msg_test_mock_server_start_trace (mock_server, "prefetch-pages");
+  iter = msg_page_iterator_new (service, PREFETCH_URL, create_item_id);
+
+  while ((id = msg_page_iterator_next (iter, NULL, &error))) {
+    g_autofree char *expected = g_strdup_printf ("%u", ++count);
+
+    g_assert_cmpstr (id, ==, expected);
+    g_free (id);
+
+    /* The next page is requested while the first one is still read */
+    if (count == 1)
+      g_assert_true (request_counter_wait (&counter, 2));
+  }
+
+  g_assert_no_error (error);
+  g_assert_cmpuint (count, ==, 6);
+  uhm_server_end_trace (mock_server);
+
+  g_signal_handler_disconnect (msg_service_get_session (service), handler_id);
+  g_assert_cmpuint (counter.count, ==, 3);
+  g_mutex_clear (&counter.mutex);
+  g_cond_clear (&counter.cond);
+}
+
+static gpointer
+cancel_thread_func (gpointer user_data)
+{
+  g_usleep (100 * G_TIME_SPAN_MILLISECOND);
+  g_cancellable_cancel (user_data);
+
+  return NULL;
+}
+
+static void
+test_prefetch_cancel (void)
+{
+  g_autoptr (MsgAuthorizer) authorizer = NULL;
+  g_autoptr (MsgService) service = NULL;
+  g_autoptr (MsgPageIterator) iter = NULL;
+  g_autoptr (GCancellable) cancellable = g_cancellable_new ();
+  g_autoptr (GError) error = NULL;
+  RequestCounter counter = { 0 };
+  GThread *thread;
+  gulong handler_id;
+  gint64 started;
+  char *id;
+
+  if (uhm_server_get_enable_online (mock_server)) {
+    g_test_skip ("The pages are made up, the trace can only be replayed");
+    return;
+  }
+
+  authorizer = MSG_AUTHORIZER (msg_dummy_authorizer_new ());
+  service = create_mock_service (authorizer);
+  msg_service_set_prefetch_pages (service, TRUE);
+  g_mutex_init (&counter.mutex);
+  g_cond_init (&counter.cond);
+  handler_id = g_signal_connect (msg_service_get_session (service), "request-queued", G_CALLBACK (request_counter_queued_cb), &counter);
+
+  msg_test_mock_server_start_trace (mock_server, "prefetch-cancel");
+  iter = msg_page_iterator_new (service, PREFETCH_URL, create_item_id);
+
+  for (guint index = 0; index < 2; index++) {
+    id = msg_page_iterator_next (iter, cancellable, &error);
+    g_assert_no_error (error);
+    g_assert_nonnull (id);
+    g_free (id);
+  }
+
+  /* The prefetch is throttled for a minute by its 429 response */
+  g_assert_true (request_counter_wait (&counter, 2));
+
+  started = g_get_monotonic_time ();
+  thread = g_thread_new ("cancel", cancel_thread_func, cancellable);
+  id = msg_page_iterator_next (iter, cancellable, &error);
+  g_thread_join (thread);
+
+  g_assert_null (id);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+  g_assert_cmpint (g_get_monotonic_time () - started, <, 5 * G_TIME_SPAN_SECOND);
+  uhm_server_end_trace (mock_server);
+
+  g_signal_handler_disconnect (msg_service_get_session (service), handler_id);
+  g_assert_cmpuint (counter.count, ==, 2);
+  g_mutex_clear (&counter.mutex);
+  g_cond_clear (&counter.cond);
+}
+
+static void
+test_batch (void)
+{
+  g_autoptr (MsgService) service = NULL;
+  g_autoptr (MsgBatch) batch = NULL;
+  g_autoptr (GError) error = NULL;
+  g_autoptr (GBytes) body = NULL;
+  const char *first = NULL;
+  const char *id;
+
+  service = MSG_SERVICE (msg_drive_service_new (NULL));
+  batch = msg_batch_new (service);
+  g_assert_cmpuint (msg_batch_get_size (batch), ==, 0);
+
+  /* Sending an empty batch is a no-op */
+  g_assert_true (msg_batch_send (batch, NULL, &error));
+  g_assert_no_error (error);
+
+  body = g_bytes_new_static ("{\"displayName\": \"test\"}", strlen ("{\"displayName\": \"test\"}"));
+
+  for (guint idx = 0; idx < MSG_BATCH_MAX_REQUESTS; idx++) {
+    g_autoptr (SoupMessage) message = NULL;
+
+    message = msg_service_build_message (service, "PATCH", "https://graph.microsoft.com/v1.0/me/drive/items/1", NULL, FALSE);
+    id = msg_batch_add (batch, message, body, first);
+    g_assert_nonnull (id);
+    if (!first)
+      first = id;
+  }
+
+  g_assert_true (msg_batch_is_full (batch));
+  g_assert_cmpuint (msg_batch_get_size (batch), ==, MSG_BATCH_MAX_REQUESTS);
+  g_assert_cmpuint (msg_batch_get_status (batch, first), ==, 0);
+  g_assert_cmpint (msg_batch_get_retry_after (batch, first), ==, -1);
+  g_assert_null (msg_batch_get_response_body (batch, first));
+  g_assert_false (msg_batch_check_response (batch, first, &error));
+  g_assert_error (error, MSG_ERROR, MSG_ERROR_PROTOCOL_ERROR);
+  g_clear_error (&error);
+
+  {
+    g_autoptr (SoupMessage) message = NULL;
+
+    message = msg_service_build_message (service, "GET", "https://graph.microsoft.com/v1.0/me", NULL, FALSE);
+    g_assert_null (msg_batch_add (batch, message, NULL, NULL));
+  }
+}
+
+static MsgCollectionReader *
+create_collection_reader (const char *data)
+{
+  g_autoptr (GInputStream) stream = NULL;
+
+  stream = g_memory_input_stream_new_from_data (data, strlen (data), NULL);
+  return msg_collection_reader_new (stream);
+}
+
+static void
+test_collection_reader (void)
+{
+  g_autoptr (MsgCollectionReader) reader = NULL;
+  g_autoptr (GError) error = NULL;
+  JsonObject *object;
+  guint count = 0;
+
+  reader = create_collection_reader ("{\"@odata.context\": \"https://graph.microsoft.com/v1.0/$metadata#items\", "
+                                     "\"@odata.count\": 3, \"@odata.nextLink\": \"https://graph.microsoft.com/v1.0/me/next?a=1\\u0026b=2\", "
+                                     "\"value\": [ {\"id\": \"1\", \"name\": \"a } ] \\\" b\"}, "
+                                     "{\"id\": \"2\", \"nested\": {\"list\": [1, 2, {\"x\": null}]}, \"flag\": true},"
+                                     "{\"id\": \"3\"} ], \"@odata.deltaLink\": \"https://graph.microsoft.com/v1.0/me/delta\"}");
+
+  g_assert_cmpstr (msg_collection_reader_get_next_link (reader), ==, NULL);
+
+  while ((object = msg_collection_reader_next (reader, NULL, &error))) {
+    g_autofree char *id = g_strdup_printf ("%u", ++count);
+
+    g_assert_cmpstr (json_object_get_string_member (object, "id"), ==, id);
+    if (count == 1)
+      g_assert_cmpstr (json_object_get_string_member (object, "name"), ==, "a } ] \" b");
+    if (count == 2)
+      g_assert_true (json_object_get_boolean_member (object, "flag"));
+
+    /* Next link preceding the value array is known as soon as elements are read */
+    g_assert_cmpstr (msg_collection_reader_get_next_link (reader), ==, "https://graph.microsoft.com/v1.0/me/next?a=1&b=2");
+    json_object_unref (object);
+  }
+
+  g_assert_no_error (error);
+  g_assert_cmpuint (count, ==, 3);
+  g_assert_cmpstr (msg_collection_reader_get_delta_link (reader), ==, "https://graph.microsoft.com/v1.0/me/delta");
+  g_assert_null (msg_collection_reader_next (reader, NULL, &error));
+  g_assert_no_error (error);
+  g_clear_object (&reader);
+
+  reader = create_collection_reader ("{\"value\": []}");
+  g_assert_null (msg_collection_reader_next (reader, NULL, &error));
+  g_assert_no_error (error);
+  g_assert_null (msg_collection_reader_get_next_link (reader));
+  g_clear_object (&reader);
+
+  reader = create_collection_reader ("{\"error\": {\"code\": \"itemNotFound\", \"message\": \"test\"}}");
+  g_assert_null (msg_collection_reader_next (reader, NULL, &error));
+  g_assert_error (error, MSG_ERROR, MSG_ERROR_FAILED);
+  g_assert_cmpstr (error->message, ==, "test");
+  g_clear_error (&error);
+  g_clear_object (&reader);
+
+  reader = create_collection_reader ("{\"value\": [{\"id\": \"1\"}, {\"id\": ");
+  object = msg_collection_reader_next (reader, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (object);
+  json_object_unref (object);
+  g_assert_null (msg_collection_reader_next (reader, NULL, &error));
+  g_assert_error (error, MSG_ERROR, MSG_ERROR_PROTOCOL_ERROR);
+}
+
+static void
+test_response_cache (void)
+{
+  g_autoptr (MsgResponseCache) cache = NULL;
+  g_autoptr (GBytes) body = g_bytes_new_static ("{\"id\": \"1\"}", 11);
+  g_autoptr (GBytes) cached = NULL;
+  g_autofree char *directory = NULL;
+  g_autofree char *etag = NULL;
+
+  directory = g_dir_make_tmp ("msg-cache-XXXXXX", NULL);
+  g_assert_nonnull (directory);
+
+  /* Room for two entries of 15 bytes (body, key and etag) */
+  cache = msg_response_cache_new (40, directory);
+  g_assert_null (msg_response_cache_lookup_etag (cache, "a"));
+
+  msg_response_cache_update (cache, "a", "\"1\"", body);
+  etag = msg_response_cache_lookup_etag (cache, "a");
+  g_assert_cmpstr (etag, ==, "\"1\"");
+
+  cached = msg_response_cache_revalidated (cache, "a", etag);
+  g_assert_true (g_bytes_equal (cached, body));
+  g_clear_pointer (&cached, g_bytes_unref);
+  g_assert_null (msg_response_cache_revalidated (cache, "a", "\"2\""));
+
+  /* Least recently used entry is evicted from memory, but kept on disk */
+  msg_response_cache_update (cache, "b", "\"1\"", body);
+  msg_response_cache_update (cache, "c", "\"1\"", body);
+  g_clear_object (&cache);
+
+  cache = msg_response_cache_new (40, directory);
+  cached = msg_response_cache_revalidated (cache, "a", "\"1\"");
+  g_assert_true (g_bytes_equal (cached, body));
+  g_clear_pointer (&cached, g_bytes_unref);
+
+  /* Responses without ETag drop the entry */
+  msg_response_cache_update (cache, "a", NULL, body);
+  g_assert_null (msg_response_cache_revalidated (cache, "a", "\"1\""));
+
+  g_assert_cmpuint (msg_response_cache_get_hits (cache), ==, 1);
+  g_assert_cmpuint (msg_response_cache_get_misses (cache), ==, 1);
+
+  msg_response_cache_clear (cache);
+  g_assert_null (msg_response_cache_lookup_etag (cache, "b"));
+  g_assert_cmpint (g_rmdir (directory), ==, 0);
+}
+
+static JsonParser *
+request_me_cancellable (MsgService    *service,
+                        GCancellable  *cancellable,
+                        GError       **error)
+{
+  g_autoptr (SoupMessage) message = NULL;
+
+  message = msg_service_build_message (service, "GET", "https://graph.microsoft.com/v1.0/me", NULL, FALSE);
+
+  return msg_service_send_and_parse_response (service, message, NULL, cancellable, error);
+}
+
+static void
+test_throttle (void)
+{
+  g_autoptr (MsgAuthorizer) authorizer = NULL;
+  g_autoptr (MsgService) service = NULL;
+  g_autoptr (JsonNode) stats = NULL;
+  JsonObject *endpoint;
+
+  if (uhm_server_get_enable_online (mock_server)) {
+    g_test_skip ("Throttling can only be replayed");
+    return;
+  }
+
+  authorizer = MSG_AUTHORIZER (msg_dummy_authorizer_new ());
+  service = create_mock_service (authorizer);
+
+  msg_test_mock_server_start_trace (mock_server, "throttle");
+
+  /* The request is resent once the Retry-After of the 429 has passed */
+  {
+    g_autoptr (JsonParser) parser = NULL;
+    g_autoptr (GError) error = NULL;
+    gint64 started = g_get_monotonic_time ();
+
+    parser = request_me (service, &error);
+    g_assert_no_error (error);
+    g_assert_nonnull (parser);
+    g_assert_cmpint (g_get_monotonic_time () - started, >=, G_TIME_SPAN_SECOND);
+  }
+
+  /* A Retry-After of a minute is cut short by cancelling */
+  for (guint index = 0; index < 2; index++) {
+    g_autoptr (GCancellable) cancellable = g_cancellable_new ();
+    g_autoptr (JsonParser) parser = NULL;
+    g_autoptr (GError) error = NULL;
+    GThread *thread;
+    gint64 elapsed;
+
+    /* The second request is held back without reaching the server */
+    thread = g_thread_new ("cancel", cancel_thread_func, cancellable);
+    elapsed = g_get_monotonic_time ();
+    parser = request_me_cancellable (service, cancellable, &error);
+    elapsed = g_get_monotonic_time () - elapsed;
+    g_thread_join (thread);
+
+    g_assert_error (error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+    g_assert_null (parser);
+    g_assert_cmpint (elapsed, >=, 100 * G_TIME_SPAN_MILLISECOND);
+    g_assert_cmpint (elapsed, <, 5 * G_TIME_SPAN_SECOND);
+  }
+
+  uhm_server_end_trace (mock_server);
+
+  stats = msg_service_get_stats (service);
+  endpoint = get_endpoint_stats (stats, "GET /me");
+  g_assert_cmpint (json_object_get_int_member (endpoint, "requests"), ==, 3);
+}
+
+static void
+test_stats (void)
+{
+  g_autoptr (MsgService) service = NULL;
+  g_autoptr (JsonNode) stats = NULL;
+  struct {
+    const char *method;
+    const char *url;
+    const char *endpoint;
+  } endpoints[] = {
+    { "GET", "https://graph.microsoft.com/v1.0/me", "GET /me" },
+    { "GET", "https://graph.microsoft.com/v1.0/drives/b!x5Qx3fQvGUmUhdlKj/items/01BYE5RZ6QN3ZWBTUFOFD3GSPGOHDJD36K/children?$expand=thumbnails", "GET /drives/{id}/items/{id}/children" },
+    { "GET", "https://graph.microsoft.com/v1.0/me/mailFolders//AQMkADAwATM0MDAAMS1iNTcwLWI2NTEtMDACLTAwCgAuAAADfolder/messages/delta", "GET /me/mailFolders/{id}/messages/delta" },
+    { "GET", "https://graph.microsoft.com/v1.0/users/max.mustermann@example.com/photo/$value", "GET /users/{id}/photo/$value" },
+    { "PUT", "https://graph.microsoft.com/v1.0/drives/b!abc/items/root:/folder/file.txt:/content", "PUT /drives/{id}/items/root:{path}" },
+    { "POST", "https://graph.microsoft.com/beta/$batch", "POST /$batch" },
+  };
+
+  for (guint index = 0; index < G_N_ELEMENTS (endpoints); index++) {
+    g_autoptr (SoupMessage) message = soup_message_new (endpoints[index].method, endpoints[index].url);
+    g_autofree char *endpoint = msg_service_stats_get_endpoint (message);
+
+    g_assert_cmpstr (endpoint, ==, endpoints[index].endpoint);
+  }
+
+  service = MSG_SERVICE (msg_drive_service_new (NULL));
+  stats = msg_service_get_stats (service);
+  g_assert_true (JSON_NODE_HOLDS_OBJECT (stats));
+  g_assert_cmpuint (json_object_get_size (json_node_get_object (stats)), ==, 0);
+
+  msg_service_reset_stats (service);
+}
+
 int
 main (int    argc,
       char **argv)
 {
+  g_autoptr (GFile) trace_directory = NULL;
+  g_autofree char *path = NULL;
   int retval;
 
   msg_test_init (argc, argv);
 
+  mock_server = msg_test_get_mock_server ();
+  path = g_test_build_filename (G_TEST_DIST, "traces/service", NULL);
+  trace_directory = g_file_new_for_path (path);
+  uhm_server_set_trace_directory (mock_server, trace_directory);
+
   g_test_add_func ("/service/response", test_response);
   g_test_add_func ("/service/service", test_service);
+  g_test_add_func ("/service/shared_session", test_shared_session);
+  g_test_add_func ("/service/service_pool", test_service_pool);
+  g_test_add_func ("/service/concurrency_limiter", test_concurrency_limiter);
+  g_test_add_func ("/service/retry_after", test_retry_after);
+  g_test_add_func ("/service/retry_transient", test_retry_transient);
+  g_test_add_func ("/service/retry_exhausted", test_retry_exhausted);
+  g_test_add_func ("/service/retry_post", test_retry_post);
+  g_test_add_func ("/service/retry_throttled", test_retry_throttled);
+  g_test_add_func ("/service/reauthorize", test_reauthorize);
+  g_test_add_func ("/service/prefetch_pages", test_prefetch_pages);
+  g_test_add_func ("/service/prefetch_cancel", test_prefetch_cancel);
+  g_test_add_func ("/service/throttle", test_throttle);
+  g_test_add_func ("/service/stats", test_stats);
+  g_test_add_func ("/service/batch", test_batch);
+  g_test_add_func ("/service/collection_reader", test_collection_reader);
+  g_test_add_func ("/service/response_cache", test_response_cache);
 
   retval = g_test_run ();
 
@@ -2,6 +2,7 @@
 #include "src/user/msg-user-contact-folder.h"
 #include "src/user/msg-user-service.h"
 #include "src/user/msg-user.h"
+#include "src/msg-private.h"
 #include "src/msg-service.h"
 
 #include "common.h"
@@ -61,6 +62,46 @@ test_get_user (void)
   uhm_server_end_trace (mock_server);
 }
 
+static void
+get_user_async_cb (GObject      *source,
+                   GAsyncResult *result,
+                   gpointer      user_data)
+{
+  GMainLoop *loop = user_data;
+  g_autoptr (JsonParser) parser = NULL;
+  g_autoptr (MsgUser) user = NULL;
+  g_autoptr (GError) error = NULL;
+  JsonObject *root_object = NULL;
+
+  parser = msg_service_send_and_parse_response_finish (MSG_SERVICE (source), result, &root_object, &error);
+  g_assert_no_error (error);
+  g_assert (parser);
+
+  user = msg_user_new_from_json (root_object, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (msg_user_get_mail (user));
+
+  g_main_loop_quit (loop);
+}
+
+static void
+test_get_user_async (void)
+{
+  g_autoptr (GMainLoop) loop = NULL;
+  g_autoptr (SoupMessage) message = NULL;
+  g_autofree char *url = NULL;
+
+  msg_test_mock_server_start_trace (mock_server, "get-user-async");
+
+  loop = g_main_loop_new (NULL, FALSE);
+  url = g_strconcat (MSG_API_ENDPOINT, "/me", NULL);
+  message = msg_service_build_message (service, "GET", url, NULL, FALSE);
+  msg_service_send_and_parse_response_async (service, message, G_PRIORITY_DEFAULT, NULL, get_user_async_cb, loop);
+  g_main_loop_run (loop);
+
+  uhm_server_end_trace (mock_server);
+}
+
 static void
 test_get_photo (void)
 {
@@ -104,6 +145,26 @@ test_get_contacts (void)
   uhm_server_end_trace (mock_server);
 }
 
+static void
+test_iterate_contacts (void)
+{
+  g_autoptr (MsgPageIterator) iter = NULL;
+  g_autoptr (MsgUser) contact = NULL;
+  g_autoptr (GError) error = NULL;
+
+  msg_test_mock_server_start_trace (mock_server, "get-contacts");
+
+  iter = msg_user_service_iterate_contacts (MSG_USER_SERVICE (service));
+  g_assert_nonnull (iter);
+
+  /* Stop after the first contact, remaining items are never parsed */
+  contact = msg_page_iterator_next (iter, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (contact);
+
+  uhm_server_end_trace (mock_server);
+}
+
 static void
 test_get_contact_folders (void)
 {
@@ -160,8 +221,10 @@ main (int    argc,
   g_test_add_func ("/user/attributes", test_attributes);
   g_test_add_func ("/user/contact_attributes", test_contact_attributes);
   g_test_add_func ("/user/get/user", test_get_user);
+  g_test_add_func ("/user/get/user_async", test_get_user_async);
   g_test_add_func ("/user/get/photo", test_get_photo);
   g_test_add_func ("/user/get/contacts", test_get_contacts);
+  g_test_add_func ("/user/iterate/contacts", test_iterate_contacts);
   g_test_add_func ("/user/get/contact_folders", test_get_contact_folders);
   g_test_add_func ("/user/get/find_users", test_get_find_users);
 